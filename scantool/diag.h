@@ -56,6 +56,7 @@ extern "C" {
 #include <stdio.h>              /* For FILE */
 
 #include "diag_os.h"    //for mutexes...
+#include "diag_trace.h" //alternate debug backend
 
 // Nice to have anywhere...
 #define MIN(_a_, _b_) (((_a_) < (_b_) ? (_a_) : (_b_)))
@@ -86,6 +87,15 @@ extern "C" {
 	#define UNUSED(X)       X       //how can we suppress "unused parameter" warnings on other compilers?
 #endif // __GNUC__
 
+//thread-local storage : one instance of the variable per thread
+#if defined(_MSC_VER) || defined(__BORLANDC__)
+	#define DIAG_THREAD_LOCAL       __declspec(thread)
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+	#define DIAG_THREAD_LOCAL       _Thread_local
+#else
+	#define DIAG_THREAD_LOCAL       __thread        //gcc, clang
+#endif
+
 //hacks for MS Visual studio / visual C
 #if defined(_MSC_VER)
 typedef SSIZE_T ssize_t;                //XXX ssize_t is currently only needed because of diag_tty_unix.c:diag_tty_{read,write}.
@@ -133,12 +143,16 @@ typedef uint16_t flag_type;     //this is used for L2 type flags (see diag_l2.h)
  * XXX Are their numeric values chosen on purpose ? i.e. why "2023" etc.
  */
 
-#define DIAG_IOCTL_GET_L1_TYPE  0x2010  /* Get L1 Type, data is ptr to int */
+#define DIAG_IOCTL_GET_L1_TYPE  0x2010  /* Get L1 Type, data is ptr to int. At L0 : optional; data holds
+	                                 * the driver's l1proto_mask, to be narrowed down if the device
+	                                 * config rules out some protocols. */
 #define DIAG_IOCTL_GET_L1_FLAGS 0x2011  /* Get L1 Flags, data is ptr to int */
 #define DIAG_IOCTL_GET_L2_FLAGS 0x2021  /* Get the L2 flags (see fmt stuff )*/
 #define DIAG_IOCTL_GET_L2_DATA  0x2023  /* Get the L2 Keybytes etc into
 	                                 * diag_l2_data passed to us
 	                                 */
+#define DIAG_IOCTL_GET_STATS    0x2024  /* Get a copy of the link stats, data = (struct diag_stats *) */
+#define DIAG_IOCTL_RESET_STATS  0x2025  /* Clear link stats. No data. */
 #define DIAG_IOCTL_SETSPEED     0x2101  /* Set speed, bits etc. data = (const struct diag_serial_settings *); ret 0 if ok
 	                                 * Ignored if DIAG_L1_AUTOSPEED or DIAG_L1_NOTTY is set */
 #define DIAG_IOCTL_INITBUS      0x2201  /* Initialise the ecu bus, data = (struct diag_l1_initbus_args *)
@@ -161,6 +175,45 @@ typedef uint16_t flag_type;     //this is used for L2 type flags (see diag_l2.h)
  * data can be freed by caller after the ioctl (L0 will make a copy of the message data as required)
  */
 #define DIAG_IOCTL_SETWM 0x2203
+/** Number of responses expected for the next request.
+ *
+ * data = (const unsigned int *); 0 means unknown.
+ * This is only a hint, applying to the next request only : smart interfaces
+ * that can stop waiting for responses after the last one (ELM327) use it,
+ * others return DIAG_ERR_IOCTL_NOTSUPP which can be ignored.
+ */
+#define DIAG_IOCTL_SETRESPCOUNT 0x2204
+/** Start / stop passive bus monitoring.
+ *
+ * data = (const unsigned int *); nonzero to start, 0 to stop.
+ * Needed by smart interfaces that only report bus traffic in a special
+ * mode (ELM327 "ATMA"); every received frame is then returned by _recv()
+ * until monitoring is stopped. Sending anything also stops it.
+ * Others return DIAG_ERR_IOCTL_NOTSUPP, which can be ignored.
+ */
+#define DIAG_IOCTL_MONITOR 0x2205
+/** Set the CAN receive filters.
+ *
+ * data = (const struct diag_can_filters *), see diag_iso15765.h; 0 filters
+ * means accept everything. Only frames matching at least one filter are
+ * returned by _recv(). L0s that can't filter return DIAG_ERR_IOCTL_NOTSUPP,
+ * which can be ignored.
+ */
+#define DIAG_IOCTL_CAN_SETFILTER 0x2206
+/** Receive a burst of CAN frames.
+ *
+ * data = (struct diag_can_batch *), see diag_iso15765.h. Waits up to
+ * ->timeout ms for the first frame, then returns every frame already
+ * received, up to ->max, in ->n. Ret DIAG_ERR_TIMEOUT if none.
+ * L0s without a batched path return DIAG_ERR_IOCTL_NOTSUPP : use _recv().
+ */
+#define DIAG_IOCTL_CAN_RECVBATCH 0x2207
+/** Send a burst of CAN frames, back to back.
+ *
+ * data = (struct diag_can_batch *); sends ->max frames, ->n is set to the
+ * number actually sent. Same DIAG_ERR_IOCTL_NOTSUPP fallback as above.
+ */
+#define DIAG_IOCTL_CAN_SENDBATCH 0x2208
 
 /****** debug control ******/
 // flag containers : diag_l0_debug, diag_l1_debug diag_l2_debug, diag_l3_debug, diag_cli_debug
@@ -198,11 +251,26 @@ extern const char *dbg_prefixes[];
 /**** debug message helpers.
  *
  * These macros will allow changing the backend and destination (stderr, file, etc)
+ * When diag_trace_enabled is set, DIAG_DBGM and DIAG_DBGMDATA messages are recorded
+ * in the trace rings instead (see diag_trace.h).
  *
  */
 
 #define DIAG_DBGLEVEL_V 0
 
+/* Compile-time filtering (build options DIAG_DBGMASK_xx and DIAG_DBGLEVEL_MIN, see cconf.h) :
+ * a message is only compiled in if all of its mask bits are in the mask for its flag
+ * variable (DIAG_DBGMASK_<flagvar>), and its level is >= DIAG_DBGLEVEL_MIN.
+ * Otherwise the whole statement is a constant-false test and is optimized out,
+ * arguments included.
+ * This means the flagvar argument must be one of the diag_xx_debug variables, by name.
+ */
+#ifndef DIAG_DBGLEVEL_MIN
+	#define DIAG_DBGLEVEL_MIN 0
+#endif
+#define DIAG_DBG_COMPILED(flagvar, mask, level) \
+	((((DIAG_DBGMASK_##flagvar) & (mask)) == (mask)) && ((level) >= DIAG_DBGLEVEL_MIN))
+
 /** for diag.h internal use only */
 #define DIAG_DBG_BACKEND(...) fprintf(stderr, __VA_ARGS__)
 
@@ -223,8 +291,13 @@ extern const char *dbg_prefixes[];
  *
  */
 #define DIAG_DBGM(flagvar, mask, level, ...) do { \
-		if (((flagvar) & (mask)) == (mask)) { \
-			DIAG_DBG_BACKEND(__VA_ARGS__); \
+		if (DIAG_DBG_COMPILED(flagvar, mask, level) && \
+		    (((flagvar) & (mask)) == (mask))) { \
+			if (diag_trace_enabled) { \
+				diag_trace_text(&(flagvar), (mask), CURFILE, __LINE__, __VA_ARGS__); \
+			} else { \
+				DIAG_DBG_BACKEND(__VA_ARGS__); \
+			} \
 		}} while (0)
 
 /** debug message formatter with data
@@ -239,9 +312,19 @@ extern const char *dbg_prefixes[];
  *
  */
 #define DIAG_DBGMDATA(flagvar, mask, level, data, datalen, ...) do { \
-		if (((flagvar) & (mask)) == (mask)) { \
+		if (DIAG_DBG_COMPILED(flagvar, mask, level) && \
+		    (((flagvar) & (mask)) == (mask))) { \
+			bool dbg_dumpdata_ = DIAG_DBG_COMPILED(flagvar, DIAG_DEBUG_DATA, level) && \
+			                ((flagvar) & DIAG_DEBUG_DATA); \
+			if (diag_trace_enabled) { \
+				diag_trace_text(&(flagvar), (mask), CURFILE, __LINE__, __VA_ARGS__); \
+				if (dbg_dumpdata_) { \
+					diag_trace_data(&(flagvar), (mask), CURFILE, __LINE__, data, datalen); \
+				} \
+				break; \
+			} \
 			DIAG_DBG_BACKEND(__VA_ARGS__); \
-			if ((flagvar) & DIAG_DEBUG_DATA) { \
+			if (dbg_dumpdata_) { \
 				diag_data_dump(stderr, data, datalen); \
 			} \
 			fprintf(stderr, "\n"); \
@@ -306,12 +389,6 @@ struct diag_msg *diag_dupsinglemsg(struct diag_msg *);
  */
 void diag_freemsg(struct diag_msg *);
 
-/** Calculate 8bit checksum
- * @param len: number of bytes in *data
- * @return 8-bit sum of all bytes
- */
-uint8_t diag_cks1(const uint8_t *data, unsigned int len);
-
 
 void diag_printmsg_header(FILE *fp, struct diag_msg *msg, bool timestamp, int msgnum);
 void diag_printmsg(FILE *fp, struct diag_msg *msg, bool timestamp);
@@ -359,7 +436,8 @@ int diag_p_ifwderr(const char *name, const int line, const int code);
 #define diag_ifwderr(C) diag_p_ifwderr(CURFILE, __LINE__, (C))
 
 
-/** Return the last error and clears it.
+/** Return the last error of the calling thread and clears it.
+ * (the error is latched per thread, like errno)
  */
 int diag_geterr(void);
 
@@ -377,6 +455,11 @@ const char *diag_errlookup(const int code);
  *
  */
 
+/** # of successful diag_calloc / diag_malloc calls so far, by the calling
+ * thread (benchmarks compare it before and after the code they measure).
+ */
+extern DIAG_THREAD_LOCAL unsigned long diag_alloc_count;
+
 // Do not call directly.
 int diag_fl_alloc(const char *fName, const int line,
                   void **pp, size_t n, size_t s, bool allocIsCalloc);
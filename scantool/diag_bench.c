@@ -0,0 +1,342 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Diag library microbenchmarks
+ * This is a stand-alone program ! Run with "make bench".
+ *
+ * Times the hot paths of frame decoding / checksums / message handling,
+ * no hardware required. Output is one line per benchmark :
+ * <name> <iterations> <ns/op> <allocs/op>
+ * separated by tabs; lines starting with '#' are comments.
+ *
+ * usage : diag_bench [min_ms [name_filter]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_cks.h"
+#include "diag_err.h"
+#include "diag_hex.h"
+#include "diag_os.h"
+#include "diag_l3_saej1979.h"
+
+#ifdef HAVE_L2_iso14230
+	#include "diag_l2_iso14230.h"
+#endif
+#ifdef HAVE_L2_iso9141
+	#include "diag_l2_iso9141.h"
+#endif
+#ifdef HAVE_L2_mb1
+	#include "diag_l2_mb1.h"
+#endif
+
+#define BENCH_DEFAULT_MS        200     //minimum run time per benchmark
+
+/* results are accumulated here so the compiler can't discard the work */
+static volatile unsigned long bench_sink;
+
+struct bench_item {
+	const char *name;
+	void (*benchfunc)(unsigned long iters);
+};
+
+
+/***** checksums *****/
+
+static uint8_t cks_buf[64];
+
+static void bench_cks1(unsigned long iters) {
+	unsigned long acc = 0;
+
+	while (iters--) {
+		acc += diag_cks1(cks_buf, sizeof(cks_buf));
+	}
+	bench_sink += acc;
+}
+
+static void bench_cks16(unsigned long iters) {
+	unsigned long acc = 0;
+
+	while (iters--) {
+		acc += diag_cks16_update(0, cks_buf, sizeof(cks_buf));
+	}
+	bench_sink += acc;
+}
+
+static void bench_j1850_crc(unsigned long iters) {
+	unsigned long acc = 0;
+
+	while (iters--) {
+		acc += diag_crc8_j1850(cks_buf, 11);    //longest J1850 frame without CRC
+	}
+	bench_sink += acc;
+}
+
+
+/***** frame decoders *****/
+
+#ifdef HAVE_L2_iso14230
+/* addressed + fmt length, addressed + len byte, addressless */
+static uint8_t frames_14230[3][12] = {
+	{0x84, 0xF1, 0x10, 0x41, 0x0C, 0x1A, 0xF8, 0x00},
+	{0x80, 0xF1, 0x10, 0x04, 0x41, 0x0C, 0x1A, 0xF8, 0x00},
+	{0x04, 0x41, 0x0C, 0x1A, 0xF8, 0x00},
+};
+static const int len_14230[3] = {8, 9, 6};
+
+static void bench_14230_decode(unsigned long iters) {
+	unsigned long acc = 0;
+	unsigned int i = 0;
+
+	while (iters--) {
+		uint8_t hdrlen, src, dst;
+		int datalen;
+
+		acc += dl2p_14230_decode(frames_14230[i], len_14230[i],
+		                         &hdrlen, &datalen, &src, &dst, 0);
+		if (++i == 3) {
+			i = 0;
+		}
+	}
+	bench_sink += acc;
+}
+#endif
+
+#ifdef HAVE_L2_iso9141
+static uint8_t frame_9141[] = {0x48, 0x6B, 0x10, 0x41, 0x0C, 0x1A, 0xF8, 0x00};
+
+static void bench_9141_decode(unsigned long iters) {
+	unsigned long acc = 0;
+
+	while (iters--) {
+		uint8_t hdrlen, src, dst;
+		int datalen;
+
+		acc += dl2p_iso9141_decode(frame_9141, sizeof(frame_9141),
+		                           &hdrlen, &datalen, &src, &dst);
+	}
+	bench_sink += acc;
+}
+#endif
+
+#ifdef HAVE_L2_mb1
+static uint8_t frame_mb1[] = {0x81, 0x02, 0x08, 0x20, 0x11, 0x22, 0, 0};
+
+static void bench_mb1_decode(unsigned long iters) {
+	unsigned long acc = 0;
+
+	while (iters--) {
+		int msglen;
+
+		acc += dl2p_mb1_decode(frame_mb1, sizeof(frame_mb1), &msglen);
+		acc += msglen;
+	}
+	bench_sink += acc;
+}
+#endif
+
+/* a few typical mode 1 / 2 / 9 responses */
+static uint8_t frames_j1979[4][8] = {
+	{0x41, 0x0C, 0x1A, 0xF8},
+	{0x41, 0x00, 0xBE, 0x3E, 0xB8, 0x11},
+	{0x42, 0x05, 0x00, 0x7B},
+	{0x49, 0x02, 0x01, 0x00, 0x00, 0x00, 0x31},
+};
+
+static void bench_j1979_getlen(unsigned long iters) {
+	unsigned long acc = 0;
+	unsigned int i = 0;
+
+	while (iters--) {
+		acc += diag_l3_j1979_getlen(frames_j1979[i], 7);
+		i = (i + 1) & 3;
+	}
+	bench_sink += acc;
+}
+
+
+
+/***** hex conversions *****/
+
+/* one ELM response line, parsed like elm_recv() does */
+static const char elm_line[] = "48 6B 10 41 0C 1A F8 A2 \r\r>";
+
+static void bench_elm_hexline(unsigned long iters) {
+	unsigned long acc = 0;
+
+	while (iters--) {
+		uint8_t out[8];
+		size_t n;
+
+		n = diag_hex_decode(out, sizeof(out), elm_line, sizeof(elm_line) - 1, NULL);
+		acc += out[n - 1] + n;
+	}
+	bench_sink += acc;
+}
+
+static void bench_hex_encode(unsigned long iters) {
+	char txt[2 * sizeof(cks_buf) + 1];
+	unsigned long acc = 0;
+
+	while (iters--) {
+		acc += diag_hex_encode(txt, cks_buf, sizeof(cks_buf));
+		acc += (uint8_t) txt[iters & 0x3F];
+	}
+	bench_sink += acc;
+}
+
+static void bench_hex_decode(unsigned long iters) {
+	char txt[2 * sizeof(cks_buf) + 1];
+	uint8_t out[sizeof(cks_buf)];
+	unsigned long acc = 0;
+
+	diag_hex_encode(txt, cks_buf, sizeof(cks_buf));
+	while (iters--) {
+		acc += diag_hex_decode(out, sizeof(out), txt, sizeof(txt) - 1, NULL);
+		acc += out[iters & 0x3F];
+	}
+	bench_sink += acc;
+}
+
+
+/***** message handling *****/
+
+static void bench_allocmsg(unsigned long iters) {
+	while (iters--) {
+		struct diag_msg *msg = diag_allocmsg(8);
+
+		bench_sink += msg->len;
+		diag_freemsg(msg);
+	}
+}
+
+static void bench_dupmsg(unsigned long iters) {
+	struct diag_msg *chain = NULL;
+	unsigned int i;
+
+	for (i = 0; i < 3; i++) {
+		struct diag_msg *msg = diag_allocmsg(8);
+		msg->next = chain;
+		chain = msg;
+	}
+
+	while (iters--) {
+		struct diag_msg *dup = diag_dupmsg(chain);
+
+		bench_sink += dup->len;
+		diag_freemsg(dup);
+	}
+	diag_freemsg(chain);
+}
+
+
+static const struct bench_item bench_list[] = {
+	{"cks1_64", bench_cks1},
+	{"cks16_64", bench_cks16},
+	{"j1850_crc_11", bench_j1850_crc},
+#ifdef HAVE_L2_iso14230
+	{"14230_decode", bench_14230_decode},
+#endif
+#ifdef HAVE_L2_iso9141
+	{"9141_decode", bench_9141_decode},
+#endif
+#ifdef HAVE_L2_mb1
+	{"mb1_decode", bench_mb1_decode},
+#endif
+	{"j1979_getlen", bench_j1979_getlen},
+	{"elm_hexline_8", bench_elm_hexline},
+	{"hex_encode_64", bench_hex_encode},
+	{"hex_decode_64", bench_hex_decode},
+	{"allocmsg_freemsg", bench_allocmsg},
+	{"dupmsg_3", bench_dupmsg},
+};
+
+
+static void bench_setup(void) {
+	unsigned int i;
+	uint16_t cksum = 0;
+
+	for (i = 0; i < sizeof(cks_buf); i++) {
+		cks_buf[i] = (uint8_t) (i * 7 + 3);
+	}
+#ifdef HAVE_L2_mb1
+	cksum = diag_cks16_update(0, frame_mb1, sizeof(frame_mb1) - 2);
+	frame_mb1[sizeof(frame_mb1) - 2] = cksum & 0xFF;
+	frame_mb1[sizeof(frame_mb1) - 1] = cksum >> 8;
+#else
+	(void) cksum;
+#endif
+}
+
+/* Run one benchmark, doubling the iteration count until it takes at least min_us */
+static void bench_run(const struct bench_item *bi, unsigned long long min_us) {
+	unsigned long iters = 1;
+	unsigned long long t0, us;
+	unsigned long allocs;
+
+	while (1) {
+		allocs = diag_alloc_count;
+		t0 = diag_os_gethrt();
+		bi->benchfunc(iters);
+		us = diag_os_hrtus(diag_os_gethrt() - t0);
+		allocs = diag_alloc_count - allocs;
+		if ((us >= min_us) || (iters >= (1UL << 30))) {
+			break;
+		}
+		iters *= 2;
+	}
+
+	printf("%s\t%lu\t%.2f\t%.2f\n", bi->name, iters,
+	       (double) us * 1000.0 / iters, (double) allocs / iters);
+}
+
+
+int main(int argc, char **argv) {
+	unsigned long min_ms = BENCH_DEFAULT_MS;
+	const char *filter = NULL;
+	unsigned int i;
+
+	if (argc > 1) {
+		min_ms = strtoul(argv[1], NULL, 0);
+	}
+	if (argc > 2) {
+		filter = argv[2];
+	}
+
+	if (diag_init()) {
+		printf("error in initialization\n");
+		return EXIT_FAILURE;
+	}
+	bench_setup();
+
+	printf("# freediag microbenchmarks, %lu ms min per item\n", min_ms);
+	printf("# name\titerations\tns/op\tallocs/op\n");
+	for (i = 0; i < ARRAY_SIZE(bench_list); i++) {
+		if (filter && !strstr(bench_list[i].name, filter)) {
+			continue;
+		}
+		bench_run(&bench_list[i], (unsigned long long) min_ms * 1000);
+	}
+
+	(void) diag_end();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,68 @@
+#ifndef _DIAG_CKS_H_
+#define _DIAG_CKS_H_
+
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Checksums and CRCs used by the L0 / L2 framing code.
+ *
+ * Every algorithm has an _update() variant taking the running value, so a
+ * receive loop can validate bytes as they arrive :
+ *	cks = diag_cks1_update(cks, newbytes, n);
+ * and only compare with the received check byte at end of frame.
+ * Byte sums use SSE2 when available (unless DIAG_CKS_NOSIMD is defined);
+ * the CRC is table-driven, 4 bytes per step.
+ */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** 8-bit additive checksum (ISO9141, ISO14230, ME interface)
+ * @param len: number of bytes in *data
+ * @return 8-bit sum of all bytes
+ */
+uint8_t diag_cks1(const uint8_t *data, unsigned int len);
+
+/** Add len bytes to a running diag_cks1 value (start with 0). */
+uint8_t diag_cks1_update(uint8_t cks, const uint8_t *data, size_t len);
+
+/** 16-bit additive checksum (MB1); stored LSB first in frames.
+ * Start with 0.
+ */
+uint16_t diag_cks16_update(uint16_t cks, const uint8_t *data, size_t len);
+
+/** CRC8 SAE J1850 : poly 0x1D, init 0xFF, result inverted.
+ * @return CRC byte as appended to J1850 frames.
+ */
+uint8_t diag_crc8_j1850(const uint8_t *data, size_t len);
+
+/** Running J1850 CRC : start with DIAG_CRC8_J1850_INIT, feed data with
+ * diag_crc8_j1850_update(), and invert (~) the result to get the CRC byte.
+ */
+#define DIAG_CRC8_J1850_INIT    0xFF
+uint8_t diag_crc8_j1850_update(uint8_t crc, const uint8_t *data, size_t len);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _DIAG_CKS_H_ */
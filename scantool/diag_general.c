@@ -37,6 +37,7 @@
 #include "diag_os.h"
 #include "diag_err.h"
 #include "diag_dtc.h"
+#include "diag_hex.h"
 #include "diag_l1.h"
 #include "diag_l2.h"
 #include "diag_l3.h"
@@ -97,6 +98,7 @@ int diag_init(void) { // returns 0 if normal exit
 	}
 
 	diag_dtc_init();
+	diag_trace_init();
 	diag_initialized = 1;
 
 	return 0;
@@ -131,6 +133,7 @@ int diag_end(void) {
 	diag_atomic_del(&periodic_done_wrapper);
 
 	// nothing to do for diag_dtc_init
+	diag_trace_end();
 
 	diag_initialized = 0;
 	return rv;
@@ -267,28 +270,30 @@ void diag_freemsg(struct diag_msg *msg) {
 }
 
 
-// diag_cks1: return simple 8-bit checksum of
-// [len] bytes at *data. Everybody needs this !
-uint8_t diag_cks1(const uint8_t *data, unsigned int len) {
-	uint8_t rv=0;
-
-	while (len > 0) {
-		len--;
-		rv += data[len];
-	}
-	return rv;
-}
-
 //diag_data_dump : print (len) bytes of uint8_t *data
 //to the specified FILE (stderr, etc.)
+//Same as fprintf(out, "0x%02X ") on every byte, but built in chunks :
+//this is called for every frame at high debug levels.
 void diag_data_dump(FILE *out, const void *data, size_t len) {
 	const uint8_t *p = (const uint8_t *)data;
+	char hex[2 * 32 + 1];
+	char txt[5 * 32];
 	size_t i;
-	for (i = 0; i < len; i++) {
-		fprintf(out, "0x%02X ", p[i]); // the formatter %#02X gives
-		                               // silly "0X6A" formatting. %#02x
-		                               // gives "0x6a", not perfect
-		                               // either...
+
+	while (len > 0) {
+		size_t chunk = (len > 32)? 32 : len;
+
+		diag_hex_encode(hex, p, chunk);
+		for (i = 0; i < chunk; i++) {
+			txt[5*i] = '0';
+			txt[5*i + 1] = 'x';
+			txt[5*i + 2] = hex[2*i];
+			txt[5*i + 3] = hex[2*i + 1];
+			txt[5*i + 4] = ' ';
+		}
+		fwrite(txt, 1, 5 * chunk, out);
+		p += chunk;
+		len -= chunk;
 	}
 }
 
@@ -303,8 +308,9 @@ void smartcat(char *p1, const size_t s1, const char *p2 ) {
  * Error code latching.
  * "diag_seterr" returns NULL so you can call it from a function
  * that returns a NULL pointer on error.
+ * The code is per thread, so that parallel probes don't clobber each other's.
  */
-static int latchedCode;
+static DIAG_THREAD_LOCAL int latchedCode;
 
 static const struct {
 	const int code;
@@ -392,6 +398,8 @@ int diag_geterr(void) {
 
 /* Memory allocation */
 
+DIAG_THREAD_LOCAL unsigned long diag_alloc_count;
+
 // Stores pointer to a newly allocated buffer of n*s bytes to pp.
 // Also takes filename and line to report for debugging purposes.
 // Returns 0 in the absence of errors.
@@ -426,6 +434,7 @@ int diag_fl_alloc(const char *fName, const int line,
 		        n, s, strerror(errno));
 		return diag_iseterr(DIAG_ERR_NOMEM);
 	}
+	diag_alloc_count++;
 	return 0;
 }
 
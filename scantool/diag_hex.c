@@ -0,0 +1,185 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Hex ASCII <-> binary conversions, see diag_hex.h
+ */
+
+#include <string.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_hex.h"
+
+#if defined(__SSE2__) && !defined(DIAG_HEX_NOSIMD)
+	#define DIAG_HEX_SSE2
+	#include <emmintrin.h>
+#endif
+
+static const char hexdigits[] = "0123456789ABCDEF";
+
+int diag_hex_nibble(char c) {
+	unsigned int u = (unsigned char) c;
+
+	if ((u - '0') < 10) {
+		return (int) (u - '0');
+	}
+	u |= 0x20;      //lowercase
+	if ((u - 'a') < 6) {
+		return (int) (u - 'a' + 10);
+	}
+	return -1;
+}
+
+#ifdef DIAG_HEX_SSE2
+/* 16 nibbles (0-15) to ASCII */
+static inline __m128i sse_nib2ascii(__m128i n) {
+	__m128i gt9 = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+
+	n = _mm_add_epi8(n, _mm_set1_epi8('0'));
+	return _mm_add_epi8(n, _mm_and_si128(gt9, _mm_set1_epi8('A' - '0' - 10)));
+}
+
+/* 16 ASCII chars to nibble values; *valid gets a bitmask of the hex digits */
+static inline __m128i sse_ascii2nib(__m128i c, unsigned int *valid) {
+	__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i a = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	//unsigned x <= k  <==>  min(x, k) == x
+	__m128i isd = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+	__m128i isa = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(5)), a);
+
+	*valid = (unsigned int) _mm_movemask_epi8(_mm_or_si128(isd, isa));
+	a = _mm_add_epi8(a, _mm_set1_epi8(10));
+	return _mm_or_si128(_mm_and_si128(isd, d), _mm_and_si128(isa, a));
+}
+
+/* "XX XX XX XX XX " : hex digits at 3k, 3k+1, spaces at 3k+2 (k = 0..4) */
+#define SPACED_HEXMASK  0x36DB
+#define SPACED_SPCMASK  0x4924
+#endif  //DIAG_HEX_SSE2
+
+size_t diag_hex_encode(char *dst, const uint8_t *src, size_t len) {
+	size_t i = 0;
+
+#ifdef DIAG_HEX_SSE2
+	const __m128i lomask = _mm_set1_epi8(0x0F);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) &src[i]);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), lomask);
+		__m128i lo = _mm_and_si128(v, lomask);
+
+		_mm_storeu_si128((__m128i *) &dst[2 * i], sse_nib2ascii(_mm_unpacklo_epi8(hi, lo)));
+		_mm_storeu_si128((__m128i *) &dst[2 * i + 16], sse_nib2ascii(_mm_unpackhi_epi8(hi, lo)));
+	}
+#endif
+	for (; i < len; i++) {
+		dst[2 * i] = hexdigits[src[i] >> 4];
+		dst[2 * i + 1] = hexdigits[src[i] & 0x0F];
+	}
+	dst[2 * len] = 0;
+	return 2 * len;
+}
+
+size_t diag_hex_decode(uint8_t *dst, size_t maxlen, const char *src, size_t srclen,
+                       const char **endp) {
+	const char *p = src;
+	const char *end = src + srclen;
+	size_t n = 0;
+
+	while (n < maxlen) {
+#ifdef DIAG_HEX_SSE2
+		if ((end - p) >= 16) {
+			unsigned int valid, spaces;
+			__m128i c = _mm_loadu_si128((const __m128i *) p);
+			__m128i v = sse_ascii2nib(c, &valid);
+
+			if ((valid == 0xFFFF) && ((maxlen - n) >= 8)) {
+				//"410C1AF8..." : 8 bytes. In each 16-bit lane, (low byte << 4) | high byte
+				__m128i hi = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00FF)), 4);
+				__m128i b = _mm_or_si128(hi, _mm_srli_epi16(v, 8));
+
+				_mm_storel_epi64((__m128i *) &dst[n], _mm_packus_epi16(b, b));
+				n += 8;
+				p += 16;
+				continue;
+			}
+			spaces = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')));
+			if (((valid & 0x7FFF) == SPACED_HEXMASK) && ((spaces & 0x7FFF) == SPACED_SPCMASK) &&
+			    ((maxlen - n) >= 5)) {
+				//"41 0C 1A F8 00 " : 5 bytes, at 3k after combining each char with the next
+				uint8_t tmp[16];
+				__m128i hi = _mm_and_si128(_mm_slli_epi16(v, 4), _mm_set1_epi8((char) 0xF0));
+				__m128i b = _mm_or_si128(hi, _mm_srli_si128(v, 1));
+
+				_mm_storeu_si128((__m128i *) tmp, b);
+				dst[n] = tmp[0];
+				dst[n + 1] = tmp[3];
+				dst[n + 2] = tmp[6];
+				dst[n + 3] = tmp[9];
+				dst[n + 4] = tmp[12];
+				n += 5;
+				p += 15;
+				continue;
+			}
+		}
+#endif
+		int hi, lo;
+
+		while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n'))) {
+			p++;
+		}
+		if ((end - p) < 2) {
+			break;
+		}
+		hi = diag_hex_nibble(p[0]);
+		lo = diag_hex_nibble(p[1]);
+		if ((hi < 0) || (lo < 0)) {
+			break;
+		}
+		dst[n++] = (uint8_t) ((hi << 4) | lo);
+		p += 2;
+	}
+
+	if (endp) {
+		*endp = p;
+	}
+	return n;
+}
+
+int diag_hex_byte(const char *tok, uint8_t *dst) {
+	int hi, lo;
+
+	if ((tok[0] == '0') && ((tok[1] == 'x') || (tok[1] == 'X'))) {
+		tok += 2;
+	}
+	hi = diag_hex_nibble(tok[0]);
+	if (hi < 0) {
+		return DIAG_ERR_BADDATA;
+	}
+	if (tok[1] == 0) {
+		*dst = (uint8_t) hi;
+		return 0;
+	}
+	lo = diag_hex_nibble(tok[1]);
+	if ((lo < 0) || (tok[2] != 0)) {
+		return DIAG_ERR_BADDATA;
+	}
+	*dst = (uint8_t) ((hi << 4) | lo);
+	return 0;
+}
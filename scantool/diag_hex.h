@@ -0,0 +1,73 @@
+#ifndef _DIAG_HEX_H_
+#define _DIAG_HEX_H_
+
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Hex ASCII <-> binary conversions.
+ *
+ * Used wherever bytes are exchanged as text : ELM interfaces, carsim
+ * .db files, data dumps, CLI arguments.
+ * Bulk conversions have an SSE2 path (x86) and a scalar fallback, used
+ * for short tails and other CPUs, or everywhere if DIAG_HEX_NOSIMD is defined.
+ */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Value of a hex digit ('0'-'9', 'A'-'F', 'a'-'f').
+ * @return 0-15, or -1 if not a hex digit.
+ */
+int diag_hex_nibble(char c);
+
+/** Encode bytes as uppercase hex, without separators ("410C").
+ *
+ * @param dst : must hold 2*len + 1 chars; 0-terminated.
+ * @return number of chars written (2*len), excluding the terminator.
+ */
+size_t diag_hex_encode(char *dst, const uint8_t *src, size_t len);
+
+/** Decode hex pairs; tolerant of ELM-style formatting.
+ *
+ * Spaces, tabs, CR and LF before / between pairs are skipped; both "41 0C"
+ * and "410C" decode to {0x41, 0x0C}. Decoding stops at the end of the input,
+ * after maxlen bytes, or at the first char that doesn't start a valid pair
+ * (the '>' prompt, "NO DATA", a lone digit, etc.)
+ *
+ * @param srclen : max # of chars to parse; src needn't be 0-terminated.
+ * @param endp : if not NULL, set to the first char that wasn't used.
+ * @return number of bytes decoded.
+ */
+size_t diag_hex_decode(uint8_t *dst, size_t maxlen, const char *src, size_t srclen,
+                       const char **endp);
+
+/** Decode one byte token : 1 or 2 hex digits, optional "0x" prefix, nothing else.
+ * ex. "0x4F", "4f", "7".
+ * @return 0 if ok.
+ */
+int diag_hex_byte(const char *tok, uint8_t *dst);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _DIAG_HEX_H_ */
@@ -93,6 +93,22 @@ extern "C" {
 #define DIAG_KW2K_SI_SPR        0x82    /* stopCommunication */
 #define DIAG_KW2K_SI_ATP        0x83    /* accessTimingParameters */
 
+/* readDataByLocalId transmissionMode (optional 3rd byte). The repeated modes
+ * make the ECU send the record again and again, without further requests,
+ * until a "stop" or another request.
+ */
+#define DIAG_KW2K_TM_SINGLE     0x01
+#define DIAG_KW2K_TM_SLOW       0x02
+#define DIAG_KW2K_TM_MEDIUM     0x03
+#define DIAG_KW2K_TM_FAST       0x04
+#define DIAG_KW2K_TM_STOP       0x05
+
+/* dynamicallyDefineLocalId definitionMode */
+#define DIAG_KW2K_DM_DBLI       0x01    /* defineByLocalIdentifier */
+#define DIAG_KW2K_DM_DBCI       0x02    /* defineByCommonIdentifier */
+#define DIAG_KW2K_DM_DBMA       0x03    /* defineByMemoryAddress */
+#define DIAG_KW2K_DM_CDDLI      0x04    /* clearDynamicallyDefinedLocalIdentifier */
+
 
 /*
  * Responses
@@ -0,0 +1,126 @@
+#ifndef _DIAG_ISO15765_H_
+#define _DIAG_ISO15765_H_
+
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * ISO 15765-2 (ISO-TP) transport over CAN, and ISO 15765-4 (OBD on CAN)
+ * identifiers and timings.
+ *
+ * CAN frame format between L2 and a frame-level CAN L0 (DIAG_L1_CAN link
+ * without DIAG_L1_DATAONLY) : one frame per _send() / _recv() call,
+ *	[ID3 ID2 ID1 ID0] [D0 ... Dn-1]
+ * ID is big-endian, with DIAG_CAN_EFF set for 29-bit identifiers; n (the DLC)
+ * is the call length - DIAG_CAN_HDRLEN, 0 to 8.
+ */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define DIAG_CAN_HDRLEN 4               /* ID bytes before the data */
+#define DIAG_CAN_MAXDLEN        8
+#define DIAG_CAN_MAXFRAME       (DIAG_CAN_HDRLEN + DIAG_CAN_MAXDLEN)
+#define DIAG_CAN_EFF    0x80000000UL    /* 29-bit (extended) identifier */
+#define DIAG_CAN_SFFMASK        0x7FFUL
+#define DIAG_CAN_EFFMASK        0x1FFFFFFFUL
+
+#define DIAG_CAN_GETID(buf)     (((uint32_t)(buf)[0] << 24) | ((uint32_t)(buf)[1] << 16) | \
+	                         ((uint32_t)(buf)[2] << 8) | (uint32_t)(buf)[3])
+#define DIAG_CAN_SETID(buf, id) do { \
+		(buf)[0] = (uint8_t)((id) >> 24); (buf)[1] = (uint8_t)((id) >> 16); \
+		(buf)[2] = (uint8_t)((id) >> 8); (buf)[3] = (uint8_t)(id); \
+} while (0)
+
+/* CAN frames exchanged in bursts (DIAG_IOCTL_CAN_RECVBATCH / _SENDBATCH) */
+struct diag_can_frame {
+	uint32_t id;            /* with DIAG_CAN_EFF for 29-bit IDs */
+	uint8_t dlc;
+	uint8_t data[DIAG_CAN_MAXDLEN];
+	unsigned long long ts;  /* rx : diag_os_gethrt() time of reception, 0 if unknown */
+};
+
+struct diag_can_batch {
+	struct diag_can_frame *frames;
+	unsigned int max;       /* recv : room in frames[]; send : frames to send */
+	unsigned int n;         /* frames received / sent */
+	unsigned int timeout;   /* recv : ms to wait for the first frame */
+};
+
+/* DIAG_IOCTL_CAN_SETFILTER : a frame is accepted if (rxid & mask) == (id & mask)
+ * for any of the filters. DIAG_CAN_EFF in both id and mask selects 29-bit frames;
+ * in mask only, it rejects the other kind.
+ */
+#define DIAG_CAN_MAXFILTERS     4
+struct diag_can_filters {
+	unsigned int n;
+	struct {
+		uint32_t id;
+		uint32_t mask;
+	} f[DIAG_CAN_MAXFILTERS];
+};
+
+/* Protocol Control Information : high nibble of the first data byte */
+#define ISO15765_PCI_MASK       0xF0
+#define ISO15765_PCI_SF 0x00    /* Single frame : low nibble = length (1-7) */
+#define ISO15765_PCI_FF 0x10    /* First frame : 12-bit length in low nibble + 2nd byte */
+#define ISO15765_PCI_CF 0x20    /* Consecutive frame : low nibble = sequence number */
+#define ISO15765_PCI_FC 0x30    /* Flow control : low nibble = flow status, then BS, STmin */
+
+#define ISO15765_FS_CTS 0       /* continue to send */
+#define ISO15765_FS_WAIT        1
+#define ISO15765_FS_OVFLW       2       /* overflow, abort */
+
+#define ISO15765_SF_MAXLEN      7
+#define ISO15765_FF_DLEN        6       /* payload bytes in a first frame */
+#define ISO15765_CF_DLEN        7       /* payload bytes in a consecutive frame */
+#define ISO15765_MAXLEN 4095            /* largest FF_DL with the 12-bit length field */
+#define ISO15765_PADBYTE        0x55    /* filler for unused bytes, frames are always sent with DLC 8 */
+
+#define ISO15765_MAXWFT 10      /* max number of FC.WAIT in a row before giving up */
+
+/* STmin byte : 0x00-0x7F ms, 0xF1-0xF9 100-900 us; anything else is
+ * reserved and must be handled as 0x7F.
+ */
+#define ISO15765_STMIN_MAX      0x7F
+
+/* Timings (ms) */
+#define ISO15765_TIM_N_BS       1000    /* max wait for a flow control */
+#define ISO15765_TIM_N_CR       1000    /* max gap between consecutive frames */
+#define ISO15765_TIM_P2 50              /* ISO15765-4 P2CAN, request to response */
+#define ISO15765_TIM_P2E        5000    /* P2*CAN, after a "responsePending" (0x7F xx 0x78) */
+
+/* ISO15765-4 legislated OBD identifiers. In 11-bit mode ECU n (0-7) is
+ * addressed at OBD_PHYS + n and answers on OBD_PHYS + 8 + n. 29-bit
+ * identifiers carry the target and source addresses (normal fixed addressing).
+ */
+#define ISO15765_OBD_FUNC       0x7DF
+#define ISO15765_OBD_PHYS       0x7E0
+#define ISO15765_OBD_RESP       0x7E8
+#define ISO15765_OBD_RESPOFS    8
+#define ISO15765_OBD_FUNC29     0x18DB0000UL    /* | (TA << 8) | SA */
+#define ISO15765_OBD_PHYS29     0x18DA0000UL    /* | (TA << 8) | SA */
+#define ISO15765_OBD_29MASK     0x1FFF0000UL
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _DIAG_ISO15765_H_ */
@@ -15,6 +15,8 @@ extern "C" {
 #include <stddef.h>
 #include <stdint.h>
 
+#include "diag_stats.h"
+
 /*
  * L0 device structure
  * This is the structure to interface between the L1 code
@@ -27,6 +29,8 @@ struct diag_l0_device {
 	const struct diag_l0 *dl0;              /** The L0 driver's diag_l0 */
 
 	bool opened;            /** L0 status */
+
+	struct diag_stats stats;        /** traffic counters, updated by L1 and L2 */
 };
 
 
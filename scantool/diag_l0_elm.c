@@ -6,7 +6,8 @@
  *
  * This is meant to support ELM323 & 327 devices; clones and originals.
  * COM speed is "autodetected" (it tries 38400, 9600 and 115200bps) but can also be
- * manually specified.
+ * manually specified. On ELM327 >= v1.2, a faster speed can then be negotiated
+ * with ATBRD ("elmupspeed" config item).
  *
  * ELM interfaces are particular in that they handle the header bytes + checksum internally.
  * Data is transferred in ASCII hex format, i.e. 0x46 0xFE is sent and received as "46FE"
@@ -40,6 +41,7 @@
 #include "diag_cfg.h"
 #include "diag_os.h"
 #include "diag_err.h"
+#include "diag_hex.h"
 #include "diag_tty.h"
 #include "diag_l0.h"
 #include "diag_l1.h"
@@ -49,6 +51,30 @@
 #define ELM_SLOWNESS    100     //Add this many ms to read timeouts, because ELMs are sloooow
 #define ELM_PURGETIME   400     //Time to wait (ms) for a response to "ATI" command
 
+/* ATST (response timeout) tuning. ATST units are 4.096ms; the ELM327 default is 0x32 (~205ms).
+ * After ELM_ST_SAMPLES responses, ATST is set to twice the (decaying) max ECU latency + margin.
+ */
+#define ELM_ST_UNIT_US  4096
+#define ELM_ST_DEFAULT  0x32
+#define ELM_ST_MIN      5       //~20ms
+#define ELM_ST_MARGIN_US        10000
+#define ELM_ST_SAMPLES  8
+
+/* ATBRD : the ELM327 UART runs at ELM_BRD_CLOCK / divisor, divisor >= ELM_BRD_MINDIV (500kbps).
+ * After answering "OK" to "ATBRD hh", the ELM switches speed, sends its ID string, and reverts
+ * to the previous speed unless it receives a CR within ELM_BRT ms.
+ */
+#define ELM_BRD_CLOCK   4000000UL
+#define ELM_BRD_MINDIV  8
+#define ELM_BRD_TIMEOUT 200     //ms, to receive "OK" and the ID string
+#define ELM_BRT         75      //ms, ELM default ATBRT
+
+/* ATMA : the ELM prints every frame on the bus, until it receives any char. It gives up
+ * with "BUFFER FULL" if the host link can't keep up; we then restart it, unless
+ * that happens ELM_MON_MAXRESTARTS times in a row without a single frame in between.
+ */
+#define ELM_MON_MAXRESTARTS     3
+
 struct elm_device {
 	int protocol;           //current L1 protocol
 
@@ -56,6 +82,7 @@ struct elm_device {
 
 	struct  cfgi port;
 	struct  cfgi speed;     //Host <-> ELM comms
+	struct  cfgi upspeed;   //Host <-> ELM comms, negotiated after open. 0 : disabled
 
 	struct diag_serial_settings serial;
 	ttyp *tty_int;                  /** handle for tty stuff */
@@ -63,10 +90,31 @@ struct elm_device {
 	uint8_t kb1, kb2;       // key bytes from 5 baud init
 	uint8_t atsh[3];        // current header setting for ISO9141
 	struct diag_msg *wm;    // custom wakeup message, if set
+
+	unsigned int version;   // firmware version *10 (1.5 => 15), 0 if unknown
+	unsigned int respcount; // expected # of responses for the next request; 0 : unknown
+	bool rxdone;            // prompt received : no more responses to the last request
+
+	unsigned long long tsent;       // hrt when the last request was sent
+	bool lat_pending;       // waiting for the first response to the last request
+	unsigned long lat_us;   // decaying max of ECU response latency
+	unsigned int nlat;      // # of latency samples
+	uint8_t st;             // current ATST setting; 0 if not tuned
+	uint8_t st_new;         // ATST setting to send before the next request
+
+	bool monitoring;        // ATMA in progress
+	unsigned int mon_restarts;      // ATMA restarts since the last good frame
+
+	uint8_t rxq[ELM_BUFSIZE];       // received but not yet parsed, see elm_getc()
+	size_t rxq_rp, rxq_wp;          // read / write index in rxq
+	char tail[3*MAXRBUF + 1];       // rest of a response line that didn't fit in the caller's buffer
+	size_t taillen;
 };
 
 #define CFGSPEED_DESCR "Host <-> ELM comm speed (bps)"
 #define CFGSPEED_SHORTN "elmspeed"
+#define CFGUPSPEED_DESCR "Faster Host <-> ELM speed (bps) to switch to with ATBRD after reset; 0 = disabled"
+#define CFGUPSPEED_SHORTN "elmupspeed"
 
 
 //flags for elmflags; set either 323_BASIC or 327_BASIC but not both;
@@ -75,6 +123,14 @@ struct elm_device {
 #define ELM_327_BASIC   2       //device type is 327
 #define ELM_32x_CLONE   4       //device is a clone; some commands will not be supported
 #define ELM_INITDONE    0x10    //set when "BUS INIT" has happened. This is important for clones.
+#define ELM_NORESPCOUNT 0x20    //response count was rejected ("?"), don't use it anymore
+#define ELM_SENTCOUNT   0x40    //last request had a response count appended
+#define ELM_UPSHIFTED   0x80    //speed was changed with ATBRD; reset with ATZ on close
+
+// features by firmware version; clones claim a version too, but all bets are off.
+#define ELM_VER_ADAPTIVE        12      //ATAT
+#define ELM_VER_BRD     12      //ATBRD
+#define ELM_VER_RESPCOUNT       13      //response count after OBD requests, ex. "010C1"
 
 
 // possible error messages returned by the ELM IC
@@ -94,9 +150,11 @@ static const char *elm323_clones[] = {NULL};    //known cloned versions
 static const char *elm327_official[] = {"1.0a", "1.0", "1.1", "1.2a", "1.2", "1.3a", "1.3", "1.4b", "2.0", NULL};
 static const char *elm327_clones[] = {"1.4a", "1.4", "1.5a", "1.5", "2.1", NULL};
 
-// baud rates for host to elm32x communication. Start with user-specified speed, then try common values
+// baud rates for host to elm32x communication. Start with user-specified speed, then
+// the ATBRD speed (in case an ELM was left at that speed), then try common values
 #define ELM_CUSTOMSPEED ((unsigned) -1)
-static const unsigned elm_speeds[] = {ELM_CUSTOMSPEED, 38400, 9600, 115200, 0};
+#define ELM_UPSPEED ((unsigned) -2)
+static const unsigned elm_speeds[] = {ELM_CUSTOMSPEED, ELM_UPSPEED, 38400, 9600, 115200, 0};
 
 
 extern const struct diag_l0 diag_l0_elm;
@@ -107,6 +165,11 @@ static int elm_sendcmd(struct diag_l0_device *dl0d,
                        const uint8_t *data, size_t len, unsigned int timeout, uint8_t *resp);
 
 static int elm_purge(struct diag_l0_device *dl0d);
+static int elm_readprompt(struct elm_device *dev, uint8_t *buf, size_t maxlen, unsigned int timeout);
+static void elm_iflush(struct elm_device *dev);
+static int elm_upshift(struct diag_l0_device *dl0d);
+static int elm_monitor_start(struct diag_l0_device *dl0d);
+static int elm_monitor_stop(struct diag_l0_device *dl0d);
 
 static void elm_parse_cr(uint8_t *data, int len);       //change 0x0A to 0x0D
 static void elm_close(struct diag_l0_device *dl0d);
@@ -155,8 +218,19 @@ int elm_new(struct diag_l0_device *dl0d) {
 	dev->speed.descr = CFGSPEED_DESCR;
 	dev->speed.shortname = CFGSPEED_SHORTN;
 
+	rv = diag_cfgn_int(&dev->upspeed, 0, 0);
+	if (rv != 0) {
+		diag_cfg_clear(&dev->port);
+		diag_cfg_clear(&dev->speed);
+		free(dev);
+		return diag_ifwderr(rv);
+	}
+	dev->upspeed.descr = CFGUPSPEED_DESCR;
+	dev->upspeed.shortname = CFGUPSPEED_SHORTN;
+
 	dev->port.next = &dev->speed;
-	dev->speed.next = NULL;
+	dev->speed.next = &dev->upspeed;
+	dev->upspeed.next = NULL;
 
 	return 0;
 }
@@ -183,6 +257,7 @@ void elm_del(struct diag_l0_device *dl0d) {
 
 	diag_cfg_clear(&dev->port);
 	diag_cfg_clear(&dev->speed);
+	diag_cfg_clear(&dev->upspeed);
 	if (dev->wm != NULL) {
 		diag_freemsg(dev->wm);
 	}
@@ -197,11 +272,19 @@ static void elm_close(struct diag_l0_device *dl0d) {
 
 	assert(dl0d != NULL);
 
+	dev = (struct elm_device *)dl0d->l0_int;
+
+	if (dev->monitoring) {
+		(void) elm_monitor_stop(dl0d);
+	}
 	if (dl0d->opened) {
 		elm_sendcmd(dl0d, buf, 5, 500, NULL);   //close protocol. So clean !
 	}
-
-	dev = (struct elm_device *)dl0d->l0_int;
+	if (dev->elmflags & ELM_UPSHIFTED) {
+		//ATZ restores the default speed; the response would come at that speed so don't wait for it.
+		(void) diag_tty_write(dev->tty_int, "ATZ\x0D", 4);
+		dev->elmflags &= ~ELM_UPSHIFTED;
+	}
 
 	/* If debugging, print to stderr */
 	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_CLOSE, DIAG_DBGLEVEL_V,
@@ -284,7 +367,7 @@ static int elm_sendcmd(struct diag_l0_device *dl0d, const uint8_t *data, size_t
 		//the %.*s is pure magic : limits the string length to len, even if the string is not null-terminated.
 		return diag_iseterr(DIAG_ERR_GENERAL);
 	}
-	diag_tty_iflush(dev->tty_int);  //currently the code often "forgets" data in the input buffer, especially if the previous
+	elm_iflush(dev);        //currently the code often "forgets" data in the input buffer, especially if the previous
 	                                //transaction failed. Flushing the input increases the odds of not crashing soon
 
 	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V,
@@ -298,7 +381,7 @@ static int elm_sendcmd(struct diag_l0_device *dl0d, const uint8_t *data, size_t
 
 	//next, receive ELM response, within {ms} delay.
 
-	rv=diag_tty_read(dev->tty_int, buf, ELM_BUFSIZE-1, timeout);    //rv=# bytes read
+	rv=elm_readprompt(dev, buf, ELM_BUFSIZE-1, timeout);    //rv=# bytes read
 
 	if (rv<1) {
 		//no data or error
@@ -342,6 +425,7 @@ static int elm_sendcmd(struct diag_l0_device *dl0d, const uint8_t *data, size_t
 	//2)were sending ATZ (special case hack, it doesn't answer "OK")
 	if ((strstr((char *)buf, "OK") != NULL) ||
 	    (strstr((char *)data, "ATKW") != NULL) ||
+	    (strstr((char *)data, "ATWS") != NULL) ||
 	    (strstr((char *)data, "ATZ") != NULL)) {
 		return 0;
 	}
@@ -362,6 +446,7 @@ static int elm_open(struct diag_l0_device *dl0d, int iProtocol) {
 	struct diag_serial_settings sset;
 	const uint8_t *buf;
 	uint8_t rxbuf[ELM_BUFSIZE];
+	bool upshifted;
 
 	const char **elm_official;
 	const char **elm_clones;        //point to elm323_ or elm327_ clone and official version string lists
@@ -398,14 +483,20 @@ static int elm_open(struct diag_l0_device *dl0d, int iProtocol) {
 	for (i=0; elm_speeds[i]; i++) {
 		sset.speed = elm_speeds[i];
 
-		// skip if custom speed was already tried:
-		if (sset.speed == (unsigned) dev->speed.val.i) {
+		// skip if custom or ATBRD speed was already tried:
+		if ((sset.speed == (unsigned) dev->speed.val.i) ||
+		    (sset.speed == (unsigned) dev->upspeed.val.i)) {
 			continue;
 		}
 
 		if (sset.speed == ELM_CUSTOMSPEED) {
 			//magic flag to retrieve custom speed
 			sset.speed = (unsigned) dev->speed.val.i;
+		} else if (sset.speed == ELM_UPSPEED) {
+			if ((dev->upspeed.val.i <= 0) || (dev->upspeed.val.i == dev->speed.val.i)) {
+				continue;
+			}
+			sset.speed = (unsigned) dev->upspeed.val.i;
 		}
 		fprintf(stderr, FLFMT "Sending ATI to ELM32x at %u...\n", FL, sset.speed);
 
@@ -418,7 +509,7 @@ static int elm_open(struct diag_l0_device *dl0d, int iProtocol) {
 			return diag_ifwderr(rv);
 		}
 
-		diag_tty_iflush(dev->tty_int);  /* Flush unread input */
+		elm_iflush(dev);        /* Flush unread input */
 
 		//At this stage, the ELM has possibly been powered up for a while;
 		//it may have an unfinished command / garbage in its input buffer. We
@@ -438,14 +529,21 @@ static int elm_open(struct diag_l0_device *dl0d, int iProtocol) {
 		return diag_iseterr(DIAG_ERR_BADIFADAPTER);
 	}
 
-	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_OPEN, DIAG_DBGLEVEL_V,
-	          FLFMT "elm_open : sending ATZ...\n", FL);
-
 	//the command "ATZ" causes a full reset and the ELM replies with
 	//a string like "ELM32x vX.Xx\n>"
+	//If the ELM answered at the ATBRD speed, it was left there by a previous session :
+	//ATZ would revert to the default speed, but ATWS keeps the current speed.
+	if (elm_speeds[i] == ELM_UPSPEED) {
+		buf=(uint8_t *)"ATWS\x0D";
+		upshifted = 1;
+	} else {
+		buf=(uint8_t *)"ATZ\x0D";
+		upshifted = 0;
+	}
+	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_OPEN, DIAG_DBGLEVEL_V,
+	          FLFMT "elm_open : sending %.*s...\n", FL, upshifted? 4:3, (const char *) buf);
 
-	buf=(uint8_t *)"ATZ\x0D";
-	rv=elm_sendcmd(dl0d, buf, 4, 2000, rxbuf);
+	rv=elm_sendcmd(dl0d, buf, upshifted? 5:4, 2000, rxbuf);
 	if (rv) {
 		fprintf(stderr, FLFMT "elm_open : ATZ failed !\n", FL);
 		elm_close(dl0d);
@@ -499,6 +597,23 @@ static int elm_open(struct diag_l0_device *dl0d, int iProtocol) {
 		printf("A 323 clone ? Report this !\n");
 	}
 
+	// 3) firmware version, ex. "ELM327 v1.5"
+	dev->version = 0;
+	{
+		const char *vp = strstr((char *)rxbuf, " v");
+		unsigned int vmaj, vmin;
+		if (vp && (sscanf(vp + 2, "%u.%1u", &vmaj, &vmin) == 2)) {
+			dev->version = vmaj * 10 + vmin;
+		}
+	}
+	dev->respcount = 0;
+	dev->rxdone = 0;
+	dev->lat_pending = 0;
+	dev->lat_us = 0;
+	dev->nlat = 0;
+	dev->st = 0;
+	dev->st_new = 0;
+
 
 	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_OPEN, DIAG_DBGLEVEL_V,
 	          FLFMT "ELM reset success, elmflags=%#x\n", FL, dev->elmflags);
@@ -547,6 +662,33 @@ static int elm_open(struct diag_l0_device *dl0d, int iProtocol) {
 		}
 	}
 
+	//switch to a faster speed if requested. If that fails, continue at the current speed.
+	if (upshifted) {
+		dev->elmflags |= ELM_UPSHIFTED;
+	} else if ((dev->upspeed.val.i > 0) && ((unsigned) dev->upspeed.val.i > dev->serial.speed)) {
+		if ((dev->elmflags & ELM_327_BASIC) && (dev->version >= ELM_VER_BRD)) {
+			if (elm_upshift(dl0d) && elm_purge(dl0d)) {
+				fprintf(stderr, FLFMT "ELM lost after failed speed change !\n", FL);
+				elm_close(dl0d);
+				return diag_iseterr(DIAG_ERR_BADIFADAPTER);
+			}
+		} else {
+			printf("ELM doesn't support speed changes, staying at %u bps.\n", dev->serial.speed);
+		}
+	}
+
+	//ATAT1 : adaptive timing; the ELM shortens its response timeout according to
+	//measured ECU latency. This is the default on some firmwares but not all.
+	if ((dev->elmflags & ELM_327_BASIC) && (dev->version >= ELM_VER_ADAPTIVE)) {
+		buf=(uint8_t *)"ATAT1\x0D";
+		if (elm_sendcmd(dl0d, buf, 6, 500, NULL)) {
+			DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_OPEN, DIAG_DBGLEVEL_V,
+			          FLFMT "sending \"ATAT1\" failed, continuing anyway\n", FL);
+		} else {
+			dev->st = ELM_ST_DEFAULT;
+		}
+	}
+
 	//check if proto is really supported (323 supports only 9141 and 14230)
 	if ((dev->elmflags & ELM_323_BASIC) &&
 	    ((iProtocol != DIAG_L1_ISO9141) &&
@@ -652,7 +794,7 @@ static int elm_bogusinit(struct diag_l0_device *dl0d, unsigned int timeout) {
 	}
 
 	// receive everything; we're hoping for a prompt at the end and no error message.
-	rv=diag_tty_read(dev->tty_int, buf, MAXRBUF-5, timeout);        //rv=# bytes read
+	rv=elm_readprompt(dev, buf, MAXRBUF-5, timeout);        //rv=# bytes read
 	elm_parse_cr(buf, rv);
 	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
 	          FLFMT "received %d bytes: %.*s: ",
@@ -898,7 +1040,7 @@ static int elm_purge(struct diag_l0_device *dl0d) {
 		fprintf(stderr, FLFMT "elm_purge : write error\n", FL);
 		return diag_iseterr(DIAG_ERR_GENERAL);
 	}
-	rv = diag_tty_read(dev->tty_int, buf, sizeof(buf), ELM_PURGETIME);
+	rv = elm_readprompt(dev, buf, sizeof(buf), ELM_PURGETIME);
 	if (rv < 1) {
 		return DIAG_ERR_GENERAL;
 	}
@@ -912,6 +1054,226 @@ static int elm_purge(struct diag_l0_device *dl0d) {
 	return 0;
 }
 
+/* elm_getc : get one received byte. Whatever the ELM sent so far is read into
+ * dev->rxq in one go, so a response line costs a syscall or two instead of one
+ * per char. Same return values as diag_tty_read().
+ */
+static int elm_getc(struct elm_device *dev, uint8_t *c, unsigned int timeout) {
+	ssize_t rv;
+
+	if (dev->rxq_rp == dev->rxq_wp) {
+		rv = diag_tty_readsome(dev->tty_int, dev->rxq, sizeof(dev->rxq), timeout);
+		if (rv <= 0) {
+			return (int) rv;
+		}
+		dev->rxq_rp = 0;
+		dev->rxq_wp = (size_t) rv;
+	}
+	*c = dev->rxq[dev->rxq_rp++];
+	return 1;
+}
+
+/* elm_iflush : discard everything received, including what elm_getc() and
+ * elm_recv() have buffered.
+ */
+static void elm_iflush(struct elm_device *dev) {
+	dev->rxq_rp = dev->rxq_wp = 0;
+	dev->taillen = 0;
+	diag_tty_iflush(dev->tty_int);
+}
+
+/* elm_keeptail : the caller's buffer filled up before the end of the line
+ * [src, src+srclen[ : keep the rest for the next elm_recv() call.
+ */
+static void elm_keeptail(struct elm_device *dev, const char *src, size_t srclen) {
+	while ((srclen > 0) && (*src == ' ')) {
+		src++;
+		srclen--;
+	}
+	memcpy(dev->tail, src, srclen);
+	dev->taillen = srclen;
+}
+
+/* elm_readline : read one non-empty line (up to CR), or up to a '>' prompt.
+ * buf is 0-terminated. Return # of bytes read.
+ */
+static int elm_readline(struct elm_device *dev, uint8_t *buf, size_t maxlen, unsigned int timeout) {
+	unsigned long t0, tcur;
+	size_t got = 0;
+	int rv;
+
+	t0 = diag_os_getms();
+	while (got < maxlen - 1) {
+		tcur = diag_os_getms() - t0;
+		if (tcur >= timeout) {
+			break;
+		}
+		rv = elm_getc(dev, &buf[got], timeout - tcur);
+		if (rv <= 0) {
+			break;
+		}
+		if ((buf[got] == 0x0D) || (buf[got] == 0x0A)) {
+			if (got == 0) {
+				continue;       //skip leading line ends
+			}
+			break;
+		}
+		got++;
+		if (buf[got - 1] == '>') {
+			break;
+		}
+	}
+	buf[got] = 0;
+	return (int) got;
+}
+
+/* elm_upshift : switch host <-> ELM speed to dev->upspeed with ATBRD.
+ * Ret 0 if the new speed is in use. On failure, the host side is back at the old
+ * speed, and the caller should check that the ELM is too (elm_purge).
+ */
+static int elm_upshift(struct diag_l0_device *dl0d) {
+	struct elm_device *dev = dl0d->l0_int;
+	struct diag_serial_settings sset;
+	unsigned long target, actual, div;
+	uint8_t buf[ELM_BUFSIZE];
+	int rv;
+
+	target = (unsigned long) dev->upspeed.val.i;
+	div = (ELM_BRD_CLOCK + target / 2) / target;
+	if ((div < ELM_BRD_MINDIV) || (div > 0xFF)) {
+		fprintf(stderr, FLFMT "ELM can't do %lu bps\n", FL, target);
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+	//the ELM's speed must be within 3% of ours
+	actual = ELM_BRD_CLOCK / div;
+	if ((actual * 100 > target * 103) || (actual * 100 < target * 97)) {
+		fprintf(stderr, FLFMT "ELM can't do %lu bps (closest : %lu)\n", FL, target, actual);
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+
+	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_IOCTL, DIAG_DBGLEVEL_V,
+	          FLFMT "ATBRD %02lX : %lu bps (ELM : %lu)\n", FL, div, target, actual);
+
+	elm_iflush(dev);
+	sprintf((char *) buf, "ATBRD %02lX\x0D", div);
+	if (diag_tty_write(dev->tty_int, buf, 9) != 9) {
+		fprintf(stderr, FLFMT "elm_upshift: write error\n", FL);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	//1) "OK" at the old speed, or an error + prompt
+	rv = elm_readline(dev, buf, sizeof(buf), ELM_BRD_TIMEOUT);
+	if ((rv <= 0) || (strstr((char *) buf, "OK") == NULL)) {
+		printf("ELM refused ATBRD (got \"%s\"), staying at %u bps.\n", buf, dev->serial.speed);
+		(void) elm_readprompt(dev, buf, sizeof(buf), ELM_BRD_TIMEOUT);
+		return DIAG_ERR_GENERAL;
+	}
+
+	//2) ID string at the new speed
+	sset = dev->serial;
+	sset.speed = (unsigned) target;
+	if (diag_tty_setup(dev->tty_int, &sset)) {
+		fprintf(stderr, FLFMT "Error setting %lu;8N1\n", FL, target);
+		goto revert;
+	}
+	rv = elm_readline(dev, buf, sizeof(buf), ELM_BRD_TIMEOUT);
+	if ((rv <= 0) || (strstr((char *) buf, "ELM") == NULL)) {
+		goto revert;
+	}
+
+	//3) confirm with a CR; the ELM answers at the new speed.
+	if (diag_tty_write(dev->tty_int, "\x0D", 1) != 1) {
+		goto revert;
+	}
+	rv = elm_readprompt(dev, buf, sizeof(buf) - 1, ELM_BRD_TIMEOUT);
+	if ((rv <= 0) || (buf[rv - 1] != '>')) {
+		goto revert;
+	}
+
+	dev->serial = sset;
+	dev->elmflags |= ELM_UPSHIFTED;
+	printf("ELM speed changed to %lu bps.\n", target);
+	return 0;
+
+revert:
+	printf("ELM speed change to %lu bps failed, staying at %u bps.\n", target, dev->serial.speed);
+	(void) diag_tty_setup(dev->tty_int, &dev->serial);
+	diag_os_millisleep(ELM_BRT * 2);        //let the ELM give up and revert
+	elm_iflush(dev);
+	return diag_iseterr(DIAG_ERR_GENERAL);
+}
+
+/* elm_readprompt : read a response, stopping at the '>' prompt instead of
+ * waiting for the whole timeout.
+ * Return # of bytes read; the prompt is missing if it timed out.
+ */
+static int elm_readprompt(struct elm_device *dev, uint8_t *buf, size_t maxlen, unsigned int timeout) {
+	unsigned long t0, tcur;
+	size_t got = 0;
+	int rv;
+
+	t0 = diag_os_getms();
+	while (got < maxlen) {
+		tcur = diag_os_getms() - t0;
+		if (tcur >= timeout) {
+			break;
+		}
+		rv = elm_getc(dev, &buf[got], timeout - tcur);
+		if (rv <= 0) {
+			break;
+		}
+		got += rv;
+		if (buf[got - 1] == '>') {
+			break;
+		}
+	}
+	return (int) got;
+}
+
+/* elm_monitor_start : enter "monitor all" mode. There is no response to ATMA
+ * other than the bus traffic itself, so no point waiting for anything here;
+ * elm_monrecv() takes care of refusals ("?") and restarts.
+ */
+static int elm_monitor_start(struct diag_l0_device *dl0d) {
+	struct elm_device *dev = dl0d->l0_int;
+
+	if (diag_tty_write(dev->tty_int, "ATMA\x0D", 5) != 5) {
+		fprintf(stderr, FLFMT "elm_monitor_start : write error\n", FL);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_PROTO, DIAG_DBGLEVEL_V,
+	          FLFMT "ATMA started (restart %u)\n", FL, dev->mon_restarts);
+	dev->monitoring = 1;
+	dev->rxdone = 0;
+	dev->lat_pending = 0;
+	return 0;
+}
+
+/* elm_monitor_stop : interrupt ATMA with a CR, and discard whatever frames were
+ * still in the pipe, up to the prompt.
+ */
+static int elm_monitor_stop(struct diag_l0_device *dl0d) {
+	struct elm_device *dev = dl0d->l0_int;
+	uint8_t buf[ELM_BUFSIZE];
+	int rv;
+
+	dev->monitoring = 0;
+	if (diag_tty_write(dev->tty_int, "\x0D", 1) != 1) {
+		fprintf(stderr, FLFMT "elm_monitor_stop : write error\n", FL);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	do {
+		rv = elm_readprompt(dev, buf, sizeof(buf), ELM_PURGETIME);
+	} while ((rv == (int) sizeof(buf)) && (buf[rv - 1] != '>'));
+
+	if ((rv > 0) && (buf[rv - 1] == '>')) {
+		dev->rxdone = 1;
+		return 0;
+	}
+	//stopped silently ? Make sure it's listening.
+	return elm_purge(dl0d);
+}
+
 /*
  * Send a load of data
  *
@@ -936,6 +1298,14 @@ static int elm_send(struct diag_l0_device *dl0d, const void *data, size_t len) {
 		return diag_iseterr(DIAG_ERR_BADLEN);
 	}
 
+	if (dev->monitoring) {
+		//the ELM won't take requests while in ATMA
+		rv = elm_monitor_stop(dl0d);
+		if (rv < 0) {
+			return diag_ifwderr(rv);
+		}
+	}
+
 	if ((2*len)>(ELM_BUFSIZE-1)) {
 		//too much data for buffer size
 		fprintf(stderr, FLFMT "ELM: too much data for buffer (report this bug please!)\n", FL);
@@ -974,11 +1344,30 @@ static int elm_send(struct diag_l0_device *dl0d, const void *data, size_t len) {
 		memcpy(dev->atsh, data, 3);
 	}
 
-	for (i=0; i<len; i++) {
-		//fill buffer with ascii-fied hex data
-		snprintf((char *) &buf[2*i], 3, "%02X", (unsigned int)((uint8_t *)data)[i] );
+	if (dev->st_new && (dev->st_new != dev->st)) {
+		sprintf((char *)buf, "ATST %02X\x0D", (unsigned int) dev->st_new);
+		if (elm_sendcmd(dl0d, buf, 8, 500, NULL) == 0) {
+			DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_PROTO, DIAG_DBGLEVEL_V,
+			          FLFMT "ATST %02X (was %02X), max latency %lu us\n", FL,
+			          (unsigned int) dev->st_new, (unsigned int) dev->st, dev->lat_us);
+			dev->st = dev->st_new;
+		} else {
+			dev->st = 0;    //don't try again
+		}
+		dev->st_new = 0;
+	}
+
+	i = (unsigned int) diag_hex_encode((char *) buf, data, len);
+	//expected response count : the ELM returns right after the last response,
+	//instead of waiting for its timeout.
+	dev->elmflags &= ~ELM_SENTCOUNT;
+	if ((dev->respcount > 0) && (dev->respcount <= 0x0F) &&
+	    (dev->elmflags & ELM_327_BASIC) && !(dev->elmflags & ELM_NORESPCOUNT) &&
+	    (dev->version >= ELM_VER_RESPCOUNT)) {
+		buf[i++] = "0123456789ABCDEF"[dev->respcount];
+		dev->elmflags |= ELM_SENTCOUNT;
 	}
-	i=2*len;
+	dev->respcount = 0;     //only for this request
 	buf[i]=0x0D;
 	buf[i+1]=0x00;  //terminate string
 
@@ -995,138 +1384,252 @@ static int elm_send(struct diag_l0_device *dl0d, const void *data, size_t len) {
 		fprintf(stderr, FLFMT "elm_send:write error\n",FL);
 		return diag_iseterr(DIAG_ERR_GENERAL);
 	}
+	dev->tsent = diag_os_gethrt();
+	dev->lat_pending = 1;
+	dev->rxdone = 0;
+	dev->taillen = 0;
 	return 0;
 }
 
+/* Record the latency of the first response to a request, and
+ * schedule a new ATST setting (sent by elm_send) if it changed enough.
+ * The max decays so that a single slow response doesn't stick forever.
+ */
+static void elm_update_st(struct elm_device *dev, unsigned long lat_us) {
+	unsigned long st;
+
+	dev->lat_pending = 0;
+	if (dev->st == 0) {
+		//no adaptive timing, or ATST failed
+		return;
+	}
+	dev->lat_us -= dev->lat_us / 8;
+	if (lat_us > dev->lat_us) {
+		dev->lat_us = lat_us;
+	}
+	if (dev->nlat < ELM_ST_SAMPLES) {
+		dev->nlat++;
+		return;
+	}
+
+	st = (dev->lat_us * 2 + ELM_ST_MARGIN_US) / ELM_ST_UNIT_US + 1;
+	if (st < ELM_ST_MIN) {
+		st = ELM_ST_MIN;
+	} else if (st > 0xFF) {
+		st = 0xFF;
+	}
+	//raise immediately, lower with some hysteresis
+	if ((st > dev->st) || (st + 2 < dev->st)) {
+		dev->st_new = (uint8_t) st;
+	}
+}
+
+/* elm_monrecv : elm_recv() while monitoring; return one frame.
+ * Lines that aren't clean frames (truncated, "<DATA ERROR", etc) are dropped.
+ */
+static int elm_monrecv(struct diag_l0_device *dl0d, void *data, size_t len, unsigned int timeout) {
+	struct elm_device *dev = dl0d->l0_int;
+	uint8_t rxbuf[3*MAXRBUF + 1];
+	unsigned long tf, tcur;
+	const char *endp;
+	size_t n;
+	int rv;
+
+	tf = diag_os_getms() + timeout + ELM_SLOWNESS;
+	while (1) {
+		tcur = diag_os_getms();
+		if (tcur >= tf) {
+			return DIAG_ERR_TIMEOUT;
+		}
+		tcur = tf - tcur;
+		if (dev->taillen) {
+			rv = (int) dev->taillen;
+			memcpy(rxbuf, dev->tail, dev->taillen);
+			rxbuf[rv] = 0;
+			dev->taillen = 0;
+		} else {
+			rv = elm_readline(dev, rxbuf, sizeof(rxbuf), (tcur < MAXTIMEOUT)? tcur : MAXTIMEOUT - 1);
+		}
+		if (rv <= 0) {
+			continue;
+		}
+
+		if (strstr((char *) rxbuf, "BUFFER FULL")) {
+			//host link too slow for the bus traffic. Frames were lost; the prompt follows.
+			dl0d->stats.overruns++;
+			fprintf(stderr, FLFMT "ELM buffer full, frames lost. Restarting monitor...\n", FL);
+			continue;
+		}
+		if (rxbuf[rv - 1] == '>') {
+			//ELM dropped out of ATMA (overflow, refused, or stopped) : go again.
+			if (++dev->mon_restarts > ELM_MON_MAXRESTARTS) {
+				fprintf(stderr, FLFMT "ELM won't stay in monitor mode, giving up.\n", FL);
+				dev->monitoring = 0;
+				return diag_iseterr(DIAG_ERR_GENERAL);
+			}
+			rv = elm_monitor_start(dl0d);
+			if (rv < 0) {
+				return diag_ifwderr(rv);
+			}
+			continue;
+		}
+
+		n = diag_hex_decode(data, len, (const char *) rxbuf, (size_t) rv, &endp);
+		if ((n > 0) && ((endp == (const char *) &rxbuf[rv]) || (n == len))) {
+			if (endp != (const char *) &rxbuf[rv]) {
+				elm_keeptail(dev, endp, (size_t) ((const char *) &rxbuf[rv] - endp));
+			}
+			dev->mon_restarts = 0;
+			return (int) n;
+		}
+		DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
+		          FLFMT "monitor : dropped '%s'\n", FL, (char *) rxbuf);
+	}
+}
+
 /*
  * Get data (blocking), returns number of bytes read, between 1 and len
  * ELM returns a string with format "%02X %02X %02X[...]\n" . But it's slow so we add ELM_SLOWNESS ms to the specified timeout.
  * We convert this received ascii string to hex before returning.
  * note : "len" is the number of bytes read on the OBD bus, *NOT* the number of ASCII chars received on the serial link !
- * TODO decode possible error strings ! Essential because ELM can reply
- * 	"FB ERROR" (FB) is a valid hex number
- * 	"ACT ALARM" (AC) is a valid hex number
- * technique:
- *	-if any hexpair doesn't decode cleanly, discard message
- *	-just before returning any data, search for an error message match
- *	-still missing : if caller requests 1 byte, and the error is "FB ERROR", we'll still happily return 0xFB !
+ * One response line is read at a time, then decoded. Anything in that line that isn't
+ * a hexpair must be an error message, ex. "NO DATA" or "48 6B 10 <DATA ERROR", so
+ * "FB ERROR" or "ACT ALERT" are not mistaken for data.
+ * Informational lines ("SEARCHING...", "BUS INIT: ...OK") are skipped.
+ * If "data" fills up before the end of the line, the rest is returned by the next call.
  *
  * TODO: improve "len" semantics for L0 interfaces that do framing, such as this. Currently this returns max 1 message, to
  * let L2 do another call to get further messages (typical case of multiple responses)
  */
 static int elm_recv(struct diag_l0_device *dl0d, void *data, size_t len, unsigned int timeout) {
-	int rv, xferd;
+	int rv;
+	size_t xferd;
 	struct elm_device *dev = dl0d->l0_int;
-	uint8_t rxbuf[3*MAXRBUF +1];    //I think some hotdog code in L2/L3 calls _recv with MAXRBUF so this needs to be huge.
+	char rxbuf[3*MAXRBUF +1];       //I think some hotdog code in L2/L3 calls _recv with MAXRBUF so this needs to be huge.
 	//the +1 is to \0-terminate the buffer for elm_parse_errors() to work
 
-	unsigned long t0,tf;    //manual timeout control
-	int steplen;    /* bytes per read */
-	int wp, rp;     /* write & read indexes in rxbuf; a type of FIFO */
+	unsigned long tf;       //manual timeout control
+	size_t wp;              //write index in rxbuf
 	const char *err;
+	const char *endp;
+	unsigned long lat_us = 0;       //latency of the first char, if measuring
 
 	if ((!len) || (len > MAXRBUF)) {
 		return diag_iseterr(DIAG_ERR_BADLEN);
 	}
 
-	t0=diag_os_getms();
-	tf=t0+timeout + ELM_SLOWNESS;   //timeout when tf is reached
+	if (dev->monitoring) {
+		return elm_monrecv(dl0d, data, len, timeout);
+	}
 
-	steplen=2;
-	wp=0;
-	rp=0;
-	xferd=0;
-	rxbuf[0] = 0x00;        //null-terminate
+	if (dev->taillen) {
+		//rest of the previous line first
+		wp = dev->taillen;
+		memcpy(rxbuf, dev->tail, wp);
+		rxbuf[wp] = 0;
+		dev->taillen = 0;
+		goto decode;
+	}
+
+	if (dev->rxdone) {
+		//already got the prompt : the ELM has nothing more for us
+		return DIAG_ERR_TIMEOUT;
+	}
+
+	tf=diag_os_getms() + timeout + ELM_SLOWNESS;    //timeout when tf is reached
 
 	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
-	          FLFMT "Expecting 3*%d bytes from ELM, %u ms timeout(+400)...",
-	          FL, (int)len, timeout);
+	          FLFMT "Expecting 3*%d bytes from ELM, %u ms timeout(+%d)...",
+	          FL, (int)len, timeout, ELM_SLOWNESS);
 
 	while (1) {
-		unsigned long tcur;
-		/* technique : try to read hexpairs (2 bytes); split messages according to
-		 * spacing chars (">\r\n")
-		 */
-		tcur = diag_os_getms();
-		if (tcur >= tf) {
-			/* timed out : */
-			goto pre_exit;
+		/* read one line : up to CR / LF / prompt, skipping empty lines */
+		wp = 0;
+		while (wp < sizeof(rxbuf) - 1) {
+			unsigned long tcur = diag_os_getms();
+			if (tcur >= tf) {
+				break;
+			}
+			tcur = tf - tcur;
+			rv = elm_getc(dev, (uint8_t *) &rxbuf[wp], (tcur < MAXTIMEOUT)? tcur : MAXTIMEOUT - 1);
+			if (rv == DIAG_ERR_TIMEOUT) {
+				break;
+			}
+			if (rv <= 0) {
+				fprintf(stderr, FLFMT "elm_recv error\n", FL);
+				return diag_iseterr(DIAG_ERR_GENERAL);
+			}
+			if (rxbuf[wp] == '>') {
+				/* prompt : that was the last response. */
+				dev->rxdone = 1;
+				break;
+			}
+			if ((rxbuf[wp] == '\r') || (rxbuf[wp] == '\n')) {
+				if (wp == 0) {
+					continue;
+				}
+				break;
+			}
+			if ((wp == 0) && dev->lat_pending && !lat_us) {
+				lat_us = (unsigned long) diag_os_hrtus(diag_os_gethrt() - dev->tsent);
+			}
+			wp++;
 		}
-		timeout = tf - tcur;
+		rxbuf[wp] = 0;
 
-		rv = diag_tty_read(dev->tty_int, rxbuf+wp, steplen, timeout);
-		if (rv == DIAG_ERR_TIMEOUT) {
-			goto pre_exit;
+		if ((strncmp(rxbuf, "SEARCHING", 9) == 0) || (strncmp(rxbuf, "BUS INIT", 8) == 0)) {
+			if (dev->rxdone) {
+				return DIAG_ERR_TIMEOUT;
+			}
+			continue;
 		}
+		break;
+	}
 
-		if (rv <= 0) {
-			fprintf(stderr, FLFMT "elm_recv error\n", FL);
-			return diag_iseterr(DIAG_ERR_GENERAL);
+decode:
+	xferd = diag_hex_decode(data, len, rxbuf, wp, &endp);
+	if ((endp == &rxbuf[wp]) || (xferd == len)) {
+		if (xferd == 0) {
+			return DIAG_ERR_TIMEOUT;
 		}
-
-		wp += rv;       /* position for next tty_read */
-		rxbuf[wp]=0;            // '\0'-terminate "string"
-
-		int skipc;      /* chars to skip */
-
-		skipc = strspn((char *)(&rxbuf[rp]), " ");      /* skip contig spaces */
-		rp += skipc;
-		/* line end ? */
-		skipc=strspn((char *)(&rxbuf[rp]), "\r\n>");
-		rp += skipc;
-		if (skipc > 0) {
-			/* definitely a line-end / prompt ! return data so far, if any */
-			if (xferd > 0) {
-				goto pre_exit;
-			}
+		if (endp != &rxbuf[wp]) {
+			elm_keeptail(dev, endp, (size_t) (&rxbuf[wp] - endp));
 		}
-
-		if (strlen((char *)(&rxbuf[rp])) < 2) {
-			/* probably incomplete hexpair. */
-			steplen=1;
-			continue;
+		if (lat_us) {
+			//only real responses count : "NO DATA" comes after the full ATST wait
+			elm_update_st(dev, lat_us);
 		}
+		return (int) xferd;
+	}
 
-		unsigned int rbyte;
-		if (sscanf((char *)(&rxbuf[rp]), "%02X", &rbyte) == 1) {
-			/* good hexpair */
-			((uint8_t *)data)[xferd]=(uint8_t) rbyte;
-			xferd++;
-			if ( (size_t)xferd==len) {
-				goto pre_exit;
-			}
-		} else {
-			/* didn't scanf properly... error message ? ex. "NO DATA\r>"
-			 * NO DATA is pretty inoffensive; skip printing that one */
-			if (!(rxbuf[rp] == 'N' && rxbuf[rp+1] =='O')) {
-				fprintf(stderr, FLFMT "ELM sscanf failed to eat '%s'\n", FL, rxbuf);
-			}
-			/* finish pulling the error message or whatever garbage */
-			rv = diag_tty_read(dev->tty_int, rxbuf+wp, sizeof(rxbuf) - wp, ELM_SLOWNESS);
-			if (rv >= 0) {
-				rxbuf[wp + rv] = 0x00;
+	/* not just hexpairs : error message ? ex. "NO DATA\r>".
+	 * Finish pulling the error message or whatever garbage */
+	if (!dev->rxdone) {
+		rv = elm_readprompt(dev, (uint8_t *) &rxbuf[wp], sizeof(rxbuf) - 1 - wp, ELM_SLOWNESS);
+		if (rv > 0) {
+			if (rxbuf[wp + rv - 1] == '>') {
+				dev->rxdone = 1;
 			}
-			xferd = DIAG_ERR_GENERAL;
-			goto pre_exit;
+			wp += rv;
+			rxbuf[wp] = 0;
 		}
-		/* here, we just sscanf'd 2 bytes, so we read 1 more. */
-		/* we can't read 2 more, in case we're in a multi-message, for instance if we just decoded 0x00 in
-		 * "48 6A 01 00\n48 6A..." , reading two bytes "\n4" would corrupt the next message !
-		 */
-		rp += 2;
-		steplen=1;
-	}       // while (1)
-
-pre_exit:
-	err = elm_parse_errors(dl0d, rxbuf);
-	if (err) {
-		if (strcmp(err, "NO DATA") == 0) {
-			return DIAG_ERR_TIMEOUT;
-		}
-		fprintf(stderr, FLFMT "ELM error %s\n", FL, err);
+	}
+
+	err = elm_parse_errors(dl0d, (uint8_t *) rxbuf);
+	if (err == NULL) {
+		fprintf(stderr, FLFMT "ELM response not understood : '%s'\n", FL, rxbuf);
 		return diag_iseterr(DIAG_ERR_GENERAL);
 	}
-	return (xferd>0)? xferd:DIAG_ERR_TIMEOUT;
+	if (strcmp(err, "NO DATA") == 0) {
+		return DIAG_ERR_TIMEOUT;
+	}
+	if ((strcmp(err, "?") == 0) && (dev->elmflags & ELM_SENTCOUNT)) {
+		//probably a clone that doesn't know about response counts
+		fprintf(stderr, FLFMT "ELM rejected response count; disabling.\n", FL);
+		dev->elmflags |= ELM_NORESPCOUNT;
+	}
+	fprintf(stderr, FLFMT "ELM error %s\n", FL, err);
+	return diag_iseterr(DIAG_ERR_GENERAL);
 }
 
 
@@ -1225,6 +1728,18 @@ static int elm_ioctl(struct diag_l0_device *dl0d, unsigned cmd, void *data) {
 	case DIAG_IOCTL_SETWM:
 		rv = elm_setwm(dl0d, (struct diag_msg *)data);
 		break;
+	case DIAG_IOCTL_SETRESPCOUNT:
+		((struct elm_device *)dl0d->l0_int)->respcount = *(const unsigned int *)data;
+		rv = 0;
+		break;
+	case DIAG_IOCTL_MONITOR:
+		if (*(const unsigned int *)data) {
+			((struct elm_device *)dl0d->l0_int)->mon_restarts = 0;
+			rv = elm_monitor_start(dl0d);
+		} else if (((struct elm_device *)dl0d->l0_int)->monitoring) {
+			rv = elm_monitor_stop(dl0d);
+		}
+		break;
 	default:
 		rv = DIAG_ERR_IOCTL_NOTSUPP;
 		break;
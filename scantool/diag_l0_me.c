@@ -37,6 +37,7 @@
 
 #include "diag.h"
 #include "diag_cfg.h"
+#include "diag_cks.h"
 #include "diag_err.h"
 #include "diag_iso14230.h"      //for TesterPresent SID
 #include "diag_tty.h"
@@ -210,36 +211,6 @@ static int muleng_txcksum(uint8_t *data) {
 	return cksum;
 }
 
-/* Copied from diag_l2_proto_j1850_crc() in diag_l2_saej1850.c; I don't want L0 code to
- * rely on L2 functions so there is some amount of code duplication. According to comments
- * this algo is from  B. Roadman's website.
- */
-static uint8_t j1850_crc(uint8_t *msg_buf, int nbytes) {
-	uint8_t crc_reg=0xff,poly,i,j;
-	uint8_t *byte_point;
-	uint8_t bit_point;
-
-	for (i=0, byte_point=msg_buf; i<nbytes; ++i, ++byte_point) {
-		for (j=0, bit_point=0x80 ; j<8; ++j, bit_point>>=1) {
-			if (bit_point & *byte_point) {  // case for new bit = 1
-				if (crc_reg & 0x80) {
-					poly=1; // define the polynomial
-				} else {
-					poly = 0x1c;
-				}
-				crc_reg= ( (crc_reg << 1) | 1) ^ poly;
-			} else {                // case for new bit = 0
-				poly=0;
-				if (crc_reg & 0x80) {
-					poly = 0x1d;
-				}
-				crc_reg= (crc_reg << 1) ^ poly;
-			}
-		}
-	}
-	return ~crc_reg;        // Return CRC
-}
-
 /* parse an ME response buffer, and return the actual payload length (including checksum / CRC byte) by
  * trying to find the longest message with a valid checksum or CRC.
  * Limitations :
@@ -255,28 +226,34 @@ static unsigned me_guess_rxlen(uint8_t *buf) {
 	/* Response format :
 	 * buf[1]=type; buf[2]: payload, padded with 0 bytes at the end; buf[13] : ME checksum (ignored here)
 	 */
+	uint8_t msg_type = buf[1];
+	uint8_t cks;
+	bool valid[11] = {0};   //valid[len] : checksum/CRC works with this length
 	unsigned len;
 
-	for (len=10; len > 0; len--) {
-		uint8_t msg_type = buf[1];
-		// verify if checksum/CRC works with this length:
-
+	// one pass with running checksums, instead of recalculating for every length
+	cks = ((msg_type == ME_RESP_PWM) || (msg_type == ME_RESP_VPW))? DIAG_CRC8_J1850_INIT : 0;
+	for (len=1; len <= 10; len++) {
 		switch (msg_type) {
 		case ME_RESP_PWM:
 		case ME_RESP_VPW:
-			if (j1850_crc(&buf[2], len) == buf[2 + len]) {
-				return len + 1;
-			}
+			cks = diag_crc8_j1850_update(cks, &buf[1 + len], 1);
+			valid[len] = ((cks ^ buf[2 + len]) == 0xFF);     //CRC byte is the inverted register
 			break;
 		case ME_RESP_14230:
 		case ME_RESP_ISO:
-			if (diag_cks1(&buf[2], len) == buf[2 + len]) {
-				return len + 1;
-			}
+			cks = diag_cks1_update(cks, &buf[1 + len], 1);
+			valid[len] = (cks == buf[2 + len]);
 			break;
 		default:
 			break;
 		}
+	}
+
+	for (len=10; len > 0; len--) {
+		if (valid[len]) {
+			return len + 1;
+		}
 
 		// was the last byte 0, therefore possibly just padding ?
 		if (buf[2+len] != 0) {
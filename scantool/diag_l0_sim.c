@@ -37,6 +37,10 @@
  * with allowance for comments (lines started with "#") and a very small and
  * rigid syntax (check the comments in the file).
  *
+ * With a "CFG P_CAN" DB file, CAN connections exchange single CAN frames
+ * (see diag_iso15765.h) and the simulator plays the ECU side of ISO15765-2,
+ * so the CAN L2 can be exercised without hardware.
+ *
  */
 
 #include <assert.h>
@@ -49,7 +53,10 @@
 #include <math.h> // sin()
 
 #include "diag.h"
+#include "diag_cks.h"
 #include "diag_err.h"
+#include "diag_hex.h"
+#include "diag_iso15765.h"
 #include "diag_os.h"
 #include "diag_l0.h"
 #include "diag_l1.h"
@@ -77,6 +84,12 @@ struct sim_ecu_response {
 	struct sim_ecu_response *next;
 };
 
+// CAN frames waiting for sim_recv(), in the L0 CAN frame format (diag_iso15765.h)
+struct sim_can_frame {
+	uint8_t data[DIAG_CAN_MAXFRAME];
+	struct sim_can_frame *next;
+};
+
 /* Internal state (struct diag_l0_device->l0_int) */
 struct sim_device {
 	int protocol;
@@ -98,6 +111,22 @@ struct sim_device {
 
 	uint8_t sim_last_ecu_request[MAX_RESP_LEN];     // Copy of most recent request.
 	struct sim_ecu_response *sim_last_ecu_responses;        // For keeping all the responses to the last request.
+
+	/* CAN mode : we exchange CAN frames, and play the ECU side of ISO15765-2 */
+	bool can;
+	uint8_t can_bs;         /* BS and STmin in our flow control frames (CFG CAN_BS, CAN_STMIN) */
+	uint8_t can_stmin;
+	struct sim_can_frame *can_rxq;  /* frames for sim_recv() */
+
+	uint32_t can_rqid;      /* segmented request being received */
+	uint8_t can_rq[MAX_RESP_LEN];
+	unsigned int can_rqlen, can_rqoff;
+	uint8_t can_rqsn, can_rqbsleft;
+
+	uint32_t can_txid;      /* segmented response being sent; waits for the tester's FC */
+	uint8_t can_tx[MAX_RESP_LEN];
+	unsigned int can_txlen, can_txoff;
+	uint8_t can_txsn;
 };
 
 
@@ -382,7 +411,6 @@ static void sim_parse_response(struct sim_ecu_response *resp_p, uint8_t req[]) {
 	uint8_t synth_resp[SRESP_SIZE]; // response bytes.
 	char *cur_tok = NULL;           //current token
 	char *rptr = resp_p->text;      //working copy of the ptr. We will mangle resp_p->text
-	int ret;
 	int pos = 0;
 
 	// extract byte values from response line, splitting tokens at whitespace / EOL.
@@ -403,13 +431,10 @@ static void sim_parse_response(struct sim_ecu_response *resp_p, uint8_t req[]) {
 			synth_resp[pos] = requestbyten(synth_resp, cur_tok + strlen(TOKEN_REQUESTBYTE), req);
 		} else {
 			// failed. try scanning element as an Hex byte.
-			unsigned int tempbyte;
-			ret = sscanf(cur_tok, "%X", &tempbyte); //can't scan direct to uint8 !
-			if (ret != 1) {
+			if (diag_hex_byte(cur_tok, &synth_resp[pos]) != 0) {
 				fprintf(stderr, FLFMT "Error parsing line: %s at position %d.\n", FL, resp_p->text, pos*5);
 				break;
 			}
-			synth_resp[pos] = (uint8_t) tempbyte;
 		}
 		pos++;
 		rptr = NULL;    //strtok: continue parsing
@@ -442,11 +467,15 @@ static void sim_read_cfg(struct sim_device *dev) {
 #define CFG_P1850V      "P_J1850V"
 #define CFG_PCAN        "P_CAN"
 #define CFG_PRAW        "P_RAW"
+#define CFG_CANBS       "CAN_BS"
+#define CFG_CANSTMIN    "CAN_STMIN"
 
 	dev->dataonly = 0;
 	dev->nocksum = 0;
 	dev->fullinit = 0;
 	dev->proto_restrict = 0;
+	dev->can_bs = 0;
+	dev->can_stmin = 0;
 
 	// search for all config lines.
 	while (1) {
@@ -492,10 +521,266 @@ static void sim_read_cfg(struct sim_device *dev) {
 		} else if (strncmp(p, CFG_PRAW, strlen(CFG_PRAW)) == 0) {
 			dev->proto_restrict=DIAG_L1_RAW;
 			continue;
+		} else if (strncmp(p, CFG_CANBS, strlen(CFG_CANBS)) == 0) {
+			dev->can_bs = (uint8_t) strtoul(p + strlen(CFG_CANBS), NULL, 0);
+		} else if (strncmp(p, CFG_CANSTMIN, strlen(CFG_CANSTMIN)) == 0) {
+			dev->can_stmin = (uint8_t) strtoul(p + strlen(CFG_CANSTMIN), NULL, 0);
 		}
 	}
 }
 
+/**************************************************/
+// CAN (ISO15765) MODE:
+/**************************************************/
+// The tester (L2) sends and receives single CAN frames. We reassemble
+// segmented requests, answer them from the DB file, and segment the responses
+// according to the tester's flow control. In the DB file, RQ lines hold the
+// request payload (no PCI bytes); RP lines start with the 4-byte CAN ID
+// of the responding ECU, followed by the payload.
+
+// ID an ECU answers on, for a request sent to <id>
+static uint32_t sim_can_respid(uint32_t id) {
+	if (id & DIAG_CAN_EFF) {
+		// 29-bit : swap target and source
+		return (id & ~0xFFFFUL) | ((id & 0xFF) << 8) | ((id >> 8) & 0xFF);
+	}
+	if (id == ISO15765_OBD_FUNC) {
+		return ISO15765_OBD_RESP;
+	}
+	return id + ISO15765_OBD_RESPOFS;
+}
+
+// Queue one frame for sim_recv(), padded to 8 bytes.
+static void sim_can_queue(struct sim_device *dev, uint32_t id, const uint8_t *data, unsigned int len) {
+	struct sim_can_frame *f;
+
+	if (diag_calloc(&f, 1)) {
+		return;
+	}
+	DIAG_CAN_SETID(f->data, id);
+	memcpy(&f->data[DIAG_CAN_HDRLEN], data, len);
+	memset(&f->data[DIAG_CAN_HDRLEN + len], ISO15765_PADBYTE, DIAG_CAN_MAXDLEN - len);
+	LL_APPEND(dev->can_rxq, f);
+}
+
+static void sim_can_fc(struct sim_device *dev, uint32_t id, uint8_t fs) {
+	uint8_t fc[3];
+
+	fc[0] = ISO15765_PCI_FC | fs;
+	fc[1] = dev->can_bs;
+	fc[2] = dev->can_stmin;
+	sim_can_queue(dev, sim_can_respid(id), fc, sizeof(fc));
+}
+
+// Queue up to <n> consecutive frames of the response being sent (0 : all).
+static void sim_can_txblock(struct sim_device *dev, unsigned int n) {
+	uint8_t cf[DIAG_CAN_MAXDLEN];
+	unsigned int cnt;
+
+	for (cnt = 0; (dev->can_txoff < dev->can_txlen) && ((n == 0) || (cnt < n)); cnt++) {
+		unsigned int clen = MIN(dev->can_txlen - dev->can_txoff, ISO15765_CF_DLEN);
+
+		cf[0] = ISO15765_PCI_CF | (dev->can_txsn & 0x0F);
+		memcpy(&cf[1], &dev->can_tx[dev->can_txoff], clen);
+		sim_can_queue(dev, dev->can_txid, cf, clen + 1);
+		dev->can_txoff += clen;
+		dev->can_txsn++;
+	}
+	if (dev->can_txoff >= dev->can_txlen) {
+		dev->can_txlen = 0;
+	}
+}
+
+// Send the pending responses, up to the first one that needs a flow control.
+static void sim_can_respond(struct sim_device *dev) {
+	uint8_t frame[DIAG_CAN_MAXDLEN];
+
+	while ((dev->can_txlen == 0) && (dev->sim_last_ecu_responses != NULL)) {
+		struct sim_ecu_response *resp_p = dev->sim_last_ecu_responses;
+		unsigned int plen;
+		uint32_t id;
+
+		sim_parse_response(resp_p, dev->sim_last_ecu_request);
+		if (resp_p->len <= DIAG_CAN_HDRLEN) {
+			fprintf(stderr, FLFMT "CAN response must be a 4-byte ID + data\n", FL);
+			dev->sim_last_ecu_responses = sim_free_ecu_response(&dev->sim_last_ecu_responses);
+			continue;
+		}
+		id = DIAG_CAN_GETID(resp_p->data);
+		plen = resp_p->len - DIAG_CAN_HDRLEN;
+
+		if (plen <= ISO15765_SF_MAXLEN) {
+			frame[0] = ISO15765_PCI_SF | (uint8_t) plen;
+			memcpy(&frame[1], &resp_p->data[DIAG_CAN_HDRLEN], plen);
+			sim_can_queue(dev, id, frame, plen + 1);
+		} else {
+			memcpy(dev->can_tx, &resp_p->data[DIAG_CAN_HDRLEN], plen);
+			dev->can_txid = id;
+			dev->can_txlen = plen;
+			dev->can_txoff = ISO15765_FF_DLEN;
+			dev->can_txsn = 1;
+			frame[0] = ISO15765_PCI_FF | (uint8_t) (plen >> 8);
+			frame[1] = (uint8_t) plen;
+			memcpy(&frame[2], dev->can_tx, ISO15765_FF_DLEN);
+			sim_can_queue(dev, id, frame, DIAG_CAN_MAXDLEN);
+		}
+		dev->sim_last_ecu_responses = sim_free_ecu_response(&dev->sim_last_ecu_responses);
+	}
+}
+
+// A complete request was received.
+static void sim_can_request(struct sim_device *dev, const uint8_t *data, unsigned int len) {
+	DIAG_DBGMDATA(diag_l0_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V, data, len,
+	              FLFMT "CAN request, %u bytes; ", FL, len);
+
+	if ((dev->sim_last_ecu_responses != NULL) || dev->can_txlen) {
+		DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V,
+		          FLFMT "new request, dropping unsent responses\n", FL);
+		sim_free_ecu_responses(&dev->sim_last_ecu_responses);
+		dev->can_txlen = 0;
+	}
+
+	memcpy(dev->sim_last_ecu_request, data, len);
+	sim_find_responses(&dev->sim_last_ecu_responses, dev->fp, data, len);
+	sim_dump_ecu_responses(dev->sim_last_ecu_responses);
+	sim_can_respond(dev);
+}
+
+// One frame from the tester.
+static int sim_can_send(struct sim_device *dev, const uint8_t *frame, size_t len) {
+	const uint8_t *d = &frame[DIAG_CAN_HDRLEN];
+	unsigned int dlc, plen, clen;
+	uint32_t id;
+
+	if ((len <= DIAG_CAN_HDRLEN) || (len > DIAG_CAN_MAXFRAME)) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+	id = DIAG_CAN_GETID(frame);
+	dlc = (unsigned int) len - DIAG_CAN_HDRLEN;
+
+	DIAG_DBGMDATA(diag_l0_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V, d, dlc,
+	              FLFMT "CAN frame 0x%lX; ", FL, (unsigned long) id);
+
+	switch (d[0] & ISO15765_PCI_MASK) {
+	case ISO15765_PCI_SF:
+		plen = d[0] & 0x0F;
+		if ((plen == 0) || (plen >= dlc)) {
+			break;
+		}
+		dev->can_rqlen = 0;
+		sim_can_request(dev, &d[1], plen);
+		break;
+	case ISO15765_PCI_FF:
+		plen = ((d[0] & 0x0F) << 8) | d[1];
+		if (dlc < DIAG_CAN_MAXDLEN) {
+			break;
+		}
+		if (plen > MAX_RESP_LEN) {
+			sim_can_fc(dev, id, ISO15765_FS_OVFLW);
+			break;
+		}
+		dev->can_rqid = id;
+		dev->can_rqlen = plen;
+		memcpy(dev->can_rq, &d[2], ISO15765_FF_DLEN);
+		dev->can_rqoff = ISO15765_FF_DLEN;
+		dev->can_rqsn = 1;
+		dev->can_rqbsleft = dev->can_bs;
+		sim_can_fc(dev, id, ISO15765_FS_CTS);
+		break;
+	case ISO15765_PCI_CF:
+		if ((dev->can_rqlen == 0) || (id != dev->can_rqid)) {
+			break;
+		}
+		if ((d[0] & 0x0F) != (dev->can_rqsn & 0x0F)) {
+			fprintf(stderr, FLFMT "CAN request : bad sequence number\n", FL);
+			dev->can_rqlen = 0;
+			break;
+		}
+		clen = MIN(dev->can_rqlen - dev->can_rqoff, dlc - 1);
+		memcpy(&dev->can_rq[dev->can_rqoff], &d[1], clen);
+		dev->can_rqoff += clen;
+		dev->can_rqsn++;
+		if (dev->can_rqoff >= dev->can_rqlen) {
+			dev->can_rqlen = 0;
+			sim_can_request(dev, dev->can_rq, dev->can_rqoff);
+		} else if (dev->can_rqbsleft && (--dev->can_rqbsleft == 0)) {
+			dev->can_rqbsleft = dev->can_bs;
+			sim_can_fc(dev, id, ISO15765_FS_CTS);
+		}
+		break;
+	case ISO15765_PCI_FC:
+		if ((dev->can_txlen == 0) || (dlc < 3)) {
+			break;
+		}
+		switch (d[0] & 0x0F) {
+		case ISO15765_FS_CTS:
+			sim_can_txblock(dev, d[1]);
+			sim_can_respond(dev);
+			break;
+		case ISO15765_FS_WAIT:
+			break;
+		default:
+			dev->can_txlen = 0;
+			sim_can_respond(dev);
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+// DIAG_IOCTL_CAN_RECVBATCH : everything queued, up to batch->max frames.
+static int sim_can_recvbatch(struct sim_device *dev, struct diag_can_batch *batch) {
+	batch->n = 0;
+	while ((dev->can_rxq != NULL) && (batch->n < batch->max)) {
+		struct sim_can_frame *f = dev->can_rxq;
+		struct diag_can_frame *bf = &batch->frames[batch->n++];
+
+		bf->id = DIAG_CAN_GETID(f->data);
+		bf->dlc = DIAG_CAN_MAXDLEN;
+		memcpy(bf->data, &f->data[DIAG_CAN_HDRLEN], DIAG_CAN_MAXDLEN);
+		bf->ts = 0;
+		LL_DELETE(dev->can_rxq, f);
+		free(f);
+	}
+	return batch->n? 0 : DIAG_ERR_TIMEOUT;
+}
+
+// DIAG_IOCTL_CAN_SENDBATCH
+static int sim_can_sendbatch(struct sim_device *dev, struct diag_can_batch *batch) {
+	uint8_t frame[DIAG_CAN_MAXFRAME];
+	int rv;
+
+	for (batch->n = 0; batch->n < batch->max; batch->n++) {
+		const struct diag_can_frame *bf = &batch->frames[batch->n];
+
+		if (bf->dlc > DIAG_CAN_MAXDLEN) {
+			return diag_iseterr(DIAG_ERR_BADLEN);
+		}
+		DIAG_CAN_SETID(frame, bf->id);
+		memcpy(&frame[DIAG_CAN_HDRLEN], bf->data, bf->dlc);
+		rv = sim_can_send(dev, frame, DIAG_CAN_HDRLEN + bf->dlc);
+		if (rv) {
+			return rv;
+		}
+	}
+	return 0;
+}
+
+static void sim_can_flush(struct sim_device *dev) {
+	struct sim_can_frame *f, *tmp;
+
+	LL_FOREACH_SAFE(dev->can_rxq, f, tmp) {
+		LL_DELETE(dev->can_rxq, f);
+		free(f);
+	}
+	dev->can_rqlen = 0;
+	dev->can_txlen = 0;
+}
+
 /**************************************************/
 // INTERFACE FUNCTIONS:
 /**************************************************/
@@ -581,6 +866,13 @@ int sim_open(struct diag_l0_device *dl0d, int iProtocol) {
 		}
 	}
 
+	/* CAN frames only make sense with a DB written for them */
+	dev->can = (iProtocol == DIAG_L1_CAN);
+	if (dev->can && (dev->proto_restrict != DIAG_L1_CAN)) {
+		sim_close(dl0d);
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
 	dl0d->opened = 1;
 	return 0;
 }
@@ -599,7 +891,7 @@ void sim_close(struct diag_l0_device *dl0d) {
 	          FLFMT "dl0d=%p closing simfile\n", FL, (void *)dl0d);
 
 	sim_free_ecu_responses(&dev->sim_last_ecu_responses);
-
+	sim_can_flush(dev);
 
 	if (dev->fp != NULL) {
 		fclose(dev->fp);
@@ -669,6 +961,10 @@ int sim_send(struct diag_l0_device *dl0d,
 		return diag_iseterr(DIAG_ERR_BADLEN);
 	}
 
+	if (dev->can) {
+		return sim_can_send(dev, data, len);
+	}
+
 	if (len > MAX_RESP_LEN) {
 		fprintf(stderr, FLFMT "Error : calling sim_send with len (%u) > MAX_RESP_LEN !\n", FL, (unsigned int) len);
 		return diag_iseterr(DIAG_ERR_GENERAL);
@@ -710,6 +1006,22 @@ int sim_recv(struct diag_l0_device *dl0d,
 	          FLFMT "link %p recv upto %ld bytes timeout %u\n",
 	          FL, (void *)dl0d, (long)len, timeout);
 
+	if (dev->can) {
+		// one frame at a time
+		struct sim_can_frame *f = dev->can_rxq;
+
+		if (f == NULL) {
+			return DIAG_ERR_TIMEOUT;
+		}
+		xferd = MIN(sizeof(f->data), len);
+		memcpy(data, f->data, xferd);
+		LL_DELETE(dev->can_rxq, f);
+		free(f);
+		DIAG_DBGMDATA(diag_l0_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V, data, xferd,
+		              FLFMT "dl0d=%p recv CAN frame; ", FL, (void *)dl0d);
+		return (int) xferd;
+	}
+
 	// "Receive from the ECU" a response.
 	resp_p = dev->sim_last_ecu_responses;
 	if (resp_p != NULL) {
@@ -741,6 +1053,11 @@ uint32_t sim_getflags(struct diag_l0_device *dl0d) {
 	struct sim_device *dev = dl0d->l0_int;
 	int ret;
 
+	if (dev->can) {
+		return DIAG_L1_DOESL2FRAME | DIAG_L1_DOESP4WAIT |
+		       DIAG_L1_AUTOSPEED | DIAG_L1_NOTTY;
+	}
+
 	ret = DIAG_L1_SLOW |
 	      DIAG_L1_FAST |
 	      DIAG_L1_PREFFAST |
@@ -770,6 +1087,31 @@ uint32_t sim_getflags(struct diag_l0_device *dl0d) {
 }
 
 
+// Narrows down the L1 protocol mask according to the DB file :
+// sim_open() refuses anything but a "CFG P_xxx" protocol, and CAN
+// without "CFG P_CAN".
+static int sim_getl1type(struct diag_l0_device *dl0d, int *mask) {
+	struct sim_device *dev = dl0d->l0_int;
+
+	if (!dl0d->opened) {
+		dev->fp = fopen(dev->simfile.val.str, "r");
+		if (dev->fp == NULL) {
+			return 0;       //sim_open() will complain
+		}
+		sim_read_cfg(dev);
+		fclose(dev->fp);
+		dev->fp = NULL;
+	}
+
+	if (dev->proto_restrict) {
+		*mask &= dev->proto_restrict;
+	} else {
+		*mask &= ~DIAG_L1_CAN;
+	}
+	return 0;
+}
+
+
 struct cfgi *sim_getcfg(struct diag_l0_device *dl0d) {
 	struct sim_device *dev;
 	if (dl0d == NULL) {
@@ -782,12 +1124,30 @@ struct cfgi *sim_getcfg(struct diag_l0_device *dl0d) {
 
 
 int sim_ioctl(struct diag_l0_device *dl0d, unsigned cmd, void *data) {
+	struct sim_device *dev = dl0d->l0_int;
 	int rv = 0;
 
 	switch (cmd) {
 	case DIAG_IOCTL_INITBUS:
 		rv = sim_initbus(dl0d, (struct diag_l1_initbus_args *)data);
 		break;
+	case DIAG_IOCTL_GET_L1_TYPE:
+		rv = sim_getl1type(dl0d, (int *)data);
+		break;
+	case DIAG_IOCTL_CAN_RECVBATCH:
+		if (!dev->can) {
+			rv = DIAG_ERR_IOCTL_NOTSUPP;
+			break;
+		}
+		rv = sim_can_recvbatch(dev, (struct diag_can_batch *)data);
+		break;
+	case DIAG_IOCTL_CAN_SENDBATCH:
+		if (!dev->can) {
+			rv = DIAG_ERR_IOCTL_NOTSUPP;
+			break;
+		}
+		rv = sim_can_sendbatch(dev, (struct diag_can_batch *)data);
+		break;
 	default:
 		rv = DIAG_ERR_IOCTL_NOTSUPP;
 		break;
@@ -800,11 +1160,11 @@ int sim_ioctl(struct diag_l0_device *dl0d, unsigned cmd, void *data) {
 // Declares the interface's protocol flags
 // and pointers to functions.
 // Like any simulator, it "implements" all protocols
-// (it only depends on the content of the DB file).
+// (it only depends on the content of the DB file, see sim_getl1type()).
 const struct diag_l0 diag_l0_sim = {
 	"Car Simulator interface",
 	"CARSIM",
-	DIAG_L1_J1850_VPW | DIAG_L1_J1850_PWM | DIAG_L1_ISO9141 | DIAG_L1_ISO14230 | DIAG_L1_RAW,
+	DIAG_L1_J1850_VPW | DIAG_L1_J1850_PWM | DIAG_L1_ISO9141 | DIAG_L1_ISO14230 | DIAG_L1_CAN | DIAG_L1_RAW,
 	sim_init,
 	sim_new,
 	sim_getcfg,
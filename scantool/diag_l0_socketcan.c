@@ -0,0 +1,625 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Diag, Layer 0, Linux SocketCAN interface (CAN_RAW socket)
+ *
+ * Any CAN adapter with a kernel driver (can0, slcan0, ...) or the "vcan"
+ * virtual interface :
+ *	ip link add dev vcan0 type vcan && ip link set up vcan0
+ * The bitrate is set outside freediag, with "ip link set can0 type can bitrate 500000".
+ *
+ * Frames are exchanged with L2 in the diag_iso15765.h format, one per
+ * _send() / _recv() call, or in bursts with DIAG_IOCTL_CAN_SENDBATCH /
+ * _RECVBATCH. Either way, reception is done with recvmmsg() : every frame
+ * already queued in the socket (up to SOCKCAN_RXBATCH) comes in with one
+ * syscall, and later calls are served from that buffer.
+ * Frames carry the kernel receive timestamp (SO_TIMESTAMPING), which stays
+ * accurate even when L2 gets to them late; the CAN_RAW_FILTER set by
+ * DIAG_IOCTL_CAN_SETFILTER keeps unrelated bus traffic in the kernel.
+ */
+
+#define _GNU_SOURCE     //recvmmsg(), sendmmsg()
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+
+#include "diag.h"
+#include "diag_cfg.h"
+#include "diag_err.h"
+#include "diag_iso15765.h"
+#include "diag_os.h"
+#include "diag_l0.h"
+#include "diag_l1.h"
+
+
+#define SOCKCAN_RXBATCH 64      /* frames per recvmmsg() */
+#define SOCKCAN_TXBATCH 32      /* frames per sendmmsg() */
+#define SOCKCAN_RCVBUF  (256 * 1024)    /* socket rx buffer : room for bursts on a busy bus */
+#define SOCKCAN_TXRETRY 100     /* ms to wait for room in a full tx queue */
+
+#define SOCKCAN_IF_SN "ifname"
+#define SOCKCAN_IF_DESCR "CAN network interface (see \"ip link\")"
+#define SOCKCAN_IF_DEFAULT "can0"
+
+/* SCM_TIMESTAMPING payload, as in linux/errqueue.h (which doesn't mix
+ * well with time.h) : [0] software, [2] raw hardware.
+ */
+struct sockcan_tstamp {
+	struct timespec ts[3];
+};
+
+extern const struct diag_l0 diag_l0_socketcan;
+
+struct sockcan_device {
+	struct cfgi ifname;
+	int fd;
+	uint32_t drops;         /* last SO_RXQ_OVFL count */
+
+	/* receive buffer, filled by one recvmmsg() and drained by _recv / RECVBATCH */
+	struct can_frame rxf[SOCKCAN_RXBATCH];
+	unsigned long long rxts[SOCKCAN_RXBATCH];       /* diag_os_gethrt() time of reception */
+	unsigned int rxn, rxi;
+
+	struct mmsghdr rxmsg[SOCKCAN_RXBATCH];
+	struct iovec rxiov[SOCKCAN_RXBATCH];
+	union {
+		char buf[CMSG_SPACE(sizeof(struct sockcan_tstamp)) + CMSG_SPACE(sizeof(uint32_t))];
+		size_t align;   /* cmsghdr alignment */
+	} rxctl[SOCKCAN_RXBATCH];
+};
+
+
+static int sockcan_init(void) {
+	return 0;
+}
+
+static int sockcan_new(struct diag_l0_device *dl0d) {
+	struct sockcan_device *dev;
+	int rv;
+
+	assert(dl0d);
+
+	rv = diag_calloc(&dev, 1);
+	if (rv != 0) {
+		return diag_ifwderr(rv);
+	}
+
+	dl0d->l0_int = dev;
+	dev->fd = -1;
+
+	rv = diag_cfgn_str(&dev->ifname, SOCKCAN_IF_DEFAULT, SOCKCAN_IF_DESCR, SOCKCAN_IF_SN);
+	if (rv != 0) {
+		free(dev);
+		return diag_ifwderr(rv);
+	}
+	dev->ifname.next = NULL;
+
+	return 0;
+}
+
+static struct cfgi *sockcan_getcfg(struct diag_l0_device *dl0d) {
+	struct sockcan_device *dev;
+	if (dl0d == NULL) {
+		return diag_pseterr(DIAG_ERR_BADCFG);
+	}
+
+	dev = dl0d->l0_int;
+	return &dev->ifname;
+}
+
+static void sockcan_del(struct diag_l0_device *dl0d) {
+	struct sockcan_device *dev;
+
+	assert(dl0d);
+
+	dev = dl0d->l0_int;
+	if (!dev) {
+		return;
+	}
+
+	diag_cfg_clear(&dev->ifname);
+	free(dev);
+	return;
+}
+
+
+static void sockcan_close(struct diag_l0_device *dl0d) {
+	struct sockcan_device *dev;
+
+	assert(dl0d);
+	dev = dl0d->l0_int;
+
+	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_CLOSE, DIAG_DBGLEVEL_V,
+	          FLFMT "dl0d=%p closing %s\n", FL, (void *)dl0d, dev->ifname.val.str);
+
+	if (dev->fd >= 0) {
+		close(dev->fd);
+		dev->fd = -1;
+	}
+	dev->rxn = dev->rxi = 0;
+	dl0d->opened = 0;
+	return;
+}
+
+static int sockcan_open(struct diag_l0_device *dl0d, int iProtocol) {
+	struct sockcan_device *dev;
+	struct sockaddr_can addr;
+	const char *ifname;
+	unsigned int i;
+	int opt;
+
+	assert(dl0d);
+	dev = dl0d->l0_int;
+	ifname = dev->ifname.val.str;
+
+	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_OPEN, DIAG_DBGLEVEL_V,
+	          FLFMT "open %s proto=%d\n", FL, ifname, iProtocol);
+
+	if (iProtocol != DIAG_L1_CAN) {
+		fprintf(stderr, FLFMT "SocketCAN only supports CAN\n", FL);
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = (int) if_nametoindex(ifname);
+	if (addr.can_ifindex == 0) {
+		fprintf(stderr, FLFMT "No CAN interface \"%s\"; set it with \"set %s\"\n",
+		        FL, ifname, SOCKCAN_IF_SN);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	dev->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (dev->fd < 0) {
+		fprintf(stderr, FLFMT "CAN socket : %s\n", FL, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	if (bind(dev->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, FLFMT "bind to %s : %s\n", FL, ifname, strerror(errno));
+		sockcan_close(dl0d);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	/* Nice to have; not fatal. */
+	opt = SOCKCAN_RCVBUF;
+	(void) setsockopt(dev->fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+	opt = 1;
+	(void) setsockopt(dev->fd, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof(opt));
+	opt = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+	      SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	if (setsockopt(dev->fd, SOL_SOCKET, SO_TIMESTAMPING, &opt, sizeof(opt)) < 0) {
+		DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_OPEN, DIAG_DBGLEVEL_V,
+		          FLFMT "no kernel timestamps : %s\n", FL, strerror(errno));
+	}
+
+	for (i = 0; i < SOCKCAN_RXBATCH; i++) {
+		dev->rxiov[i].iov_base = &dev->rxf[i];
+		dev->rxiov[i].iov_len = sizeof(struct can_frame);
+		dev->rxmsg[i].msg_hdr.msg_iov = &dev->rxiov[i];
+		dev->rxmsg[i].msg_hdr.msg_iovlen = 1;
+		dev->rxmsg[i].msg_hdr.msg_control = dev->rxctl[i].buf;
+	}
+	dev->rxn = dev->rxi = 0;
+	dev->drops = 0;
+
+	dl0d->opened = 1;
+	return 0;
+}
+
+
+/* Kernel timestamp (CLOCK_REALTIME) of a received frame -> diag_os_gethrt() time.
+ * <rt> and <hrt> are both clocks read right after reception.
+ */
+static unsigned long long sockcan_tshrt(const struct timespec *ts,
+                                        const struct timespec *rt, unsigned long long hrt) {
+	long long age_us;
+
+	age_us = ((long long) rt->tv_sec - ts->tv_sec) * 1000000LL +
+	         (rt->tv_nsec - ts->tv_nsec) / 1000;
+	if ((age_us < 0) || (age_us > 10 * 1000000LL)) {
+		/* clock was stepped; don't trust it */
+		return hrt;
+	}
+	return hrt - diag_os_ushrt((unsigned long) age_us);
+}
+
+/* Parse the ancillary data of rxmsg[i] : timestamp and drop counter. */
+static void sockcan_rxctl(struct diag_l0_device *dl0d, unsigned int i,
+                          const struct timespec *rt, unsigned long long hrt) {
+	struct sockcan_device *dev = dl0d->l0_int;
+	struct msghdr *mh = &dev->rxmsg[i].msg_hdr;
+	struct cmsghdr *cm;
+
+	dev->rxts[i] = hrt;
+
+	for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET) {
+			continue;
+		}
+		if (cm->cmsg_type == SO_TIMESTAMPING) {
+			struct sockcan_tstamp tst;
+
+			memcpy(&tst, CMSG_DATA(cm), sizeof(tst));
+			/* Software stamps are on the host clock; raw hardware ones
+			 * are on the adapter's and only good for debugging.
+			 */
+			if (tst.ts[0].tv_sec || tst.ts[0].tv_nsec) {
+				dev->rxts[i] = sockcan_tshrt(&tst.ts[0], rt, hrt);
+			}
+			DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_TIMER, DIAG_DBGLEVEL_V,
+			          FLFMT "frame %u : sw %ld.%09ld hw %ld.%09ld\n", FL, i,
+			          (long) tst.ts[0].tv_sec, tst.ts[0].tv_nsec,
+			          (long) tst.ts[2].tv_sec, tst.ts[2].tv_nsec);
+		} else if (cm->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t drops;
+
+			memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+			if (drops != dev->drops) {
+				fprintf(stderr, FLFMT "%s : %lu frames dropped, socket buffer full\n",
+				        FL, dev->ifname.val.str, (unsigned long) (drops - dev->drops));
+				dl0d->stats.overruns += drops - dev->drops;
+				dev->drops = drops;
+			}
+		}
+	}
+}
+
+/*
+ * Refill the receive buffer : wait up to <timeout> ms for a frame, then get
+ * everything the socket holds (up to SOCKCAN_RXBATCH) with one recvmmsg().
+ * Ret 0 if ok, DIAG_ERR_TIMEOUT if nothing came.
+ */
+static int sockcan_fill(struct diag_l0_device *dl0d, unsigned int timeout) {
+	struct sockcan_device *dev = dl0d->l0_int;
+	struct pollfd pfd;
+	struct timespec rt;
+	unsigned long long hrt;
+	unsigned int i, n;
+	int rv;
+
+	dev->rxn = dev->rxi = 0;
+
+	pfd.fd = dev->fd;
+	pfd.events = POLLIN;
+	do {
+		rv = poll(&pfd, 1, (int) timeout);
+	} while ((rv < 0) && (errno == EINTR));
+	if (rv < 0) {
+		fprintf(stderr, FLFMT "poll : %s\n", FL, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	if (rv == 0) {
+		return DIAG_ERR_TIMEOUT;
+	}
+
+	for (i = 0; i < SOCKCAN_RXBATCH; i++) {
+		dev->rxmsg[i].msg_hdr.msg_controllen = sizeof(dev->rxctl[i].buf);
+		dev->rxmsg[i].msg_hdr.msg_flags = 0;
+	}
+	rv = recvmmsg(dev->fd, dev->rxmsg, SOCKCAN_RXBATCH, MSG_DONTWAIT, NULL);
+	if (rv < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) {
+			return DIAG_ERR_TIMEOUT;
+		}
+		fprintf(stderr, FLFMT "recvmmsg : %s\n", FL, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &rt);
+	hrt = diag_os_gethrt();
+
+	/* keep data frames only, compacted at the start of the buffer */
+	for (i = 0, n = 0; i < (unsigned int) rv; i++) {
+		const struct can_frame *cf = &dev->rxf[i];
+
+		if ((dev->rxmsg[i].msg_len != sizeof(struct can_frame)) ||
+		    (cf->can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG))) {
+			continue;
+		}
+		sockcan_rxctl(dl0d, i, &rt, hrt);
+		if (n != i) {
+			dev->rxf[n] = dev->rxf[i];
+			dev->rxts[n] = dev->rxts[i];
+		}
+		n++;
+	}
+	dev->rxn = n;
+
+	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
+	          FLFMT "recvmmsg : %d frames, %u kept\n", FL, rv, n);
+
+	return n? 0 : DIAG_ERR_TIMEOUT;
+}
+
+/* L2 ID (diag_iso15765.h) <-> SocketCAN ID. Both use bit 31 for 29-bit IDs. */
+static uint32_t sockcan_l2id(canid_t id) {
+	if (id & CAN_EFF_FLAG) {
+		return DIAG_CAN_EFF | (id & CAN_EFF_MASK);
+	}
+	return id & CAN_SFF_MASK;
+}
+
+static canid_t sockcan_canid(uint32_t id) {
+	if (id & DIAG_CAN_EFF) {
+		return CAN_EFF_FLAG | (id & CAN_EFF_MASK);
+	}
+	return id & CAN_SFF_MASK;
+}
+
+
+static int sockcan_recv(struct diag_l0_device *dl0d,
+                        void *data, size_t len, unsigned int timeout) {
+	struct sockcan_device *dev = dl0d->l0_int;
+	const struct can_frame *cf;
+	uint8_t *p = data;
+	unsigned int dlc;
+	int rv;
+
+	if (len < DIAG_CAN_HDRLEN) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+
+	if (dev->rxi >= dev->rxn) {
+		rv = sockcan_fill(dl0d, timeout);
+		if (rv) {
+			return rv;
+		}
+	}
+	cf = &dev->rxf[dev->rxi++];
+
+	dlc = MIN(cf->can_dlc, DIAG_CAN_MAXDLEN);
+	dlc = MIN(dlc, (unsigned int) len - DIAG_CAN_HDRLEN);
+	DIAG_CAN_SETID(p, sockcan_l2id(cf->can_id));
+	memcpy(&p[DIAG_CAN_HDRLEN], cf->data, dlc);
+
+	DIAG_DBGMDATA(diag_l0_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V, cf->data, dlc,
+	              FLFMT "recv 0x%lX; ", FL, (unsigned long) sockcan_l2id(cf->can_id));
+
+	return (int) (DIAG_CAN_HDRLEN + dlc);
+}
+
+static int sockcan_recvbatch(struct diag_l0_device *dl0d, struct diag_can_batch *batch) {
+	struct sockcan_device *dev = dl0d->l0_int;
+	int rv;
+
+	batch->n = 0;
+	if (dev->rxi >= dev->rxn) {
+		rv = sockcan_fill(dl0d, batch->timeout);
+		if (rv) {
+			return rv;
+		}
+	}
+
+	while ((dev->rxi < dev->rxn) && (batch->n < batch->max)) {
+		const struct can_frame *cf = &dev->rxf[dev->rxi];
+		struct diag_can_frame *bf = &batch->frames[batch->n++];
+
+		bf->id = sockcan_l2id(cf->can_id);
+		bf->dlc = MIN(cf->can_dlc, DIAG_CAN_MAXDLEN);
+		memcpy(bf->data, cf->data, bf->dlc);
+		bf->ts = dev->rxts[dev->rxi];
+		dev->rxi++;
+	}
+
+	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
+	          FLFMT "recv batch : %u frames\n", FL, batch->n);
+	return 0;
+}
+
+
+/*
+ * Send frames with sendmmsg(), waiting a bit if the tx queue is full
+ * (ENOBUFS : the bus is busy, or nobody acks our frames).
+ */
+static int sockcan_write(struct diag_l0_device *dl0d, struct can_frame *cf, unsigned int n) {
+	struct sockcan_device *dev = dl0d->l0_int;
+	struct mmsghdr msg[SOCKCAN_TXBATCH];
+	struct iovec iov[SOCKCAN_TXBATCH];
+	unsigned int done = 0, waited = 0;
+	unsigned int i;
+
+	while (done < n) {
+		unsigned int cnt = MIN(n - done, SOCKCAN_TXBATCH);
+		int rv;
+
+		memset(msg, 0, sizeof(msg));
+		for (i = 0; i < cnt; i++) {
+			iov[i].iov_base = &cf[done + i];
+			iov[i].iov_len = sizeof(struct can_frame);
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		rv = sendmmsg(dev->fd, msg, cnt, 0);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (((errno == ENOBUFS) || (errno == EAGAIN)) && (waited < SOCKCAN_TXRETRY)) {
+				diag_os_millisleep(1);
+				waited++;
+				continue;
+			}
+			fprintf(stderr, FLFMT "sendmmsg on %s : %s\n", FL,
+			        dev->ifname.val.str, strerror(errno));
+			return diag_iseterr(DIAG_ERR_GENERAL);
+		}
+		done += (unsigned int) rv;
+	}
+
+	return 0;
+}
+
+static int sockcan_send(struct diag_l0_device *dl0d, const void *data, size_t len) {
+	const uint8_t *p = data;
+	struct can_frame cf;
+	unsigned int dlc;
+
+	if ((len < DIAG_CAN_HDRLEN) || (len > DIAG_CAN_MAXFRAME)) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+	dlc = (unsigned int) len - DIAG_CAN_HDRLEN;
+
+	memset(&cf, 0, sizeof(cf));
+	cf.can_id = sockcan_canid(DIAG_CAN_GETID(p));
+	cf.can_dlc = (uint8_t) dlc;
+	memcpy(cf.data, &p[DIAG_CAN_HDRLEN], dlc);
+
+	DIAG_DBGMDATA(diag_l0_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V, cf.data, dlc,
+	              FLFMT "send 0x%lX; ", FL, (unsigned long) DIAG_CAN_GETID(p));
+
+	return sockcan_write(dl0d, &cf, 1);
+}
+
+static int sockcan_sendbatch(struct diag_l0_device *dl0d, struct diag_can_batch *batch) {
+	struct can_frame cf[SOCKCAN_TXBATCH];
+	unsigned int i, cnt;
+	int rv;
+
+	batch->n = 0;
+	while (batch->n < batch->max) {
+		cnt = MIN(batch->max - batch->n, SOCKCAN_TXBATCH);
+		memset(cf, 0, sizeof(cf));
+		for (i = 0; i < cnt; i++) {
+			const struct diag_can_frame *bf = &batch->frames[batch->n + i];
+
+			if (bf->dlc > DIAG_CAN_MAXDLEN) {
+				return diag_iseterr(DIAG_ERR_BADLEN);
+			}
+			cf[i].can_id = sockcan_canid(bf->id);
+			cf[i].can_dlc = bf->dlc;
+			memcpy(cf[i].data, bf->data, bf->dlc);
+		}
+		rv = sockcan_write(dl0d, cf, cnt);
+		if (rv) {
+			return rv;
+		}
+		batch->n += cnt;
+	}
+
+	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V,
+	          FLFMT "sent batch : %u frames\n", FL, batch->n);
+	return 0;
+}
+
+
+static int sockcan_setfilter(struct diag_l0_device *dl0d, const struct diag_can_filters *flt) {
+	struct sockcan_device *dev = dl0d->l0_int;
+	struct can_filter cfl[DIAG_CAN_MAXFILTERS];
+	unsigned int i, nf;
+
+	if (flt->n > DIAG_CAN_MAXFILTERS) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+
+	nf = flt->n;
+	if (nf == 0) {
+		/* match everything */
+		cfl[0].can_id = 0;
+		cfl[0].can_mask = 0;
+		nf = 1;
+	}
+	for (i = 0; i < flt->n; i++) {
+		/* DIAG_CAN_EFF is CAN_EFF_FLAG, so id and mask carry over as is */
+		cfl[i].can_id = flt->f[i].id;
+		cfl[i].can_mask = flt->f[i].mask;
+		DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_IOCTL, DIAG_DBGLEVEL_V,
+		          FLFMT "filter %u : id 0x%08lX mask 0x%08lX\n", FL, i,
+		          (unsigned long) cfl[i].can_id, (unsigned long) cfl[i].can_mask);
+	}
+
+	if (setsockopt(dev->fd, SOL_CAN_RAW, CAN_RAW_FILTER, cfl,
+	               (socklen_t) (nf * sizeof(struct can_filter))) < 0) {
+		fprintf(stderr, FLFMT "CAN_RAW_FILTER : %s\n", FL, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	return 0;
+}
+
+/* Drop anything received so far. */
+static void sockcan_iflush(struct diag_l0_device *dl0d) {
+	struct sockcan_device *dev = dl0d->l0_int;
+	struct can_frame cf;
+
+	dev->rxn = dev->rxi = 0;
+	while (recv(dev->fd, &cf, sizeof(cf), MSG_DONTWAIT) > 0) {
+		;
+	}
+}
+
+
+static uint32_t sockcan_getflags(UNUSED(struct diag_l0_device *dl0d)) {
+	return DIAG_L1_DOESL2FRAME | DIAG_L1_DOESP4WAIT | DIAG_L1_AUTOSPEED;
+}
+
+static int sockcan_ioctl(struct diag_l0_device *dl0d, unsigned cmd, void *data) {
+	int rv = 0;
+
+	switch (cmd) {
+	case DIAG_IOCTL_IFLUSH:
+		sockcan_iflush(dl0d);
+		break;
+	case DIAG_IOCTL_CAN_SETFILTER:
+		rv = sockcan_setfilter(dl0d, (const struct diag_can_filters *)data);
+		break;
+	case DIAG_IOCTL_CAN_RECVBATCH:
+		rv = sockcan_recvbatch(dl0d, (struct diag_can_batch *)data);
+		break;
+	case DIAG_IOCTL_CAN_SENDBATCH:
+		rv = sockcan_sendbatch(dl0d, (struct diag_can_batch *)data);
+		break;
+	default:
+		rv = DIAG_ERR_IOCTL_NOTSUPP;
+		break;
+	}
+
+	return rv;
+}
+
+
+const struct diag_l0 diag_l0_socketcan = {
+	"Linux SocketCAN interface",
+	"SOCKETCAN",
+	DIAG_L1_CAN,
+	sockcan_init,
+	sockcan_new,
+	sockcan_getcfg,
+	sockcan_del,
+	sockcan_open,
+	sockcan_close,
+	sockcan_getflags,
+	sockcan_recv,
+	sockcan_send,
+	sockcan_ioctl
+};
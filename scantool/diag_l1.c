@@ -41,6 +41,7 @@
 
 #include "diag.h"
 #include "diag_err.h"
+#include "diag_iso15765.h"
 #include "diag_os.h"
 #include "diag_l0.h"
 #include "diag_l1.h"
@@ -118,9 +119,34 @@ void diag_l1_close(struct diag_l0_device *dl0d) {
 }
 
 int diag_l1_ioctl(struct diag_l0_device *dl0d, unsigned cmd, void *data) {
-	/* At the moment, no ioctls are handled at the L1 level, so forward them to L0. */
+	const struct diag_can_batch *batch = data;
+	unsigned int i;
+	int rv;
+
+	/* At the moment, no ioctls are handled at the L1 level, so forward them to L0.
+	 * Batched CAN transfers bypass diag_l1_send/_recv, count their bytes here.
+	 */
+	rv = diag_l0_ioctl(dl0d, cmd, data);
+	if (rv != 0) {
+		return rv;
+	}
+
+	switch (cmd) {
+	case DIAG_IOCTL_CAN_RECVBATCH:
+		for (i = 0; i < batch->n; i++) {
+			diag_stats_rxbytes(&dl0d->stats, DIAG_CAN_HDRLEN + batch->frames[i].dlc);
+		}
+		break;
+	case DIAG_IOCTL_CAN_SENDBATCH:
+		for (i = 0; i < batch->n; i++) {
+			dl0d->stats.tx_bytes += DIAG_CAN_HDRLEN + batch->frames[i].dlc;
+		}
+		break;
+	default:
+		break;
+	}
 
-	return diag_l0_ioctl(dl0d, cmd, data);
+	return 0;
 }
 
 
@@ -164,6 +190,9 @@ int diag_l1_send(struct diag_l0_device *dl0d, const void *data, size_t len, unsi
 		 * Send the lot
 		 */
 		rv = diag_l0_send(dl0d, data, len);
+		if (rv == 0) {
+			dl0d->stats.tx_bytes += len;
+		}
 
 		//optionally remove echos
 		if ((l0flags & DIAG_L1_BLOCKDUPLEX) && (rv==0)) {
@@ -176,6 +205,7 @@ int diag_l1_send(struct diag_l0_device *dl0d, const void *data, size_t len, unsi
 
 			//compare to sent bytes
 			if ( memcmp(duplexbuf, data, len) !=0) {
+				dl0d->stats.echo_errors++;
 				fprintf(stderr,FLFMT "Bus Error: bad half duplex echo!\n", FL);
 				rv=DIAG_ERR_BUSERROR;
 			}
@@ -183,12 +213,14 @@ int diag_l1_send(struct diag_l0_device *dl0d, const void *data, size_t len, unsi
 	} else {
 		/* else: send each byte */
 		const uint8_t *dp = (const uint8_t *)data;
+		unsigned long long p4hrt = diag_os_ushrt(p4 * 1000UL);
 
 		while (len--) {
 			rv = diag_l0_send(dl0d, dp, 1);
 			if (rv != 0) {
 				break;
 			}
+			dl0d->stats.tx_bytes++;
 
 			/*
 			 * If half duplex, read back the echo, if
@@ -201,11 +233,13 @@ int diag_l1_send(struct diag_l0_device *dl0d, const void *data, size_t len, unsi
 
 				c = *dp - 1; /* set it with wrong val. */
 				if (diag_l0_recv(dl0d, &c, 1, 200) != 1) {
+					dl0d->stats.echo_errors++;
 					rv=DIAG_ERR_GENERAL;
 					break;
 				}
 
 				if (c != *dp) {
+					dl0d->stats.echo_errors++;
 					if (c == *dp - 1) {
 						fprintf(stderr,"Half duplex interface not echoing!\n");
 					} else {
@@ -218,11 +252,13 @@ int diag_l1_send(struct diag_l0_device *dl0d, const void *data, size_t len, unsi
 					break;
 				}
 			}
-			dp++;
-
-			if (p4) { /* Inter byte gap */
-				diag_os_millisleep(p4);
+			/* Inter byte gap : P4 is a minimum, so it's measured from the
+			 * end of this byte (incl. echo), as an absolute deadline.
+			 */
+			if (p4) {
+				diag_os_sleepuntil(diag_os_gethrt() + p4hrt);
 			}
+			dp++;
 		}
 	}
 
@@ -260,6 +296,7 @@ int diag_l1_recv(struct diag_l0_device *dl0d, void *data, size_t len, unsigned i
 	}
 
 	if (rv>0) {
+		diag_stats_rxbytes(&dl0d->stats, (unsigned int) rv);
 		DIAG_DBGMDATA(diag_l1_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
 		              data, (size_t) rv, "got %d bytes; ",rv);
 	}
@@ -274,7 +311,10 @@ uint32_t diag_l1_getflags(struct diag_l0_device *dl0d) {
 }
 
 //diag_l1_gettype: returns l1proto_mask :supported L1 protos
-//of the l0 driver
+//of the l0 driver, possibly narrowed down by the device config
 int diag_l1_gettype(struct diag_l0_device *dl0d) {
-	return dl0d->dl0->l1proto_mask;
+	int mask = dl0d->dl0->l1proto_mask;
+
+	(void) diag_l0_ioctl(dl0d, DIAG_IOCTL_GET_L1_TYPE, &mask);
+	return mask;
 }
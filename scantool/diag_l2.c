@@ -34,6 +34,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "diag.h"
@@ -43,11 +44,17 @@
 #include "diag_err.h"
 
 #include "diag_l2.h"
+#include "diag_l2_can.h"
 #include "utlist.h"
 
 
 int diag_l2_debug;
 
+/* ISO-TP settings; here rather than in diag_l2_can.c so frontends can set
+ * them even if the CAN L2 isn't compiled in.
+ */
+struct diag_l2_can_cfg diag_l2_can_cfg;
+
 
 /* struct to manage L2 stuff, used in here only */
 static struct {
@@ -96,29 +103,32 @@ static int diag_l2_rmconn(struct diag_l2_conn *dl2c) {
 
 /*
  * Called regularly to check timeouts etc (call at least once per
- * second)
- * Note: This is called from a signal handler.
- *
- * XXX Uses functions not async-signal-safe.
+ * second), from the periodic service thread (see diag_os*.c).
  * This parses through the l2internal.dl2conn_list linked-list and
  * calls the  ->diag_l2_proto_timeout function for every dl2conn
  * that has expired.
  *
- * In order for this to work well, all L2
+ * Returns the number of ms until the next keepalive is due, so the
+ * caller can sleep until then (ALARM_TIMEOUT if nothing is due).
  */
-void diag_l2_timer(void) {
+unsigned long diag_l2_timer(void) {
 	struct diag_l2_conn     *d_l2_conn;
+	unsigned long next = ALARM_TIMEOUT;
 
 	unsigned long now;
 
-	now = diag_os_getms(); /* XXX probably Not async safe */
+	now = diag_os_getms();
 
-	if (periodic_done() || !diag_os_trylock(&l2internal.connlist_mtx)) {
-		return;
+	if (periodic_done()) {
+		return next;
+	}
+	if (!diag_os_trylock(&l2internal.connlist_mtx)) {
+		//busy; try again soon
+		return DIAG_L2_TIMER_RETRY;
 	}
 
 	LL_FOREACH(l2internal.dl2conn_list, d_l2_conn) {
-		bool expired = 0;
+		unsigned long elapsed;
 
 		/*
 		 * If in monitor mode, or the connection isn't open,
@@ -134,15 +144,23 @@ void diag_l2_timer(void) {
 
 		//we're subtracting unsigned values but since the clock is
 		//monotonic, the difference will always be >= 0
-		expired = ((now - d_l2_conn->tlast) > d_l2_conn->tinterval)? 1:0;
+		elapsed = now - d_l2_conn->tlast;
 
 		/* If expired, call the timeout routine */
-		if (expired && d_l2_conn->l2proto->diag_l2_proto_timeout) {
-			d_l2_conn->l2proto->diag_l2_proto_timeout(d_l2_conn);
+		if (elapsed > d_l2_conn->tinterval) {
+			if (d_l2_conn->l2proto->diag_l2_proto_timeout) {
+				d_l2_conn->diag_link->l2_dl0d->stats.keepalives++;
+				d_l2_conn->l2proto->diag_l2_proto_timeout(d_l2_conn);
+			}
+			//assume the keepalive restarted the interval
+			elapsed = 0;
+		}
+		if (d_l2_conn->tinterval - elapsed + 1 < next) {
+			next = d_l2_conn->tinterval - elapsed + 1;
 		}
 	}
 	diag_os_unlock(&l2internal.connlist_mtx);
-	return;
+	return next;
 }
 
 /*
@@ -154,6 +172,20 @@ void diag_l2_addmsg(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 	return;
 }
 
+/*
+ * Count received frames (and bad checksums) in a msg chain
+ */
+static void stats_countrx(struct diag_stats *st, struct diag_msg *msg) {
+	struct diag_msg *tmsg;
+
+	LL_FOREACH(msg, tmsg) {
+		st->rx_frames++;
+		if (tmsg->fmt & DIAG_FMT_BADCS) {
+			st->cks_errors++;
+		}
+	}
+}
+
 /************************************************************************/
 /*  PUBLIC Interface starts here					*/
 /************************************************************************/
@@ -414,30 +446,49 @@ struct diag_l2_conn *diag_l2_StartCommunications(struct diag_l0_device *dl0d, in
 
 	d_l2_conn->diag_l2_state = DIAG_L2_STATE_CLOSED;
 
+	/*
+	 * Attach the connection to our main list right away (the keepalive
+	 * timer skips it until it's OPEN); this reserves the dl2l so the
+	 * mutex needn't be held during the (slow) protocol init, and
+	 * several links can be initialized concurrently.
+	 */
+	LL_PREPEND(l2internal.dl2conn_list, d_l2_conn);
+	diag_os_unlock(&l2internal.connlist_mtx);
+
+	/* new connection : start from fresh stats (includes init traffic) */
+	diag_stats_reset(&dl0d->stats);
+
 	/* Now do protocol version of StartCommunications */
 
+	diag_os_rt_enter();
 	rv = d_l2_conn->l2proto->diag_l2_proto_startcomms(d_l2_conn,
 	                                                  flags, bitrate, target, source);
+	diag_os_rt_leave();
+
+	if ((rv >= 0) && ((flags & DIAG_L2_TYPE_INITMASK) == DIAG_L2_TYPE_MONINIT)) {
+		/* smart interfaces may need to be told to report all bus traffic */
+		unsigned int mon = 1;
+
+		rv = diag_l2_ioctl(d_l2_conn, DIAG_IOCTL_MONITOR, &mon);
+		if (rv == DIAG_ERR_IOCTL_NOTSUPP) {
+			rv = 0;
+		} else if ((rv < 0) && d_l2_conn->l2proto->diag_l2_proto_stopcomms) {
+			(void) d_l2_conn->l2proto->diag_l2_proto_stopcomms(d_l2_conn);
+		}
+	}
 
+	diag_os_lock(&l2internal.connlist_mtx);
 	if (rv < 0) {
 		/* Something went wrong */
 		DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_OPEN, DIAG_DBGLEVEL_V,
 		          FLFMT "protocol startcomms returned %d\n", FL, rv);
 
+		LL_DELETE(l2internal.dl2conn_list, d_l2_conn);
 		free(d_l2_conn);
 		diag_os_unlock(&l2internal.connlist_mtx);
 		return diag_pfwderr(rv);
 	}
 
-	/*
-	 * note target for quick lookup of connection for received messages
-	 * - unless we're re-using a established connection, then no need
-	 * to re-note.
-	 */
-
-	/* And attach connection info to our main list */
-	LL_PREPEND(l2internal.dl2conn_list, d_l2_conn);
-
 	d_l2_conn->tlast=diag_os_getms();
 	d_l2_conn->diag_l2_state = DIAG_L2_STATE_OPEN;
 
@@ -446,6 +497,8 @@ struct diag_l2_conn *diag_l2_StartCommunications(struct diag_l0_device *dl0d, in
 	          FL, (void *)d_l2_conn);
 
 	diag_os_unlock(&l2internal.connlist_mtx);
+	//new keepalive deadline
+	diag_os_periodic_wake();
 	return d_l2_conn;
 }
 
@@ -459,13 +512,25 @@ struct diag_l2_conn *diag_l2_StartCommunications(struct diag_l0_device *dl0d, in
 int diag_l2_StopCommunications(struct diag_l2_conn *d_l2_conn) {
 	assert(d_l2_conn != NULL);
 
+	/* diag_l2_timer() holds the lock while it sends keepalives : once the
+	 * state is changed under the lock, it is done with this connection.
+	 */
+	diag_os_lock(&l2internal.connlist_mtx);
 	d_l2_conn->diag_l2_state = DIAG_L2_STATE_CLOSING;
+	diag_os_unlock(&l2internal.connlist_mtx);
+
+	if ((d_l2_conn->diag_l2_type & DIAG_L2_TYPE_INITMASK) == DIAG_L2_TYPE_MONINIT) {
+		unsigned int mon = 0;
+		(void) diag_l2_ioctl(d_l2_conn, DIAG_IOCTL_MONITOR, &mon);
+	}
 
 	/*
 	 * Call protocol close routine, if it exists
 	 */
 	if (d_l2_conn->l2proto->diag_l2_proto_stopcomms) {
+		diag_os_rt_enter();
 		(void)d_l2_conn->l2proto->diag_l2_proto_stopcomms(d_l2_conn);
+		diag_os_rt_leave();
 	}
 
 	//remove from the main linked list
@@ -493,17 +558,26 @@ int diag_l2_StopCommunications(struct diag_l2_conn *d_l2_conn) {
  */
 int diag_l2_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 	int rv;
+	struct diag_stats *st = &d_l2_conn->diag_link->l2_dl0d->stats;
 
 	DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V,
 	          FLFMT "diag_l2_send %p msg %p msglen %u called\n",
 	          FL, (void *)d_l2_conn, (void *)msg, msg->len);
 
+	/* diag_l2_request() times the whole exchange itself */
+	if (!st->in_request) {
+		diag_stats_reqstart(st);
+	}
+
 	/* Call protocol specific send routine */
+	diag_os_rt_enter();
 	rv = d_l2_conn->l2proto->diag_l2_proto_send(d_l2_conn, msg);
+	diag_os_rt_leave();
 
 	if (rv==0) {
 		//update timestamp
 		d_l2_conn->tlast = diag_os_getms();
+		st->tx_frames++;
 	}
 
 
@@ -517,28 +591,56 @@ int diag_l2_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
  */
 struct diag_msg *diag_l2_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg, int *errval) {
 	struct diag_msg *rxmsg;
+	struct diag_stats *st = &d_l2_conn->diag_link->l2_dl0d->stats;
 
 	DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V,
 	          FLFMT "_request dl2c=%p msg=%p called\n",
 	          FL, (void *)d_l2_conn, (void *)msg);
 
 	/* Call protocol specific send routine */
+	st->requests++;
+	diag_stats_reqstart(st);
+	st->in_request = 1;
+	diag_os_rt_enter();
 	rxmsg = d_l2_conn->l2proto->diag_l2_proto_request(d_l2_conn, msg, errval);
+	diag_os_rt_leave();
+	st->in_request = 0;
+	diag_stats_reqend(st);
 
 	DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V,
 	          FLFMT "_request returns %p, err %d\n",
 	          FL, (void *)rxmsg, *errval);
 
 	if (rxmsg==NULL) {
+		if (*errval == DIAG_ERR_TIMEOUT) {
+			st->timeouts++;
+		}
 		return diag_pfwderr(*errval);
 	}
 	//update timers
 	d_l2_conn->tlast = diag_os_getms();
+	stats_countrx(st, rxmsg);
 
 	return rxmsg;
 }
 
 
+/* callback wrapper for diag_l2_recv(), to count received frames */
+struct recv_stats_handle {
+	struct diag_stats *st;
+	void (*callback)(void *handle, struct diag_msg *msg);
+	void *handle;
+};
+
+static void recv_stats_callback(void *handle, struct diag_msg *msg) {
+	struct recv_stats_handle *rsh = (struct recv_stats_handle *)handle;
+
+	stats_countrx(rsh->st, msg);
+	if (rsh->callback) {
+		rsh->callback(rsh->handle, msg);
+	}
+}
+
 /*
  * Recv a message - will end up calling the callback routine with a message
  * or an error if an error has occurred
@@ -551,18 +653,31 @@ struct diag_msg *diag_l2_request(struct diag_l2_conn *d_l2_conn, struct diag_msg
 int diag_l2_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout,
                  void (*callback)(void *handle, struct diag_msg *msg), void *handle) {
 	int rv;
+	struct recv_stats_handle rsh;
 
 	DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
 	          FLFMT "diag_l2_recv %p timeout %u called\n",
 	          FL, (void *)d_l2_conn, timeout);
 
+	rsh.st = &d_l2_conn->diag_link->l2_dl0d->stats;
+	rsh.callback = callback;
+	rsh.handle = handle;
+
 	/* Call protocol specific recv routine */
-	rv = d_l2_conn->l2proto->diag_l2_proto_recv(d_l2_conn, timeout, callback, handle);
+	diag_os_rt_enter();
+	rv = d_l2_conn->l2proto->diag_l2_proto_recv(d_l2_conn, timeout, recv_stats_callback, &rsh);
+	diag_os_rt_leave();
 
 	if (rv==0) {
 		//update timers if success
 		d_l2_conn->tlast = diag_os_getms();
+		if (!rsh.st->in_request) {
+			diag_stats_reqend(rsh.st);
+		}
 	} else {
+		if (rv == DIAG_ERR_TIMEOUT) {
+			rsh.st->timeouts++;
+		}
 		DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
 		          FLFMT "diag_l2_recv returns %d\n", FL, rv);
 	}
@@ -604,6 +719,14 @@ int diag_l2_ioctl(struct diag_l2_conn *d_l2_conn, unsigned int cmd, void *data)
 		d->physaddr = d_l2_conn->diag_l2_physaddr;
 		d->kb1 = d_l2_conn->diag_l2_kb1;
 		d->kb2 = d_l2_conn->diag_l2_kb2;
+		d->nresp = d_l2_conn->diag_l2_nresp;
+		memcpy(d->resp, d_l2_conn->diag_l2_resp, sizeof(d->resp));
+		break;
+	case DIAG_IOCTL_GET_STATS:
+		*(struct diag_stats *)data = dl0d->stats;
+		break;
+	case DIAG_IOCTL_RESET_STATS:
+		diag_stats_reset(&dl0d->stats);
 		break;
 	case DIAG_IOCTL_SETSPEED:
 		if (dl2l->l1flags & (DIAG_L1_AUTOSPEED | DIAG_L1_NOTTY)) {
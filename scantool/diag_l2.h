@@ -47,6 +47,14 @@ extern "C" {
 
 struct diag_l0_device;
 
+/* One responder to a functionally addressed init */
+struct diag_l2_resp {
+	uint8_t physaddr;
+	uint8_t kb1;
+	uint8_t kb2;
+};
+#define DIAG_L2_MAXRESP 16      /* more than that is unlikely on one K-line */
+
 //diag_l2_link : elements of the diag_l2_links linked-list.
 //An l2 link associates an existing diag_l0_device with
 //one L1 proto and L1 flags.
@@ -133,6 +141,14 @@ struct diag_l2_conn {
 	uint8_t diag_l2_kb1;    /* KB 1, (ISO stuff really) */
 	uint8_t diag_l2_kb2;    /* KB 2, (ISO stuff really) */
 
+	/*
+	 * ECUs that answered a functionally addressed init, in the order
+	 * they were received. Only filled by protocols that can tell them
+	 * apart (ISO14230 fastinit); nresp stays 0 otherwise.
+	 */
+	unsigned int diag_l2_nresp;
+	struct diag_l2_resp diag_l2_resp[DIAG_L2_MAXRESP];
+
 
 	/* Main linked list of all connections */
 	struct diag_l2_conn *next;
@@ -256,6 +272,8 @@ struct  diag_l2_data {
 	uint8_t physaddr;       /* Physical address of ECU */
 	uint8_t kb1;            /* Keybyte 0 */
 	uint8_t kb2;            /* Keybyte 1 */
+	unsigned int nresp;     /* # of responders to a functional init */
+	struct diag_l2_resp resp[DIAG_L2_MAXRESP];
 };
 
 
@@ -391,7 +409,11 @@ struct diag_msg *diag_l2_request(struct diag_l2_conn *connection, struct diag_ms
 int diag_l2_ioctl(struct diag_l2_conn *connection, unsigned int cmd, void *data);
 
 
-void diag_l2_timer(void);       /* Regular timer routine */
+/** Regular timer routine, called by the periodic service thread.
+ * @return ms until the next keepalive is due; at most ALARM_TIMEOUT.
+ */
+unsigned long diag_l2_timer(void);
+#define DIAG_L2_TIMER_RETRY     20      //ms; retry delay if the connection list was busy
 
 extern int diag_l2_debug;
 extern struct diag_l2_conn  *global_l2_conn;    //TODO : move in globcfg struct
@@ -1,16 +1,882 @@
-#include <stddef.h>
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Diag
+ *
+ * L2 driver for CAN : ISO 15765-2 (ISO-TP) transport.
+ *
+ * Messages up to 7 bytes go out as a single frame; longer ones as a first
+ * frame followed by consecutive frames, paced by the receiver's flow control
+ * (block size, STmin). Received segmented messages are reassembled per CAN
+ * ID, so several ECUs can answer a functional request at the same time; we
+ * send our own flow control (diag_l2_can_cfg) to each of them.
+ *
+ * Addressing follows ISO 15765-4 (OBD) unless diag_l2_can_cfg.txid is set :
+ * functional requests go to 0x7DF (29-bit : 0x18DB<tgt><src>), physical
+ * ones to 0x7E0 + (tgt & 7) (29-bit : 0x18DA<tgt><src>).
+ *
+ * The L0 must exchange raw frames (see diag_iso15765.h); interfaces that do
+ * ISO-TP themselves (DIAG_L1_DATAONLY) are not supported. If the L0 can,
+ * frames are received and (with STmin = 0) sent in bursts with
+ * DIAG_IOCTL_CAN_RECVBATCH / _SENDBATCH instead of one call per frame.
+ */
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_iso15765.h"
+#include "diag_os.h"
+#include "diag_l1.h"
 #include "diag_l2.h"
-#include "diag_l2_can.h"
+
+#include "diag_l2_can.h" /* prototypes for this file */
+
+#include "utlist.h"
+
+
+#define CAN_MAXRX       8       /* concurrent reassemblies, i.e. ECUs sending segmented responses */
+#define CAN_BATCH       32      /* frames per DIAG_IOCTL_CAN_RECVBATCH / _SENDBATCH */
+#define CAN_MAXPENDING  8       /* ECUs that can be waited for after a responsePending */
+
+/* One message being reassembled */
+struct can_rxslot {
+	uint32_t id;            /* sender; 0 if slot is free */
+	unsigned int len;       /* FF_DL */
+	unsigned int off;       /* bytes received so far */
+	uint8_t sn;             /* next expected sequence number */
+	uint8_t bsleft;         /* CFs until we must send another FC; 0 = no limit */
+	unsigned long long tlast;       /* hrt of the last frame, for N_Cr */
+	uint8_t buf[ISO15765_MAXLEN];
+};
+
+/* An ECU that answered "responsePending" (7F xx 78) to the current request */
+struct can_pending {
+	uint8_t src;
+	unsigned long deadline; /* diag_os_getms() time when we give up on it */
+};
+
+/*
+ * ISO-TP specific data
+ */
+struct diag_l2_can {
+	struct diag_l2_can_cfg cfg;
+	uint32_t txid;          /* request ID */
+	uint32_t rxid;          /* only accepted response ID; 0 if functional */
+	uint8_t srcaddr;
+	bool funcaddr;
+	bool monitor;           /* MONINIT : passive, accept everything and never send FC */
+	bool nobatch;           /* L0 has no batched transfers, use diag_l1_send / _recv */
+
+	struct can_rxslot rx[CAN_MAXRX];
+
+	/* frames from the last DIAG_IOCTL_CAN_RECVBATCH, not yet processed */
+	struct diag_can_frame rxq[CAN_BATCH];
+	unsigned int rxn, rxi;
+};
+
+
+/* STmin byte -> microseconds */
+static unsigned long can_stmin_us(uint8_t stmin) {
+	if (stmin <= ISO15765_STMIN_MAX) {
+		return stmin * 1000UL;
+	}
+	if ((stmin >= 0xF1) && (stmin <= 0xF9)) {
+		return (stmin - 0xF0) * 100UL;
+	}
+	return ISO15765_STMIN_MAX * 1000UL;
+}
+
+/* ID to send flow control to, for a segmented message received from <id> */
+static uint32_t can_fcid(const struct diag_l2_can *dp, uint32_t id) {
+	if (dp->cfg.txid) {
+		return dp->txid;
+	}
+	if (id & DIAG_CAN_EFF) {
+		return DIAG_CAN_EFF | ISO15765_OBD_PHYS29 | ((id & 0xFF) << 8) | dp->srcaddr;
+	}
+	return id - ISO15765_OBD_RESPOFS;
+}
+
+static bool can_accept(const struct diag_l2_can *dp, uint32_t id) {
+	if (dp->monitor) {
+		return 1;
+	}
+	if (dp->rxid) {
+		return (id == dp->rxid);
+	}
+	if (dp->cfg.txid) {
+		return 1;
+	}
+	if (dp->cfg.id29) {
+		return ((id & ~0xFFUL) == (DIAG_CAN_EFF | ISO15765_OBD_PHYS29 | ((uint32_t) dp->srcaddr << 8)));
+	}
+	return ((id & ~7UL) == ISO15765_OBD_RESP);
+}
+
+/* Same as can_accept(), as L0 filters : lets the L0 (or the kernel) drop
+ * unrelated bus traffic before it reaches us. Best effort.
+ */
+static void can_setfilter(struct diag_l2_conn *d_l2_conn) {
+	const struct diag_l2_can *dp = d_l2_conn->diag_l2_proto_data;
+	struct diag_can_filters flt;
+
+	flt.n = 0;
+	if (dp->monitor || (dp->cfg.txid && !dp->rxid)) {
+		/* accept everything */
+	} else if (dp->rxid) {
+		flt.f[0].id = dp->rxid;
+		flt.f[0].mask = DIAG_CAN_EFF | ((dp->rxid & DIAG_CAN_EFF)? DIAG_CAN_EFFMASK : DIAG_CAN_SFFMASK);
+		flt.n = 1;
+	} else if (dp->cfg.id29) {
+		flt.f[0].id = DIAG_CAN_EFF | ISO15765_OBD_PHYS29 | ((uint32_t) dp->srcaddr << 8);
+		flt.f[0].mask = DIAG_CAN_EFF | (DIAG_CAN_EFFMASK & ~0xFFUL);
+		flt.n = 1;
+	} else {
+		flt.f[0].id = ISO15765_OBD_RESP;
+		flt.f[0].mask = DIAG_CAN_EFF | (DIAG_CAN_SFFMASK & ~7UL);
+		flt.n = 1;
+	}
+	(void) diag_l1_ioctl(d_l2_conn->diag_link->l2_dl0d, DIAG_IOCTL_CAN_SETFILTER, &flt);
+}
+
+/* Send one frame, padded to 8 bytes. */
+static int can_txframe(struct diag_l2_conn *d_l2_conn, uint32_t id,
+                       const uint8_t *data, unsigned int len) {
+	uint8_t frame[DIAG_CAN_MAXFRAME];
+
+	DIAG_CAN_SETID(frame, id);
+	memcpy(&frame[DIAG_CAN_HDRLEN], data, len);
+	memset(&frame[DIAG_CAN_HDRLEN + len], ISO15765_PADBYTE, DIAG_CAN_MAXDLEN - len);
+
+	return diag_l1_send(d_l2_conn->diag_link->l2_dl0d, frame, sizeof(frame), 0);
+}
+
+static int can_txfc(struct diag_l2_conn *d_l2_conn, uint32_t id, uint8_t fs) {
+	struct diag_l2_can *dp = d_l2_conn->diag_l2_proto_data;
+	uint8_t fc[3];
+
+	fc[0] = ISO15765_PCI_FC | fs;
+	fc[1] = dp->cfg.bs;
+	fc[2] = dp->cfg.stmin;
+	return can_txframe(d_l2_conn, id, fc, sizeof(fc));
+}
+
+/* Receive one frame, from the last burst if the L0 supports them.
+ * Ret DLC (0-8) and fills *id and *ts (diag_os_gethrt() time of reception),
+ * or <0 if error.
+ */
+static int can_rxframe(struct diag_l2_conn *d_l2_conn, uint32_t *id,
+                       uint8_t *data, unsigned long long *ts, unsigned int timeout) {
+	struct diag_l2_can *dp = d_l2_conn->diag_l2_proto_data;
+	uint8_t frame[DIAG_CAN_MAXFRAME];
+	int rv;
+
+	if ((dp->rxi >= dp->rxn) && !dp->nobatch) {
+		struct diag_can_batch batch;
+
+		batch.frames = dp->rxq;
+		batch.max = CAN_BATCH;
+		batch.n = 0;
+		batch.timeout = timeout;
+		dp->rxi = dp->rxn = 0;
+		rv = diag_l1_ioctl(d_l2_conn->diag_link->l2_dl0d, DIAG_IOCTL_CAN_RECVBATCH, &batch);
+		if (rv == DIAG_ERR_IOCTL_NOTSUPP) {
+			dp->nobatch = 1;
+		} else if (rv < 0) {
+			return rv;
+		} else {
+			dp->rxn = batch.n;
+		}
+	}
+	if (dp->rxi < dp->rxn) {
+		const struct diag_can_frame *f = &dp->rxq[dp->rxi++];
+
+		*id = f->id;
+		*ts = f->ts? f->ts : diag_os_gethrt();
+		memcpy(data, f->data, f->dlc);
+		return f->dlc;
+	}
+	if (!dp->nobatch) {
+		return DIAG_ERR_TIMEOUT;
+	}
+
+	rv = diag_l1_recv(d_l2_conn->diag_link->l2_dl0d, frame, sizeof(frame), timeout);
+	if (rv < 0) {
+		return rv;
+	}
+	if (rv < DIAG_CAN_HDRLEN) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+	*id = DIAG_CAN_GETID(frame);
+	*ts = diag_os_gethrt();
+	rv -= DIAG_CAN_HDRLEN;
+	memcpy(data, &frame[DIAG_CAN_HDRLEN], (size_t) rv);
+	return rv;
+}
+
+
+static int dl2p_can_startcomms(struct diag_l2_conn *d_l2_conn, flag_type flags,
+                               UNUSED(unsigned int bitrate),
+                               target_type target, source_type source) {
+	struct diag_l2_can *dp;
+	int rv;
+
+	if (d_l2_conn->diag_link->l1flags & DIAG_L1_DATAONLY) {
+		fprintf(stderr, FLFMT "ISO-TP needs an interface that passes raw CAN frames.\n", FL);
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
+	rv = diag_calloc(&dp, 1);
+	if (rv != 0) {
+		return diag_ifwderr(rv);
+	}
+	d_l2_conn->diag_l2_proto_data = (void *)dp;
+
+	dp->cfg = diag_l2_can_cfg;
+	dp->srcaddr = source;
+	dp->funcaddr = (flags & DIAG_L2_TYPE_FUNCADDR) != 0;
+	dp->monitor = (flags & DIAG_L2_TYPE_INITMASK) == DIAG_L2_TYPE_MONINIT;
+
+	if (dp->cfg.txid) {
+		dp->txid = dp->cfg.txid;
+		dp->rxid = dp->cfg.rxid;
+		dp->funcaddr = 0;
+	} else if (dp->cfg.id29) {
+		dp->txid = DIAG_CAN_EFF | ((uint32_t) target << 8) | source;
+		if (dp->funcaddr) {
+			dp->txid |= ISO15765_OBD_FUNC29;
+		} else {
+			dp->txid |= ISO15765_OBD_PHYS29;
+			dp->rxid = DIAG_CAN_EFF | ISO15765_OBD_PHYS29 | ((uint32_t) source << 8) | target;
+		}
+	} else {
+		if (dp->funcaddr) {
+			dp->txid = ISO15765_OBD_FUNC;
+		} else {
+			dp->txid = ISO15765_OBD_PHYS + (target & 7);
+			dp->rxid = dp->txid + ISO15765_OBD_RESPOFS;
+		}
+	}
+
+	d_l2_conn->diag_l2_destaddr = target;
+	d_l2_conn->diag_l2_srcaddr = source;
+	d_l2_conn->diag_l2_p2min = 0;
+	d_l2_conn->diag_l2_p2max = ISO15765_TIM_P2;
+	d_l2_conn->diag_l2_p2emax = ISO15765_TIM_P2E;
+	d_l2_conn->diag_l2_p3min = 0;
+	d_l2_conn->diag_l2_p4min = 0;
+
+	DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_OPEN, DIAG_DBGLEVEL_V,
+	          FLFMT "ISO-TP tx ID 0x%lX, rx ID 0x%lX, BS %u STmin 0x%02X\n",
+	          FL, (unsigned long) dp->txid, (unsigned long) dp->rxid,
+	          dp->cfg.bs, dp->cfg.stmin);
+
+	can_setfilter(d_l2_conn);
+	(void)diag_l2_ioctl(d_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+
+	return 0;
+}
+
+static int dl2p_can_stopcomms(struct diag_l2_conn *d_l2_conn) {
+	struct diag_l2_can *dp;
+
+	dp = (struct diag_l2_can *)d_l2_conn->diag_l2_proto_data;
+
+	if (dp) {
+		free(dp);
+	}
+	d_l2_conn->diag_l2_proto_data=NULL;
+
+	return 0;
+}
+
+
+/*
+ * Wait for a flow control from the receiver of our segmented message.
+ * Fills *bs and *stmin when it's a CTS; ret 0 if ok.
+ */
+static int can_waitfc(struct diag_l2_conn *d_l2_conn, uint8_t *bs, uint8_t *stmin) {
+	struct diag_l2_can *dp = d_l2_conn->diag_l2_proto_data;
+	unsigned long long t_end;
+	unsigned int nwait = 0;
+	unsigned long long ts;
+	uint8_t data[DIAG_CAN_MAXDLEN];
+	uint32_t id;
+	int rv;
+
+	t_end = diag_os_gethrt() + diag_os_ushrt(ISO15765_TIM_N_BS * 1000UL);
+	while (1) {
+		unsigned long long now = diag_os_gethrt();
+		unsigned int tout;
+
+		if (now >= t_end) {
+			break;
+		}
+		tout = (unsigned int) (diag_os_hrtus(t_end - now) / 1000) + 1;
+		rv = can_rxframe(d_l2_conn, &id, data, &ts, tout);
+		if (rv == DIAG_ERR_TIMEOUT) {
+			break;
+		}
+		if (rv < 0) {
+			return diag_ifwderr(rv);
+		}
+		if ((rv < 3) || (dp->rxid && (id != dp->rxid)) ||
+		    ((data[0] & ISO15765_PCI_MASK) != ISO15765_PCI_FC)) {
+			DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
+			          FLFMT "ignoring frame 0x%lX while waiting for FC\n",
+			          FL, (unsigned long) id);
+			continue;
+		}
+
+		switch (data[0] & 0x0F) {
+		case ISO15765_FS_CTS:
+			*bs = data[1];
+			*stmin = data[2];
+			return 0;
+		case ISO15765_FS_WAIT:
+			if (++nwait > ISO15765_MAXWFT) {
+				fprintf(stderr, FLFMT "ISO-TP : too many FC.WAIT, aborting\n", FL);
+				return diag_iseterr(DIAG_ERR_GENERAL);
+			}
+			t_end = diag_os_gethrt() + diag_os_ushrt(ISO15765_TIM_N_BS * 1000UL);
+			break;
+		case ISO15765_FS_OVFLW:
+			fprintf(stderr, FLFMT "ISO-TP : receiver overflow, message too long\n", FL);
+			return diag_iseterr(DIAG_ERR_BADLEN);
+		default:
+			fprintf(stderr, FLFMT "ISO-TP : bad flow status 0x%02X\n", FL, data[0]);
+			return diag_iseterr(DIAG_ERR_BADDATA);
+		}
+	}
+	DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
+	          FLFMT "ISO-TP : no flow control (N_Bs)\n", FL);
+	return DIAG_ERR_TIMEOUT;
+}
+
+/*
+ * Send up to <bs> consecutive frames (0 : the rest of the message) with
+ * DIAG_IOCTL_CAN_SENDBATCH, advancing *off and *sn.
+ * Ret DIAG_ERR_IOCTL_NOTSUPP, before sending anything, if the L0 can't do it.
+ */
+static int can_txburst(struct diag_l2_conn *d_l2_conn, const struct diag_msg *msg,
+                       unsigned int *off, uint8_t *sn, uint8_t bs) {
+	struct diag_l2_can *dp = d_l2_conn->diag_l2_proto_data;
+	struct diag_can_frame frames[CAN_BATCH];
+	struct diag_can_batch batch;
+	unsigned int cnt = 0;
+	int rv;
+
+	while ((*off < msg->len) && ((bs == 0) || (cnt < bs))) {
+		unsigned int n, boff = *off;
+		uint8_t bsn = *sn;
+
+		for (n = 0; (n < CAN_BATCH) && (boff < msg->len) && ((bs == 0) || (cnt + n < bs)); n++) {
+			unsigned int clen = MIN(msg->len - boff, ISO15765_CF_DLEN);
+			struct diag_can_frame *f = &frames[n];
+
+			f->id = dp->txid;
+			f->dlc = DIAG_CAN_MAXDLEN;
+			f->data[0] = ISO15765_PCI_CF | (bsn & 0x0F);
+			memcpy(&f->data[1], &msg->data[boff], clen);
+			memset(&f->data[1 + clen], ISO15765_PADBYTE, ISO15765_CF_DLEN - clen);
+			boff += clen;
+			bsn++;
+		}
+
+		batch.frames = frames;
+		batch.max = n;
+		batch.n = 0;
+		rv = diag_l1_ioctl(d_l2_conn->diag_link->l2_dl0d, DIAG_IOCTL_CAN_SENDBATCH, &batch);
+		if (rv) {
+			return rv;
+		}
+		if (batch.n != n) {
+			return diag_iseterr(DIAG_ERR_GENERAL);
+		}
+		*off = boff;
+		*sn = bsn;
+		cnt += n;
+	}
+	return 0;
+}
+
+/*
+ * Send a message, segmenting if it doesn't fit in a single frame.
+ * ret 0 if ok
+ */
+static int dl2p_can_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
+	struct diag_l2_can *dp = d_l2_conn->diag_l2_proto_data;
+	uint8_t frame[DIAG_CAN_MAXDLEN];
+	unsigned int off;
+	uint8_t sn;
+	int rv;
+
+	DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V,
+	          FLFMT "diag_l2_can_send %p msg %p len %u called\n",
+	          FL, (void *)d_l2_conn, (void *)msg, msg->len);
+
+	if ((msg->len == 0) || (msg->len > ISO15765_MAXLEN)) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+
+	if (msg->len <= ISO15765_SF_MAXLEN) {
+		frame[0] = ISO15765_PCI_SF | (uint8_t) msg->len;
+		memcpy(&frame[1], msg->data, msg->len);
+		rv = can_txframe(d_l2_conn, dp->txid, frame, msg->len + 1);
+		return rv? diag_ifwderr(rv):0;
+	}
+
+	if (dp->funcaddr) {
+		/* ISO15765-4 : functional requests must fit in a single frame */
+		fprintf(stderr, FLFMT "ISO-TP : functional request too long (%u)\n", FL, msg->len);
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+
+	frame[0] = ISO15765_PCI_FF | (uint8_t) (msg->len >> 8);
+	frame[1] = (uint8_t) msg->len;
+	memcpy(&frame[2], msg->data, ISO15765_FF_DLEN);
+	rv = can_txframe(d_l2_conn, dp->txid, frame, DIAG_CAN_MAXDLEN);
+	if (rv) {
+		return diag_ifwderr(rv);
+	}
+	off = ISO15765_FF_DLEN;
+	sn = 1;
+
+	while (off < msg->len) {
+		uint8_t bs, stmin;
+		unsigned long long st_hrt;
+		unsigned long long tnext;
+		unsigned int cnt;
+
+		rv = can_waitfc(d_l2_conn, &bs, &stmin);
+		if (rv) {
+			return diag_ifwderr(rv);
+		}
+		st_hrt = diag_os_ushrt(can_stmin_us(stmin));
+		tnext = diag_os_gethrt();
+
+		if ((st_hrt == 0) && !dp->nobatch) {
+			/* no separation time : the whole block can go out in bursts */
+			rv = can_txburst(d_l2_conn, msg, &off, &sn, bs);
+			if (rv == 0) {
+				continue;
+			}
+			if (rv != DIAG_ERR_IOCTL_NOTSUPP) {
+				return diag_ifwderr(rv);
+			}
+			dp->nobatch = 1;
+		}
+
+		/* one block; BS=0 means the rest of the message */
+		for (cnt = 0; (off < msg->len) && ((bs == 0) || (cnt < bs)); cnt++) {
+			unsigned int clen = MIN(msg->len - off, ISO15765_CF_DLEN);
+
+			if (cnt) {
+				diag_os_sleepuntil(tnext);
+			}
+			frame[0] = ISO15765_PCI_CF | (sn & 0x0F);
+			memcpy(&frame[1], &msg->data[off], clen);
+			rv = can_txframe(d_l2_conn, dp->txid, frame, clen + 1);
+			if (rv) {
+				return diag_ifwderr(rv);
+			}
+			tnext = diag_os_gethrt() + st_hrt;
+			off += clen;
+			sn++;
+		}
+	}
+
+	return 0;
+}
+
+
+static struct can_rxslot *can_findslot(struct diag_l2_can *dp, uint32_t id) {
+	unsigned int i;
+
+	for (i = 0; i < CAN_MAXRX; i++) {
+		if (dp->rx[i].id == id) {
+			return &dp->rx[i];
+		}
+	}
+	return NULL;
+}
+
+/* Add a complete message to the connection. <ts> : diag_os_gethrt() time of
+ * its last frame, as given by L0; 0 if unknown.
+ */
+static int can_deliver(struct diag_l2_conn *d_l2_conn, uint32_t id,
+                       const uint8_t *data, unsigned int len, unsigned long long ts) {
+	struct diag_msg *tmsg;
+	unsigned long long now;
+
+	tmsg = diag_allocmsg(len);
+	if (tmsg == NULL) {
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	}
+	memcpy(tmsg->data, data, len);
+	tmsg->src = (uint8_t) id;
+	tmsg->dest = d_l2_conn->diag_l2_srcaddr;
+	/* the CAN controller checks the CRC, and only passes good frames */
+	tmsg->fmt = DIAG_FMT_FRAMED | DIAG_FMT_CKSUMMED;
+	/* rxtime is in diag_os_getms() time : go back by the frame's age */
+	now = diag_os_gethrt();
+	tmsg->rxtime = diag_os_getms();
+	if (ts && (ts <= now)) {
+		tmsg->rxtime -= (unsigned long) (diag_os_hrtus(now - ts) / 1000);
+	}
+
+	diag_l2_addmsg(d_l2_conn, tmsg);
+	return 0;
+}
+
+/*
+ * Process one received frame. Ret 1 if it completed a message, 0 if not,
+ * <0 on error.
+ */
+static int can_rxprocess(struct diag_l2_conn *d_l2_conn, uint32_t id,
+                         const uint8_t *data, unsigned int dlc, unsigned long long ts) {
+	struct diag_l2_can *dp = d_l2_conn->diag_l2_proto_data;
+	struct can_rxslot *slot;
+	unsigned int len, clen;
+	int rv;
+
+	switch (data[0] & ISO15765_PCI_MASK) {
+	case ISO15765_PCI_SF:
+		len = data[0] & 0x0F;
+		if ((len == 0) || (len >= dlc)) {
+			break;
+		}
+		rv = can_deliver(d_l2_conn, id, &data[1], len, ts);
+		return rv? rv:1;
+	case ISO15765_PCI_FF:
+		len = ((data[0] & 0x0F) << 8) | data[1];
+		if ((dlc < DIAG_CAN_MAXDLEN) || (len <= ISO15765_SF_MAXLEN)) {
+			break;
+		}
+		/* a new FF aborts a reception in progress from the same sender */
+		slot = can_findslot(dp, id);
+		if (slot == NULL) {
+			slot = can_findslot(dp, 0);
+		}
+		if (slot == NULL) {
+			fprintf(stderr, FLFMT "ISO-TP : too many segmented messages at once, dropping 0x%lX\n",
+			        FL, (unsigned long) id);
+			if (!dp->monitor) {
+				(void) can_txfc(d_l2_conn, can_fcid(dp, id), ISO15765_FS_OVFLW);
+			}
+			return 0;
+		}
+		slot->id = id;
+		slot->len = len;
+		memcpy(slot->buf, &data[2], ISO15765_FF_DLEN);
+		slot->off = ISO15765_FF_DLEN;
+		slot->sn = 1;
+		slot->bsleft = dp->cfg.bs;
+		slot->tlast = ts;
+		if (!dp->monitor) {
+			rv = can_txfc(d_l2_conn, can_fcid(dp, id), ISO15765_FS_CTS);
+			if (rv) {
+				slot->id = 0;
+				return diag_ifwderr(rv);
+			}
+		}
+		return 0;
+	case ISO15765_PCI_CF:
+		slot = can_findslot(dp, id);
+		if ((slot == NULL) || (dlc < 2)) {
+			break;
+		}
+		if ((data[0] & 0x0F) != (slot->sn & 0x0F)) {
+			fprintf(stderr, FLFMT "ISO-TP : sequence error from 0x%lX (got %u, expected %u)\n",
+			        FL, (unsigned long) id, data[0] & 0x0F, slot->sn & 0x0F);
+			slot->id = 0;
+			return 0;
+		}
+		clen = MIN(slot->len - slot->off, dlc - 1);
+		memcpy(&slot->buf[slot->off], &data[1], clen);
+		slot->off += clen;
+		slot->sn++;
+		slot->tlast = ts;
+		if (slot->off >= slot->len) {
+			slot->id = 0;
+			rv = can_deliver(d_l2_conn, id, slot->buf, slot->len, ts);
+			return rv? rv:1;
+		}
+		if (slot->bsleft && (--slot->bsleft == 0)) {
+			slot->bsleft = dp->cfg.bs;
+			if (!dp->monitor) {
+				rv = can_txfc(d_l2_conn, can_fcid(dp, id), ISO15765_FS_CTS);
+				if (rv) {
+					slot->id = 0;
+					return diag_ifwderr(rv);
+				}
+			}
+		}
+		return 0;
+	default:
+		/* FC, or reserved */
+		return 0;
+	}
+
+	DIAG_DBGMDATA(diag_l2_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V, data, dlc,
+	              FLFMT "ignoring bad frame from 0x%lX; ", FL, (unsigned long) id);
+	return 0;
+}
+
+/*
+ * Protocol receive routine
+ *
+ * Receive messages until timeout has elapsed (measured from this function's
+ * entry), and save them on d_l2_conn->diag_msg. Segmented receptions in
+ * progress extend the timeout, up to N_Cr after their last frame.
+ * If <first> is set, return as soon as one message is complete : used for
+ * physical requests, where only one ECU answers.
+ *
+ * Ret 0 if ok, whether or not there were any messages.
+ */
+static int dl2p_can_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout, bool first) {
+	struct diag_l2_can *dp = d_l2_conn->diag_l2_proto_data;
+	unsigned long long t_end, ncr;
+	unsigned int i;
+	int rv;
+
+	ncr = diag_os_ushrt(ISO15765_TIM_N_CR * 1000UL);
+	t_end = diag_os_gethrt() + diag_os_ushrt((timeout? timeout:1) * 1000UL);
+
+	DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
+	          FLFMT "diag_l2_can_int_recv timeout=%u\n", FL, timeout);
+
+	while (1) {
+		unsigned long long now, tlim;
+		unsigned long long ts;
+		uint8_t data[DIAG_CAN_MAXDLEN];
+		uint32_t id;
+
+		now = diag_os_gethrt();
+		tlim = t_end;
+		for (i = 0; i < CAN_MAXRX; i++) {
+			if (dp->rx[i].id == 0) {
+				continue;
+			}
+			if (now > dp->rx[i].tlast + ncr) {
+				fprintf(stderr, FLFMT "ISO-TP : timeout receiving from 0x%lX, %u/%u bytes\n",
+				        FL, (unsigned long) dp->rx[i].id, dp->rx[i].off, dp->rx[i].len);
+				dp->rx[i].id = 0;
+				continue;
+			}
+			if (dp->rx[i].tlast + ncr > tlim) {
+				tlim = dp->rx[i].tlast + ncr;
+			}
+		}
+		if (now >= tlim) {
+			break;
+		}
+
+		rv = can_rxframe(d_l2_conn, &id, data, &ts, (unsigned int) (diag_os_hrtus(tlim - now) / 1000) + 1);
+		if (rv == DIAG_ERR_TIMEOUT) {
+			break;
+		}
+		if (rv < 0) {
+			diag_freemsg(d_l2_conn->diag_msg);
+			d_l2_conn->diag_msg = NULL;
+			return rv;
+		}
+		if ((rv == 0) || !can_accept(dp, id)) {
+			continue;
+		}
+		rv = can_rxprocess(d_l2_conn, id, data, (unsigned int) rv, ts);
+		if (rv < 0) {
+			diag_freemsg(d_l2_conn->diag_msg);
+			d_l2_conn->diag_msg = NULL;
+			return rv;
+		}
+		if (rv && (first || dp->monitor)) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+
+static int dl2p_can_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout,
+                         void (*callback)(void *handle, struct diag_msg *msg),
+                         void *handle) {
+	struct diag_l2_can *dp = d_l2_conn->diag_l2_proto_data;
+	struct diag_msg *tmsg;
+	int rv;
+
+	rv = dl2p_can_int_recv(d_l2_conn, timeout, !dp->funcaddr);
+	if (rv < 0) {
+		return rv;
+	}
+
+	if (d_l2_conn->diag_msg == NULL) {
+		return DIAG_ERR_TIMEOUT;
+	}
+
+	tmsg = d_l2_conn->diag_msg;
+	d_l2_conn->diag_msg = NULL;
+
+	if (callback) {
+		callback(handle, tmsg);
+	}
+
+	diag_freemsg(tmsg);
+
+	return 0;
+}
+
+/* Remove "responsePending" negative responses (7F xx 78) from the
+ * received messages, and keep track of who is still pending in pend[] : a
+ * 7F xx 78 adds its sender (or pushes back its P2*CAN deadline), any other
+ * response removes it.
+ */
+static void can_droppending(struct diag_l2_conn *d_l2_conn,
+                            struct can_pending *pend, unsigned int *npend) {
+	struct diag_msg *tmsg, *tmp;
+	unsigned int i;
+
+	LL_FOREACH_SAFE(d_l2_conn->diag_msg, tmsg, tmp) {
+		bool rp = (tmsg->len == 3) && (tmsg->data[0] == 0x7F) && (tmsg->data[2] == 0x78);
+
+		for (i = 0; i < *npend; i++) {
+			if (pend[i].src == tmsg->src) {
+				break;
+			}
+		}
+		if (!rp) {
+			if (i < *npend) {
+				pend[i] = pend[--(*npend)];
+			}
+			continue;
+		}
+		if (i == *npend) {
+			if (*npend == CAN_MAXPENDING) {
+				fprintf(stderr, FLFMT "too many ECUs pending, not waiting for 0x%02X\n",
+				        FL, (unsigned int) tmsg->src);
+				i = CAN_MAXPENDING;
+			} else {
+				pend[i].src = tmsg->src;
+				(*npend)++;
+			}
+		}
+		if (i < CAN_MAXPENDING) {
+			pend[i].deadline = tmsg->rxtime + d_l2_conn->diag_l2_p2emax + RXTOFFSET;
+		}
+		LL_DELETE(d_l2_conn->diag_msg, tmsg);
+		tmsg->next = NULL;
+		diag_freemsg(tmsg);
+	}
+	return;
+}
+
+/* Forget pending ECUs whose P2*CAN expired; ret ms until the last
+ * deadline of the others, 0 if none are left.
+ */
+static unsigned int can_pendingwait(struct can_pending *pend, unsigned int *npend) {
+	unsigned long now = diag_os_getms();
+	unsigned long wait = 0;
+	unsigned int i = 0;
+
+	while (i < *npend) {
+		long left = (long) (pend[i].deadline - now);
+
+		if (left <= 0) {
+			DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
+			          FLFMT "P2*CAN expired for 0x%02X\n", FL, (unsigned int) pend[i].src);
+			pend[i] = pend[--(*npend)];
+			continue;
+		}
+		if ((unsigned long) left > wait) {
+			wait = (unsigned long) left;
+		}
+		i++;
+	}
+	return (unsigned int) wait;
+}
+
+/*
+ * Send a request and wait for the response(s)
+ */
+static struct diag_msg *dl2p_can_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
+                                         int *errval) {
+	struct diag_l2_can *dp = d_l2_conn->diag_l2_proto_data;
+	struct can_pending pend[CAN_MAXPENDING];
+	unsigned int npend = 0;
+	struct diag_msg *rmsg;
+	unsigned int timeout;
+	bool first = !dp->funcaddr;
+	int rv;
+
+	rv = diag_l2_send(d_l2_conn, msg);
+	if (rv < 0) {
+		*errval = rv;
+		return diag_pseterr(DIAG_ERR_GENERAL);
+	}
+
+	/* Functional requests : every ECU answers within P2, except those that
+	 * sent responsePending; keep waiting for each of those until its final
+	 * response or until its P2*CAN runs out.
+	 */
+	timeout = d_l2_conn->diag_l2_p2max + RXTOFFSET;
+	while (1) {
+		rv = dl2p_can_int_recv(d_l2_conn, timeout, first);
+		if (rv < 0) {
+			*errval = rv;
+			return diag_pseterr(DIAG_ERR_GENERAL);
+		}
+		can_droppending(d_l2_conn, pend, &npend);
+		if (!dp->funcaddr && d_l2_conn->diag_msg) {
+			break;
+		}
+		timeout = can_pendingwait(pend, &npend);
+		if (timeout == 0) {
+			break;
+		}
+		/* only the pending ECUs are left : check after every message */
+		first = 1;
+	}
+
+	if (!d_l2_conn->diag_msg) {
+		*errval = DIAG_ERR_TIMEOUT;
+		return NULL;
+	}
+
+	rmsg = d_l2_conn->diag_msg;
+	d_l2_conn->diag_msg = NULL;
+	return rmsg;
+}
 
 const struct diag_l2_proto diag_l2_proto_can = {
 	DIAG_L2_PROT_CAN,
 	"CAN",
-	0,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
+	DIAG_L2_FLAG_FRAMED | DIAG_L2_FLAG_CONNECTS_ALWAYS,
+	dl2p_can_startcomms,
+	dl2p_can_stopcomms,
+	dl2p_can_send,
+	dl2p_can_recv,
+	dl2p_can_request,
 	NULL
 };
@@ -22,8 +22,8 @@
  *
  *************************************************************************
  *
- * CAN.  Not written, but put in its own file for modularity.  It used
- * to be inline in L2.
+ * CAN L2 : ISO 15765-2 (ISO-TP) segmentation and reassembly, on top of a
+ * frame-level CAN L0 (frame format in diag_iso15765.h).
  *
  */
 
@@ -31,6 +31,22 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
+#include <stdint.h>
+
+/* ISO-TP parameters, copied into each connection by startcomms.
+ * All 0 by default : no FC limits, 11-bit OBD identifiers.
+ */
+struct diag_l2_can_cfg {
+	uint8_t bs;             /* block size sent in our flow control frames; 0 = no more FC needed */
+	uint8_t stmin;          /* STmin sent in our flow control frames (raw ISO15765 encoding) */
+	bool id29;              /* use 29-bit OBD identifiers (default 11-bit) */
+	uint32_t txid;          /* if nonzero, request ID to use instead of the OBD ones (| DIAG_CAN_EFF if 29-bit) */
+	uint32_t rxid;          /* response ID when txid is set; 0 accepts any */
+};
+
+extern struct diag_l2_can_cfg diag_l2_can_cfg;
+
 #if defined(__cplusplus)
 }
 #endif
@@ -31,6 +31,7 @@
 #include <string.h>
 
 #include "diag.h"
+#include "diag_cks.h"
 #include "diag_os.h"
 #include "diag_tty.h"
 #include "diag_l0.h"
@@ -54,9 +55,9 @@
  * but it only worries about the first message
  * only proto_14230_intrecv should use this...
  */
-static int dl2p_14230_decode(uint8_t *data, int len,
-                             uint8_t *hdrlen, int *datalen, uint8_t *source, uint8_t *dest,
-                             int first_frame) {
+int dl2p_14230_decode(uint8_t *data, int len,
+                      uint8_t *hdrlen, int *datalen, uint8_t *source, uint8_t *dest,
+                      int first_frame) {
 	uint8_t dl;
 
 	DIAG_DBGMDATA(diag_l2_debug, DIAG_DEBUG_PROTO, DIAG_DBGLEVEL_V,
@@ -495,6 +496,42 @@ static int dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int time
 }
 
 
+/*
+ * Walk the StartComms responses to a functional fastinit and note every
+ * ECU that answered positively. They all arrive in the same P2 window
+ * so _int_recv() already split them into a chain.
+ */
+static void dl2p_14230_noteresp(struct diag_l2_conn *d_l2_conn) {
+	struct diag_msg *msg;
+
+	d_l2_conn->diag_l2_nresp = 0;
+	for (msg = d_l2_conn->diag_msg; msg; msg = msg->next) {
+		struct diag_l2_resp *r;
+		unsigned int i;
+
+		if ((msg->len < 3) || (msg->data[0] != DIAG_KW2K_RC_SCRPR) ||
+		    (msg->fmt & DIAG_FMT_BADCS)) {
+			continue;
+		}
+		for (i = 0; i < d_l2_conn->diag_l2_nresp; i++) {
+			if (d_l2_conn->diag_l2_resp[i].physaddr == msg->src) {
+				break;
+			}
+		}
+		if ((i < d_l2_conn->diag_l2_nresp) || (i >= DIAG_L2_MAXRESP)) {
+			continue;
+		}
+		r = &d_l2_conn->diag_l2_resp[i];
+		r->physaddr = msg->src;
+		r->kb1 = msg->data[1];
+		r->kb2 = msg->data[2];
+		d_l2_conn->diag_l2_nresp++;
+	}
+	DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_PROTO, DIAG_DBGLEVEL_V,
+	          FLFMT "_StartComms: %u functional responder(s)\n",
+	          FL, d_l2_conn->diag_l2_nresp);
+}
+
 /* External interface */
 
 static int dl2p_14230_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg);
@@ -567,7 +604,7 @@ static int dl2p_14230_startcomms( struct diag_l2_conn      *d_l2_conn, flag_type
 		return diag_ifwderr(rv);
 	}
 
-	dp->state = STATE_CONNECTING;
+	dp->state = ISO14230_STATE_CONNECTING;
 
 	/* Flush unread input, then wait for idle bus. */
 	(void)diag_l2_ioctl(d_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
@@ -608,7 +645,7 @@ static int dl2p_14230_startcomms( struct diag_l2_conn      *d_l2_conn, flag_type
 		if (d_l2_conn->diag_link->l1flags & DIAG_L1_DOESFULLINIT) {
 			//TODO : somehow extract keybyte data for those cases...
 			//original elm327s have the "atkw" command to get the keybytes, but clones suck.
-			dp->state = STATE_ESTABLISHED;
+			dp->state = ISO14230_STATE_ESTABLISHED;
 			break;
 		}
 
@@ -652,8 +689,11 @@ static int dl2p_14230_startcomms( struct diag_l2_conn      *d_l2_conn, flag_type
 			DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_PROTO, DIAG_DBGLEVEL_V,
 			          FLFMT "_StartComms Physaddr=0x%X KB1=%02X, KB2=%02X\n",
 			          FL, d_l2_conn->diag_l2_physaddr, d_l2_conn->diag_l2_kb1, d_l2_conn->diag_l2_kb2);
+			if (flags & DIAG_L2_TYPE_FUNCADDR) {
+				dl2p_14230_noteresp(d_l2_conn);
+			}
 			rv=0;
-			dp->state = STATE_ESTABLISHED;
+			dp->state = ISO14230_STATE_ESTABLISHED;
 			break;
 		case DIAG_KW2K_RC_NR:
 			DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_PROTO, DIAG_DBGLEVEL_V,
@@ -681,7 +721,7 @@ static int dl2p_14230_startcomms( struct diag_l2_conn      *d_l2_conn, flag_type
 
 		//some L0 devices handle the full init transaction:
 		if ((d_l2_conn->diag_link->l1flags & DIAG_L1_DOESFULLINIT) && (rv==0)) {
-			dp->state = STATE_ESTABLISHED;
+			dp->state = ISO14230_STATE_ESTABLISHED;
 			break;
 		}
 
@@ -743,13 +783,13 @@ static int dl2p_14230_startcomms( struct diag_l2_conn      *d_l2_conn, flag_type
 			          FL, d_l2_conn->diag_l2_kb1, d_l2_conn->diag_l2_kb2);
 		}
 		rv=0;
-		dp->state = STATE_ESTABLISHED;
+		dp->state = ISO14230_STATE_ESTABLISHED;
 		break;  //case _SLOWINIT
 	case DIAG_L2_TYPE_MONINIT:
 		/* Monitor mode, don't send anything */
 		dp->first_frame = 1;
 		dp->monitor_mode = 1;
-		dp->state = STATE_ESTABLISHED;
+		dp->state = ISO14230_STATE_ESTABLISHED;
 		rv = 0;
 		break;
 	default:
@@ -797,7 +837,7 @@ static int dl2p_14230_startcomms( struct diag_l2_conn      *d_l2_conn, flag_type
 	}
 
 	/* And we're done */
-	dp->state = STATE_ESTABLISHED;
+	dp->state = ISO14230_STATE_ESTABLISHED;
 
 	return 0;
 }
@@ -962,7 +1002,7 @@ static int dl2p_14230_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg)
 	              FLFMT "_send: ", FL);
 
 	/* Wait p3min milliseconds, but not if doing fast/slow init */
-	if (dp->state == STATE_ESTABLISHED) {
+	if (dp->state == ISO14230_STATE_ESTABLISHED) {
 		diag_os_millisleep(d_l2_conn->diag_l2_p3min);
 	}
 
@@ -1084,6 +1124,7 @@ static struct diag_msg *dl2p_14230_request(struct diag_l2_conn *d_l2_conn, struc
 			}
 
 			retries--;
+			d_l2_conn->diag_link->l2_dl0d->stats.retries++;
 
 			if (rv < 0) {
 				*errval = rv;
@@ -1102,6 +1143,7 @@ static struct diag_msg *dl2p_14230_request(struct diag_l2_conn *d_l2_conn, struc
 			 */
 			DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_PROTO, DIAG_DBGLEVEL_V,
 			          FLFMT "got RspPending: retrying...\n", FL);
+			d_l2_conn->diag_link->l2_dl0d->stats.retries++;
 
 			/* reattach the rest of the chain, in case the good response
 			 * was already received
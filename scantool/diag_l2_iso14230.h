@@ -44,9 +44,9 @@ struct diag_l2_14230 {
 	int modeflags;  /* 14230-specific Flags; see below */
 
 	enum {
-		STATE_CLOSED=0,         /* Established comms */
-		STATE_CONNECTING=1,             /* Connecting */
-		STATE_ESTABLISHED=2,    /* Established */
+		ISO14230_STATE_CLOSED=0,        /* Established comms */
+		ISO14230_STATE_CONNECTING=1,    /* Connecting */
+		ISO14230_STATE_ESTABLISHED=2,   /* Established */
 	} state;
 
 	bool first_frame;       /* First frame flag, used mainly for
@@ -96,6 +96,14 @@ struct diag_l2_14230 {
 extern "C" {
 #endif
 
+/** Decode a received header; see diag_l2_iso14230.c.
+ * Exported for the benchmarks only; L2 code must not call this directly.
+ * @return expected length of the message (hdr+data+cks), or <0 if error
+ */
+int dl2p_14230_decode(uint8_t *data, int len,
+                      uint8_t *hdrlen, int *datalen, uint8_t *source, uint8_t *dest,
+                      int first_frame);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -36,6 +36,7 @@
 #include <stdlib.h>
 
 #include "diag.h"
+#include "diag_cks.h"
 #include "diag_err.h"
 #include "diag_os.h"
 #include "diag_tty.h"
@@ -194,7 +195,7 @@ static int dl2p_iso9141_startcomms(struct diag_l2_conn *d_l2_conn,
 
 	dp->srcaddr = source;
 	dp->target = target;
-	dp->state = STATE_CONNECTING;
+	dp->state = ISO9141_STATE_CONNECTING;
 	d_l2_conn->diag_l2_kb1 = 0;
 	d_l2_conn->diag_l2_kb2 = 0;
 	d_l2_conn->diag_l2_proto_data = (void *)dp;
@@ -239,7 +240,7 @@ static int dl2p_iso9141_startcomms(struct diag_l2_conn *d_l2_conn,
 		return diag_iseterr(rv);
 	}
 
-	dp->state = STATE_ESTABLISHED;
+	dp->state = ISO9141_STATE_ESTABLISHED;
 
 	return 0;
 }
@@ -274,8 +275,8 @@ static int dl2p_iso9141_stopcomms(struct diag_l2_conn *d_l2_conn) {
  * So this only verifies minimal length and valid header bytes.
  * Should only really be used by the _int_recv function.
  */
-static int dl2p_iso9141_decode(uint8_t *data, int len,
-                               uint8_t *hdrlen, int *datalen, uint8_t *source, uint8_t *dest) {
+int dl2p_iso9141_decode(uint8_t *data, int len,
+                        uint8_t *hdrlen, int *datalen, uint8_t *source, uint8_t *dest) {
 
 	DIAG_DBGMDATA(diag_l2_debug, DIAG_DEBUG_PROTO, DIAG_DBGLEVEL_V, data, len,
 	              FLFMT "decode len %d: ", FL, len);
@@ -443,11 +444,21 @@ int dl2p_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout)
 				       (size_t)dp->rxoffset);
 				tmsg->rxtime = diag_os_getms();
 
+				if ((l1flags & DIAG_L1_STRIPSL2CKSUM) == 0) {
+					// the running sum includes the checksum byte itself
+					uint8_t rx_cs = dp->rxbuf[dp->rxoffset - 1];
+					tmsg->fmt |= DIAG_FMT_CKSUMMED;
+					if ((uint8_t) (dp->rxsum - rx_cs) != rx_cs) {
+						tmsg->fmt |= DIAG_FMT_BADCS;
+					}
+				}
+
 				DIAG_DBGMDATA(diag_l2_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
 				              dp->rxbuf, (size_t)dp->rxoffset,
 				              "l2_iso9141_recv: ");
 
 				dp->rxoffset = 0;
+				dp->rxsum = 0;
 
 				// Add received message to response list:
 				diag_l2_addmsg(d_l2_conn, tmsg);
@@ -479,7 +490,8 @@ int dl2p_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout)
 		}
 
 		// Data received OK.
-		// Add length to offset.
+		// Add length to offset, and checksum the new bytes.
+		dp->rxsum = diag_cks1_update(dp->rxsum, &dp->rxbuf[dp->rxoffset], (size_t) rv);
 		dp->rxoffset += (uint8_t) rv;
 
 		// This is where some tweaking might be needed if
@@ -538,6 +550,9 @@ int dl2p_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout)
 				amsg->len = (uint8_t) MAXLEN_ISO9141;
 				tmsg->len -= (uint8_t) MAXLEN_ISO9141;
 				tmsg->data += MAXLEN_ISO9141;
+				//checksum verified on reception doesn't apply to the pieces
+				amsg->fmt &= ~(DIAG_FMT_CKSUMMED | DIAG_FMT_BADCS);
+				tmsg->fmt &= ~(DIAG_FMT_CKSUMMED | DIAG_FMT_BADCS);
 
 				/*  Insert new amsg before old msg */
 				amsg->next = tmsg;
@@ -554,12 +569,16 @@ int dl2p_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout)
 
 		// If L1 doesn't strip the checksum byte, verify it:
 		if ((l1flags & DIAG_L1_STRIPSL2CKSUM) == 0) {
-			uint8_t rx_cs = tmsg->data[tmsg->len - 1];
-			if (rx_cs != diag_cks1(tmsg->data, tmsg->len - 1)) {
+			if (!(tmsg->fmt & DIAG_FMT_CKSUMMED)) {
+				//not checked on reception
+				uint8_t rx_cs = tmsg->data[tmsg->len - 1];
+				if (rx_cs != diag_cks1(tmsg->data, tmsg->len - 1)) {
+					tmsg->fmt |= DIAG_FMT_BADCS;
+				}
+			}
+			if (tmsg->fmt & DIAG_FMT_BADCS) {
 				fprintf(stderr, FLFMT "Checksum error in received message!\n", FL);
-				tmsg->fmt |= DIAG_FMT_BADCS;
 			} else {
-				tmsg->fmt &= ~DIAG_FMT_BADCS;
 				tmsg->fmt |= DIAG_FMT_FRAMED;   //if the checksum fits, it means we framed things properly.
 			}
 			// "Remove" the checksum byte:
@@ -76,15 +76,22 @@ struct diag_l2_iso9141 {
 
 	uint8_t rxbuf[MAXLEN_ISO9141]; // Receive buffer, for building message in.
 	uint8_t rxoffset;
+	uint8_t rxsum;          // running diag_cks1() of rxbuf[0..rxoffset)
 
 	enum {
-		STATE_CLOSED=0,
-		STATE_CONNECTING=1,
-		STATE_ESTABLISHED=2,
+		ISO9141_STATE_CLOSED=0,
+		ISO9141_STATE_CONNECTING=1,
+		ISO9141_STATE_ESTABLISHED=2,
 	} state;
 
 };
 
+/** Decode a received message; see diag_l2_iso9141.c.
+ * Exported for the benchmarks only.
+ */
+int dl2p_iso9141_decode(uint8_t *data, int len,
+                        uint8_t *hdrlen, int *datalen, uint8_t *source, uint8_t *dest);
+
 
 #if defined(__cplusplus)
 }
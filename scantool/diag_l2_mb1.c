@@ -32,6 +32,7 @@
 #include <string.h>
 
 #include "diag.h"
+#include "diag_cks.h"
 #include "diag_err.h"
 #include "diag_os.h"
 #include "diag_tty.h"
@@ -153,9 +154,8 @@ static int dl2p_mb1_stopcomms(UNUSED(struct diag_l2_conn *dl2c)) {
  *
  * Data/len is received data/len
  */
-static int dl2p_mb1_decode(uint8_t *data, int len, int *msglen) {
+int dl2p_mb1_decode(uint8_t *data, int len, int *msglen) {
 	uint16_t cksum;
-	int i;
 
 	DIAG_DBGMDATA(diag_l2_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V, data, len,
 	              FLFMT "decode len %d; ", FL, len);
@@ -172,9 +172,7 @@ static int dl2p_mb1_decode(uint8_t *data, int len, int *msglen) {
 
 	*msglen = data[3];
 
-	for (i = 0, cksum = 0; i < len - 2; i++) {
-		cksum += data[i];
-	}
+	cksum = diag_cks16_update(0, data, (size_t) (len - 2));
 	if (data[len-2] != (cksum &0xff)) {
 		DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
 		          FLFMT "recv cksum 0x%02X 0x%02X, wanted 0x%X\n",
@@ -303,7 +301,6 @@ static int dl2p_mb1_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 	unsigned int sleeptime;
 	uint8_t txbuf[MAXRBUF];
 	uint16_t cksum;
-	unsigned i;
 
 	DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V,
 	          FLFMT "diag_l2_send %p, msg %p called\n",
@@ -326,9 +323,7 @@ static int dl2p_mb1_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 	memcpy(&txbuf[3], &msg->data[1], (size_t)(msg->len-1));
 
 	/* Checksum is 16 bit addition, in LSB order on packet */
-	for (i = 0, cksum = 0; i < (msg->len + 2); i++) {
-		cksum += txbuf[i];
-	}
+	cksum = diag_cks16_update(0, txbuf, (size_t) (msg->len + 2));
 
 	txbuf[msg->len+2] = (uint8_t) (cksum & 0xff);
 	txbuf[msg->len+3] = (uint8_t) ((cksum>>8) & 0xff);
@@ -33,6 +33,13 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
+/** Check a received message; see diag_l2_mb1.c.
+ * Exported for the benchmarks only.
+ */
+int dl2p_mb1_decode(uint8_t *data, int len, int *msglen);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -36,6 +36,7 @@
 #include <string.h>
 
 #include "diag.h"
+#include "diag_cks.h"
 #include "diag_err.h"
 #include "diag_os.h"
 #include "diag_l1.h"
@@ -64,7 +65,6 @@ struct diag_l2_j1850 {
 #define STATE_ESTABLISHED 2     /* Established */
 
 /* Prototypes */
-uint8_t dl2p_j1850_crc(uint8_t *msg_buf, int nbytes);
 
 /* External interface */
 
@@ -122,33 +122,6 @@ static int dl2p_j1850_stopcomms(struct diag_l2_conn *d_l2_conn) {
 }
 
 
-/* Thanks to B. Roadman's web site for this CRC code */
-uint8_t dl2p_j1850_crc(uint8_t *msg_buf, int nbytes) {
-	uint8_t crc_reg=0xff,poly,i,j;
-	uint8_t *byte_point;
-	uint8_t bit_point;
-
-	for (i=0, byte_point=msg_buf; i<nbytes; ++i, ++byte_point) {
-		for (j=0, bit_point=0x80 ; j<8; ++j, bit_point>>=1) {
-			if (bit_point & *byte_point) {  // case for new bit = 1
-				if (crc_reg & 0x80) {
-					poly=1; // define the polynomial
-				} else {
-					poly = 0x1c;
-				}
-				crc_reg= ( (crc_reg << 1) | 1) ^ poly;
-			} else {                // case for new bit = 0
-				poly=0;
-				if (crc_reg & 0x80) {
-					poly = 0x1d;
-				}
-				crc_reg= (crc_reg << 1) ^ poly;
-			}
-		}
-	}
-	return ~crc_reg;        // Return CRC
-}
-
 /*
  * Just send the data
  *
@@ -198,7 +171,7 @@ static int dl2p_j1850_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg)
 	    ((l1flags & DIAG_L1_DATAONLY) == 0)) {
 		// Add in J1850 CRC
 		int curoff = offset;
-		buf[offset++] = dl2p_j1850_crc(buf, curoff);
+		buf[offset++] = diag_crc8_j1850(buf, curoff);
 	}
 
 	DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V,
@@ -322,7 +295,7 @@ static int dl2p_j1850_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int time
 
 		if (!(l1flags & DIAG_L1_STRIPSL2CKSUM)) {
 			//test & trim checksum
-			uint8_t tcrc=dl2p_j1850_crc(dp->rxbuf, dp->rxoffset - 1);
+			uint8_t tcrc=diag_crc8_j1850(dp->rxbuf, dp->rxoffset - 1);
 			if (dp->rxbuf[dp->rxoffset - 1] != tcrc) {
 				fprintf(stderr, "Bad checksum detected: needed %02X got %02X\n",
 				        tcrc, dp->rxbuf[dp->rxoffset - 1]);
@@ -338,6 +311,10 @@ static int dl2p_j1850_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int time
 
 		diag_l2_addmsg(d_l2_conn, tmsg);
 
+		if ((d_l2_conn->diag_l2_type & DIAG_L2_TYPE_INITMASK) == DIAG_L2_TYPE_MONINIT) {
+			//monitoring : deliver every frame as it arrives
+			break;
+		}
 	}       //while !timed out
 
 	dp->state = STATE_ESTABLISHED;
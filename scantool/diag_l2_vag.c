@@ -55,6 +55,7 @@
 #include "diag_err.h"
 #include "diag_os.h"
 #include "diag_tty.h"
+#include "diag_l0.h"
 #include "diag_l1.h"
 #include "diag_l2.h"
 
@@ -355,6 +356,7 @@ int diag_l2_vag_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 				}
 				DIAG_DBGM(diag_l2_debug, DIAG_DEBUG_PROTO, DIAG_DBGLEVEL_V,
 				          FLFMT "\tso will retry\n", FL);
+				d_l2_conn->diag_link->l2_dl0d->stats.retries++;
 
 				//re-send with the previous sequence number
 				//NOTE: SAE J2818 says that "The Message number is NOT incremented by the transmitter for a repeated block."
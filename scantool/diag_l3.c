@@ -27,6 +27,7 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "diag.h"
@@ -240,9 +241,8 @@ struct diag_msg *diag_l3_request(struct diag_l3_conn *dl3c, struct diag_msg *txm
 }
 
 /*
- * Note: This is called regularly from a signal handler.
- * (see diag_os.c)
- * XXX This calls non async-signal-safe functions!
+ * Note: This is called regularly from the periodic service thread.
+ * (see diag_os*.c)
  */
 void diag_l3_timer(void) {
 	/*
@@ -323,3 +323,108 @@ struct diag_msg *diag_l3_base_request(struct diag_l3_conn *dl3c,
 
 	return rxmsg;
 }
+
+
+#define L3_SID_NR       0x7F    /* negative response */
+#define L3_SID_POSRESP  0x40    /* added to the request SID */
+
+void diag_l3_dupcallback(void *handle, struct diag_msg *msg) {
+	struct diag_msg **pmsg = (struct diag_msg **)handle;
+	struct diag_msg *dmsg;
+
+	dmsg = diag_dupmsg(msg);
+	if (dmsg != NULL) {
+		LL_CONCAT(*pmsg, dmsg);
+	}
+}
+
+int diag_l3_xfer(struct diag_l3_conn *d_l3_conn, uint8_t *data, unsigned int len,
+                 struct diag_msg **resp, struct diag_msg **others, uint8_t *nrc) {
+	struct diag_msg msg = {0};
+	struct diag_msg *rxmsg, *tmsg;
+	int errval;
+
+	msg.data = data;
+	msg.len = len;
+	*nrc = 0;
+
+	rxmsg = diag_l3_request(d_l3_conn, &msg, &errval);
+	if (rxmsg == NULL) {
+		return diag_ifwderr(errval);
+	}
+
+	/* other messages (unsolicited records, etc) can come with the response;
+	 * a negative response must be for this SID.
+	 */
+	LL_FOREACH(rxmsg, tmsg) {
+		if ((tmsg->len >= 1) && (tmsg->data[0] == (data[0] | L3_SID_POSRESP))) {
+			break;
+		}
+		if ((tmsg->len >= 3) && (tmsg->data[0] == L3_SID_NR) && (tmsg->data[1] == data[0])) {
+			break;
+		}
+	}
+	if (tmsg == NULL) {
+		fprintf(stderr, FLFMT "SID 0x%02X : unexpected response 0x%02X\n",
+		        FL, data[0], rxmsg->len? rxmsg->data[0]:0);
+	} else {
+		LL_DELETE(rxmsg, tmsg);
+		tmsg->next = NULL;
+	}
+	if (others) {
+		*others = rxmsg;
+	} else {
+		diag_freemsg(rxmsg);
+	}
+	if (tmsg == NULL) {
+		return diag_iseterr(DIAG_ERR_BADDATA);
+	}
+
+	if (tmsg->data[0] == L3_SID_NR) {
+		*nrc = tmsg->data[2];
+		DIAG_DBGM(diag_l3_debug, DIAG_DEBUG_PROTO, DIAG_DBGLEVEL_V,
+		          FLFMT "SID 0x%02X : negative response 0x%02X\n", FL, data[0], *nrc);
+		diag_freemsg(tmsg);
+		return DIAG_ERR_ECUSAIDNO;
+	}
+
+	if (resp) {
+		*resp = tmsg;
+	} else {
+		diag_freemsg(tmsg);
+	}
+	return 0;
+}
+
+int diag_l3_waitqueue(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
+                      struct diag_msg **queue,
+                      struct diag_msg *(*sort)(struct diag_l3_conn *, struct diag_msg *)) {
+	unsigned long t_end;
+
+	t_end = diag_os_getms() + timeout;
+	while (*queue == NULL) {
+		struct diag_msg *rxmsg = NULL;
+		unsigned long now = diag_os_getms();
+		int rv;
+
+		if (now >= t_end) {
+			return DIAG_ERR_TIMEOUT;
+		}
+		rv = diag_l2_recv(d_l3_conn->d_l3l2_conn, (unsigned int) (t_end - now),
+		                  diag_l3_dupcallback, &rxmsg);
+		if (rv == DIAG_ERR_TIMEOUT) {
+			return rv;
+		}
+		if (rv < 0) {
+			return diag_ifwderr(rv);
+		}
+		rxmsg = sort(d_l3_conn, rxmsg);
+		if (rxmsg) {
+			DIAG_DBGMDATA(diag_l3_debug, DIAG_DEBUG_READ, DIAG_DBGLEVEL_V,
+			              rxmsg->data, rxmsg->len,
+			              FLFMT "dropping unexpected message; ", FL);
+			diag_freemsg(rxmsg);
+		}
+	}
+	return 0;
+}
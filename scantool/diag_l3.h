@@ -188,6 +188,37 @@ struct diag_msg *diag_l3_base_request(struct diag_l3_conn *dl3c,
                                       struct diag_msg *txmsg, int *errval);
 
 
+/* Helpers for L3s with KWP2000-style services (ISO14230-3, UDS) :
+ * positive response SID = request SID | 0x40, negative response 7F <SID> <NRC>.
+ */
+
+/** diag_l2_recv() callback : append a copy of the received message(s) to the
+ * chain at *(struct diag_msg **) handle.
+ */
+void diag_l3_dupcallback(void *handle, struct diag_msg *msg);
+
+/** Send a request, and pick its response out of the received messages.
+ *
+ * @param resp : if not NULL, gets the positive response (caller must free).
+ * @param others : if not NULL, gets the other messages received with the
+ *	response (caller must free); otherwise they're dropped.
+ * @param nrc : set to the NRC of a negative response, 0 otherwise.
+ * @return 0 if positive; DIAG_ERR_ECUSAIDNO if negative; other errors.
+ */
+int diag_l3_xfer(struct diag_l3_conn *d_l3_conn, uint8_t *data, unsigned int len,
+                 struct diag_msg **resp, struct diag_msg **others, uint8_t *nrc);
+
+/** Wait until a message is queued on *queue, e.g. records sent repeatedly by the ECU.
+ *
+ * Messages are received from L2 and passed to sort(), which must move those
+ * it keeps to *queue and return the rest; these are dropped.
+ * @return 0 if *queue isn't empty, DIAG_ERR_TIMEOUT after <timeout> ms, or other errors.
+ */
+int diag_l3_waitqueue(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
+                      struct diag_msg **queue,
+                      struct diag_msg *(*sort)(struct diag_l3_conn *, struct diag_msg *));
+
+
 
 // diag_l3_debug : contains debugging message flags (see diag.h)
 extern int diag_l3_debug;
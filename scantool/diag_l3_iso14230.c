@@ -24,18 +24,40 @@
  * routines
  * This doesn't duplicate what is provided by the L3 J1979 handler.
  * It provides iso14230 SID + response code string decoding,
+ * dynamically defined local identifiers, and readDataByLocalId with
+ * repeated transmission, decoded into column buffers.
  */
 
+#include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "diag.h"
 #include "diag_err.h"
+#include "diag_os.h"
 #include "diag_iso14230.h"
 #include "diag_l2.h"
 #include "diag_l3.h"
 #include "diag_l3_iso14230.h"
 
+#include "utlist.h"
+
+/* A local id we defined on this connection */
+struct kwp_ddli {
+	uint8_t lid;
+	unsigned int n;
+	struct diag_kwp_ddli_elem elems[DIAG_KWP_DDLI_MAXELEMS];
+	struct kwp_ddli *next;
+};
+
+struct l3_14230_int {
+	uint8_t nrc;            /* from the last negative response */
+	struct kwp_ddli *ddlis;
+	struct diag_msg *rrx;   /* repeated records not read yet */
+};
 
 
 static const char *l3_iso14230_sidlookup(const int id);
@@ -227,6 +249,377 @@ void diag_l3_iso14230_decode(UNUSED(struct diag_l3_conn *d_l3_conn),
 }
 
 
+/* Move the repeated records (61 <lid> ...) from the <rxmsg> chain to the
+ * record queue; ret what's left.
+ */
+static struct diag_msg *kwp_sortrx(struct diag_l3_conn *d_l3_conn, struct diag_msg *rxmsg) {
+	struct l3_14230_int *l3i = d_l3_conn->l3_int;
+	struct diag_msg *tmsg, *tmp;
+
+	LL_FOREACH_SAFE(rxmsg, tmsg, tmp) {
+		if ((tmsg->len >= 2) && (tmsg->data[0] == (DIAG_KW2K_SI_RDDBLI | 0x40))) {
+			LL_DELETE(rxmsg, tmsg);
+			tmsg->next = NULL;
+			LL_APPEND(l3i->rrx, tmsg);
+		}
+	}
+	return rxmsg;
+}
+
+/*
+ * Send <len> bytes and check the response against the request SID.
+ * ret 0 and the response in *resp (caller must free) if positive;
+ * DIAG_ERR_ECUSAIDNO with l3i->nrc set if negative.
+ * With repeated transmission, more records can come with the response;
+ * they are queued for diag_l3_iso14230_recvrecord().
+ */
+static int kwp_xfer(struct diag_l3_conn *d_l3_conn, uint8_t *data, unsigned int len,
+                    struct diag_msg **resp) {
+	struct l3_14230_int *l3i = d_l3_conn->l3_int;
+	struct diag_msg *others = NULL;
+	int rv;
+
+	rv = diag_l3_xfer(d_l3_conn, data, len, resp, &others, &l3i->nrc);
+	diag_freemsg(kwp_sortrx(d_l3_conn, others));
+	return rv;
+}
+
+/*
+ * After "21 <lid> 05", records the ECU sent before stopping can still be
+ * pending; the stop is confirmed by a 61 <lid> without record data.
+ * Drop records until then. <rxmsg> is the response picked by kwp_xfer().
+ */
+static int kwp_waitstop(struct diag_l3_conn *d_l3_conn, uint8_t lid, struct diag_msg *rxmsg) {
+	struct l3_14230_int *l3i = d_l3_conn->l3_int;
+	struct diag_msg *tmsg;
+	unsigned long t_end;
+	bool stopped;
+
+	t_end = diag_os_getms() + d_l3_conn->d_l3l2_conn->diag_l2_p2emax + RXTOFFSET;
+	stopped = (rxmsg->len == 2) && (rxmsg->data[1] == lid);
+	diag_freemsg(rxmsg);
+
+	while (1) {
+		unsigned long now;
+		int rv;
+
+		LL_FOREACH(l3i->rrx, tmsg) {
+			if ((tmsg->len == 2) && (tmsg->data[1] == lid)) {
+				stopped = true;
+			}
+		}
+		/* records sent before the ECU stopped are stale now */
+		diag_freemsg(l3i->rrx);
+		l3i->rrx = NULL;
+		if (stopped) {
+			return 0;
+		}
+
+		now = diag_os_getms();
+		rv = DIAG_ERR_TIMEOUT;
+		if (now < t_end) {
+			rv = diag_l3_waitqueue(d_l3_conn, (unsigned int) (t_end - now),
+			                       &l3i->rrx, kwp_sortrx);
+		}
+		if (rv == DIAG_ERR_TIMEOUT) {
+			fprintf(stderr, FLFMT "local id 0x%02X : ECU didn't confirm the stop\n", FL, lid);
+			return diag_iseterr(rv);
+		}
+		if (rv < 0) {
+			return diag_ifwderr(rv);
+		}
+	}
+}
+
+static struct kwp_ddli *kwp_findddli(struct l3_14230_int *l3i, uint8_t lid) {
+	struct kwp_ddli *dd;
+
+	LL_FOREACH(l3i->ddlis, dd) {
+		if (dd->lid == lid) {
+			return dd;
+		}
+	}
+	return NULL;
+}
+
+int diag_l3_iso14230_ddli_clear(struct diag_l3_conn *d_l3_conn, uint8_t lid) {
+	struct l3_14230_int *l3i = d_l3_conn->l3_int;
+	struct kwp_ddli *dd;
+	uint8_t data[3];
+
+	data[0] = DIAG_KW2K_SI_DDLI;
+	data[1] = lid;
+	data[2] = DIAG_KW2K_DM_CDDLI;
+
+	dd = kwp_findddli(l3i, lid);
+	if (dd) {
+		LL_DELETE(l3i->ddlis, dd);
+		free(dd);
+	}
+	return kwp_xfer(d_l3_conn, data, sizeof(data), NULL);
+}
+
+/*
+ * One request per element : every ECU accepts that, while only some take
+ * several definitions in one request. It is only done once per log anyway.
+ */
+int diag_l3_iso14230_ddli_define(struct diag_l3_conn *d_l3_conn, uint8_t lid,
+                                 const struct diag_kwp_ddli_elem *elems, unsigned int n) {
+	struct l3_14230_int *l3i = d_l3_conn->l3_int;
+	struct kwp_ddli *dd;
+	unsigned int i, pos;
+	int rv;
+
+	if ((n == 0) || (n > DIAG_KWP_DDLI_MAXELEMS)) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+
+	/* The ECU appends to an existing definition, and may still hold one
+	 * from a previous session : start from scratch. Clearing an undefined
+	 * local id can be refused, that's fine.
+	 */
+	rv = diag_l3_iso14230_ddli_clear(d_l3_conn, lid);
+	if ((rv < 0) && (rv != DIAG_ERR_ECUSAIDNO)) {
+		return rv;
+	}
+
+	for (i = 0, pos = 1; i < n; i++) {
+		uint8_t data[8];
+		unsigned int len = 5;
+
+		if ((elems[i].size == 0) || (pos + elems[i].size > 0x100)) {
+			return diag_iseterr(DIAG_ERR_BADVAL);
+		}
+		data[0] = DIAG_KW2K_SI_DDLI;
+		data[1] = lid;
+		data[2] = elems[i].mode;
+		data[3] = (uint8_t) pos;
+		data[4] = elems[i].size;
+		switch (elems[i].mode) {
+		case DIAG_KW2K_DM_DBLI:
+			data[len++] = (uint8_t) elems[i].src;
+			data[len++] = elems[i].pos;
+			break;
+		case DIAG_KW2K_DM_DBCI:
+			data[len++] = (uint8_t) (elems[i].src >> 8);
+			data[len++] = (uint8_t) elems[i].src;
+			data[len++] = elems[i].pos;
+			break;
+		case DIAG_KW2K_DM_DBMA:
+			data[len++] = (uint8_t) (elems[i].src >> 16);
+			data[len++] = (uint8_t) (elems[i].src >> 8);
+			data[len++] = (uint8_t) elems[i].src;
+			break;
+		default:
+			return diag_iseterr(DIAG_ERR_BADVAL);
+		}
+
+		rv = kwp_xfer(d_l3_conn, data, len, NULL);
+		if (rv < 0) {
+			return rv;
+		}
+		pos += elems[i].size;
+	}
+
+	rv = diag_calloc(&dd, 1);
+	if (rv) {
+		return diag_ifwderr(rv);
+	}
+	dd->lid = lid;
+	dd->n = n;
+	memcpy(dd->elems, elems, n * sizeof(*elems));
+	LL_PREPEND(l3i->ddlis, dd);
+
+	return 0;
+}
+
+unsigned int diag_l3_iso14230_ddli_get(struct diag_l3_conn *d_l3_conn, uint8_t lid,
+                                       const struct diag_kwp_ddli_elem **elems) {
+	struct kwp_ddli *dd;
+
+	dd = kwp_findddli(d_l3_conn->l3_int, lid);
+	if (dd == NULL) {
+		return 0;
+	}
+	*elems = dd->elems;
+	return dd->n;
+}
+
+
+int diag_l3_iso14230_readlid(struct diag_l3_conn *d_l3_conn, uint8_t lid, uint8_t tm,
+                             uint8_t *out, unsigned int buflen) {
+	struct diag_msg *rxmsg;
+	uint8_t data[3];
+	unsigned int len;
+	int rv;
+
+	if ((tm < DIAG_KW2K_TM_SINGLE) || (tm > DIAG_KW2K_TM_STOP)) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+
+	/* transmissionMode is optional, and some ECUs refuse it : only send
+	 * it when it matters.
+	 */
+	data[0] = DIAG_KW2K_SI_RDDBLI;
+	data[1] = lid;
+	data[2] = tm;
+	rv = kwp_xfer(d_l3_conn, data, (tm == DIAG_KW2K_TM_SINGLE)? 2:3, &rxmsg);
+	if (rv < 0) {
+		return rv;
+	}
+
+	if (tm == DIAG_KW2K_TM_STOP) {
+		return kwp_waitstop(d_l3_conn, lid, rxmsg);
+	}
+
+	if ((rxmsg->len < 2) || (rxmsg->data[1] != lid)) {
+		fprintf(stderr, FLFMT "local id 0x%02X : bad response\n", FL, lid);
+		diag_freemsg(rxmsg);
+		return diag_iseterr(DIAG_ERR_BADDATA);
+	}
+
+	len = rxmsg->len - 2;
+	memcpy(out, &rxmsg->data[2], MIN(len, buflen));
+	diag_freemsg(rxmsg);
+
+	return (int) len;
+}
+
+int diag_l3_iso14230_recvrecord(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
+                                uint8_t *lid, uint8_t *out, unsigned int buflen) {
+	struct l3_14230_int *l3i = d_l3_conn->l3_int;
+	struct diag_msg *rmsg;
+	unsigned int len;
+	int rv;
+
+	rv = diag_l3_waitqueue(d_l3_conn, timeout, &l3i->rrx, kwp_sortrx);
+	if (rv < 0) {
+		return rv;
+	}
+
+	rmsg = l3i->rrx;
+	LL_DELETE(l3i->rrx, rmsg);
+	rmsg->next = NULL;
+
+	*lid = rmsg->data[1];
+	len = rmsg->len - 2;
+	memcpy(out, &rmsg->data[2], MIN(len, buflen));
+	diag_freemsg(rmsg);
+
+	return (int) len;
+}
+
+
+uint8_t diag_l3_iso14230_lastnrc(struct diag_l3_conn *d_l3_conn) {
+	struct l3_14230_int *l3i = d_l3_conn->l3_int;
+
+	return l3i->nrc;
+}
+
+const char *diag_l3_iso14230_nrcstr(uint8_t nrc) {
+	return l3_iso14230_neglookup(nrc);
+}
+
+
+int diag_l3_iso14230_colbuf_new(struct diag_l3_conn *d_l3_conn, uint8_t lid,
+                                unsigned int maxrows, struct diag_kwp_colbuf **cbp) {
+	struct kwp_ddli *dd;
+	struct diag_kwp_colbuf *cb;
+	unsigned int i;
+	int rv;
+
+	dd = kwp_findddli(d_l3_conn->l3_int, lid);
+	if ((dd == NULL) || (maxrows == 0)) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+
+	rv = diag_calloc(&cb, 1);
+	if (rv) {
+		return diag_ifwderr(rv);
+	}
+	rv = diag_calloc(&cb->t, maxrows);
+	if (rv == 0) {
+		rv = diag_calloc(&cb->vals, dd->n * maxrows);
+	}
+	if (rv) {
+		diag_l3_iso14230_colbuf_del(cb);
+		return diag_ifwderr(rv);
+	}
+
+	cb->ncols = dd->n;
+	cb->maxrows = maxrows;
+	for (i = 0; i < dd->n; i++) {
+		cb->width[i] = dd->elems[i].size;
+	}
+
+	*cbp = cb;
+	return 0;
+}
+
+void diag_l3_iso14230_colbuf_del(struct diag_kwp_colbuf *cb) {
+	if (cb == NULL) {
+		return;
+	}
+	free(cb->t);
+	free(cb->vals);
+	free(cb);
+}
+
+int diag_l3_iso14230_colbuf_add(struct diag_kwp_colbuf *cb, const uint8_t *rec,
+                                unsigned int len, unsigned long t) {
+	unsigned int c, i, off;
+
+	if (cb->nrows >= cb->maxrows) {
+		return DIAG_ERR_GENERAL;
+	}
+
+	for (c = 0, off = 0; c < cb->ncols; c++) {
+		uint32_t v = 0;
+
+		if (off + cb->width[c] > len) {
+			return DIAG_ERR_BADLEN;
+		}
+		for (i = 0; i < cb->width[c]; i++) {
+			v = (v << 8) | rec[off++];
+		}
+		cb->vals[c * cb->maxrows + cb->nrows] = v;
+	}
+	cb->t[cb->nrows] = t;
+	cb->nrows++;
+
+	return 0;
+}
+
+
+static int diag_l3_iso14230_start(struct diag_l3_conn *d_l3_conn) {
+	struct l3_14230_int *l3i;
+	int rv;
+
+	assert(d_l3_conn != NULL);
+
+	rv = diag_calloc(&l3i, 1);
+	if (rv) {
+		return diag_ifwderr(rv);
+	}
+	d_l3_conn->l3_int = l3i;
+	return 0;
+}
+
+static int diag_l3_iso14230_stop(struct diag_l3_conn *d_l3_conn) {
+	struct l3_14230_int *l3i = d_l3_conn->l3_int;
+	struct kwp_ddli *dd, *tmp;
+
+	LL_FOREACH_SAFE(l3i->ddlis, dd, tmp) {
+		LL_DELETE(l3i->ddlis, dd);
+		free(dd);
+	}
+	diag_freemsg(l3i->rrx);
+	free(l3i);
+	d_l3_conn->l3_int = NULL;
+	return 0;
+}
+
+
 /*
  * Table of english descriptions of the ISO14230 SIDs
  */
@@ -339,8 +732,8 @@ static const char *l3_iso14230_neglookup(const int id) {
 
 const struct diag_l3_proto diag_l3_iso14230 = {
 	"ISO14230",
-	diag_l3_base_start,
-	diag_l3_base_stop,
+	diag_l3_iso14230_start,
+	diag_l3_iso14230_stop,
 	diag_l3_iso14230_send,
 	diag_l3_iso14230_recv,
 	NULL,   //ioctl
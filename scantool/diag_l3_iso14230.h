@@ -34,6 +34,97 @@ extern "C" {
 // changes (SID 83, AccessTimingParameter) to modify P3. But by default they
 // should be configured to accept 55 ms < P3 < 5000 ms
 
+#include <stdint.h>
+
+struct diag_l3_conn;
+
+/* Dynamically defined local identifiers (SID 0x2C) : many signals packed in
+ * one record, read in a single request or streamed by the ECU with a
+ * repeated transmissionMode.
+ */
+#define DIAG_KWP_DDLI_MAXELEMS  32
+
+/** One element of a dynamically defined local id : <size> bytes, taken from
+ * byte <pos> (1-based) of the record of local id or common id <src>, or from
+ * memory address <src>.
+ */
+struct diag_kwp_ddli_elem {
+	uint8_t mode;   /* DIAG_KW2K_DM_DBLI, _DBCI or _DBMA */
+	uint8_t pos;    /* unused for _DBMA */
+	uint8_t size;
+	uint32_t src;
+};
+
+/** Column buffer of decoded records : one column per element of the
+ * definition, values are the element bytes read big-endian (elements larger
+ * than 4 bytes keep their last 4 bytes). Rows are appended in reception
+ * order, up to maxrows.
+ */
+struct diag_kwp_colbuf {
+	unsigned int ncols;
+	unsigned int maxrows;
+	unsigned int nrows;
+	uint8_t width[DIAG_KWP_DDLI_MAXELEMS];  /* bytes per column */
+	unsigned long *t;       /* [maxrows] : reception time (ms) of each row */
+	uint32_t *vals;         /* [ncols * maxrows] : row r of column c is vals[c * maxrows + r] */
+};
+
+/* The request functions below ret 0 (or the record length, for reads) if ok,
+ * <0 on error : DIAG_ERR_ECUSAIDNO if the ECU sent a negative response, see
+ * diag_l3_iso14230_lastnrc().
+ */
+
+/** Define local id <lid> as the concatenation of the <n> elements, in order.
+ * Any previous definition of <lid> is cleared first.
+ */
+int diag_l3_iso14230_ddli_define(struct diag_l3_conn *d_l3_conn, uint8_t lid,
+                                 const struct diag_kwp_ddli_elem *elems, unsigned int n);
+
+/** Clear a dynamically defined local id. */
+int diag_l3_iso14230_ddli_clear(struct diag_l3_conn *d_l3_conn, uint8_t lid);
+
+/** readDataByLocalId with transmissionMode <tm> (DIAG_KW2K_TM_*).
+ * _SINGLE reads one record; _SLOW, _MEDIUM and _FAST start repeated
+ * transmission and return the first record (get the next ones with
+ * diag_l3_iso14230_recvrecord()); _STOP stops it and ret 0.
+ * Copies up to <buflen> bytes of the record to <out>.
+ * @return record length (may be larger than buflen), <0 on error.
+ */
+int diag_l3_iso14230_readlid(struct diag_l3_conn *d_l3_conn, uint8_t lid, uint8_t tm,
+                             uint8_t *out, unsigned int buflen);
+
+/** Wait up to <timeout> ms for one repeated record.
+ * @return record length, DIAG_ERR_TIMEOUT if none, other <0 on error.
+ */
+int diag_l3_iso14230_recvrecord(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
+                                uint8_t *lid, uint8_t *out, unsigned int buflen);
+
+/** @return NRC of the last negative response, 0 if none. */
+uint8_t diag_l3_iso14230_lastnrc(struct diag_l3_conn *d_l3_conn);
+
+/** @return english description of a NRC */
+const char *diag_l3_iso14230_nrcstr(uint8_t nrc);
+
+/** Get the definition of a local id defined with diag_l3_iso14230_ddli_define().
+ * @return number of elements, 0 if <lid> wasn't defined on this connection.
+ */
+unsigned int diag_l3_iso14230_ddli_get(struct diag_l3_conn *d_l3_conn, uint8_t lid,
+                                       const struct diag_kwp_ddli_elem **elems);
+
+/** Alloc a column buffer for <maxrows> records of local id <lid>, which must
+ * have been defined on this connection. Free with diag_l3_iso14230_colbuf_del().
+ */
+int diag_l3_iso14230_colbuf_new(struct diag_l3_conn *d_l3_conn, uint8_t lid,
+                                unsigned int maxrows, struct diag_kwp_colbuf **cbp);
+void diag_l3_iso14230_colbuf_del(struct diag_kwp_colbuf *cb);
+
+/** Decode one record (as returned by _readlid or _recvrecord) as a new row.
+ * @return 0 if ok, DIAG_ERR_BADLEN if the record is too short for the
+ * definition, DIAG_ERR_GENERAL if the buffer is full.
+ */
+int diag_l3_iso14230_colbuf_add(struct diag_kwp_colbuf *cb, const uint8_t *rec,
+                                unsigned int len, unsigned long t);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -61,7 +61,7 @@ struct l3_j1979_int {
  * Get this wrong and all will fail, it's used to frame the incoming messages
  * properly
  */
-static int diag_l3_j1979_getlen(uint8_t *data, int len) {
+int diag_l3_j1979_getlen(uint8_t *data, int len) {
 	static const int rqst_lengths[] = { -1, 2, 3, 1, 1, 2, 2, 1, 7, 2 };
 	int rv;
 	uint8_t mode;
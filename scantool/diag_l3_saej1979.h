@@ -27,8 +27,15 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 #define J1979_KEEPALIVE 3500            //ms timeout between keepalive messages on OBD bus
 
+/** Return expected length of a J1979 message; see diag_l3_saej1979.c.
+ * Exported for the benchmarks only.
+ */
+int diag_l3_j1979_getlen(uint8_t *data, int len);
+
 #if defined(__cplusplus)
 }
 #endif
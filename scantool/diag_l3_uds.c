@@ -0,0 +1,544 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * L3, ISO 14229-1 Unified Diagnostic Services (UDS)
+ *
+ * L2 (ISO15765 on CAN) does segmentation and handles "responsePending"
+ * negative responses; this layer checks responses, keeps the session alive
+ * with TesterPresent, and implements DynamicallyDefineDataIdentifier and
+ * ReadDataByPeriodicIdentifier.
+ *
+ * Periodic records are expected in the "type 1" format, i.e. on the
+ * normal response identifier : 6A <pDID> <data...>, one single frame each.
+ * They can arrive while waiting for the response to another request; they
+ * are then kept for diag_l3_uds_periodic_recv().
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_l2.h"
+#include "diag_l3.h"
+#include "diag_l3_uds.h"
+
+#include "utlist.h"
+
+/* A DID we defined on this connection */
+struct uds_dddi {
+	uint16_t did;
+	unsigned int n;
+	struct diag_uds_dddi_elem elems[UDS_DDDI_MAXELEMS];
+	struct uds_dddi *next;
+};
+
+struct l3_uds_int {
+	uint8_t session;
+	uint8_t nrc;            /* from the last negative response */
+	struct uds_dddi *dddis;
+	struct diag_msg *prx;   /* periodic records not read yet */
+};
+
+
+static bool uds_isperiodic(const struct diag_msg *msg) {
+	return (msg->len >= 2) && (msg->data[0] == (UDS_SID_RDBPI | UDS_SID_POSRESP));
+}
+
+/* Move periodic records from the <rxmsg> chain to the periodic queue;
+ * ret what's left.
+ */
+static struct diag_msg *uds_sortrx(struct diag_l3_conn *d_l3_conn, struct diag_msg *rxmsg) {
+	struct l3_uds_int *l3u = d_l3_conn->l3_int;
+	struct diag_msg *tmsg, *tmp;
+
+	LL_FOREACH_SAFE(rxmsg, tmsg, tmp) {
+		if (uds_isperiodic(tmsg)) {
+			LL_DELETE(rxmsg, tmsg);
+			tmsg->next = NULL;
+			LL_APPEND(l3u->prx, tmsg);
+		}
+	}
+	return rxmsg;
+}
+
+
+static int diag_l3_uds_send(struct diag_l3_conn *d_l3_conn, struct diag_msg *msg) {
+	int rv;
+
+	DIAG_DBGMDATA(diag_l3_debug, DIAG_DEBUG_WRITE, DIAG_DBGLEVEL_V,
+	              msg->data, (size_t)msg->len,
+	              FLFMT "_send %u bytes; ", FL, msg->len);
+
+	rv = diag_l2_send(d_l3_conn->d_l3l2_conn, msg);
+	return rv? diag_ifwderr(rv):0;
+}
+
+static int diag_l3_uds_recv(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
+                            void (* rcv_call_back)(void *handle,struct diag_msg *), void *handle) {
+	int rv;
+
+	rv = diag_l2_recv(d_l3_conn->d_l3l2_conn, timeout, rcv_call_back, handle);
+	if (rv == DIAG_ERR_TIMEOUT) {
+		return rv;
+	}
+	return rv? diag_ifwderr(rv):0;
+}
+
+/*
+ * Send a request and return the response, positive or negative. Periodic
+ * records that come first are queued, and we keep waiting for the response.
+ */
+static struct diag_msg *diag_l3_uds_request(struct diag_l3_conn *d_l3_conn,
+                                            struct diag_msg *txmsg, int *errval) {
+	struct diag_l2_conn *d_l2_conn = d_l3_conn->d_l3l2_conn;
+	struct diag_msg *rxmsg;
+	unsigned int timeout;
+
+	*errval = 0;
+
+	rxmsg = diag_l2_request(d_l2_conn, txmsg, errval);
+	if (rxmsg == NULL) {
+		return diag_pfwderr(*errval);
+	}
+
+	timeout = d_l2_conn->diag_l2_p2max + RXTOFFSET;
+	while ((rxmsg = uds_sortrx(d_l3_conn, rxmsg)) == NULL) {
+		int rv;
+
+		rv = diag_l2_recv(d_l2_conn, timeout, diag_l3_dupcallback, &rxmsg);
+		if (rv < 0) {
+			*errval = rv;
+			return diag_pfwderr(rv);
+		}
+		if (rxmsg && (rxmsg->len == 3) && (rxmsg->data[0] == UDS_SID_NR) &&
+		    (rxmsg->data[2] == UDS_NRC_RCRRP)) {
+			diag_freemsg(rxmsg);
+			rxmsg = NULL;
+			timeout = d_l2_conn->diag_l2_p2emax + RXTOFFSET;
+		}
+	}
+
+	d_l3_conn->timer = diag_os_getms();
+	return rxmsg;
+}
+
+/*
+ * Send <len> bytes and check the response against the request SID.
+ * ret 0 and the response in *resp (caller must free) if positive;
+ * DIAG_ERR_ECUSAIDNO with l3u->nrc set if negative.
+ */
+static int uds_xfer(struct diag_l3_conn *d_l3_conn, uint8_t *data, unsigned int len,
+                    struct diag_msg **resp) {
+	struct l3_uds_int *l3u = d_l3_conn->l3_int;
+
+	return diag_l3_xfer(d_l3_conn, data, len, resp, NULL, &l3u->nrc);
+}
+
+
+int diag_l3_uds_session(struct diag_l3_conn *d_l3_conn, uint8_t session) {
+	struct l3_uds_int *l3u = d_l3_conn->l3_int;
+	struct diag_msg *rxmsg;
+	uint8_t data[2];
+	int rv;
+
+	data[0] = UDS_SID_DSC;
+	data[1] = session;
+	rv = uds_xfer(d_l3_conn, data, sizeof(data), &rxmsg);
+	if (rv < 0) {
+		return rv;
+	}
+
+	if (rxmsg->len >= 6) {
+		DIAG_DBGM(diag_l3_debug, DIAG_DEBUG_PROTO, DIAG_DBGLEVEL_V,
+		          FLFMT "session 0x%02X : P2server %u ms, P2*server %u ms\n",
+		          FL, session, (rxmsg->data[2] << 8) | rxmsg->data[3],
+		          ((rxmsg->data[4] << 8) | rxmsg->data[5]) * 10);
+	}
+	diag_freemsg(rxmsg);
+
+	/* The ECU drops dynamic definitions when changing sessions. */
+	while (l3u->dddis) {
+		struct uds_dddi *dd = l3u->dddis;
+		LL_DELETE(l3u->dddis, dd);
+		free(dd);
+	}
+	l3u->session = session;
+	return 0;
+}
+
+
+int diag_l3_uds_readdid(struct diag_l3_conn *d_l3_conn, uint16_t did,
+                        uint8_t *out, unsigned int buflen) {
+	struct diag_msg *rxmsg;
+	uint8_t data[3];
+	unsigned int len;
+	int rv;
+
+	data[0] = UDS_SID_RDBI;
+	data[1] = (uint8_t) (did >> 8);
+	data[2] = (uint8_t) did;
+	rv = uds_xfer(d_l3_conn, data, sizeof(data), &rxmsg);
+	if (rv < 0) {
+		return rv;
+	}
+
+	if ((rxmsg->len < 3) || (rxmsg->data[1] != data[1]) || (rxmsg->data[2] != data[2])) {
+		fprintf(stderr, FLFMT "DID 0x%04X : bad response\n", FL, did);
+		diag_freemsg(rxmsg);
+		return diag_iseterr(DIAG_ERR_BADDATA);
+	}
+
+	len = rxmsg->len - 3;
+	memcpy(out, &rxmsg->data[3], MIN(len, buflen));
+	diag_freemsg(rxmsg);
+
+	return (int) len;
+}
+
+
+static struct uds_dddi *uds_finddddi(struct l3_uds_int *l3u, uint16_t did) {
+	struct uds_dddi *dd;
+
+	LL_FOREACH(l3u->dddis, dd) {
+		if (dd->did == did) {
+			return dd;
+		}
+	}
+	return NULL;
+}
+
+int diag_l3_uds_dddi_clear(struct diag_l3_conn *d_l3_conn, uint16_t did) {
+	struct l3_uds_int *l3u = d_l3_conn->l3_int;
+	struct uds_dddi *dd;
+	uint8_t data[4];
+	int rv;
+
+	data[0] = UDS_SID_DDDI;
+	data[1] = UDS_DDDI_CLEAR;
+	data[2] = (uint8_t) (did >> 8);
+	data[3] = (uint8_t) did;
+	rv = uds_xfer(d_l3_conn, data, sizeof(data), NULL);
+
+	dd = uds_finddddi(l3u, did);
+	if (dd) {
+		LL_DELETE(l3u->dddis, dd);
+		free(dd);
+	}
+	return rv;
+}
+
+int diag_l3_uds_dddi_define(struct diag_l3_conn *d_l3_conn, uint16_t did,
+                            const struct diag_uds_dddi_elem *elems, unsigned int n) {
+	struct l3_uds_int *l3u = d_l3_conn->l3_int;
+	struct uds_dddi *dd;
+	uint8_t data[4 + 4 * UDS_DDDI_MAXELEMS];
+	unsigned int i, len;
+	int rv;
+
+	if ((n == 0) || (n > UDS_DDDI_MAXELEMS)) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+
+	/* A new definition of an existing DID is appended to the old one. */
+	if (uds_finddddi(l3u, did)) {
+		rv = diag_l3_uds_dddi_clear(d_l3_conn, did);
+		if (rv < 0) {
+			return rv;
+		}
+	}
+
+	data[0] = UDS_SID_DDDI;
+	data[1] = UDS_DDDI_BYID;
+	data[2] = (uint8_t) (did >> 8);
+	data[3] = (uint8_t) did;
+	for (i = 0, len = 4; i < n; i++) {
+		data[len++] = (uint8_t) (elems[i].srcdid >> 8);
+		data[len++] = (uint8_t) elems[i].srcdid;
+		data[len++] = elems[i].pos;
+		data[len++] = elems[i].size;
+	}
+
+	rv = uds_xfer(d_l3_conn, data, len, NULL);
+	if (rv < 0) {
+		return rv;
+	}
+
+	rv = diag_calloc(&dd, 1);
+	if (rv) {
+		return diag_ifwderr(rv);
+	}
+	dd->did = did;
+	dd->n = n;
+	memcpy(dd->elems, elems, n * sizeof(*elems));
+	LL_PREPEND(l3u->dddis, dd);
+
+	return 0;
+}
+
+unsigned int diag_l3_uds_dddi_get(struct diag_l3_conn *d_l3_conn, uint16_t did,
+                                  const struct diag_uds_dddi_elem **elems) {
+	struct uds_dddi *dd;
+
+	dd = uds_finddddi(d_l3_conn->l3_int, did);
+	if (dd == NULL) {
+		return 0;
+	}
+	*elems = dd->elems;
+	return dd->n;
+}
+
+
+int diag_l3_uds_periodic(struct diag_l3_conn *d_l3_conn, uint8_t mode,
+                         const uint16_t *dids, unsigned int n) {
+	struct l3_uds_int *l3u = d_l3_conn->l3_int;
+	uint8_t data[2 + 0x100];
+	unsigned int i;
+	int rv;
+
+	if ((mode < UDS_PERIODIC_SLOW) || (mode > UDS_PERIODIC_STOP) ||
+	    (n > 0x100) || ((n == 0) && (mode != UDS_PERIODIC_STOP))) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+
+	data[0] = UDS_SID_RDBPI;
+	data[1] = mode;
+	for (i = 0; i < n; i++) {
+		if ((dids[i] & UDS_PDID_MASK) != UDS_PDID_BASE) {
+			fprintf(stderr, FLFMT "DID 0x%04X can't be read periodically\n", FL, dids[i]);
+			return diag_iseterr(DIAG_ERR_BADVAL);
+		}
+		data[2 + i] = (uint8_t) dids[i];
+	}
+
+	rv = uds_xfer(d_l3_conn, data, 2 + n, NULL);
+	if ((rv == 0) && (mode == UDS_PERIODIC_STOP)) {
+		/* records sent before the ECU stopped are stale now */
+		diag_freemsg(l3u->prx);
+		l3u->prx = NULL;
+	}
+	return rv;
+}
+
+int diag_l3_uds_periodic_recv(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
+                              uint16_t *did, uint8_t *out, unsigned int buflen) {
+	struct l3_uds_int *l3u = d_l3_conn->l3_int;
+	struct diag_msg *pmsg;
+	unsigned int len;
+	int rv;
+
+	rv = diag_l3_waitqueue(d_l3_conn, timeout, &l3u->prx, uds_sortrx);
+	if (rv < 0) {
+		return rv;
+	}
+
+	pmsg = l3u->prx;
+	LL_DELETE(l3u->prx, pmsg);
+	pmsg->next = NULL;
+
+	*did = UDS_PDID_BASE | pmsg->data[1];
+	len = pmsg->len - 2;
+	memcpy(out, &pmsg->data[2], MIN(len, buflen));
+	diag_freemsg(pmsg);
+
+	return (int) len;
+}
+
+
+uint8_t diag_l3_uds_lastnrc(struct diag_l3_conn *d_l3_conn) {
+	struct l3_uds_int *l3u = d_l3_conn->l3_int;
+
+	return l3u->nrc;
+}
+
+
+/* TesterPresent with "no response" keeps a non-default session alive */
+static int diag_l3_uds_timer(struct diag_l3_conn *d_l3_conn, unsigned long ms) {
+	struct l3_uds_int *l3u = d_l3_conn->l3_int;
+	uint8_t data[] = { UDS_SID_TP, UDS_SPRMIB };
+	struct diag_msg msg = {0};
+	int rv;
+
+	if ((ms < UDS_KEEPALIVE) || (l3u->session == UDS_SESSION_DEFAULT)) {
+		return 0;
+	}
+	if (d_l3_conn->d_l3l2_flags & DIAG_L2_FLAG_KEEPALIVE) {
+		return 0;
+	}
+
+	DIAG_DBGM(diag_l3_debug, DIAG_DEBUG_TIMER, DIAG_DBGLEVEL_V,
+	          FLFMT "TesterPresent, %lu ms since last request\n", FL, ms);
+
+	msg.data = data;
+	msg.len = sizeof(data);
+	rv = diag_l2_send(d_l3_conn->d_l3l2_conn, &msg);
+	if (rv < 0) {
+		fprintf(stderr, FLFMT "UDS keepalive failed ! Try to disconnect and reconnect.\n", FL);
+		return rv;
+	}
+	d_l3_conn->timer = diag_os_getms();
+	return 0;
+}
+
+
+/* _start : a TesterPresent request checks the ECU answers UDS. */
+static int diag_l3_uds_start(struct diag_l3_conn *d_l3_conn) {
+	struct l3_uds_int *l3u;
+	uint8_t data[] = { UDS_SID_TP, 0 };
+	int rv;
+
+	assert(d_l3_conn != NULL);
+
+	rv = diag_calloc(&l3u, 1);
+	if (rv) {
+		return diag_ifwderr(rv);
+	}
+	l3u->session = UDS_SESSION_DEFAULT;
+	d_l3_conn->l3_int = l3u;
+
+	rv = uds_xfer(d_l3_conn, data, sizeof(data), NULL);
+	if (rv < 0) {
+		fprintf(stderr, FLFMT "No TesterPresent response, ECU doesn't support UDS ?\n", FL);
+		free(l3u);
+		d_l3_conn->l3_int = NULL;
+		return diag_ifwderr(rv);
+	}
+
+	return 0;
+}
+
+static int diag_l3_uds_stop(struct diag_l3_conn *d_l3_conn) {
+	struct l3_uds_int *l3u = d_l3_conn->l3_int;
+	struct uds_dddi *dd, *tmp;
+
+	LL_FOREACH_SAFE(l3u->dddis, dd, tmp) {
+		LL_DELETE(l3u->dddis, dd);
+		free(dd);
+	}
+	diag_freemsg(l3u->prx);
+	free(l3u);
+	d_l3_conn->l3_int = NULL;
+	return 0;
+}
+
+
+static const struct {
+	const int id;
+	const char *service;
+} uds_sids[] = {
+	{UDS_SID_DSC,   "DiagnosticSessionControl"},
+	{UDS_SID_ER,    "ECUReset"},
+	{UDS_SID_CDTCI, "ClearDiagnosticInformation"},
+	{UDS_SID_RDTCI, "ReadDTCInformation"},
+	{UDS_SID_RDBI,  "ReadDataByIdentifier"},
+	{UDS_SID_RMBA,  "ReadMemoryByAddress"},
+	{UDS_SID_RSDBI, "ReadScalingDataByIdentifier"},
+	{UDS_SID_SA,    "SecurityAccess"},
+	{UDS_SID_CC,    "CommunicationControl"},
+	{UDS_SID_RDBPI, "ReadDataByPeriodicIdentifier"},
+	{UDS_SID_DDDI,  "DynamicallyDefineDataIdentifier"},
+	{UDS_SID_WDBI,  "WriteDataByIdentifier"},
+	{UDS_SID_IOCBI, "InputOutputControlByIdentifier"},
+	{UDS_SID_RC,    "RoutineControl"},
+	{UDS_SID_RD,    "RequestDownload"},
+	{UDS_SID_RU,    "RequestUpload"},
+	{UDS_SID_TD,    "TransferData"},
+	{UDS_SID_RTE,   "RequestTransferExit"},
+	{UDS_SID_WMBA,  "WriteMemoryByAddress"},
+	{UDS_SID_TP,    "TesterPresent"},
+	{UDS_SID_CDTCS, "ControlDTCSetting"},
+};
+
+static const char *uds_sidlookup(const int id) {
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(uds_sids); i++) {
+		if (uds_sids[i].id == id) {
+			return uds_sids[i].service;
+		}
+	}
+	return "Unknown SID";
+}
+
+static const struct {
+	const uint8_t id;
+	const char *response;
+} uds_nrcs[] = {
+	{UDS_NRC_GR,            "generalReject"},
+	{UDS_NRC_SNS,           "serviceNotSupported"},
+	{UDS_NRC_SFNS,          "sub-functionNotSupported"},
+	{UDS_NRC_IMLOIF,        "incorrectMessageLengthOrInvalidFormat"},
+	{UDS_NRC_RTL,           "responseTooLong"},
+	{UDS_NRC_BRR,           "busyRepeatRequest"},
+	{UDS_NRC_CNC,           "conditionsNotCorrect"},
+	{UDS_NRC_RSE,           "requestSequenceError"},
+	{UDS_NRC_ROOR,          "requestOutOfRange"},
+	{UDS_NRC_SAD,           "securityAccessDenied"},
+	{UDS_NRC_IK,            "invalidKey"},
+	{UDS_NRC_ENOA,          "exceededNumberOfAttempts"},
+	{UDS_NRC_RTDNE,         "requiredTimeDelayNotExpired"},
+	{UDS_NRC_GPF,           "generalProgrammingFailure"},
+	{UDS_NRC_RCRRP,         "requestCorrectlyReceived-ResponsePending"},
+	{UDS_NRC_SFNSIAS,       "sub-functionNotSupportedInActiveSession"},
+	{UDS_NRC_SNSIAS,        "serviceNotSupportedInActiveSession"},
+};
+
+const char *diag_l3_uds_nrcstr(uint8_t nrc) {
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(uds_nrcs); i++) {
+		if (uds_nrcs[i].id == nrc) {
+			return uds_nrcs[i].response;
+		}
+	}
+	return "unknown NRC";
+}
+
+static void diag_l3_uds_decode(UNUSED(struct diag_l3_conn *d_l3_conn),
+                               struct diag_msg *msg, char *buf, const size_t bufsize) {
+	if (msg->len == 0) {
+		snprintf(buf, bufsize, "UDS empty message");
+	} else if ((msg->data[0] == UDS_SID_NR) && (msg->len >= 3)) {
+		snprintf(buf, bufsize, "UDS negative response, %s : %s",
+		         uds_sidlookup(msg->data[1]), diag_l3_uds_nrcstr(msg->data[2]));
+	} else if (msg->data[0] & UDS_SID_POSRESP) {
+		snprintf(buf, bufsize, "UDS response, %s",
+		         uds_sidlookup(msg->data[0] & ~UDS_SID_POSRESP));
+	} else {
+		snprintf(buf, bufsize, "UDS request, %s", uds_sidlookup(msg->data[0]));
+	}
+}
+
+
+const struct diag_l3_proto diag_l3_uds = {
+	"UDS",
+	diag_l3_uds_start,
+	diag_l3_uds_stop,
+	diag_l3_uds_send,
+	diag_l3_uds_recv,
+	NULL,   //ioctl
+	diag_l3_uds_request,
+	diag_l3_uds_decode,
+	diag_l3_uds_timer
+};
@@ -0,0 +1,174 @@
+#ifndef _DIAG_L3_UDS_H_
+#define _DIAG_L3_UDS_H_
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * L3, ISO 14229-1 Unified Diagnostic Services (UDS), normally over an
+ * ISO15765 (CAN) L2.
+ *
+ * Besides plain request / response, this provides the services used for
+ * fast logging : DynamicallyDefineDataIdentifier (0x2C) packs signals taken
+ * from several DIDs into one DID, that is then read in a single request, or
+ * sent periodically by the ECU with ReadDataByPeriodicIdentifier (0x2A).
+ */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct diag_l3_conn;
+
+/* Service identifiers; a positive response is SID | UDS_SID_POSRESP */
+#define UDS_SID_DSC     0x10    /* DiagnosticSessionControl */
+#define UDS_SID_ER      0x11    /* ECUReset */
+#define UDS_SID_CDTCI   0x14    /* ClearDiagnosticInformation */
+#define UDS_SID_RDTCI   0x19    /* ReadDTCInformation */
+#define UDS_SID_RDBI    0x22    /* ReadDataByIdentifier */
+#define UDS_SID_RMBA    0x23    /* ReadMemoryByAddress */
+#define UDS_SID_RSDBI   0x24    /* ReadScalingDataByIdentifier */
+#define UDS_SID_SA      0x27    /* SecurityAccess */
+#define UDS_SID_CC      0x28    /* CommunicationControl */
+#define UDS_SID_RDBPI   0x2A    /* ReadDataByPeriodicIdentifier */
+#define UDS_SID_DDDI    0x2C    /* DynamicallyDefineDataIdentifier */
+#define UDS_SID_WDBI    0x2E    /* WriteDataByIdentifier */
+#define UDS_SID_IOCBI   0x2F    /* InputOutputControlByIdentifier */
+#define UDS_SID_RC      0x31    /* RoutineControl */
+#define UDS_SID_RD      0x34    /* RequestDownload */
+#define UDS_SID_RU      0x35    /* RequestUpload */
+#define UDS_SID_TD      0x36    /* TransferData */
+#define UDS_SID_RTE     0x37    /* RequestTransferExit */
+#define UDS_SID_WMBA    0x3D    /* WriteMemoryByAddress */
+#define UDS_SID_TP      0x3E    /* TesterPresent */
+#define UDS_SID_CDTCS   0x85    /* ControlDTCSetting */
+#define UDS_SID_NR      0x7F    /* negative response : 7F <SID> <NRC> */
+#define UDS_SID_POSRESP 0x40
+
+#define UDS_SPRMIB      0x80    /* suppressPosRspMsgIndicationBit, in sub-function bytes */
+
+/* Negative response codes (NRC) */
+#define UDS_NRC_GR      0x10    /* generalReject */
+#define UDS_NRC_SNS     0x11    /* serviceNotSupported */
+#define UDS_NRC_SFNS    0x12    /* sub-functionNotSupported */
+#define UDS_NRC_IMLOIF  0x13    /* incorrectMessageLengthOrInvalidFormat */
+#define UDS_NRC_RTL     0x14    /* responseTooLong */
+#define UDS_NRC_BRR     0x21    /* busyRepeatRequest */
+#define UDS_NRC_CNC     0x22    /* conditionsNotCorrect */
+#define UDS_NRC_RSE     0x24    /* requestSequenceError */
+#define UDS_NRC_ROOR    0x31    /* requestOutOfRange */
+#define UDS_NRC_SAD     0x33    /* securityAccessDenied */
+#define UDS_NRC_IK      0x35    /* invalidKey */
+#define UDS_NRC_ENOA    0x36    /* exceededNumberOfAttempts */
+#define UDS_NRC_RTDNE   0x37    /* requiredTimeDelayNotExpired */
+#define UDS_NRC_GPF     0x72    /* generalProgrammingFailure */
+#define UDS_NRC_RCRRP   0x78    /* requestCorrectlyReceived-ResponsePending (handled by L2) */
+#define UDS_NRC_SFNSIAS 0x7E    /* sub-functionNotSupportedInActiveSession */
+#define UDS_NRC_SNSIAS  0x7F    /* serviceNotSupportedInActiveSession */
+
+/* DiagnosticSessionControl sessions */
+#define UDS_SESSION_DEFAULT     0x01
+#define UDS_SESSION_PROG        0x02
+#define UDS_SESSION_EXTENDED    0x03
+
+/* DynamicallyDefineDataIdentifier sub-functions */
+#define UDS_DDDI_BYID   0x01    /* defineByIdentifier */
+#define UDS_DDDI_BYMEM  0x02    /* defineByMemoryAddress */
+#define UDS_DDDI_CLEAR  0x03    /* clearDynamicallyDefinedDataIdentifier */
+
+/* ReadDataByPeriodicIdentifier transmission modes */
+#define UDS_PERIODIC_SLOW       0x01
+#define UDS_PERIODIC_MEDIUM     0x02
+#define UDS_PERIODIC_FAST       0x03
+#define UDS_PERIODIC_STOP       0x04
+
+/* Periodic DIDs are 0xF200-0xF2FF; only the low byte is sent. To be
+ * sent periodically, a dynamically defined DID must be in that range.
+ */
+#define UDS_PDID_BASE   0xF200
+#define UDS_PDID_MASK   0xFF00
+
+#define UDS_KEEPALIVE   2000    /* ms between TesterPresent outside the default session; S3server is 5000 */
+#define UDS_DDDI_MAXELEMS       32      /* source signals in one dynamically defined DID */
+
+/** One signal of a dynamically defined DID : <size> bytes from the record of
+ * <srcdid>, starting at (1-based) byte <pos>.
+ */
+struct diag_uds_dddi_elem {
+	uint16_t srcdid;
+	uint8_t pos;
+	uint8_t size;
+};
+
+/* All functions below ret 0 (or the record length, for reads) if ok, <0 on
+ * error; DIAG_ERR_ECUSAIDNO if the ECU sent a negative response, see
+ * diag_l3_uds_lastnrc().
+ */
+
+/** Switch to another diagnostic session (UDS_SESSION_*).
+ * Outside the default session, the L3 timer sends TesterPresent.
+ */
+int diag_l3_uds_session(struct diag_l3_conn *d_l3_conn, uint8_t session);
+
+/** ReadDataByIdentifier : copy up to <buflen> bytes of the record of <did> to
+ * <out>.
+ * @return record length (may be larger than buflen), <0 on error.
+ */
+int diag_l3_uds_readdid(struct diag_l3_conn *d_l3_conn, uint16_t did,
+                        uint8_t *out, unsigned int buflen);
+
+/** Define <did> as the concatenation of the <n> elements, in order.
+ * A DID that was already defined on this connection is cleared first.
+ */
+int diag_l3_uds_dddi_define(struct diag_l3_conn *d_l3_conn, uint16_t did,
+                            const struct diag_uds_dddi_elem *elems, unsigned int n);
+
+/** Clear one dynamically defined DID. */
+int diag_l3_uds_dddi_clear(struct diag_l3_conn *d_l3_conn, uint16_t did);
+
+/** Get the definition of a DID defined with diag_l3_uds_dddi_define().
+ * @return number of elements, 0 if <did> wasn't defined on this connection.
+ */
+unsigned int diag_l3_uds_dddi_get(struct diag_l3_conn *d_l3_conn, uint16_t did,
+                                  const struct diag_uds_dddi_elem **elems);
+
+/** ReadDataByPeriodicIdentifier : start (UDS_PERIODIC_SLOW..FAST) or stop
+ * (UDS_PERIODIC_STOP) periodic transmission of <n> DIDs (full 0xF2xx values).
+ * Stopping with n == 0 stops all of them.
+ */
+int diag_l3_uds_periodic(struct diag_l3_conn *d_l3_conn, uint8_t mode,
+                         const uint16_t *dids, unsigned int n);
+
+/** Wait up to <timeout> ms for one periodic record; store its DID in *did and
+ * up to <buflen> bytes of data in <out>.
+ * @return record length, DIAG_ERR_TIMEOUT if none, other <0 on error.
+ */
+int diag_l3_uds_periodic_recv(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
+                              uint16_t *did, uint8_t *out, unsigned int buflen);
+
+/** @return NRC of the last negative response, 0 if none. */
+uint8_t diag_l3_uds_lastnrc(struct diag_l3_conn *d_l3_conn);
+
+/** @return english description of a NRC */
+const char *diag_l3_uds_nrcstr(uint8_t nrc);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _DIAG_L3_UDS_H_ */
@@ -41,7 +41,7 @@ typedef DWORD OS_ERRTYPE;
 typedef int OS_ERRTYPE;
 #endif
 
-#define ALARM_TIMEOUT 300       // ms interval timeout for timer callbacks (keepalive etc)
+#define ALARM_TIMEOUT 300       // ms, max interval between timer callbacks (keepalive etc)
 
 /* Common prototypes but note that the source
  * is different and defined in OS specific
@@ -59,6 +59,72 @@ int diag_os_close(void);
  */
 void diag_os_millisleep(unsigned int ms);
 
+/** Microsecond sleep (blocking)
+ *
+ * Same as diag_os_sleepuntil(diag_os_gethrt() + diag_os_ushrt(us)).
+ * @param us requested delay
+ */
+void diag_os_usleep(unsigned long us);
+
+/** Sleep until an absolute deadline (blocking)
+ *
+ * @param deadline : diag_os_gethrt() timestamp; returns immediately if already passed.
+ * Build deadlines with diag_os_ushrt(), e.g.
+ * dl = diag_os_gethrt() + diag_os_ushrt(us) .
+ * Since the deadline is absolute, a sequence of waits (inter-byte gaps etc)
+ * doesn't accumulate the overhead of the code between the waits.
+ * If enabled with diag_os_setspin(), the last part of the wait is a busy
+ * loop, to cancel the OS wakeup latency measured by diag_os_calibrate().
+ */
+void diag_os_sleepuntil(unsigned long long deadline);
+
+/** Convert microseconds to diag_os_gethrt() units.
+ *
+ * Inverse of diag_os_hrtus().
+ */
+unsigned long long diag_os_ushrt(unsigned long us);
+
+/** Enable / disable the busy-wait tail of diag_os_sleepuntil().
+ *
+ * Disabled by default; this trades CPU time for accuracy.
+ * @return spin duration used, in us.
+ */
+unsigned long diag_os_setspin(bool enable);
+
+/** Wake the periodic service (L2/L3 timers) now.
+ *
+ * The service normally sleeps until the next keepalive is due, as
+ * reported by diag_l2_timer(); call this after changing a connection's
+ * keepalive interval so the new deadline is taken into account.
+ */
+void diag_os_periodic_wake(void);
+
+/** Real-time settings for the bus I/O path, see diag_os_rt_setup() */
+struct diag_os_rtcfg {
+	int prio;       //SCHED_FIFO priority; <= 0 : disabled
+	int cpu;        //CPU to pin RT threads to; -1 : no pinning
+};
+
+/** Enable real-time scheduling for the bus I/O path.
+ *
+ * Must be called before diag_init(), with enough privileges (root, or
+ * CAP_SYS_NICE). This allows the process to use cfg->prio, then drops
+ * root privileges (to $SUDO_UID / $SUDO_GID if set, otherwise the real uid).
+ * Fails rather than keep running as root if that would be uid 0.
+ * Afterwards, only threads between diag_os_rt_enter() and diag_os_rt_leave()
+ * (L2 calls, the periodic service thread) run at RT priority, on the chosen CPU,
+ * with a pre-faulted and locked stack; the CLI etc keep normal scheduling.
+ * @return 0 if ok
+ */
+int diag_os_rt_setup(const struct diag_os_rtcfg *cfg);
+
+/** Switch the calling thread to / from the RT settings.
+ *
+ * Calls can be nested; no-op if RT wasn't set up.
+ */
+void diag_os_rt_enter(void);
+void diag_os_rt_leave(void);
+
 /** Check if a key was pressed
  *
  * @return 0 if no key was pressed
@@ -75,6 +141,14 @@ int diag_os_ipending(void);
  */
 void diag_os_calibrate(void);
 
+/** Force a new clock discovery + calibration.
+ *
+ * diag_os_init() normally reuses the results cached from a previous run
+ * on the same machine (unix); this discards them and measures again.
+ * Best done with no connections open.
+ */
+void diag_os_recalibrate(void);
+
 /** Return OS-specific error message
  *
  * @return error string or empty string if not found.
@@ -150,6 +224,22 @@ bool diag_os_trylock(diag_mtx *mtx);
 /** unlock mutex */
 void diag_os_unlock(diag_mtx *mtx);
 
+/* thread wrapper stuff; same backends as the mutexes. */
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+typedef HANDLE diag_thread;
+#else
+typedef pthread_t diag_thread;
+#endif
+
+/** Start a new thread running fn(arg).
+ *
+ * @return 0 if ok; the thread must then be reaped with diag_os_thread_join().
+ */
+int diag_os_thread_start(diag_thread *thr, void *(*fn)(void *), void *arg);
+
+/** Wait for a thread started with diag_os_thread_start() to finish. */
+void diag_os_thread_join(diag_thread *thr);
+
 /** move the console cursor up the specified number of lines and to column 1 */
 void diag_os_cursor_up(unsigned int lines);
 
@@ -38,13 +38,20 @@
  *	(4)	EINTR handling code belongs inside diag_os* and diag_tty* functions only,
  *		to provide a clean OS-independant API to upper levels.
  *
+ * The periodic callbacks (L2/L3 timers, keepalives) run in a dedicated
+ * service thread that sleeps on a condition variable until the next
+ * deadline, or until woken by diag_os_periodic_wake(). No signals are
+ * involved, so the timers are free to use any function, and they don't
+ * interrupt blocking syscalls elsewhere in the program.
+ *
  * Goals : if _POSIX_TIMERS is defined, we attempt to use:
- *		1- POSIX timer_create() mechanisms for the periodic callbacks
+ *		1- a monotonic clock for the service thread deadlines
  *		2- POSIX clock_gettime(), using best available clockid, for _getms() and _gethrt()
  *		3- clock_nanosleep(), using best available clockid, for _millisleep()
+ *		   and (with TIMER_ABSTIME) _sleepuntil()
  *
  * Fallbacks for above:
- *		1- SIGALRM signal handler
+ *		1- CLOCK_REALTIME / gettimeofday() deadlines
  *		2- gettimeofday(), yuck. TODO : OSX specific mach_absolute_time()
  *		3a- (linux): /dev/rtc trick
  *		3b- (other): nanosleep()
@@ -54,8 +61,14 @@
  */
 
 
+#ifdef __linux__
+	#define _GNU_SOURCE     //pthread_setaffinity_np(), cpu_set_t
+#endif
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -63,9 +76,11 @@
 #include "diag_os_unix.h"
 #include "diag.h"
 
+#include "diag_l0.h"
 #include "diag_l2.h"
 #include "diag_l3.h"
 #include "diag_err.h"
+#include "diag_trace.h"
 
 #include <unistd.h>
 
@@ -74,6 +89,11 @@
 #include <signal.h>
 #include <time.h>
 #include <pthread.h>
+#include <sys/utsname.h>
+#include <sched.h>
+#include <grp.h>                //setgroups()
+#include <sys/mman.h>           //mlock()
+#include <sys/resource.h>       //setrlimit()
 
 /***
  * In the following #ifdefs, enable/include everything supported.
@@ -86,11 +106,9 @@
         Implications : timer_create(), clock_gettime(), clock_nanosleep() are available.
  */
 //Best clockids auto-selected by diag_os_discover() :
-static clockid_t clkid_pt = CLOCK_MONOTONIC;            //clockid for periodic timer,
+static clockid_t clkid_pt = CLOCK_MONOTONIC;            //clockid for periodic service thread,
 static clockid_t clkid_gt = CLOCK_MONOTONIC;            // for clock_gettime(),
 static clockid_t clkid_ns = CLOCK_MONOTONIC;            // for clock_nanosleep()
-
-static timer_t ptimer_id;               //periodic timer ID
 #endif // _POSIX_TIMERS
 
 #ifdef __linux__
@@ -110,121 +128,158 @@ static timer_t ptimer_id;               //periodic timer ID
 static int diag_os_init_done=0;
 static int discover_done = 0;   //protect diag_os_millisleep() and _gethrt()
 
-static void diag_os_discover(void);
+/* diag_os_sleepuntil() busy-wait tail, in us; measured by diag_os_calibrate() */
+#define SPIN_MIN_US     50
+#define SPIN_MAX_US     1000
+static unsigned long spin_us = SPIN_MIN_US;
+static bool spin_enabled = 0;
 
-static pthread_mutex_t periodic_lock = PTHREAD_MUTEX_INITIALIZER;
+static int calibrate_done = 0;
 
-static void
-#if defined(_POSIX_TIMERS) && (SEL_PERIODIC==S_POSIX || SEL_PERIODIC==S_AUTO)
-diag_os_periodic(UNUSED(union sigval sv)) {
-#else
-diag_os_periodic(UNUSED(int unused)) {
+static void diag_os_discover(void);
+static bool calcache_load(void);
+static void calcache_save(void);
+
+/* Periodic service thread state. periodic_mtx protects the flags and
+ * is the condvar mutex; it is *not* held while the timers run. */
+static diag_thread periodic_thread;
+static pthread_mutex_t periodic_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t periodic_cond;
+static bool periodic_stop;
+static bool periodic_kick;
+#ifdef _POSIX_TIMERS
+static clockid_t clkid_cond = CLOCK_REALTIME;   //clock used by periodic_cond
 #endif
-	/* Warning: these indirectly use non-async-signal-safe functions
-	 * Their behavior is undefined if they happen
-	 * to occur during any other non-async-signal-safe function.
-	 * See doc/sourcetree_notes.txt
-	 */
 
-	if (periodic_done() || pthread_mutex_trylock(&periodic_lock)) {
-		return;
+//run L3 + L2 timers; ret ms until the next call is needed
+static unsigned long diag_os_periodic(void) {
+	unsigned long next;
+
+	if (periodic_done()) {
+		return ALARM_TIMEOUT;
 	}
 
 	diag_l3_timer(); /* Call L3 Timers */
-	diag_l2_timer(); /* Call L2 timers */
-	pthread_mutex_unlock(&periodic_lock);
-}
+	next = diag_l2_timer(); /* Call L2 timers */
 
-//diag_os_init sets up a periodic callback (diag_os_periodic())
-//for keepalive messages, and selects + calibrates timer functions.
-//return 0 if ok
-int diag_os_init(void) {
-	const long tmo = ALARM_TIMEOUT;
+	return (next < ALARM_TIMEOUT)? next : ALARM_TIMEOUT;
+}
 
-	if (diag_os_init_done) {
-		return 0;
+//fill *ts with the current time + ms, on the periodic_cond clock
+static void periodic_deadline(struct timespec *ts, unsigned long ms) {
+#ifdef _POSIX_TIMERS
+	clock_gettime(clkid_cond, ts);
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	ts->tv_sec = tv.tv_sec;
+	ts->tv_nsec = tv.tv_usec * 1000;
+#endif
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000*1000;
+	if (ts->tv_nsec >= 1000*1000*1000) {
+		ts->tv_nsec -= 1000*1000*1000;
+		ts->tv_sec++;
 	}
+}
 
-	diag_os_discover();     //auto-select clockids or other capabilities
-	diag_os_calibrate();    //calibrate before starting periodic timer
+static void *periodic_service(UNUSED(void *arg)) {
+	unsigned long next = ALARM_TIMEOUT;
+	sigset_t allsigs;
 
-#if defined(_POSIX_TIMERS) && (SEL_PERIODIC==S_POSIX || SEL_PERIODIC==S_AUTO)
-	struct itimerspec pti;
-	struct sigevent pt_sigev;
+	//leave all signals (SIGINT, the diag_tty timeout signal, etc) to the other threads
+	sigfillset(&allsigs);
+	pthread_sigmask(SIG_BLOCK, &allsigs, NULL);
 
-	pt_sigev.sigev_notify = SIGEV_THREAD;   //"Upon timer expiration, invoke sigev_notify_function "
-	pt_sigev.sigev_notify_function = diag_os_periodic;
-	pt_sigev.sigev_notify_attributes = NULL;        //not sure what we need here, if anything.
-//	pt_sigev.sigev_value.sival_int = 0;	//not used
-//	pt_sigev.siev_signo = 0;	//not used
+	//keepalives are bus I/O too; no-op if RT wasn't set up
+	diag_os_rt_enter();
 
-	if (timer_create(clkid_pt, &pt_sigev, &ptimer_id) != 0) {
-		fprintf(stderr, FLFMT "Could not create periodic timer... report this\n", FL);
-		diag_os_geterr(0);
-		return diag_iseterr(DIAG_ERR_GENERAL);
+	pthread_mutex_lock(&periodic_mtx);
+	while (!periodic_stop) {
+		struct timespec dl;
+		int rv = 0;
+
+		periodic_deadline(&dl, next);
+		while (!periodic_stop && !periodic_kick && (rv != ETIMEDOUT)) {
+			rv = pthread_cond_timedwait(&periodic_cond, &periodic_mtx, &dl);
+		}
+		if (periodic_stop) {
+			break;
+		}
+		periodic_kick = 0;
+
+		pthread_mutex_unlock(&periodic_mtx);
+		next = diag_os_periodic();
+		pthread_mutex_lock(&periodic_mtx);
 	}
-	//timer was created in disarmed state
-	pti.it_interval.tv_sec = (tmo / 1000);
-	pti.it_interval.tv_nsec = (tmo % 1000) * 1000*1000;
-	pti.it_value.tv_sec = pti.it_interval.tv_sec;
-	pti.it_value.tv_nsec = pti.it_interval.tv_nsec;
+	pthread_mutex_unlock(&periodic_mtx);
+	diag_os_rt_leave();
+	diag_trace_release();   //a restarted thread claims a ring again
+	return NULL;
+}
+
+void diag_os_periodic_wake(void) {
+	pthread_mutex_lock(&periodic_mtx);
+	periodic_kick = 1;
+	pthread_cond_signal(&periodic_cond);
+	pthread_mutex_unlock(&periodic_mtx);
+}
+
+//start the periodic service thread. Ret 0 if ok
+static int periodic_start(void) {
+	pthread_condattr_t cattr;
 
-	if (timer_settime(ptimer_id, 0, &pti, NULL) != 0) {
-		fprintf(stderr, FLFMT "Could not set periodic timer... report this\n", FL);
-		diag_os_geterr(0);
-		timer_delete(ptimer_id);
+	pthread_condattr_init(&cattr);
+#if defined(_POSIX_TIMERS) && defined(_POSIX_CLOCK_SELECTION) && (_POSIX_CLOCK_SELECTION >= 0)
+	//a monotonic deadline isn't affected by wall-clock changes
+	if (pthread_condattr_setclock(&cattr, clkid_pt) == 0) {
+		clkid_cond = clkid_pt;
+	}
+#endif
+	pthread_cond_init(&periodic_cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	periodic_stop = 0;
+	periodic_kick = 0;
+	if (diag_os_thread_start(&periodic_thread, periodic_service, NULL)) {
+		fprintf(stderr, FLFMT "Could not start periodic service thread... report this\n", FL);
+		pthread_cond_destroy(&periodic_cond);
 		return diag_iseterr(DIAG_ERR_GENERAL);
 	}
-#else   //so, no _POSIX_TIMERS ... sucks
-	struct sigaction stNew;
-	struct itimerval tv;
+	return 0;
+}
 
-	/*
-	 * Install alarm handler
-	 */
-	memset(&stNew, 0, sizeof(stNew));
-	stNew.sa_handler = diag_os_periodic;
-	stNew.sa_flags = 0;
-	//stNew.sa_flags = SA_RESTART;
-
-/* Notes on SA_RESTART: (man 7 signal)
-        The following interfaces are never restarted after being interrupted by
-        a signal handler, regardless of the use of SA_RESTART; they always fail
-        with the error EINTR when interrupted by a signal handler:
-   select, clock_nanosleep, [some others].
-
- *** From POSIX docs:
-   SA_RESTART
-    This flag affects the behavior of interruptible functions; that is,
-    those specified to fail with errno set to [EINTR]. If set, and a
-    function specified as interruptible is interrupted by this signal,
-    the function shall restart and shall not fail with [EINTR] unless
-    otherwise specified. If an interruptible function which uses a
-    timeout is restarted, the duration of the timeout following the
-    restart is set to an unspecified value that does not exceed the
-    original timeout value. If the flag is not set, interruptible
-    functions interrupted by this signal shall fail with errno set to
-    [EINTR].
-
- *** Interesting synthesis on
-   http://unix.stackexchange.com/questions/16455/interruption-of-system-calls-when-a-signal-is-caught
-
- *** Conclusion : since we need to handle EINTR for read(), write(), select()
-        and some *sleep() syscalls anyway, we don't specify SA_RESTART.
+//stop the periodic service thread; returns once it's no longer running callbacks
+static void periodic_end(void) {
+	pthread_mutex_lock(&periodic_mtx);
+	periodic_stop = 1;
+	pthread_cond_signal(&periodic_cond);
+	pthread_mutex_unlock(&periodic_mtx);
+	diag_os_thread_join(&periodic_thread);
+	pthread_cond_destroy(&periodic_cond);
+}
 
- */
+//diag_os_init starts the periodic service thread (diag_os_periodic())
+//for keepalive messages, and selects + calibrates timer functions.
+//return 0 if ok
+int diag_os_init(void) {
+	int rv;
 
-	sigaction(SIGALRM, &stNew, NULL);       //install handler for SIGALRM
-	/*
-	 * Start repeating timer
-	 */
-	tv.it_interval.tv_sec = tmo / 1000;     /* Seconds */
-	tv.it_interval.tv_usec = (tmo % 1000) * 1000;   /* ms */
+	if (diag_os_init_done) {
+		return 0;
+	}
 
-	tv.it_value = tv.it_interval;
+	//use cached results if this machine was already calibrated
+	if (!calcache_load()) {
+		diag_os_discover();     //auto-select clockids or other capabilities
+		diag_os_calibrate();    //calibrate before starting periodic service
+		calcache_save();
+	}
 
-	setitimer(ITIMER_REAL, &tv, 0); /* Set timer : it will SIGALRM upon expiration */
-#endif // _POSIX_TIMERS
+	rv = periodic_start();
+	if (rv) {
+		return rv;
+	}
 
 	if (getuid() == 0) {
 		printf("\t******** WARNING ********\n"
@@ -236,23 +291,14 @@ int diag_os_init(void) {
 	return 0;
 }       //diag_os_init
 
-//diag_os_close: delete alarm handlers / periodic timers
+//diag_os_close: stop the periodic service thread
 //return 0 if ok (in this case, always)
 int diag_os_close() {
-#if defined(_POSIX_TIMERS) && (SEL_PERIODIC==S_POSIX || SEL_PERIODIC==S_AUTO)
-	//disarm + delete periodic timer
-	timer_delete(ptimer_id);
-#else
-	//stop the interval timer:
-	struct itimerval tv = {{0,0},{0, 0}};
-	setitimer(ITIMER_REAL, &tv, 0);
-
-	//and  set the SIGALRM handler to default, whatever that is
-	struct sigaction disable_tmr;
-	memset(&disable_tmr, 0, sizeof(disable_tmr));
-	disable_tmr.sa_handler=SIG_DFL;
-	sigaction(SIGALRM, &disable_tmr, NULL);
-#endif // _POSIX_TIMERS
+	if (!diag_os_init_done) {
+		return 0;
+	}
+
+	periodic_end();
 
 	diag_os_init_done = 0;
 	return 0;
@@ -390,6 +436,79 @@ void diag_os_millisleep(unsigned int ms) {
 
 }       //diag_os_millisleep
 
+
+//OS sleep until deadline, no spin.
+static void sleepuntil_os(unsigned long long deadline) {
+	unsigned long long now = diag_os_gethrt();
+	unsigned long long us;
+
+	if (deadline <= now) {
+		return;
+	}
+	us = diag_os_hrtus(deadline - now);
+
+#if defined(_POSIX_TIMERS) && (SEL_SLEEP==S_POSIX || SEL_SLEEP==S_AUTO)
+	/* deadline is on the clock_gettime() clock, which may not be usable
+	 * with clock_nanosleep() (CLOCK_MONOTONIC_RAW); translate it
+	 * to an absolute time on clkid_ns. */
+	struct timespec abst;
+	int rv;
+
+	clock_gettime(clkid_ns, &abst);
+	abst.tv_sec += us / 1000000;
+	abst.tv_nsec += (us % 1000000) * 1000;
+	if (abst.tv_nsec >= 1000*1000*1000) {
+		abst.tv_nsec -= 1000*1000*1000;
+		abst.tv_sec++;
+	}
+
+	//absolute : restarting after EINTR doesn't add any delay
+	while ((rv = clock_nanosleep(clkid_ns, TIMER_ABSTIME, &abst, NULL)) != 0) {
+		if (rv != EINTR) {
+			//unlikely
+			fprintf(stderr, "diag_os_sleepuntil : error %d\n", rv);
+			break;
+		}
+	}
+#else
+	//whole ms only; the rest is left to the spin loop if enabled.
+	if (us >= 1000) {
+		diag_os_millisleep(us / 1000);
+	}
+#endif
+	return;
+}
+
+void diag_os_sleepuntil(unsigned long long deadline) {
+	if (!discover_done) {
+		return;
+	}
+	if (spin_enabled) {
+		unsigned long long spin = diag_os_ushrt(spin_us);
+
+		if (deadline > spin) {
+			sleepuntil_os(deadline - spin);
+		}
+		while (diag_os_gethrt() < deadline) {}
+		return;
+	}
+	sleepuntil_os(deadline);
+	return;
+}
+
+void diag_os_usleep(unsigned long us) {
+	if (us == 0 || !discover_done) {
+		return;
+	}
+	diag_os_sleepuntil(diag_os_gethrt() + diag_os_ushrt(us));
+	return;
+}
+
+unsigned long diag_os_setspin(bool enable) {
+	spin_enabled = enable;
+	return spin_us;
+}
+
 /*
  * diag_os_ipending: Is input available on stdin. ret 1 if yes.
  *
@@ -534,7 +653,6 @@ static void diag_os_discover(void) {
 //call after diag_os_discover !
 void diag_os_calibrate(void) {
 	#define RESOL_ITERS     5
-	static int calibrate_done=0;
 	unsigned long t1, t2;
 	unsigned long long tl1, tl2, resol, maxres;     //for _gethrt()
 
@@ -625,11 +743,210 @@ void diag_os_calibrate(void) {
 		}
 	}       //for testvals
 
+	//measure wakeup latency of diag_os_sleepuntil(), to size the spin tail.
+	//Use the median of a few short sleeps; outliers can't be helped anyway.
+	{
+		#define LAT_ITERS       11
+		unsigned long lat[LAT_ITERS];
+		int i, j;
+
+		for (i = 0; i < LAT_ITERS; i++) {
+			unsigned long l;
+			tl1 = diag_os_gethrt() + diag_os_ushrt(1000);
+			sleepuntil_os(tl1);
+			tl2 = diag_os_gethrt();
+			l = (unsigned long) diag_os_hrtus(tl2 - tl1);
+			//insertion sort
+			for (j = i; (j > 0) && (lat[j - 1] > l); j--) {
+				lat[j] = lat[j - 1];
+			}
+			lat[j] = l;
+		}
+		spin_us = 2 * lat[LAT_ITERS / 2];
+		if (spin_us < SPIN_MIN_US) {
+			spin_us = SPIN_MIN_US;
+		} else if (spin_us > SPIN_MAX_US) {
+			spin_us = SPIN_MAX_US;
+		}
+		printf("diag_os_sleepuntil() wakeup latency ~%luus, spin=%luus\n",
+		       lat[LAT_ITERS / 2], spin_us);
+	}
+
 	calibrate_done=1;
 	return;
 }       //diag_os_calibrate
 
 
+void diag_os_recalibrate(void) {
+	//the periodic callbacks use the timing functions being recalibrated
+	if (diag_os_init_done) {
+		periodic_end();
+	}
+	discover_done = 0;
+	calibrate_done = 0;
+	diag_os_discover();
+	diag_os_calibrate();
+	calcache_save();
+	if (diag_os_init_done && periodic_start()) {
+		diag_os_init_done = 0;
+	}
+	return;
+}
+
+
+/*** Calibration cache ***/
+/* The results of diag_os_discover() and diag_os_calibrate() only depend on
+ * the machine, so they're saved to a small text file and reused on the
+ * next start if the kernel and CPU are the same.
+ * File location : $FREEDIAG_CALCACHE if set (empty string : no cache),
+ * otherwise $HOME/CALCACHE_NAME.
+ */
+#define CALCACHE_NAME   ".freediag_timing"
+#define CALCACHE_VER    1
+
+//ret NULL if no cache should be used
+static const char *calcache_path(void) {
+	static char path[256];
+	const char *env = getenv("FREEDIAG_CALCACHE");
+
+	if (env) {
+		if (*env == 0) {
+			return NULL;
+		}
+		snprintf(path, sizeof(path), "%s", env);
+		return path;
+	}
+	env = getenv("HOME");
+	if (!env) {
+		return NULL;
+	}
+	if (snprintf(path, sizeof(path), "%s/%s", env, CALCACHE_NAME) >= (int) sizeof(path)) {
+		return NULL;
+	}
+	return path;
+}
+
+//machine identity : kernel + CPU model
+static void calcache_key(char *key, size_t len) {
+	struct utsname un;
+	char cpu[128] = "unknown";
+
+#ifdef __linux__
+	FILE *fp = fopen("/proc/cpuinfo", "r");
+	if (fp) {
+		char line[256];
+		while (fgets(line, sizeof(line), fp)) {
+			char *col = strchr(line, ':');
+			if (col && (strncmp(line, "model name", 10) == 0)) {
+				col += strspn(col, ": \t");
+				col[strcspn(col, "\r\n")] = 0;
+				snprintf(cpu, sizeof(cpu), "%s", col);
+				break;
+			}
+		}
+		fclose(fp);
+	}
+#endif
+	if (uname(&un) != 0) {
+		snprintf(key, len, "unknown;%s", cpu);
+		return;
+	}
+	snprintf(key, len, "%s %s %s;%s", un.sysname, un.release, un.machine, cpu);
+	return;
+}
+
+//ret 1 if valid cached results were loaded
+static bool calcache_load(void) {
+	const char *path = calcache_path();
+	char key[400], line[500];
+	bool keyok = 0;
+	int ver = 0;
+	unsigned long spin = 0;
+#ifdef _POSIX_TIMERS
+	long gt = -1, ns = -1;
+	struct timespec tmtest;
+#endif
+	FILE *fp;
+
+	if (!path || !(fp = fopen(path, "r"))) {
+		return 0;
+	}
+	calcache_key(key, sizeof(key));
+
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (strncmp(line, "key=", 4) == 0) {
+			keyok = (strcmp(&line[4], key) == 0);
+		}
+		(void) sscanf(line, "version=%d", &ver);
+		(void) sscanf(line, "spin_us=%lu", &spin);
+#ifdef _POSIX_TIMERS
+		(void) sscanf(line, "clkid_gt=%ld", &gt);
+		(void) sscanf(line, "clkid_ns=%ld", &ns);
+#endif
+	}
+	fclose(fp);
+
+	if (!keyok || (ver != CALCACHE_VER) ||
+	    (spin < SPIN_MIN_US) || (spin > SPIN_MAX_US)) {
+		return 0;
+	}
+#ifdef _POSIX_TIMERS
+	//make sure the clocks still work
+	if ((gt < 0) || (ns < 0) || (clock_gettime((clockid_t) gt, &tmtest) != 0)) {
+		return 0;
+	}
+	tmtest.tv_sec = 0;
+	tmtest.tv_nsec = 0;
+	if (clock_nanosleep((clockid_t) ns, 0, &tmtest, NULL) == ENOTSUP) {
+		return 0;
+	}
+	#ifdef _POSIX_MONOTONIC_CLOCK
+	clkid_pt = CLOCK_MONOTONIC;
+	#else
+	clkid_pt = CLOCK_REALTIME;
+	#endif
+	clkid_gt = (clockid_t) gt;
+	clkid_ns = (clockid_t) ns;
+#endif
+	spin_us = spin;
+	discover_done = 1;
+	calibrate_done = 1;
+	DIAG_DBGM(diag_l0_debug, DIAG_DEBUG_TIMER, DIAG_DBGLEVEL_V,
+	          FLFMT "Using cached timing calibration from %s (\"debug calibrate\" to redo)\n",
+	          FL, path);
+	return 1;
+}
+
+static void calcache_save(void) {
+	const char *path = calcache_path();
+	char key[400];
+	FILE *fp;
+
+	if (!path) {
+		return;
+	}
+	fp = fopen(path, "w");
+	if (!fp) {
+		//not fatal; we'll just calibrate again next time
+		fprintf(stderr, FLFMT "Could not save timing calibration to %s: %s\n",
+		        FL, path, strerror(errno));
+		return;
+	}
+	calcache_key(key, sizeof(key));
+	fprintf(fp, "#freediag timing calibration; delete to force re-calibration\n");
+	fprintf(fp, "version=%d\n", CALCACHE_VER);
+	fprintf(fp, "key=%s\n", key);
+#ifdef _POSIX_TIMERS
+	fprintf(fp, "clkid_gt=%ld\n", (long) clkid_gt);
+	fprintf(fp, "clkid_ns=%ld\n", (long) clkid_ns);
+#endif
+	fprintf(fp, "spin_us=%lu\n", spin_us);
+	fclose(fp);
+	return;
+}
+
+
 unsigned long diag_os_getms(void) {
 	//just use diag_os_gethrt() backend
 	return diag_os_hrtus(diag_os_gethrt()) / 1000;
@@ -674,6 +991,15 @@ unsigned long long diag_os_hrtus(unsigned long long hrdelta) {
 #endif // _POSIX_TIMERS
 }
 
+//inverse of diag_os_hrtus()
+unsigned long long diag_os_ushrt(unsigned long us) {
+#if defined(_POSIX_TIMERS) && (SEL_HRT==S_POSIX || SEL_HRT==S_AUTO)
+	return us * 1000ULL;
+#else
+	return us;
+#endif // _POSIX_TIMERS
+}
+
 void diag_os_initmtx(diag_mtx *mtx) {
 	pthread_mutex_init((pthread_mutex_t *)mtx, NULL);
 	return;
@@ -710,3 +1036,222 @@ void diag_os_unlock(diag_mtx *mtx) {
 	pthread_mutex_unlock((pthread_mutex_t *)mtx);
 	return;
 }
+
+int diag_os_thread_start(diag_thread *thr, void *(*fn)(void *), void *arg) {
+	int rv;
+
+	rv = pthread_create((pthread_t *)thr, NULL, fn, arg);
+	if (rv) {
+		fprintf(stderr, FLFMT "pthread_create failed: %s.\n", FL, strerror(rv));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	return 0;
+}
+
+void diag_os_thread_join(diag_thread *thr) {
+	pthread_join(*(pthread_t *)thr, NULL);
+	return;
+}
+
+
+/*** Real-time I/O path ***/
+/* Rather than running the whole process (CLI, readline, logging) at RT
+ * priority like schedSetter does, only the threads doing bus I/O are
+ * boosted, and only while they're inside L2 (diag_os_rt_enter / _leave).
+ * This works unprivileged after diag_os_rt_setup() raised RLIMIT_RTPRIO:
+ * any thread may then switch itself between SCHED_OTHER and SCHED_FIFO.
+ */
+#define RT_STACK_BYTES  (64 * 1024)     //pre-faulted + locked, per RT thread
+#define RT_MEMLOCK_MIN  (1024 * 1024)   //RLIMIT_MEMLOCK we want
+
+static struct diag_os_rtcfg rt_cfg;
+static bool rt_enabled = 0;
+
+static DIAG_THREAD_LOCAL unsigned int rt_depth; //diag_os_rt_enter() nesting
+static DIAG_THREAD_LOCAL int rt_oldpolicy;
+static DIAG_THREAD_LOCAL struct sched_param rt_oldparam;
+static DIAG_THREAD_LOCAL bool rt_stacklocked;
+#ifdef __linux__
+static DIAG_THREAD_LOCAL cpu_set_t rt_oldcpus;
+static DIAG_THREAD_LOCAL bool rt_cpusaved;
+#endif
+
+/* pre-fault RT_STACK_BYTES of stack below the caller's frame, and lock it.
+ * noinline so the array really is below the caller. */
+static __attribute__((noinline)) void rt_lockstack(void) {
+	volatile uint8_t stack[RT_STACK_BYTES];
+	size_t i;
+
+	if (rt_stacklocked) {
+		return;
+	}
+	for (i = 0; i < sizeof(stack); i += 1024) {
+		stack[i] = 0;
+	}
+	if (mlock((const void *) stack, sizeof(stack)) != 0) {
+		fprintf(stderr, FLFMT "mlock(stack) failed: %s\n", FL, strerror(errno));
+	}
+	rt_stacklocked = 1;
+	return;
+}
+
+//ret 0 if ok
+static int drop_privileges(void) {
+	const char *sudo_uid = getenv("SUDO_UID");
+	const char *sudo_gid = getenv("SUDO_GID");
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+
+	if (geteuid() != 0) {
+		return 0;       //nothing to drop
+	}
+	if (sudo_uid && sudo_gid) {
+		char *endp1, *endp2;
+		unsigned long u = strtoul(sudo_uid, &endp1, 10);
+		unsigned long g = strtoul(sudo_gid, &endp2, 10);
+
+		if (*sudo_uid && *sudo_gid && !*endp1 && !*endp2) {
+			uid = (uid_t) u;
+			gid = (gid_t) g;
+		}
+	}
+	if (uid == 0) {
+		//staying root with RT priority is worse than no RT at all
+		fprintf(stderr, FLFMT "Real-time setup : no unprivileged user to switch to; "
+		        "run through sudo, or as a user allowed to use SCHED_FIFO.\n", FL);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	if ((setgroups(0, NULL) != 0) || (setgid(gid) != 0) || (setuid(uid) != 0)) {
+		fprintf(stderr, FLFMT "could not drop privileges: %s\n", FL, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	//paranoia : make sure it can't be undone
+	if (setuid(0) == 0) {
+		fprintf(stderr, FLFMT "privileges were not dropped !\n", FL);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	return 0;
+}
+
+int diag_os_rt_setup(const struct diag_os_rtcfg *cfg) {
+	struct rlimit rl;
+	int pmin, pmax;
+
+	assert(cfg);
+	if (diag_os_init_done) {
+		fprintf(stderr, FLFMT "RT setup must be done before diag_init()\n", FL);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	if (cfg->prio <= 0) {
+		rt_enabled = 0;
+		return 0;
+	}
+
+	pmin = sched_get_priority_min(SCHED_FIFO);
+	pmax = sched_get_priority_max(SCHED_FIFO);
+	if ((cfg->prio < pmin) || (cfg->prio > pmax)) {
+		fprintf(stderr, FLFMT "RT priority must be %d-%d\n", FL, pmin, pmax);
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+#ifdef __linux__
+	if (cfg->cpu >= CPU_SETSIZE) {
+		fprintf(stderr, FLFMT "bad CPU number %d\n", FL, cfg->cpu);
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+#else
+	if (cfg->cpu >= 0) {
+		printf("CPU pinning not supported on this OS; ignoring.\n");
+	}
+#endif
+
+	/* while privileged : allow this process to use SCHED_FIFO and
+	 * to lock some memory, even after dropping privileges. */
+#ifdef RLIMIT_RTPRIO
+	if ((getrlimit(RLIMIT_RTPRIO, &rl) == 0) && (rl.rlim_max < (rlim_t) cfg->prio)) {
+		rl.rlim_max = cfg->prio;
+	}
+	rl.rlim_cur = cfg->prio;
+	if (setrlimit(RLIMIT_RTPRIO, &rl) != 0) {
+		fprintf(stderr, FLFMT "could not raise RLIMIT_RTPRIO: %s\n", FL, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+#endif
+	if ((getrlimit(RLIMIT_MEMLOCK, &rl) == 0) && (rl.rlim_cur != RLIM_INFINITY) &&
+	    (rl.rlim_cur < RT_MEMLOCK_MIN)) {
+		rl.rlim_cur = RT_MEMLOCK_MIN;
+		if (rl.rlim_max < RT_MEMLOCK_MIN) {
+			rl.rlim_max = RT_MEMLOCK_MIN;
+		}
+		(void) setrlimit(RLIMIT_MEMLOCK, &rl);       //not fatal
+	}
+
+	if (drop_privileges()) {
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	rt_cfg = *cfg;
+	rt_enabled = 1;
+
+	//check that it actually works now
+	diag_os_rt_enter();
+	if (rt_depth && (rt_oldpolicy == -1)) {
+		rt_enabled = 0;
+	}
+	diag_os_rt_leave();
+	if (!rt_enabled) {
+		fprintf(stderr, FLFMT "SCHED_FIFO not permitted\n", FL);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	printf("Real-time I/O : SCHED_FIFO priority %d", rt_cfg.prio);
+	if (rt_cfg.cpu >= 0) {
+		printf(", CPU %d", rt_cfg.cpu);
+	}
+	printf("\n");
+	return 0;
+}
+
+void diag_os_rt_enter(void) {
+	struct sched_param sp;
+
+	if (!rt_enabled || (rt_depth++ > 0)) {
+		return;
+	}
+	rt_lockstack();
+
+	if (pthread_getschedparam(pthread_self(), &rt_oldpolicy, &rt_oldparam) != 0) {
+		rt_oldpolicy = -1;
+		return;
+	}
+	sp.sched_priority = rt_cfg.prio;
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0) {
+		rt_oldpolicy = -1;
+	}
+#ifdef __linux__
+	rt_cpusaved = 0;
+	if (rt_cfg.cpu >= 0) {
+		cpu_set_t cpus;
+
+		if (pthread_getaffinity_np(pthread_self(), sizeof(rt_oldcpus), &rt_oldcpus) == 0) {
+			CPU_ZERO(&cpus);
+			CPU_SET(rt_cfg.cpu, &cpus);
+			rt_cpusaved = (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0);
+		}
+	}
+#endif
+	return;
+}
+
+void diag_os_rt_leave(void) {
+	if (!rt_enabled || (rt_depth == 0) || (--rt_depth > 0)) {
+		return;
+	}
+	if (rt_oldpolicy != -1) {
+		(void) pthread_setschedparam(pthread_self(), rt_oldpolicy, &rt_oldparam);
+	}
+#ifdef __linux__
+	if (rt_cpusaved) {
+		(void) pthread_setaffinity_np(pthread_self(), sizeof(rt_oldcpus), &rt_oldcpus);
+	}
+#endif
+	return;
+}
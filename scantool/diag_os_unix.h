@@ -36,9 +36,6 @@ extern "C" {
  ### Map of features with more than one implementation related to POSIX ###
 
  ## time-related features ##
-        SEL_PERIODIC: Periodic timer callback (for L2+L3 keepalives)
-                A) needs _POSIX_TIMERS, uses timer_create()
-                B) (available everywhere?) setitimer+sigaction to install a SIGALRM handler
         SEL_SLEEP: diag_os_millisleep()
                 A) needs _POSIX_TIMERS, uses clock_nanosleep()
                 B) needs __linux__ && (uid==root), uses /dev/rtc
@@ -62,13 +59,10 @@ extern "C" {
 #define S_ALT2  2
 /** Insert desired selectors here **/
 //example:
-//#define	SEL_PERIODIC S_OTHER
+//#define	SEL_SLEEP S_OTHER
 
 /* Default selectors: anything still undefined is set to S_AUTO which
         means "force nothing", i.e. "use most appropriate implementation". */
-#ifndef SEL_PERIODIC
-#define SEL_PERIODIC    S_AUTO
-#endif
 #ifndef SEL_SLEEP
 #define SEL_SLEEP       S_AUTO
 #endif
@@ -27,6 +27,7 @@
 #include "diag_l2.h"
 #include "diag_l3.h"
 #include "diag_err.h"
+#include "diag_trace.h"
 
 
 #include <process.h>
@@ -52,6 +53,11 @@ static int pfconv_valid=0;      //flag after querying perfo_freq; nothing will n
 int shortsleep_reliable=0;      //TODO : auto-detect this on startup. See diag_os_millisleep & diag_os_calibrate
 static UINT timer_period = 0; // to store timeBeginPeriod(timer_period) value for future cleanup
 
+/* diag_os_sleepuntil() busy-wait tail, in us. Sleep() can't do better than
+ * ~1ms even after timeBeginPeriod, so this isn't calibrated. */
+static unsigned long spin_us = 2000;
+static bool spin_enabled = 0;
+
 
 static void tweak_timing(bool change_interval);
 static void reset_timing(void);
@@ -76,13 +82,59 @@ VOID CALLBACK timercallback(UNUSED(PVOID lpParam), BOOLEAN timedout) {
 		fprintf(stderr, FLFMT "Problem with OS timer callback! Report this !\n", FL);
 	} else {
 		diag_l3_timer();        /* Call L3 Timer */
-		diag_l2_timer();        /* Call L2 timer */
+		(void) diag_l2_timer(); /* Call L2 timer */
 	}
+	//the next callback may run on another pool thread
+	diag_trace_release();
 	LeaveCriticalSection(&periodic_lock);
 
 	return;
 }
 
+/* Real-time I/O path : no privileges involved on win32; the thread priority
+ * is raised to TIME_CRITICAL while inside L2. */
+static struct diag_os_rtcfg rt_cfg;
+static bool rt_enabled = 0;
+static DIAG_THREAD_LOCAL unsigned int rt_depth;
+static DIAG_THREAD_LOCAL int rt_oldprio;
+static DIAG_THREAD_LOCAL DWORD_PTR rt_oldmask;
+
+int diag_os_rt_setup(const struct diag_os_rtcfg *cfg) {
+	assert(cfg);
+	rt_cfg = *cfg;
+	rt_enabled = (cfg->prio > 0);
+	return 0;
+}
+
+void diag_os_rt_enter(void) {
+	if (!rt_enabled || (rt_depth++ > 0)) {
+		return;
+	}
+	rt_oldprio = GetThreadPriority(GetCurrentThread());
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+	rt_oldmask = 0;
+	if ((rt_cfg.cpu >= 0) && (rt_cfg.cpu < (int) (8 * sizeof(DWORD_PTR)))) {
+		rt_oldmask = SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << rt_cfg.cpu);
+	}
+	return;
+}
+
+void diag_os_rt_leave(void) {
+	if (!rt_enabled || (rt_depth == 0) || (--rt_depth > 0)) {
+		return;
+	}
+	SetThreadPriority(GetCurrentThread(), rt_oldprio);
+	if (rt_oldmask) {
+		SetThreadAffinityMask(GetCurrentThread(), rt_oldmask);
+	}
+	return;
+}
+
+//The timer queue runs at a fixed ALARM_TIMEOUT interval; nothing to wake.
+void diag_os_periodic_wake(void) {
+	return;
+}
+
 //diag_os_init : Sets up a periodic callback
 //to call diag_l3_timer and diag_l2_timer.
 // Also calls tweak_timing() to increase thread priority.
@@ -232,6 +284,45 @@ void diag_os_millisleep(unsigned int ms) {
 }       //diag_os_millisleep
 
 
+void diag_os_sleepuntil(unsigned long long deadline) {
+	unsigned long long now = diag_os_gethrt();
+	unsigned long long us;
+
+	if (deadline <= now) {
+		return;
+	}
+	us = diag_os_hrtus(deadline - now);
+
+	if (spin_enabled) {
+		if (us > spin_us) {
+			Sleep((DWORD) ((us - spin_us) / 1000));
+		}
+		while (diag_os_gethrt() < deadline) {}
+		return;
+	}
+
+	//no spin : whole ms, then 1ms steps until the deadline has passed
+	Sleep((DWORD) (us / 1000));
+	while (diag_os_gethrt() < deadline) {
+		Sleep(1);
+	}
+	return;
+}
+
+void diag_os_usleep(unsigned long us) {
+	if (us == 0) {
+		return;
+	}
+	diag_os_sleepuntil(diag_os_gethrt() + diag_os_ushrt(us));
+	return;
+}
+
+unsigned long diag_os_setspin(bool enable) {
+	spin_enabled = enable;
+	return spin_us;
+}
+
+
 int diag_os_ipending(void) {
 	if (_kbhit()) {
 		(void) _getch();
@@ -401,8 +492,9 @@ const char *diag_os_geterr(OS_ERRTYPE os_errno) {
 //On win32, running diag_os_millisleep repeatedly allows it to
 //auto-adjust to a certain degree.
 
+static int calibrate_done=0;    //do it only once
+
 void diag_os_calibrate(void) {
-	static int calibrate_done=0;    //do it only once
 	int testval;    //timeout to test
 	LARGE_INTEGER qpc1, qpc2;
 	LONGLONG tsum;
@@ -486,6 +578,22 @@ void diag_os_calibrate(void) {
 
 }       //diag_os_calibrate
 
+//no calibration cache on win32 : _millisleep() self-adjusts anyway.
+void diag_os_recalibrate(void) {
+	bool locked = diag_os_init_done;
+
+	//hold off the periodic callbacks meanwhile : they use the timing functions
+	if (locked) {
+		EnterCriticalSection(&periodic_lock);
+	}
+	calibrate_done = 0;
+	diag_os_calibrate();
+	if (locked) {
+		LeaveCriticalSection(&periodic_lock);
+	}
+	return;
+}
+
 //return monotonic clock time, ms precision.
 //resolution and accuracy are not important; GetTickCount() is good enough
 unsigned long diag_os_getms(void) {
@@ -506,6 +614,12 @@ unsigned long long diag_os_hrtus(unsigned long long hrdelta) {
 	return (unsigned long long) (hrdelta * (double) pf_conv);
 }
 
+//inverse of diag_os_hrtus()
+unsigned long long diag_os_ushrt(unsigned long us) {
+	assert(pfconv_valid);
+	return (unsigned long long) (us * (double) perfo_freq.QuadPart / 1E6);
+}
+
 
 void diag_os_initmtx(diag_mtx *mtx) {
 	InitializeCriticalSection((CRITICAL_SECTION *)mtx);
@@ -539,3 +653,43 @@ void diag_os_unlock(diag_mtx *mtx) {
 	LeaveCriticalSection((CRITICAL_SECTION *)mtx);
 	return;
 }
+
+/* CreateThread wants a different prototype; bounce through this. */
+struct thread_args {
+	void *(*fn)(void *);
+	void *arg;
+};
+
+static DWORD WINAPI thread_tramp(LPVOID p) {
+	struct thread_args ta = *(struct thread_args *)p;
+
+	free(p);
+	(void)ta.fn(ta.arg);
+	return 0;
+}
+
+int diag_os_thread_start(diag_thread *thr, void *(*fn)(void *), void *arg) {
+	struct thread_args *ta;
+	int rv;
+
+	rv = diag_malloc(&ta, 1);
+	if (rv) {
+		return diag_ifwderr(rv);
+	}
+	ta->fn = fn;
+	ta->arg = arg;
+
+	*thr = CreateThread(NULL, 0, thread_tramp, ta, 0, NULL);
+	if (*thr == NULL) {
+		fprintf(stderr, FLFMT "CreateThread failed: %s\n", FL, diag_os_geterr(0));
+		free(ta);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	return 0;
+}
+
+void diag_os_thread_join(diag_thread *thr) {
+	WaitForSingleObject(*thr, INFINITE);
+	CloseHandle(*thr);
+	return;
+}
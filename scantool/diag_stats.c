@@ -0,0 +1,153 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Link statistics : counters and latency histograms, see diag_stats.h
+ */
+
+#include <string.h>
+
+#include "diag.h"
+#include "diag_os.h"
+#include "diag_stats.h"
+
+void diag_stats_reset(struct diag_stats *st) {
+	memset(st, 0, sizeof(*st));
+}
+
+void diag_hist_add(struct diag_hist *h, unsigned long us) {
+	unsigned int b = 0;
+	unsigned long v = us >> DIAG_STATS_B0SHIFT;
+
+	while (v && (b < DIAG_STATS_NBUCKETS - 1)) {
+		v >>= 1;
+		b++;
+	}
+	h->bucket[b]++;
+
+	if ((h->cnt == 0) || (us < h->min)) {
+		h->min = us;
+	}
+	if (us > h->max) {
+		h->max = us;
+	}
+	h->sum += us;
+	h->cnt++;
+}
+
+void diag_stats_reqstart(struct diag_stats *st) {
+	st->treq = diag_os_gethrt();
+	st->req_pending = 1;
+	st->first_pending = 1;
+}
+
+void diag_stats_reqend(struct diag_stats *st) {
+	if (!st->req_pending) {
+		return;
+	}
+	diag_hist_add(&st->lat_done,
+	              (unsigned long) diag_os_hrtus(diag_os_gethrt() - st->treq));
+	st->req_pending = 0;
+	st->first_pending = 0;
+}
+
+void diag_stats_rxbytes(struct diag_stats *st, unsigned int nbytes) {
+	st->rx_bytes += nbytes;
+	if (st->first_pending) {
+		diag_hist_add(&st->lat_first,
+		              (unsigned long) diag_os_hrtus(diag_os_gethrt() - st->treq));
+		st->first_pending = 0;
+	}
+}
+
+/* lower bound of bucket b, in us */
+static unsigned long bucket_lo(unsigned int b) {
+	return b? (1UL << (b + DIAG_STATS_B0SHIFT - 1)) : 0;
+}
+
+static void hist_print(FILE *out, const char *name, const struct diag_hist *h) {
+	unsigned int b;
+
+	if (h->cnt == 0) {
+		fprintf(out, "%s: no samples\n", name);
+		return;
+	}
+	fprintf(out, "%s: %lu samples, min %lu.%03lu ms, avg %lu.%03lu ms, max %lu.%03lu ms\n",
+	        name, h->cnt,
+	        h->min / 1000, h->min % 1000,
+	        (unsigned long) (h->sum / h->cnt) / 1000, (unsigned long) (h->sum / h->cnt) % 1000,
+	        h->max / 1000, h->max % 1000);
+
+	for (b = 0; b < DIAG_STATS_NBUCKETS; b++) {
+		unsigned long lo = bucket_lo(b);
+
+		if (!h->bucket[b]) {
+			continue;
+		}
+		if (b == DIAG_STATS_NBUCKETS - 1) {
+			fprintf(out, "\t>= %lu.%03lu ms\t: %lu\n",
+			        lo / 1000, lo % 1000, h->bucket[b]);
+		} else {
+			unsigned long hi = bucket_lo(b + 1);
+			fprintf(out, "\t%lu.%03lu - %lu.%03lu ms\t: %lu\n",
+			        lo / 1000, lo % 1000, hi / 1000, hi % 1000, h->bucket[b]);
+		}
+	}
+}
+
+void diag_stats_print(FILE *out, const struct diag_stats *st) {
+	fprintf(out, "Bytes sent / received: %lu / %lu\n", st->tx_bytes, st->rx_bytes);
+	fprintf(out, "Frames sent / received: %lu / %lu\n", st->tx_frames, st->rx_frames);
+	fprintf(out, "Requests: %lu\n", st->requests);
+	fprintf(out, "Checksum errors: %lu\n", st->cks_errors);
+	fprintf(out, "Half duplex echo errors: %lu\n", st->echo_errors);
+	fprintf(out, "Interface overruns: %lu\n", st->overruns);
+	fprintf(out, "Timeouts: %lu\n", st->timeouts);
+	fprintf(out, "Retries: %lu\n", st->retries);
+	fprintf(out, "Keepalives: %lu\n", st->keepalives);
+	hist_print(out, "Request -> first byte", &st->lat_first);
+	hist_print(out, "Request -> complete response", &st->lat_done);
+}
+
+static void hist_dump(FILE *out, const char *name, const struct diag_hist *h) {
+	unsigned int b;
+
+	fprintf(out, "%s_cnt=%lu\n", name, h->cnt);
+	fprintf(out, "%s_min_us=%lu\n", name, h->cnt? h->min : 0);
+	fprintf(out, "%s_max_us=%lu\n", name, h->max);
+	fprintf(out, "%s_sum_us=%llu\n", name, h->sum);
+	for (b = 0; b < DIAG_STATS_NBUCKETS; b++) {
+		fprintf(out, "%s_ge%luus=%lu\n", name, bucket_lo(b), h->bucket[b]);
+	}
+}
+
+void diag_stats_dump(FILE *out, const struct diag_stats *st) {
+	fprintf(out, "tx_bytes=%lu\n", st->tx_bytes);
+	fprintf(out, "rx_bytes=%lu\n", st->rx_bytes);
+	fprintf(out, "tx_frames=%lu\n", st->tx_frames);
+	fprintf(out, "rx_frames=%lu\n", st->rx_frames);
+	fprintf(out, "requests=%lu\n", st->requests);
+	fprintf(out, "cks_errors=%lu\n", st->cks_errors);
+	fprintf(out, "echo_errors=%lu\n", st->echo_errors);
+	fprintf(out, "overruns=%lu\n", st->overruns);
+	fprintf(out, "timeouts=%lu\n", st->timeouts);
+	fprintf(out, "retries=%lu\n", st->retries);
+	fprintf(out, "keepalives=%lu\n", st->keepalives);
+	hist_dump(out, "lat_first", &st->lat_first);
+	hist_dump(out, "lat_done", &st->lat_done);
+}
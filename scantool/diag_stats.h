@@ -0,0 +1,112 @@
+#ifndef _DIAG_STATS_H_
+#define _DIAG_STATS_H_
+
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Link statistics : traffic counters and latency histograms.
+ *
+ * One struct diag_stats lives in every diag_l0_device, so that L1 can
+ * count raw bytes and L2 can count frames / errors on the same object.
+ * Since only one L2 connection may use a given dl0d, these are also the
+ * per-connection stats; diag_l2_StartCommunications() resets them.
+ *
+ * Counters are updated without locking (the keepalive timer may race
+ * with the main thread); a lost increment is acceptable here.
+ */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Latency histograms use log2 buckets :
+ * bucket 0 : < 256us,
+ * bucket n : [2^(n+7), 2^(n+8)) us,
+ * last bucket : everything above.
+ */
+#define DIAG_STATS_NBUCKETS     16
+#define DIAG_STATS_B0SHIFT      8
+
+struct diag_hist {
+	unsigned long cnt;
+	unsigned long long sum;         //in us
+	unsigned long min;              //in us; only valid if cnt > 0
+	unsigned long max;
+	unsigned long bucket[DIAG_STATS_NBUCKETS];
+};
+
+struct diag_stats {
+	/* L1 counters */
+	unsigned long tx_bytes;
+	unsigned long rx_bytes;
+	unsigned long echo_errors;      //bad / missing half duplex echos
+	unsigned long overruns;         //interface buffer overflows, frames lost
+	/* L2 counters */
+	unsigned long tx_frames;
+	unsigned long rx_frames;
+	unsigned long requests;
+	unsigned long cks_errors;       //frames received with DIAG_FMT_BADCS
+	unsigned long timeouts;         //requests / recvs that ended with DIAG_ERR_TIMEOUT
+	unsigned long retries;          //protocol-level retransmissions / rspPending waits
+	unsigned long keepalives;
+
+	struct diag_hist lat_first;     //request -> first byte received
+	struct diag_hist lat_done;      //request -> complete response
+
+	/* transaction in progress; used by L1 to time the first byte */
+	unsigned long long treq;        //diag_os_gethrt() timestamp
+	bool req_pending;
+	bool first_pending;
+	bool in_request;                //inside diag_l2_request()
+};
+
+/** Clear all counters and histograms */
+void diag_stats_reset(struct diag_stats *st);
+
+/** Add one sample to a histogram
+ * @param us : sample in microseconds
+ */
+void diag_hist_add(struct diag_hist *h, unsigned long us);
+
+/** Mark the beginning / end of a transaction (diag_l2_request(), or
+ * diag_l2_send() followed by diag_l2_recv()); the end records lat_done.
+ * diag_stats_rxbytes() records lat_first on the first rx data in between.
+ */
+void diag_stats_reqstart(struct diag_stats *st);
+void diag_stats_reqend(struct diag_stats *st);
+
+/** Count received bytes; records lat_first if a request is pending. */
+void diag_stats_rxbytes(struct diag_stats *st, unsigned int nbytes);
+
+/** Print stats for humans. */
+void diag_stats_print(FILE *out, const struct diag_stats *st);
+
+/** Print stats as "key=value" lines, one per counter / bucket.
+ * Keys are stable, for parsing by scripts.
+ */
+void diag_stats_dump(FILE *out, const struct diag_stats *st);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _DIAG_STATS_H_ */
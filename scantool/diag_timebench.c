@@ -0,0 +1,350 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Timing accuracy benchmark
+ * This is a stand-alone program ! Run with "make bench_timing".
+ *
+ * Measures, over a range of values :
+ *	- diag_os_millisleep() overshoot / jitter;
+ *	- diag_os_usleep() overshoot / jitter, with and without spin;
+ *	- diag_tty_read() timeout accuracy (nothing is ever received);
+ *	- diag_tty_write() duration.
+ * By default the tty tests run on a pseudo-terminal, so no hardware is needed;
+ * a real serial port can be specified instead (nothing must be connected to it).
+ * On a pty, write durations have no reference and are only reported.
+ *
+ * Output is one tab-separated line per tested value :
+ * <test> <value> <samples> <mean> <stddev> <min> <p95> <max> <result>
+ * all times being errors (measured - expected) in microseconds.
+ * Lines starting with '#' are comments. Exit status is 0 if every test passed.
+ * The max is only reported : a single scheduling hiccup shouldn't fail the run.
+ *
+ * usage : diag_timebench [-n iterations] [port]
+ */
+
+#ifndef _WIN32
+	#define _XOPEN_SOURCE 600       //posix_openpt() and friends
+#endif
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_tty.h"
+
+#define TB_DEFITERS     20
+#define TB_MAXITERS     1000
+#define TB_SPEED        10400
+
+/* Pass / fail thresholds, in us. "early" is the most a timeout may
+ * expire before the requested value; "mean" and "p95" bound the overshoot.
+ */
+#define SLEEP_EARLY     100
+#define SLEEP_MEAN      1000
+#define SLEEP_P95       2000
+
+#define READ_EARLY      500
+#define READ_MEAN       2000
+#define READ_P95        4000
+
+#define WRITE_EARLY     500     //only checked on real ports
+#define WRITE_MEAN      2000
+#define WRITE_P95       4000
+
+struct tb_stat {
+	unsigned int n;
+	long long err[TB_MAXITERS];     //measured - expected, us
+};
+
+struct tb_limits {
+	long long early;
+	long long mean;
+	long long p95;
+};
+
+static const struct tb_limits sleep_lim = {SLEEP_EARLY, SLEEP_MEAN, SLEEP_P95};
+static const struct tb_limits read_lim = {READ_EARLY, READ_MEAN, READ_P95};
+static const struct tb_limits write_lim = {WRITE_EARLY, WRITE_MEAN, WRITE_P95};
+
+static const unsigned int sleep_vals[] = {1, 2, 5, 10, 15, 20, 25, 50, 100};
+static const unsigned int usleep_vals[] = {200, 500, 1000, 2500, 5000, 10000};
+static const unsigned int read_vals[] = {5, 10, 20, 25, 50, 100, 200};
+static const unsigned int write_lens[] = {1, 2, 5, 10, 20};
+
+static struct tb_stat tb_samples;
+
+static void tb_add(struct tb_stat *ts, long long err) {
+	if (ts->n < TB_MAXITERS) {
+		ts->err[ts->n++] = err;
+	}
+}
+
+static int tb_cmp(const void *a, const void *b) {
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* print one result line, then clear samples.
+ * lim == NULL : report only.
+ * ret 1 if passed (or not checked) */
+static bool tb_report(const char *test, unsigned int val, struct tb_stat *ts,
+                      const struct tb_limits *lim) {
+	double mean = 0, var = 0;
+	long long min, p95, max;
+	unsigned int i;
+	bool pass = 1;
+	const char *result = "info";
+
+	if (ts->n == 0) {
+		return 1;
+	}
+
+	qsort(ts->err, ts->n, sizeof(ts->err[0]), tb_cmp);
+	for (i = 0; i < ts->n; i++) {
+		mean += ts->err[i];
+	}
+	mean /= ts->n;
+	for (i = 0; i < ts->n; i++) {
+		var += (ts->err[i] - mean) * (ts->err[i] - mean);
+	}
+	var /= ts->n;
+	min = ts->err[0];
+	p95 = ts->err[(ts->n * 95 - 1) / 100];
+	max = ts->err[ts->n - 1];
+
+	if (lim) {
+		pass = (min >= -lim->early) && (mean <= lim->mean) && (p95 <= lim->p95);
+		result = pass? "PASS":"FAIL";
+	}
+
+	printf("%s\t%u\t%u\t%.0f\t%.0f\t%lld\t%lld\t%lld\t%s\n", test, val, ts->n,
+	       mean, sqrt(var), min, p95, max, result);
+	ts->n = 0;
+	return pass;
+}
+
+static bool tb_sleep(unsigned int iters) {
+	unsigned int i, j;
+	bool pass = 1;
+
+	for (i = 0; i < ARRAY_SIZE(sleep_vals); i++) {
+
+		for (j = 0; j < iters; j++) {
+			unsigned long long t0 = diag_os_gethrt();
+			diag_os_millisleep(sleep_vals[i]);
+			tb_add(&tb_samples, (long long) diag_os_hrtus(diag_os_gethrt() - t0) -
+			       sleep_vals[i] * 1000LL);
+		}
+		pass &= tb_report("sleep_ms", sleep_vals[i], &tb_samples, &sleep_lim);
+	}
+	return pass;
+}
+
+static bool tb_usleep(unsigned int iters, bool spin) {
+	unsigned int i, j;
+	bool pass = 1;
+
+	(void) diag_os_setspin(spin);
+	for (i = 0; i < ARRAY_SIZE(usleep_vals); i++) {
+		for (j = 0; j < iters; j++) {
+			unsigned long long t0 = diag_os_gethrt();
+			diag_os_usleep(usleep_vals[i]);
+			tb_add(&tb_samples, (long long) diag_os_hrtus(diag_os_gethrt() - t0) -
+			       usleep_vals[i]);
+		}
+		pass &= tb_report(spin? "usleep_spin_us":"usleep_us", usleep_vals[i],
+		                  &tb_samples, &sleep_lim);
+	}
+	(void) diag_os_setspin(0);
+	return pass;
+}
+
+static bool tb_read(ttyp *tty, unsigned int iters) {
+	unsigned int i, j;
+	bool pass = 1;
+	uint8_t buf[8];
+
+	for (i = 0; i < ARRAY_SIZE(read_vals); i++) {
+
+		for (j = 0; j < iters; j++) {
+			unsigned long long t0 = diag_os_gethrt();
+			ssize_t rv = diag_tty_read(tty, buf, sizeof(buf), read_vals[i]);
+			long long dt = (long long) diag_os_hrtus(diag_os_gethrt() - t0);
+
+			if (rv != DIAG_ERR_TIMEOUT) {
+				printf("# read_ms %u : unexpected return %d\n", read_vals[i], (int) rv);
+				pass = 0;
+				continue;
+			}
+			tb_add(&tb_samples, dt - read_vals[i] * 1000LL);
+		}
+		pass &= tb_report("read_timeout_ms", read_vals[i], &tb_samples, &read_lim);
+	}
+	return pass;
+}
+
+/* on a pty, "master" is the other end : drain it after each write */
+static bool tb_write(ttyp *tty, int master, unsigned int iters) {
+	unsigned int i, j;
+	bool pass = 1;
+	uint8_t buf[32];
+
+	memset(buf, 0x55, sizeof(buf));
+
+	for (i = 0; i < ARRAY_SIZE(write_lens); i++) {
+		unsigned int len = write_lens[i];
+		long long expected = (master >= 0)? 0 : (len * 10 * 1000000LL) / TB_SPEED;
+
+		for (j = 0; j < iters; j++) {
+			unsigned long long t0 = diag_os_gethrt();
+			ssize_t rv = diag_tty_write(tty, buf, len);
+			long long dt = (long long) diag_os_hrtus(diag_os_gethrt() - t0);
+
+			if (rv != (ssize_t) len) {
+				printf("# write_len %u : unexpected return %d\n", len, (int) rv);
+				pass = 0;
+				continue;
+			}
+			tb_add(&tb_samples, dt - expected);
+#ifndef _WIN32
+			if (master >= 0) {
+				while (read(master, buf, sizeof(buf)) > 0) {}
+				memset(buf, 0x55, sizeof(buf));
+			}
+#endif
+		}
+		pass &= tb_report("write_len", len, &tb_samples,
+		                  (master < 0)? &write_lim : NULL);
+	}
+	return pass;
+}
+
+/* open a pty; ret master fd and fill slave name, or -1 */
+static int tb_openpty(char *slave, size_t len) {
+#ifndef _WIN32
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (master < 0) {
+		return -1;
+	}
+	if (grantpt(master) || unlockpt(master) || (ptsname(master) == NULL)) {
+		close(master);
+		return -1;
+	}
+	strncpy(slave, ptsname(master), len - 1);
+	slave[len - 1] = 0;
+	(void) fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+	return master;
+#else
+	(void) slave;
+	(void) len;
+	return -1;
+#endif
+}
+
+int main(int argc, char **argv) {
+	unsigned int iters = TB_DEFITERS;
+	const char *port = NULL;
+	char ptyname[64];
+	int master = -1;
+	int i;
+	ttyp *tty;
+	struct diag_serial_settings set;
+	bool pass = 1;
+
+	for (i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)) {
+			iters = (unsigned int) strtoul(argv[++i], NULL, 0);
+		} else if (argv[i][0] == '-') {
+			printf("usage : %s [-n iterations] [port]\n", argv[0]);
+			return EXIT_FAILURE;
+		} else {
+			port = argv[i];
+		}
+	}
+	if (iters == 0) {
+		iters = TB_DEFITERS;
+	} else if (iters > TB_MAXITERS) {
+		iters = TB_MAXITERS;
+	}
+
+	if (diag_init()) {
+		printf("error in initialization\n");
+		return EXIT_FAILURE;
+	}
+
+	if (port == NULL) {
+		master = tb_openpty(ptyname, sizeof(ptyname));
+		if (master < 0) {
+			printf("Could not open a pty; specify a serial port instead.\n");
+			(void) diag_end();
+			return EXIT_FAILURE;
+		}
+		port = ptyname;
+	}
+
+	printf("# freediag timing benchmark, %u iterations per value, tty %s%s\n",
+	       iters, port, (master >= 0)? " (pty)":"");
+	printf("# test\tvalue\tsamples\tmean_us\tstddev_us\tmin_us\tp95_us\tmax_us\tresult\n");
+
+	pass &= tb_sleep(iters);
+	pass &= tb_usleep(iters, 0);
+	pass &= tb_usleep(iters, 1);
+
+	tty = diag_tty_open(port);
+	if (tty == NULL) {
+		printf("# could not open %s\n", port);
+		pass = 0;
+		goto done;
+	}
+	set.speed = TB_SPEED;
+	set.databits = diag_databits_8;
+	set.stopbits = diag_stopbits_1;
+	set.parflag = diag_par_n;
+	if (diag_tty_setup(tty, &set)) {
+		printf("# could not set up %s\n", port);
+		pass = 0;
+	} else {
+		(void) diag_tty_iflush(tty);
+		pass &= tb_read(tty, iters);
+		pass &= tb_write(tty, master, iters);
+	}
+	diag_tty_close(tty);
+
+done:
+#ifndef _WIN32
+	if (master >= 0) {
+		close(master);
+	}
+#endif
+	printf("# %s\n", pass? "all tests passed":"some tests FAILED");
+	(void) diag_end();
+	return pass? EXIT_SUCCESS : EXIT_FAILURE;
+}
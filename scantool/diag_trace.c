@@ -0,0 +1,802 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Binary trace buffer, see diag_trace.h
+ *
+ * Each thread gets its own ring the first time it logs, so the recorders
+ * need no lock : they only take a timestamp and fill a record. The ring
+ * list itself is protected by trace_mtx, which is only taken when a thread
+ * claims a ring and by the (slow) dump / save functions.
+ *
+ * Text records aren't formatted when they're logged : diag_trace_text()
+ * only walks the format string to fetch the arguments, and packs them in
+ * the payload (little-endian; 4 bytes for int, 8 for long, long long,
+ * size_t, double and pointers; strings are copied as u8 len + chars since
+ * they may be gone by dump time). The format string is run over those
+ * arguments by the dump / decode functions. Arguments that don't fit are
+ * dropped, and the message is printed up to that point followed by "...".
+ *
+ * Saved file format (all integers little-endian) :
+ *	"FDTRACE" '\0', u32 version, u32 nstrings, u32 nrecs
+ *	nstrings * { u16 len, string bytes }    (file names and format strings)
+ *	nrecs * { u64 usecs, u16 file index, u16 fmt index (0xFFFF if none),
+ *		u16 line, u16 mask, u8 layer, u8 kind, u32 thread,
+ *		u8 nargs, u8 len, payload bytes }
+ * Timestamps are in microseconds from the first record.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_l0.h"
+#include "diag_l1.h"
+#include "diag_l2.h"
+#include "diag_l3.h"
+#include "diag_trace.h"
+
+#define TRACE_MAGIC "FDTRACE"
+#define TRACE_VERSION 2
+#define TRACE_NOFMT 0xFFFF
+
+struct trace_ring {
+	struct trace_ring *next;
+	struct diag_trace_rec *rec;
+	unsigned int size;
+	unsigned long head;     //total # of records written; rec[head % size] is next
+	uint32_t thread;        //thread # of the current owner
+	bool inuse;
+};
+
+volatile bool diag_trace_enabled = 0;
+
+static diag_mtx trace_mtx;
+static struct trace_ring *ring_list;
+static unsigned int trace_nrec = DIAG_TRACE_DEFSIZE;
+static uint32_t thread_cnt;
+
+static DIAG_THREAD_LOCAL struct trace_ring *my_ring;
+
+
+void diag_trace_init(void) {
+	diag_os_initstaticmtx(&trace_mtx);
+}
+
+void diag_trace_end(void) {
+	struct trace_ring *r, *tmp;
+
+	diag_trace_enabled = 0;
+	diag_os_lock(&trace_mtx);
+	for (r = ring_list; r; r = tmp) {
+		tmp = r->next;
+		free(r->rec);
+		free(r);
+	}
+	ring_list = NULL;
+	my_ring = NULL;
+	diag_os_unlock(&trace_mtx);
+	diag_os_delmtx(&trace_mtx);
+}
+
+void diag_trace_enable(unsigned int nrec) {
+	if (nrec) {
+		trace_nrec = nrec;
+	}
+	diag_trace_enabled = 1;
+}
+
+void diag_trace_disable(void) {
+	diag_trace_enabled = 0;
+}
+
+void diag_trace_clear(void) {
+	struct trace_ring *r;
+
+	diag_os_lock(&trace_mtx);
+	for (r = ring_list; r; r = r->next) {
+		r->head = 0;
+	}
+	diag_os_unlock(&trace_mtx);
+}
+
+void diag_trace_release(void) {
+	if (!my_ring) {
+		return;
+	}
+	diag_os_lock(&trace_mtx);
+	my_ring->inuse = 0;
+	my_ring = NULL;
+	diag_os_unlock(&trace_mtx);
+}
+
+/* Find or allocate a ring for the calling thread. Slow path, once per thread. */
+static struct trace_ring *claim_ring(void) {
+	struct trace_ring *r;
+
+	diag_os_lock(&trace_mtx);
+	for (r = ring_list; r; r = r->next) {
+		if (!r->inuse) {
+			break;
+		}
+	}
+	if (!r) {
+		if (diag_calloc(&r, 1)) {
+			diag_os_unlock(&trace_mtx);
+			return NULL;
+		}
+		if (diag_calloc(&r->rec, trace_nrec)) {
+			free(r);
+			diag_os_unlock(&trace_mtx);
+			return NULL;
+		}
+		r->size = trace_nrec;
+		r->next = ring_list;
+		ring_list = r;
+	}
+	r->inuse = 1;
+	r->thread = thread_cnt++;
+	my_ring = r;
+	diag_os_unlock(&trace_mtx);
+	return r;
+}
+
+static uint8_t trace_layer(const int *flagvar) {
+	if (flagvar == &diag_l0_debug) {
+		return 0;
+	} else if (flagvar == &diag_l1_debug) {
+		return 1;
+	} else if (flagvar == &diag_l2_debug) {
+		return 2;
+	} else if (flagvar == &diag_l3_debug) {
+		return 3;
+	}
+	return DIAG_TRACE_LAPP;
+}
+
+static struct diag_trace_rec *new_rec(const int *flagvar, unsigned int mask,
+                                      const char *file, int line, uint8_t kind) {
+	struct trace_ring *r = my_ring;
+	struct diag_trace_rec *rec;
+
+	if (!r) {
+		r = claim_ring();
+		if (!r) {
+			return NULL;
+		}
+	}
+	rec = &r->rec[r->head % r->size];
+	rec->ts = diag_os_gethrt();
+	rec->file = file;
+	rec->line = (uint16_t) line;
+	rec->mask = (uint16_t) mask;
+	rec->layer = trace_layer(flagvar);
+	rec->kind = kind;
+	rec->thread = r->thread;
+	r->head++;
+	return rec;
+}
+
+/* Argument classes of printf conversions */
+enum trace_arg {
+	TA_END,         //end of the format, or unsupported conversion
+	TA_PCT,         //"%%" : no argument
+	TA_INT,
+	TA_LONG,
+	TA_LLONG,
+	TA_SIZE,
+	TA_DBL,
+	TA_PTR,
+	TA_STR,
+};
+
+/* Parse the conversion spec at fmt (which points to the '%').
+ * *len is set to the length of the spec, including the conversion char, and
+ * *nstar to the number of '*' in it (each takes an int argument before the
+ * value).
+ */
+static enum trace_arg scan_spec(const char *fmt, size_t *len, unsigned int *nstar) {
+	const char *p = fmt + 1;
+	unsigned int nl = 0;
+	bool sz = 0;
+	enum trace_arg ta;
+
+	*nstar = 0;
+	p += strspn(p, "-+ #0");
+	if (*p == '*') {
+		(*nstar)++;
+		p++;
+	} else {
+		p += strspn(p, "0123456789");
+	}
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			(*nstar)++;
+			p++;
+		} else {
+			p += strspn(p, "0123456789");
+		}
+	}
+	for (; strchr("hljzt", *p) && *p; p++) {
+		if (*p == 'l') {
+			nl++;
+		} else if (*p == 'j') {
+			nl = 2;
+		} else if (*p != 'h') {
+			sz = 1;
+		}
+	}
+
+	switch (*p) {
+	case '%':
+		ta = TA_PCT;
+		break;
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+		ta = sz ? TA_SIZE : (nl >= 2) ? TA_LLONG : nl ? TA_LONG : TA_INT;
+		break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		ta = TA_DBL;
+		break;
+	case 'p':
+		ta = TA_PTR;
+		break;
+	case 's':
+		ta = TA_STR;
+		break;
+	default:
+		//long double, %n, or a typo
+		return TA_END;
+	}
+	*len = (size_t) (p + 1 - fmt);
+	return ta;
+}
+
+/* append the <bytes> low bytes of v to the payload. ret 0 if it doesn't fit */
+static bool put_arg(struct diag_trace_rec *rec, unsigned long long v, unsigned int bytes) {
+	if (rec->len + bytes > sizeof(rec->payload)) {
+		return 0;
+	}
+	while (bytes--) {
+		rec->payload[rec->len++] = (uint8_t) v;
+		v >>= 8;
+	}
+	return 1;
+}
+
+static bool put_str(struct diag_trace_rec *rec, const char *str) {
+	size_t n, room = sizeof(rec->payload) - rec->len;
+
+	if (room < 2) {
+		return 0;
+	}
+	if (!str) {
+		str = "(null)";
+	}
+	n = MIN(strlen(str), room - 1);
+	rec->payload[rec->len++] = (uint8_t) n;
+	memcpy(&rec->payload[rec->len], str, n);
+	rec->len += (uint8_t) n;
+	return 1;
+}
+
+void diag_trace_text(const int *flagvar, unsigned int mask, const char *file, int line,
+                     const char *fmt, ...) {
+	struct diag_trace_rec *rec;
+	const char *p;
+	size_t len;
+	va_list ap;
+
+	rec = new_rec(flagvar, mask, file, line, DIAG_TRACE_TEXT);
+	if (!rec) {
+		return;
+	}
+
+	va_start(ap, fmt);
+	/* the record already has file:line; skip the usual FLFMT prefix */
+	if (strncmp(fmt, FLFMT, sizeof(FLFMT) - 1) == 0) {
+		(void) va_arg(ap, const char *);
+		(void) va_arg(ap, int);
+		fmt += sizeof(FLFMT) - 1;
+	}
+	rec->fmt = fmt;
+	rec->nargs = 0;
+	rec->len = 0;
+
+	for (p = strchr(fmt, '%'); p; p = strchr(p + len, '%')) {
+		unsigned int nstar;
+		enum trace_arg ta = scan_spec(p, &len, &nstar);
+		bool ok = 1;
+
+		if (ta == TA_END) {
+			break;
+		}
+		if (ta == TA_PCT) {
+			continue;
+		}
+		while (nstar--) {
+			ok = ok && put_arg(rec, (unsigned int) va_arg(ap, int), 4);
+		}
+		switch (ta) {
+		case TA_INT:
+			ok = ok && put_arg(rec, (unsigned int) va_arg(ap, int), 4);
+			break;
+		case TA_LONG:
+			ok = ok && put_arg(rec, (unsigned long) va_arg(ap, long), 8);
+			break;
+		case TA_LLONG:
+			ok = ok && put_arg(rec, (unsigned long long) va_arg(ap, long long), 8);
+			break;
+		case TA_SIZE:
+			ok = ok && put_arg(rec, va_arg(ap, size_t), 8);
+			break;
+		case TA_PTR:
+			ok = ok && put_arg(rec, (uintptr_t) va_arg(ap, void *), 8);
+			break;
+		case TA_DBL: {
+			double d = va_arg(ap, double);
+			uint64_t u;
+
+			memcpy(&u, &d, sizeof(u));
+			ok = ok && put_arg(rec, u, 8);
+			break;
+		}
+		case TA_STR:
+			ok = ok && put_str(rec, va_arg(ap, const char *));
+			break;
+		default:
+			break;
+		}
+		if (!ok) {
+			break;
+		}
+		rec->nargs++;
+	}
+	va_end(ap);
+}
+
+/* Data longer than one payload is split across consecutive records. */
+void diag_trace_data(const int *flagvar, unsigned int mask, const char *file, int line,
+                     const void *data, size_t len) {
+	const uint8_t *p = data;
+
+	do {
+		struct diag_trace_rec *rec;
+		size_t chunk = MIN(len, sizeof(rec->payload));
+
+		rec = new_rec(flagvar, mask, file, line, DIAG_TRACE_DATA);
+		if (!rec) {
+			return;
+		}
+		memcpy(rec->payload, p, chunk);
+		rec->len = (uint8_t) chunk;
+		p += chunk;
+		len -= chunk;
+	} while (len);
+}
+
+
+/**** decoding ****/
+
+static unsigned long long get_arg(const struct diag_trace_rec *rec, unsigned int *pos,
+                                  unsigned int bytes) {
+	unsigned long long v = 0;
+	unsigned int i;
+
+	for (i = 0; i < bytes; i++) {
+		v |= (unsigned long long) rec->payload[*pos + i] << (8 * i);
+	}
+	*pos += bytes;
+	return v;
+}
+
+/* Run the format string of a text record over its arguments, into buf. */
+static void format_rec(char *buf, size_t size, const char *fmt,
+                       const struct diag_trace_rec *rec) {
+	const char *p = fmt;
+	unsigned int pos = 0, argn = 0;
+	bool dropped = 0;
+	size_t n = 0;
+
+	while ((*p != 0) && (n < size - 1)) {
+		const char *pct = strchr(p, '%');
+		char spec[40], str[DIAG_TRACE_PAYLOAD];
+		unsigned int nstar, need, i, j;
+		enum trace_arg ta;
+		size_t len;
+		int w = 0;
+
+		len = pct ? (size_t) (pct - p) : strlen(p);
+		len = MIN(len, size - 1 - n);
+		memcpy(&buf[n], p, len);
+		n += len;
+		if (!pct) {
+			break;
+		}
+
+		ta = scan_spec(pct, &len, &nstar);
+		if (ta == TA_PCT) {
+			if (n < size - 1) {
+				buf[n++] = '%';
+			}
+			p = pct + len;
+			continue;
+		}
+		if (ta == TA_END) {
+			break;
+		}
+		if (argn++ >= rec->nargs) {
+			//arguments were dropped when recording
+			dropped = 1;
+			break;
+		}
+		/* (nargs and len come from a file when decoding : don't trust them) */
+		need = 4 * nstar + ((ta == TA_INT) ? 4 : (ta == TA_STR) ? 1 : 8);
+		if ((pos + need > rec->len) ||
+		    ((ta == TA_STR) && (pos + need + rec->payload[pos + need - 1] > rec->len))) {
+			dropped = 1;
+			break;
+		}
+
+		/* copy the spec, with '*' replaced by the recorded width / precision */
+		for (i = 0, j = 0; (i < len) && (j < sizeof(spec) - 12); i++) {
+			if (pct[i] == '*') {
+				j += (unsigned int) sprintf(&spec[j], "%d",
+				                            (int) (int32_t) get_arg(rec, &pos, 4));
+			} else {
+				spec[j++] = pct[i];
+			}
+		}
+		spec[j] = 0;
+		p = pct + len;
+
+		switch (ta) {
+		case TA_INT:
+			w = snprintf(&buf[n], size - n, spec, (int) (int32_t) get_arg(rec, &pos, 4));
+			break;
+		case TA_LONG:
+			w = snprintf(&buf[n], size - n, spec, (long) get_arg(rec, &pos, 8));
+			break;
+		case TA_LLONG:
+			w = snprintf(&buf[n], size - n, spec, (long long) get_arg(rec, &pos, 8));
+			break;
+		case TA_SIZE:
+			w = snprintf(&buf[n], size - n, spec, (size_t) get_arg(rec, &pos, 8));
+			break;
+		case TA_PTR:
+			w = snprintf(&buf[n], size - n, spec, (void *) (uintptr_t) get_arg(rec, &pos, 8));
+			break;
+		case TA_DBL: {
+			uint64_t u = get_arg(rec, &pos, 8);
+			double d;
+
+			memcpy(&d, &u, sizeof(d));
+			w = snprintf(&buf[n], size - n, spec, d);
+			break;
+		}
+		case TA_STR:
+			len = rec->payload[pos++];
+			memcpy(str, &rec->payload[pos], len);
+			str[len] = 0;
+			pos += (unsigned int) len;
+			w = snprintf(&buf[n], size - n, spec, str);
+			break;
+		default:
+			break;
+		}
+		if (w > 0) {
+			n = MIN(n + (size_t) w, size - 1);
+		}
+	}
+	buf[n] = 0;
+	if (dropped) {
+		snprintf(&buf[n], size - n, "...");
+	}
+	/* messages usually end with \n; the dumper adds its own */
+	n = strlen(buf);
+	while (n && (buf[n - 1] == '\n')) {
+		buf[--n] = 0;
+	}
+}
+
+/* Print one record. */
+static void print_rec(FILE *out, unsigned long long us, const char *file, const char *fmt,
+                      const struct diag_trace_rec *rec) {
+	static const char *layers[] = {"L0", "L1", "L2", "L3", "APP"};
+	const char *pf = dbg_prefixes[DIAG_DEBUGPF_NONE];
+	unsigned int i;
+
+	//dbg_prefixes[] is ordered like the DIAG_DEBUG_* bits
+	for (i = 0; i < DIAG_DEBUGPF_TIMER; i++) {
+		if (rec->mask & (1U << i)) {
+			pf = dbg_prefixes[i + 1];
+			break;
+		}
+	}
+
+	fprintf(out, "[%6llu.%06llu] T%lu %-3s %-7s%s:%u\t",
+	        us / 1000000, us % 1000000, (unsigned long) rec->thread,
+	        layers[MIN(rec->layer, DIAG_TRACE_LAPP)], pf, file, rec->line);
+	if (rec->kind == DIAG_TRACE_DATA) {
+		diag_data_dump(out, rec->payload, rec->len);
+	} else if (fmt) {
+		char buf[256];
+
+		format_rec(buf, sizeof(buf), fmt, rec);
+		fprintf(out, "%s", buf);
+	}
+	fprintf(out, "\n");
+}
+
+static int cmp_rec(const void *a, const void *b) {
+	const struct diag_trace_rec *ra = *(const struct diag_trace_rec * const *)a;
+	const struct diag_trace_rec *rb = *(const struct diag_trace_rec * const *)b;
+
+	if (ra->ts < rb->ts) {
+		return -1;
+	}
+	return (ra->ts > rb->ts);
+}
+
+/* Collect pointers to every held record, sorted by time. Caller has trace_mtx.
+ * @return # of records, *list must be freed; -1 on error
+ */
+static long collect(struct diag_trace_rec ***list) {
+	struct trace_ring *r;
+	struct diag_trace_rec **l;
+	unsigned long n = 0, i;
+
+	for (r = ring_list; r; r = r->next) {
+		n += MIN(r->head, r->size);
+	}
+	*list = NULL;
+	if (n == 0) {
+		return 0;
+	}
+	if (diag_malloc(&l, n)) {
+		return -1;
+	}
+	n = 0;
+	for (r = ring_list; r; r = r->next) {
+		unsigned long first = (r->head > r->size) ? r->head - r->size : 0;
+		for (i = first; i < r->head; i++) {
+			l[n++] = &r->rec[i % r->size];
+		}
+	}
+	qsort(l, n, sizeof(*l), cmp_rec);
+	*list = l;
+	return (long) n;
+}
+
+unsigned long diag_trace_count(void) {
+	struct trace_ring *r;
+	unsigned long n = 0;
+
+	diag_os_lock(&trace_mtx);
+	for (r = ring_list; r; r = r->next) {
+		n += MIN(r->head, r->size);
+	}
+	diag_os_unlock(&trace_mtx);
+	return n;
+}
+
+unsigned long diag_trace_dump(FILE *out) {
+	struct diag_trace_rec **l;
+	long n, i;
+
+	diag_os_lock(&trace_mtx);
+	n = collect(&l);
+	for (i = 0; i < n; i++) {
+		print_rec(out, diag_os_hrtus(l[i]->ts - l[0]->ts), l[i]->file,
+		          (l[i]->kind == DIAG_TRACE_TEXT) ? l[i]->fmt : NULL, l[i]);
+	}
+	diag_os_unlock(&trace_mtx);
+	free(l);
+	return (n > 0) ? (unsigned long) n : 0;
+}
+
+static void put_le(FILE *f, unsigned long long v, int bytes) {
+	while (bytes--) {
+		fputc((int) (v & 0xFF), f);
+		v >>= 8;
+	}
+}
+
+static int get_le(FILE *f, unsigned long long *v, int bytes) {
+	int i, c;
+
+	*v = 0;
+	for (i = 0; i < bytes; i++) {
+		c = fgetc(f);
+		if (c == EOF) {
+			return -1;
+		}
+		*v |= (unsigned long long) c << (8 * i);
+	}
+	return 0;
+}
+
+/* index of str in the table, adding it if needed */
+static unsigned int str_index(const char **strs, unsigned int *nstrs, const char *str) {
+	unsigned int j;
+
+	for (j = 0; j < *nstrs; j++) {
+		if (strs[j] == str) {
+			return j;
+		}
+	}
+	strs[(*nstrs)++] = str;
+	return j;
+}
+
+int diag_trace_save(const char *fname) {
+	struct diag_trace_rec **l;
+	const char **strs = NULL;
+	unsigned int nstrs = 0, j;
+	long n, i;
+	FILE *f;
+	int rv = 0;
+
+	f = fopen(fname, "wb");
+	if (!f) {
+		fprintf(stderr, "Could not create %s\n", fname);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	diag_os_lock(&trace_mtx);
+	n = collect(&l);
+	if (n < 0) {
+		rv = DIAG_ERR_NOMEM;
+		goto done;
+	}
+
+	/* string table : every record points to one of a few CURFILE literals,
+	 * and text records to one of the format strings.
+	 */
+	if (n && diag_calloc(&strs, 2 * (size_t) n)) {
+		rv = DIAG_ERR_NOMEM;
+		goto done;
+	}
+	for (i = 0; i < n; i++) {
+		(void) str_index(strs, &nstrs, l[i]->file);
+		if (l[i]->kind == DIAG_TRACE_TEXT) {
+			(void) str_index(strs, &nstrs, l[i]->fmt);
+		}
+	}
+
+	fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), f);
+	put_le(f, TRACE_VERSION, 4);
+	put_le(f, nstrs, 4);
+	put_le(f, (unsigned long long) n, 4);
+	for (j = 0; j < nstrs; j++) {
+		size_t len = strlen(strs[j]);
+		put_le(f, len, 2);
+		fwrite(strs[j], 1, len, f);
+	}
+	for (i = 0; i < n; i++) {
+		const struct diag_trace_rec *rec = l[i];
+
+		put_le(f, diag_os_hrtus(rec->ts - l[0]->ts), 8);
+		put_le(f, str_index(strs, &nstrs, rec->file), 2);
+		put_le(f, (rec->kind == DIAG_TRACE_TEXT) ?
+		          str_index(strs, &nstrs, rec->fmt) : TRACE_NOFMT, 2);
+		put_le(f, rec->line, 2);
+		put_le(f, rec->mask, 2);
+		fputc(rec->layer, f);
+		fputc(rec->kind, f);
+		put_le(f, rec->thread, 4);
+		fputc(rec->nargs, f);
+		fputc(rec->len, f);
+		fwrite(rec->payload, 1, rec->len, f);
+	}
+
+done:
+	diag_os_unlock(&trace_mtx);
+	free(strs);
+	free(l);
+	if (fclose(f) && !rv) {
+		rv = DIAG_ERR_GENERAL;
+	}
+	return rv ? diag_iseterr(rv) : 0;
+}
+
+int diag_trace_decode(FILE *in, FILE *out) {
+	char magic[sizeof(TRACE_MAGIC)];
+	unsigned long long v, nstrs, nrecs, i;
+	char **strs = NULL;
+	int rv = DIAG_ERR_BADDATA;
+
+	if ((fread(magic, 1, sizeof(magic), in) != sizeof(magic)) ||
+	    memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "Not a freediag trace file\n");
+		return diag_iseterr(DIAG_ERR_BADDATA);
+	}
+	if (get_le(in, &v, 4) || (v != TRACE_VERSION)) {
+		fprintf(stderr, "Unsupported trace file version\n");
+		return diag_iseterr(DIAG_ERR_BADDATA);
+	}
+	if (get_le(in, &nstrs, 4) || get_le(in, &nrecs, 4)) {
+		return diag_iseterr(DIAG_ERR_BADDATA);
+	}
+
+	if (nstrs && diag_calloc(&strs, (size_t) nstrs)) {
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	}
+	for (i = 0; i < nstrs; i++) {
+		if (get_le(in, &v, 2) || diag_calloc(&strs[i], (size_t) v + 1)) {
+			goto done;
+		}
+		if (fread(strs[i], 1, (size_t) v, in) != v) {
+			goto done;
+		}
+	}
+
+	for (i = 0; i < nrecs; i++) {
+		struct diag_trace_rec rec;
+		unsigned long long us, fidx, fmtidx, tmp;
+
+		if (get_le(in, &us, 8) || get_le(in, &fidx, 2) || (fidx >= nstrs)) {
+			goto done;
+		}
+		if (get_le(in, &fmtidx, 2) || ((fmtidx >= nstrs) && (fmtidx != TRACE_NOFMT))) {
+			goto done;
+		}
+		if (get_le(in, &tmp, 2)) {
+			goto done;
+		}
+		rec.line = (uint16_t) tmp;
+		if (get_le(in, &tmp, 2)) {
+			goto done;
+		}
+		rec.mask = (uint16_t) tmp;
+		if (get_le(in, &tmp, 2)) {
+			goto done;
+		}
+		rec.layer = tmp & 0xFF;
+		rec.kind = (tmp >> 8) & 0xFF;
+		if (get_le(in, &tmp, 4)) {
+			goto done;
+		}
+		rec.thread = (uint32_t) tmp;
+		if (get_le(in, &tmp, 2)) {
+			goto done;
+		}
+		rec.nargs = tmp & 0xFF;
+		rec.len = (tmp >> 8) & 0xFF;
+		if ((rec.len > sizeof(rec.payload)) ||
+		    (fread(rec.payload, 1, rec.len, in) != rec.len)) {
+			goto done;
+		}
+		print_rec(out, us, strs[fidx],
+		          (fmtidx != TRACE_NOFMT) ? strs[fmtidx] : NULL, &rec);
+	}
+	rv = 0;
+
+done:
+	if (rv) {
+		fprintf(stderr, "Truncated or corrupt trace file\n");
+	}
+	for (i = 0; strs && (i < nstrs); i++) {
+		free(strs[i]);
+	}
+	free(strs);
+	return rv ? diag_iseterr(rv) : 0;
+}
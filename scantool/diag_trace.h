@@ -0,0 +1,126 @@
+#ifndef _DIAG_TRACE_H_
+#define _DIAG_TRACE_H_
+
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Binary trace buffer : alternate backend for DIAG_DBGM / DIAG_DBGMDATA.
+ *
+ * fprintf(stderr) on every debug message costs enough time to wreck
+ * K-line timings. When tracing is enabled, debug messages are instead
+ * stored as fixed-size records in a per-thread ring buffer (no locking,
+ * no I/O, no formatting) : a record holds the format string pointer and
+ * the raw arguments. The rings are formatted later with diag_trace_dump(),
+ * or saved with diag_trace_save() and decoded offline (diag_tracedec program).
+ *
+ * Oldest records are overwritten when a ring is full.
+ */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define DIAG_TRACE_PAYLOAD      56      /* bytes of arguments or data per record */
+#define DIAG_TRACE_DEFSIZE      4096    /* default # of records per ring */
+
+/* record kinds */
+#define DIAG_TRACE_TEXT 0       /* payload is the arguments of "fmt", see diag_trace.c */
+#define DIAG_TRACE_DATA 1       /* payload is raw data from DIAG_DBGMDATA */
+
+/* layer ids; the debug flag variable determines the layer */
+#define DIAG_TRACE_LAPP 4       /* anything above L3 (CLI etc) */
+
+struct diag_trace_rec {
+	unsigned long long ts;  //diag_os_gethrt() timestamp
+	const char *file;       //CURFILE of the call site; with "line" this is the event id.
+	const char *fmt;        //format string (a literal), for DIAG_TRACE_TEXT
+	uint32_t thread;        //# of the thread that logged this
+	uint16_t line;
+	uint16_t mask;          //DIAG_DEBUG_* flags of the call site
+	uint8_t layer;          //0-3, or DIAG_TRACE_LAPP
+	uint8_t kind;           //DIAG_TRACE_TEXT or _DATA
+	uint8_t nargs;          //conversions of fmt with their argument in payload
+	uint8_t len;            //valid bytes in payload
+	uint8_t payload[DIAG_TRACE_PAYLOAD];
+};
+
+/** Set by diag_trace_enable(). Checked by the debug macros
+ * without locking; a stale read only means one message goes
+ * to the "wrong" backend.
+ */
+extern volatile bool diag_trace_enabled;
+
+/** Called from diag_init() / diag_end() */
+void diag_trace_init(void);
+void diag_trace_end(void);
+
+/** Start recording debug messages into the rings.
+ *
+ * @param nrec : ring size (records) for rings created from now on; 0 for default.
+ * Rings are allocated the first time each thread logs something.
+ */
+void diag_trace_enable(unsigned int nrec);
+
+/** Stop recording; debug messages go back to stderr. Recorded data is kept. */
+void diag_trace_disable(void);
+
+/** Forget all recorded data (rings stay allocated). */
+void diag_trace_clear(void);
+
+/** Mark the calling thread's ring as reusable by a future thread.
+ * Threads that log and then exit should call this before returning.
+ */
+void diag_trace_release(void);
+
+/** Return # of records currently held, all rings combined */
+unsigned long diag_trace_count(void);
+
+/** Print all records, merged in time order.
+ * @return # of records printed
+ */
+unsigned long diag_trace_dump(FILE *out);
+
+/** Save all records to a binary file, for diag_trace_decode().
+ * @return 0 if ok
+ */
+int diag_trace_save(const char *fname);
+
+/** Decode a file written by diag_trace_save().
+ * @return 0 if ok
+ */
+int diag_trace_decode(FILE *in, FILE *out);
+
+/* recorders; use the DIAG_DBGM* macros instead of calling these directly */
+void diag_trace_text(const int *flagvar, unsigned int mask, const char *file, int line,
+                     const char *fmt, ...)
+#ifdef __GNUC__
+__attribute__((format(printf, 5, 6)))
+#endif
+;
+void diag_trace_data(const int *flagvar, unsigned int mask, const char *file, int line,
+                     const void *data, size_t len);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _DIAG_TRACE_H_ */
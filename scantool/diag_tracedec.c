@@ -0,0 +1,49 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Offline decoder for trace files saved with "debug trace flush <file>".
+ * This is a stand-alone program !
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "diag.h"
+#include "diag_trace.h"
+
+int main(int argc, char **argv) {
+	FILE *in;
+	int rv;
+
+	if (argc != 2) {
+		printf("usage: %s <tracefile>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (!in) {
+		fprintf(stderr, "Could not open %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	rv = diag_trace_decode(in, stdout);
+	fclose(in);
+
+	return rv ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -101,6 +101,15 @@ int diag_tty_iflush(ttyp *tty_int);
 ssize_t diag_tty_read(ttyp *tty_int,
                       void *buf, size_t count, unsigned int timeout);
 
+/** Read what's available : wait up to (timeout) ms for the first byte like
+ * diag_tty_read(), then also return whatever else was already received (up
+ * to count bytes) without waiting for more.
+ * Lets line-oriented L0s (ELM) get a whole line in one call instead of one
+ * byte per read. Same return values as diag_tty_read().
+ */
+ssize_t diag_tty_readsome(ttyp *tty_int,
+                          void *buf, size_t count, unsigned int timeout);
+
 /** Write bytes to tty (blocking).
  *
  *	@param count: Attempt to write [count] bytes, block (== do not return) until write has completed.
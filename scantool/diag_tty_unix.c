@@ -179,11 +179,13 @@ ttyp *diag_tty_open(const char *portname) {
 	}
 #endif
 
+	//not fatal : ptys don't have modem lines, but are useful for testing.
 	if (ioctl(uti->fd, TIOCMGET, &uti->modemflags) < 0) {
 		fprintf(stderr,
 		        FLFMT "open: TIOCMGET failed: %s\n", FL, strerror(errno));
-		diag_tty_close(uti);
-		return diag_pseterr(DIAG_ERR_GENERAL);
+		uti->tiocm_works = 0;
+	} else {
+		uti->tiocm_works = 1;
 	}
 
 #ifdef  USE_TERMIOS2
@@ -270,7 +272,9 @@ void diag_tty_close(ttyp *tty_int) {
 #else
 		(void)tcsetattr(uti->fd, TCSADRAIN, &uti->st_orig);
 #endif
-		(void)ioctl(uti->fd, TIOCMSET, &uti->modemflags);
+		if (uti->tiocm_works) {
+			(void)ioctl(uti->fd, TIOCMSET, &uti->modemflags);
+		}
 		(void)close(uti->fd);
 	}
 
@@ -1100,6 +1104,29 @@ finished:
 #endif //_tty_read() implementations
 
 
+ssize_t diag_tty_readsome(ttyp *tty_int, void *buf, size_t count, unsigned int timeout) {
+	struct unix_tty_int *uti = tty_int;
+	ssize_t rv;
+	int avail = 0;
+
+	rv = diag_tty_read(tty_int, buf, 1, timeout);
+	if ((rv <= 0) || (count == 1)) {
+		return rv;
+	}
+
+	//the rest, if any, can be read without blocking
+	if ((ioctl(uti->fd, FIONREAD, &avail) != 0) || (avail <= 0)) {
+		return rv;
+	}
+	rv = read(uti->fd, (uint8_t *) buf + 1, MIN((size_t) avail, count - 1));
+	if (rv < 0) {
+		//the first byte is still good; a real error will show on the next read
+		return 1;
+	}
+	return rv + 1;
+}
+
+
 /*
  * POSIX serial I/O input flush +
  * diag_tty_read with IFLUSH_TIMEOUT.
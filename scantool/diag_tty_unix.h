@@ -166,6 +166,7 @@ struct unix_tty_int {
 
 	//flags backup (ioctl TIOCMGET, TIOCMSET)
 	int modemflags;
+	int tiocm_works;        //0 if TIOCMGET failed (e.g. pseudo-terminals)
 
 #if defined(_POSIX_TIMERS)
 	timer_t timerid;                //Used for read() and write() timeouts
@@ -373,6 +373,28 @@ ssize_t diag_tty_read(ttyp *ttyh, void *buf, size_t count, unsigned int timeout)
 }
 
 
+ssize_t diag_tty_readsome(ttyp *ttyh, void *buf, size_t count, unsigned int timeout) {
+	struct tty_int *wti = ttyh;
+	ssize_t rv;
+	DWORD errs, bytesread;
+	COMSTAT stat;
+
+	rv = diag_tty_read(ttyh, buf, 1, timeout);
+	if ((rv <= 0) || (count == 1)) {
+		return rv;
+	}
+
+	//the rest, if any, can be read without blocking
+	if (!ClearCommError(wti->fd, &errs, &stat) || (stat.cbInQue == 0)) {
+		return rv;
+	}
+	if (!ReadFile(wti->fd, (uint8_t *) buf + 1, MIN((DWORD) (count - 1), stat.cbInQue),
+	              &bytesread, NULL)) {
+		return 1;
+	}
+	return (ssize_t) bytesread + 1;
+}
+
 
 /*
  *  flush input buffer and display some of the discarded data
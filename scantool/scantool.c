@@ -94,13 +94,15 @@ uint8_t global_O2_sensors;      /* O2 sensors bit mask */
 /*
  * Data received from each ecu
  */
-ecu_data ecu_info[MAX_ECU];
+ecu_data *ecu_info;
 unsigned int ecu_count;         /* How many ecus are active */
+static unsigned int ecu_alloc;  /* allocated size of ecu_info[] */
+static uint16_t ecu_idx[0x100]; /* ecu_info[] index + 1 by source address, 0 if unused */
 
 
 /* Merge of all the suported mode1 pids by all the ECUs */
-uint8_t merged_mode1_info[0x100];
-uint8_t merged_mode5_info[0x100];
+pidmap merged_mode1_info;
+pidmap merged_mode5_info;
 
 
 /* Prototypes */
@@ -118,6 +120,192 @@ const int _RQST_HANDLE_O2S = RQST_HANDLE_O2S;   //O2 sensor tests
 const int _RQST_HANDLE_READINESS = RQST_HANDLE_READINESS;       //Readiness tests
 
 
+/*
+ * ************
+ * Sparse ECU data store : supported-PID bitmaps + packed responses
+ * ************
+ */
+
+static unsigned int popcount32(uint32_t v) {
+#ifdef __GNUC__
+	return (unsigned int) __builtin_popcount(v);
+#else
+	v = v - ((v >> 1) & 0x55555555);
+	v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+	return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+#endif
+}
+
+static unsigned int ctz32(uint32_t v) {
+	unsigned int n = 0;
+	assert(v != 0);
+#ifdef __GNUC__
+	n = (unsigned int) __builtin_ctz(v);
+#else
+	while ((v & 1) == 0) {
+		v >>= 1;
+		n++;
+	}
+#endif
+	return n;
+}
+
+void pidmap_set(pidmap *pm, unsigned int pid) {
+	if (pid >= 0x100) {
+		return;
+	}
+	pm->w[pid / 32] |= 1UL << (pid % 32);
+}
+
+bool pidmap_test(const pidmap *pm, unsigned int pid) {
+	if (pid >= 0x100) {
+		return 0;
+	}
+	return (pm->w[pid / 32] >> (pid % 32)) & 1;
+}
+
+void pidmap_merge(pidmap *dst, const pidmap *src) {
+	unsigned int i;
+	for (i = 0; i < PIDMAP_WORDS; i++) {
+		dst->w[i] |= src->w[i];
+	}
+}
+
+unsigned int pidmap_rank(const pidmap *pm, unsigned int pid) {
+	unsigned int i, rank = 0;
+
+	if (pid >= 0x100) {
+		pid = 0x100;
+	}
+	for (i = 0; i < pid / 32; i++) {
+		rank += popcount32(pm->w[i]);
+	}
+	if (pid % 32) {
+		rank += popcount32(pm->w[i] & ((1UL << (pid % 32)) - 1));
+	}
+	return rank;
+}
+
+int pidmap_next(const pidmap *pm, int start) {
+	unsigned int i;
+	uint32_t w;
+
+	if (start < 0) {
+		start = 0;
+	}
+	if (start >= 0x100) {
+		return -1;
+	}
+	i = (unsigned int) start / 32;
+	//mask off bits below start in the first word
+	w = pm->w[i] & ~((1UL << (start % 32)) - 1);
+	while (1) {
+		if (w) {
+			return (int) (i * 32 + ctz32(w));
+		}
+		if (++i >= PIDMAP_WORDS) {
+			return -1;
+		}
+		w = pm->w[i];
+	}
+}
+
+response *resp_get(const resp_store *rs, unsigned int pid) {
+	if (!pidmap_test(&rs->present, pid)) {
+		return NULL;
+	}
+	return &rs->resp[pidmap_rank(&rs->present, pid)];
+}
+
+response *resp_add(resp_store *rs, unsigned int pid) {
+	response *r;
+	unsigned int idx;
+
+	if (pid >= 0x100) {
+		return NULL;
+	}
+
+	r = resp_get(rs, pid);
+	if (r != NULL) {
+		return r;
+	}
+
+	if (rs->count == rs->alloc) {
+		/* grow table; most ECUs support a few dozen PIDs at most */
+		response *newresp;
+		unsigned int newalloc = rs->alloc ? rs->alloc * 2 : 8;
+
+		if (diag_malloc(&newresp, newalloc)) {
+			return NULL;
+		}
+		if (rs->count) {
+			memcpy(newresp, rs->resp, rs->count * sizeof(*newresp));
+		}
+		free(rs->resp);
+		rs->resp = newresp;
+		rs->alloc = newalloc;
+	}
+
+	idx = pidmap_rank(&rs->present, pid);
+	memmove(&rs->resp[idx + 1], &rs->resp[idx],
+	        (rs->count - idx) * sizeof(*rs->resp));
+	rs->count++;
+	pidmap_set(&rs->present, pid);
+
+	r = &rs->resp[idx];
+	memset(r, 0, sizeof(*r));
+	r->type = TYPE_UNTESTED;
+	r->pid = (uint8_t) pid;
+	return r;
+}
+
+void resp_clear(resp_store *rs) {
+	free(rs->resp);
+	memset(rs, 0, sizeof(*rs));
+}
+
+
+ecu_data *ecu_find(uint8_t addr) {
+	if (ecu_idx[addr] == 0) {
+		return NULL;
+	}
+	return &ecu_info[ecu_idx[addr] - 1];
+}
+
+ecu_data *ecu_add(uint8_t addr) {
+	ecu_data *ep;
+
+	ep = ecu_find(addr);
+	if (ep != NULL) {
+		return ep;
+	}
+
+	if (ecu_count == ecu_alloc) {
+		/* grow table; usually only a handful of ECUs respond */
+		ecu_data *newtab;
+		unsigned int newalloc = ecu_alloc ? ecu_alloc * 2 : 4;
+
+		if (diag_malloc(&newtab, newalloc)) {
+			return diag_pseterr(DIAG_ERR_NOMEM);
+		}
+		if (ecu_count) {
+			memcpy(newtab, ecu_info, ecu_count * sizeof(*newtab));
+		}
+		free(ecu_info);
+		ecu_info = newtab;
+		ecu_alloc = newalloc;
+	}
+
+	ep = &ecu_info[ecu_count];
+	memset(ep, 0, sizeof(*ep));
+	ep->valid = 1;
+	ep->ecu_addr = addr;
+	ecu_count++;
+	ecu_idx[addr] = (uint16_t) ecu_count;
+	return ep;
+}
+
+
 struct diag_msg *find_ecu_msg(int byte, databyte_type val) {
 	ecu_data *ep;
 	struct diag_msg *rxmsg = NULL;
@@ -217,26 +405,10 @@ void j1979_data_rcv(void *handle, struct diag_msg *msg) {
 	 */
 	LL_FOREACH(msg, tmsg) {
 		uint8_t src = tmsg->src;
-		unsigned int ecu_idx;
 		struct diag_msg *rmsg;
-		bool found=0;
 
-		for (ecu_idx=0, ep=ecu_info; ecu_idx<MAX_ECU; ecu_idx++, ep++) {
-			if (ep->valid) {
-				if (ep->ecu_addr == src) {
-					found = 1;
-					break;
-				}
-			} else {
-				ecu_count++;
-				ep->valid = 1;
-				ep->ecu_addr = src;
-				found = 1;
-				break;
-			}
-		}
-		if (!found) {
-			fprintf(stderr, "ERROR: Too many ECUs responded\n");
+		ep = ecu_add(src);
+		if (ep == NULL) {
 			fprintf(stderr, "ERROR: Info from ECU addr 0x%02X ignored\n", src);
 			return;
 		}
@@ -338,7 +510,7 @@ void j1979_data_rcv(void *handle, struct diag_msg *msg) {
 			return;
 		case RQST_HANDLE_O2S:
 			if (ecu_count > 1) {
-				fprintf(stderr, "ECU %u ", ecu_idx);
+				fprintf(stderr, "ECU %u ", (unsigned int) (ep - ecu_info));
 			}
 
 			/* O2 Sensor test results */
@@ -462,6 +634,72 @@ int l2_check_pid_bits(uint8_t *data, int pid) {
 	return 0;
 }
 
+/*
+ * Number of ECUs expected to answer a mode 1 / 2 request for <pid>, according
+ * to their supported PIDs; 0 if unknown (before the scan, other modes which
+ * may have multi-frame responses, etc.)
+ */
+static unsigned int j1979_nresp(uint8_t mode, uint8_t pid) {
+	ecu_data *ep;
+	unsigned int i, n = 0;
+
+	if (global_state < STATE_SCANDONE) {
+		return 0;
+	}
+	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+		if (mode == 1) {
+			n += pidmap_test(&ep->mode1_info, pid);
+		} else if (mode == 2) {
+			n += pidmap_test(&ep->mode2_info, pid);
+		} else {
+			return 0;
+		}
+	}
+	return n;
+}
+
+/* send a J1979 request, telling the interface how many responses to expect */
+static int j1979_send(struct diag_l3_conn *d_conn, struct diag_msg *msg, unsigned int nresp) {
+	(void) diag_l3_ioctl(d_conn, DIAG_IOCTL_SETRESPCOUNT, &nresp);
+	return diag_l3_send(d_conn, msg);
+}
+
+/*
+ * Send a J1979 request and get the response(s), with one retry and then a
+ * keepalive to resynch.
+ * @return 0 if ok, DIAG_ERR_TIMEOUT if resynched, other <0 if connection lost
+ */
+static int j1979_xfer(struct diag_l3_conn *d_conn, struct diag_msg *msg,
+                      unsigned int nresp, void *handle) {
+	int rv;
+
+	if ((rv = j1979_send(d_conn, msg, nresp))) {
+		return diag_ifwderr(rv);
+	}
+
+	/* And get response(s) within a short while */
+	rv = diag_l3_recv(d_conn, 300, j1979_data_rcv, handle);
+	if (rv < 0) {
+		fprintf(stderr, "Request failed, retrying...\n");
+		if ((rv = j1979_send(d_conn, msg, nresp))) {
+			return diag_ifwderr(rv);
+		}
+		rv = diag_l3_recv(d_conn, 300, j1979_data_rcv, handle);
+		if (rv < 0) {
+			fprintf(stderr, "Retry failed, resynching...\n");
+			rv= d_conn->d_l3_proto->diag_l3_proto_timer(d_conn, 6000);      //force keepalive
+			if (rv < 0) {
+				fprintf(stderr, "\tfailed, connection to ECU may be lost!\n");
+				return diag_ifwderr(rv);
+			}
+			fprintf(stderr, "\tOK.\n");
+			return DIAG_ERR_TIMEOUT;
+
+		}
+	}
+	return rv;
+}
+
 int l3_do_j1979_rqst(struct diag_l3_conn *d_conn, uint8_t mode, uint8_t p1, uint8_t p2,
                      uint8_t p3, uint8_t p4, uint8_t p5, uint8_t p6, void *handle) {
 	assert(d_conn != NULL);
@@ -474,6 +712,8 @@ int l3_do_j1979_rqst(struct diag_l3_conn *d_conn, uint8_t mode, uint8_t p1, uint
 
 	uint8_t *rxdata;
 	struct diag_msg *rxmsg;
+	response *r;
+	unsigned int nresp;
 
 	if (handle != NULL) {
 		ihandle= *(int *) handle;
@@ -512,29 +752,10 @@ int l3_do_j1979_rqst(struct diag_l3_conn *d_conn, uint8_t mode, uint8_t p1, uint
 	data[4] = p4;
 	data[5] = p5;
 	data[6] = p6;
-	if ((rv = diag_l3_send(d_conn, &msg))) {
-		return diag_ifwderr(rv);
-	}
-
-	/* And get response(s) within a short while */
-	rv = diag_l3_recv(d_conn, 300, j1979_data_rcv, handle);
+	nresp = j1979_nresp(mode, p1);
+	rv = j1979_xfer(d_conn, &msg, nresp, handle);
 	if (rv < 0) {
-		fprintf(stderr, "Request failed, retrying...\n");
-		if ((rv = diag_l3_send(d_conn, &msg))) {
-			return diag_ifwderr(rv);
-		}
-		rv = diag_l3_recv(d_conn, 300, j1979_data_rcv, handle);
-		if (rv < 0) {
-			fprintf(stderr, "Retry failed, resynching...\n");
-			rv= d_conn->d_l3_proto->diag_l3_proto_timer(d_conn, 6000);      //force keepalive
-			if (rv < 0) {
-				fprintf(stderr, "\tfailed, connection to ECU may be lost!\n");
-				return diag_ifwderr(rv);
-			}
-			fprintf(stderr, "\tOK.\n");
-			return DIAG_ERR_TIMEOUT;
-
-		}
+		return rv;
 	}
 
 	//This part is super confusing: ihandle comes from the handle from a callback passed
@@ -568,29 +789,154 @@ int l3_do_j1979_rqst(struct diag_l3_conn *d_conn, uint8_t mode, uint8_t p1, uint
 			}
 			switch (mode) {
 			case 1:
-				if (rxdata[0] != 0x41) {
-					ep->mode1_data[p1].type = TYPE_FAILED;
+			case 2:
+				r = resp_add((mode == 1) ? &ep->mode1_data : &ep->mode2_data, p1);
+				if (r == NULL) {
+					return diag_iseterr(DIAG_ERR_NOMEM);
+				}
+				if (rxdata[0] != (mode + 0x40)) {
+					r->type = TYPE_FAILED;
 					break;
 				}
-				memcpy(ep->mode1_data[p1].data, rxdata,
-				       rxmsg->len);
-				ep->mode1_data[p1].len = rxmsg->len;
-				ep->mode1_data[p1].type = TYPE_GOOD;
-
+				r->len = (uint8_t) MIN(rxmsg->len, sizeof(r->data));
+				memcpy(r->data, rxdata, r->len);
+				r->type = TYPE_GOOD;
 				break;
-			case 2:
-				if (rxdata[0] != 0x42) {
-					ep->mode2_data[p1].type = TYPE_FAILED;
+			}
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Mode 1 PID data lengths (J1979 Appendix B), to split multi-PID responses;
+ * 0 if unknown or variable.
+ */
+static const uint8_t j1979_mode1_pidlen[0x60] = {
+	/* 0x00 */ 4, 4, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1,
+	/* 0x10 */ 2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2,
+	/* 0x20 */ 4, 2, 2, 2, 4, 4, 4, 4, 4, 4, 4, 4, 1, 1, 1, 1,
+	/* 0x30 */ 1, 2, 2, 1, 4, 4, 4, 4, 4, 4, 4, 4, 2, 2, 2, 2,
+	/* 0x40 */ 4, 4, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 4,
+	/* 0x50 */ 4, 1, 1, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 2, 1,
+};
+
+static unsigned int j1979_pidlen(uint8_t pid) {
+	if (pid >= ARRAY_SIZE(j1979_mode1_pidlen)) {
+		return 0;
+	}
+	return j1979_mode1_pidlen[pid];
+}
+
+/*
+ * Multi-PID mode 1 requests are only allowed on CAN (J1979 / ISO15765-4);
+ * K-line and J1850 ECUs take a single PID.
+ */
+static bool j1979_multipid(struct diag_l3_conn *d_conn) {
+	return d_conn->d_l3l2_conn->l2proto->diag_l2_protocol == DIAG_L2_PROT_CAN;
+}
+
+/*
+ * Split a multi-PID mode 1 response (0x41 PID data [PID data ...]) into
+ * one mode1_data[] entry per PID, laid out like single-PID responses.
+ */
+static int j1979_split_mode1(ecu_data *ep, const uint8_t *pids, unsigned int npids) {
+	const struct diag_msg *rxmsg = ep->rxmsg;
+	unsigned int off, i;
+	response *r;
+
+	if ((rxmsg->len < 1) || (rxmsg->data[0] != 0x41)) {
+		/* refused; mark what this ECU should have answered */
+		for (i = 0; i < npids; i++) {
+			if (!pidmap_test(&ep->mode1_info, pids[i])) {
+				continue;
+			}
+			r = resp_add(&ep->mode1_data, pids[i]);
+			if (r == NULL) {
+				return diag_iseterr(DIAG_ERR_NOMEM);
+			}
+			r->type = TYPE_FAILED;
+		}
+		return 0;
+	}
+
+	for (off = 1; off < rxmsg->len; ) {
+		uint8_t pid = rxmsg->data[off];
+		unsigned int dlen = j1979_pidlen(pid);
+
+		if ((dlen == 0) || (off + 1 + dlen > rxmsg->len)) {
+			DIAG_DBGMDATA(diag_cli_debug, DIAG_DEBUG_DATA, DIAG_DBGLEVEL_V,
+			              rxmsg->data, rxmsg->len,
+			              "can't split mode 1 response from 0x%02X at PID 0x%02X; ",
+			              ep->ecu_addr, pid);
+			break;
+		}
+		r = resp_add(&ep->mode1_data, pid);
+		if (r == NULL) {
+			return diag_iseterr(DIAG_ERR_NOMEM);
+		}
+		r->data[0] = 0x41;
+		r->data[1] = pid;
+		memcpy(&r->data[2], &rxmsg->data[off + 1], dlen);
+		r->len = (uint8_t) (2 + dlen);
+		r->type = TYPE_GOOD;
+		off += 1 + dlen;
+	}
+	return 0;
+}
+
+int l3_do_j1979_rqst_multi(struct diag_l3_conn *d_conn, const uint8_t *pids, unsigned int npids) {
+	assert(d_conn != NULL);
+	struct diag_msg msg = {0};
+	uint8_t data[1 + J1979_MAXPIDS];
+	unsigned int i, j, nresp;
+	ecu_data *ep;
+	int rv;
+
+	if ((npids == 0) || (npids > J1979_MAXPIDS)) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+	for (i = 0; i < npids; i++) {
+		if (j1979_pidlen(pids[i]) == 0) {
+			return diag_iseterr(DIAG_ERR_BADVAL);
+		}
+	}
+
+	msg.src = global_cfg.src;
+	msg.dest = global_cfg.tgt;
+	msg.data = data;
+	msg.len = 1 + npids;
+	data[0] = 1;
+	memcpy(&data[1], pids, npids);
+
+	/* ECUs that support at least one of the PIDs */
+	nresp = 0;
+	if (global_state >= STATE_SCANDONE) {
+		for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+			for (j = 0; j < npids; j++) {
+				if (pidmap_test(&ep->mode1_info, pids[j])) {
+					nresp++;
 					break;
 				}
-				memcpy(ep->mode2_data[p1].data, rxdata,
-				       rxmsg->len);
-				ep->mode2_data[p1].len = rxmsg->len;
-				ep->mode2_data[p1].type = TYPE_GOOD;
-				break;
 			}
 		}
 	}
+
+	rv = j1979_xfer(d_conn, &msg, nresp, (void *)&_RQST_HANDLE_NORMAL);
+	if (rv < 0) {
+		return rv;
+	}
+
+	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+		if (ep->rxmsg == NULL) {
+			continue;
+		}
+		rv = j1979_split_mode1(ep, pids, npids);
+		if (rv < 0) {
+			return rv;
+		}
+	}
 	return 0;
 }
 
@@ -662,11 +1008,22 @@ int l2_do_send(struct diag_l2_conn *d_conn, void *data, size_t len, void *handle
  * Clear data that is relevant to an ECU
  */
 static int clear_data(void) {
+	ecu_data *ep;
+	unsigned int i;
+
+	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+		resp_clear(&ep->mode1_data);
+		resp_clear(&ep->mode2_data);
+		diag_freemsg(ep->rxmsg);
+	}
+	free(ecu_info);
+	ecu_info = NULL;
+	ecu_alloc = 0;
 	ecu_count = 0;
-	memset(ecu_info, 0, sizeof(ecu_info));
+	memset(ecu_idx, 0, sizeof(ecu_idx));
 
-	memset(merged_mode1_info, 0, sizeof(merged_mode1_info));
-	memset(merged_mode5_info, 0, sizeof(merged_mode5_info));
+	memset(&merged_mode1_info, 0, sizeof(merged_mode1_info));
+	memset(&merged_mode5_info, 0, sizeof(merged_mode5_info));
 
 	return 0;
 }
@@ -802,6 +1159,117 @@ static int do_l2_j1850_start(int l1_type) {
 }
 
 
+/*
+ * ISO15765 (CAN) start; there is no bus init, and J1979 requests are
+ * functional unless "set addrtype phys".
+ */
+static int do_l2_can_start(UNUSED(int unused)) {
+	struct diag_l2_conn *d_conn;
+	flag_type flags = 0;
+
+	if (global_cfg.addrtype) {
+		flags = DIAG_L2_TYPE_FUNCADDR;
+	}
+
+	d_conn = do_l2_common_start(DIAG_L1_CAN, DIAG_L2_PROT_CAN,
+	                            flags, global_cfg.speed, global_cfg.tgt, global_cfg.src);
+
+	if (d_conn == NULL) {
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	/* Connected ! */
+	global_l2_conn = d_conn;
+
+	return 0;
+}
+
+
+/*
+ * Mode 1 part of do_j1979_getdata() : one request per PID.
+ * Returns 0, or 1 if interrupted.
+ */
+static int j1979_getmode1(struct diag_l3_conn *d_conn, int interruptible) {
+	struct diag_msg *msg;
+	int i, rv;
+
+	PIDMAP_FOREACH_FROM(&merged_mode1_info, i, 3) {
+		fprintf(stderr, "Requesting Mode 1 Pid 0x%02X...\n", i);
+		rv = l3_do_j1979_rqst(d_conn, 0x1, (uint8_t) i, 0x00,
+		                      0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL);
+		if (rv < 0) {
+			fprintf(stderr, "Mode 1 Pid 0x%02X request failed (%d)\n",
+			        i, rv);
+		} else {
+			msg = find_ecu_msg(0, 0x41);
+			if (msg == NULL) {
+				fprintf(stderr,
+				        "Mode 1 Pid 0x%02X request "
+				        "no-data (%d)\n",
+				        i, rv);
+			}
+		}
+
+		if (interruptible) {
+			if (diag_os_ipending()) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Same, on CAN : pack the PIDs J1979_MAXPIDS at a time. PIDs of unknown
+ * length can't be split out of a combined response, those are requested
+ * alone.
+ */
+static int j1979_getmode1_multi(struct diag_l3_conn *d_conn, int interruptible) {
+	uint8_t pids[J1979_MAXPIDS];
+	unsigned int npids = 0;
+	struct diag_msg *msg;
+	int i, rv;
+
+	PIDMAP_FOREACH_FROM(&merged_mode1_info, i, 3) {
+		bool last = (pidmap_next(&merged_mode1_info, i + 1) < 0);
+
+		if (j1979_pidlen((uint8_t) i) == 0) {
+			fprintf(stderr, "Requesting Mode 1 Pid 0x%02X...\n", i);
+			rv = l3_do_j1979_rqst(d_conn, 0x1, (uint8_t) i, 0x00,
+			                      0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL);
+			if (rv < 0) {
+				fprintf(stderr, "Mode 1 Pid 0x%02X request failed (%d)\n", i, rv);
+			}
+		} else {
+			pids[npids++] = (uint8_t) i;
+		}
+
+		if ((npids == J1979_MAXPIDS) || (last && npids)) {
+			fprintf(stderr, "Requesting Mode 1 Pids 0x%02X-0x%02X (%u)...\n",
+			        pids[0], pids[npids - 1], npids);
+			rv = l3_do_j1979_rqst_multi(d_conn, pids, npids);
+			if (rv < 0) {
+				fprintf(stderr, "Mode 1 Pids 0x%02X-0x%02X request failed (%d)\n",
+				        pids[0], pids[npids - 1], rv);
+			} else {
+				msg = find_ecu_msg(0, 0x41);
+				if (msg == NULL) {
+					fprintf(stderr, "Mode 1 Pids 0x%02X-0x%02X request no-data (%d)\n",
+					        pids[0], pids[npids - 1], rv);
+				}
+			}
+			npids = 0;
+		}
+
+		if (interruptible) {
+			if (diag_os_ipending()) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
 /*
  * Gets the data for every supported test using global L3 connection
  *
@@ -813,10 +1281,9 @@ static int do_l2_j1850_start(int l1_type) {
  * It is used in "Interuptible" mode when doing "monitor" command
  */
 int do_j1979_getdata(int interruptible) {
-	unsigned int i,j;
-	int rv;
+	unsigned int j;
+	int i, rv;
 	struct diag_l3_conn *d_conn;
-	ecu_data *ep;
 	struct diag_msg *msg;
 
 	d_conn = global_l3_conn;
@@ -829,30 +1296,13 @@ int do_j1979_getdata(int interruptible) {
 	/*
 	 * Now get all the data supported
 	 */
-	for (i=3; i<0x100; i++) {
-		if (merged_mode1_info[i]) {
-			fprintf(stderr, "Requesting Mode 1 Pid 0x%02X...\n", i);
-			rv = l3_do_j1979_rqst(d_conn, 0x1, (uint8_t) i, 0x00,
-			                      0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL);
-			if (rv < 0) {
-				fprintf(stderr, "Mode 1 Pid 0x%02X request failed (%d)\n",
-				        i, rv);
-			} else {
-				msg = find_ecu_msg(0, 0x41);
-				if (msg == NULL) {
-					fprintf(stderr,
-					        "Mode 1 Pid 0x%02X request "
-					        "no-data (%d)\n",
-					        i, rv);
-				}
-			}
-
-			if (interruptible) {
-				if (diag_os_ipending()) {
-					return 1;
-				}
-			}
-		}
+	if (j1979_multipid(d_conn)) {
+		rv = j1979_getmode1_multi(d_conn, interruptible);
+	} else {
+		rv = j1979_getmode1(d_conn, interruptible);
+	}
+	if (rv) {
+		return rv;
 	}
 
 	/* Get mode2/pid2 (DTC that caused freezeframe) */
@@ -871,26 +1321,24 @@ int do_j1979_getdata(int interruptible) {
 	}
 	diag_os_ipending();     //again, required for WIN32 to "purge" last keypress
 	/* Now go thru the ECUs that have responded with mode2 info */
-	for (j=0, ep=ecu_info; j<ecu_count; j++, ep++) {
-		if ( (ep->mode2_data[2].type == TYPE_GOOD) &&
-		     (ep->mode2_data[2].data[2] |
-		      ep->mode2_data[2].data[3]) ) {
-			for (i=3; i<0x100; i++) {
-				if (ep->mode2_info[i]) {
-					fprintf(stderr, "Requesting Mode 0x02 Pid 0x%02X...\n", i);
-					rv = l3_do_j1979_rqst(d_conn, 0x2, (uint8_t)i, 0x00,
-					                      0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL);
-					if (rv < 0) {
-						fprintf(stderr, "Mode 0x02 Pid 0x%02X request failed (%d)\n", i, rv);
-					} else {
-						msg = find_ecu_msg(0, 0x42);
-						if (msg == NULL) {
-							fprintf(stderr, "Mode 0x02 Pid 0x%02X request no-data (%d)\n", i, rv);
-							return DIAG_ERR_GENERAL;
-						}
+	for (j=0; j<ecu_count; j++) {
+		response *r = resp_get(&ecu_info[j].mode2_data, 2);
+		if (RESP_GOOD(r) && (r->data[2] | r->data[3]) ) {
+			/* ecu_info[] may move during the requests : re-index every time */
+			PIDMAP_FOREACH_FROM(&ecu_info[j].mode2_info, i, 3) {
+				fprintf(stderr, "Requesting Mode 0x02 Pid 0x%02X...\n", i);
+				rv = l3_do_j1979_rqst(d_conn, 0x2, (uint8_t)i, 0x00,
+				                      0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL);
+				if (rv < 0) {
+					fprintf(stderr, "Mode 0x02 Pid 0x%02X request failed (%d)\n", i, rv);
+				} else {
+					msg = find_ecu_msg(0, 0x42);
+					if (msg == NULL) {
+						fprintf(stderr, "Mode 0x02 Pid 0x%02X request no-data (%d)\n", i, rv);
+						return DIAG_ERR_GENERAL;
 					}
-
 				}
+
 				if (interruptible) {
 					if (diag_os_ipending()) { // was Enter
 						                  // pressed
@@ -908,15 +1356,18 @@ int do_j1979_getdata(int interruptible) {
  *
  * This is the basic work horse routine
  */
-void do_j1979_basics() {
+void do_j1979_basics(bool discover) {
 	ecu_data *ep;
 	unsigned int i;
 	int o2monitoring = 0;
 
 	/*
-	 * Get supported PIDs and Tests etc
+	 * Get supported PIDs and Tests etc, unless already restored
+	 * from the capability cache
 	 */
-	do_j1979_getpids();
+	if (discover) {
+		do_j1979_getpids();
+	}
 
 	global_state = STATE_SCANDONE;
 
@@ -935,17 +1386,20 @@ void do_j1979_basics() {
 	 * And now do stuff with that data
 	 */
 	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		if ( (ep->mode1_data[2].type == TYPE_GOOD) &&
-		     (ep->mode1_data[2].data[2] | ep->mode1_data[2].data[3]) ) {
+		response *r;
+
+		r = resp_get(&ep->mode1_data, 2);
+		if (RESP_GOOD(r) && (r->data[2] | r->data[3]) ) {
 			fprintf(stderr, "ECU %u Freezeframe data exists, caused by DTC ",
 			        i);
-			print_single_dtc(ep->mode1_data[2].data[2], ep->mode1_data[2].data[3]);
+			print_single_dtc(r->data[2], r->data[3]);
 			fprintf(stderr, "\n");
 		}
 
-		if (ep->mode1_data[0x1c].type == TYPE_GOOD) {
+		r = resp_get(&ep->mode1_data, 0x1c);
+		if (RESP_GOOD(r)) {
 			fprintf(stderr, "ECU %u is ", i);
-			switch (ep->mode1_data[0x1c].data[2]) {
+			switch (r->data[2]) {
 			case 1:
 				fprintf(stderr, "OBD II (California ARB)");
 				break;
@@ -965,7 +1419,7 @@ void do_j1979_basics() {
 				fprintf(stderr, "EOBD (Europe)");
 				break;
 			default:
-				fprintf(stderr, "unknown (%d)", ep->mode1_data[0x1c].data[2]);
+				fprintf(stderr, "unknown (%d)", r->data[2]);
 				break;
 			}
 			fprintf(stderr, " compliant\n");
@@ -975,12 +1429,14 @@ void do_j1979_basics() {
 		 * If ECU supports Oxygen sensor monitoring, then do O2 sensor
 		 * stuff
 		 */
-		if ( (ep->mode1_data[1].type == TYPE_GOOD) &&
-		     (ep->mode1_data[1].data[4] & 0x20) ) {
+		r = resp_get(&ep->mode1_data, 1);
+		if (RESP_GOOD(r) && (r->data[4] & 0x20) ) {
 			o2monitoring = 1;
 		}
 	}
-	do_j1979_getO2sensors();
+	if (discover) {
+		do_j1979_getO2sensors();
+	}
 	if (o2monitoring > 0) {
 		do_j1979_O2tests();
 	} else {
@@ -1058,25 +1514,23 @@ void do_j1979_cms() {
 void do_j1979_ncms(int printall) {
 	int rv;
 	struct diag_l3_conn *d_conn;
-	unsigned int i, j;
+	unsigned int i;
 //	int supported=0;		//not used ?
 	ecu_data *ep;
 
-	uint8_t merged_mode6_info[0x100];
+	pidmap merged_mode6_info;
 
 	d_conn = global_l3_conn;
 
 	/* Merge all ECU mode6 info into one place*/
-	memset(merged_mode6_info, 0, sizeof(merged_mode6_info));
+	memset(&merged_mode6_info, 0, sizeof(merged_mode6_info));
 	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		for (j=0; j<sizeof(ep->mode6_info); j++) {
-			merged_mode6_info[j] |= ep->mode6_info[j];
-		}
+		pidmap_merge(&merged_mode6_info, &ep->mode6_info);
 		//if (ep->mode6_info[0] != 0)	//XXX not sure what this accomplished
 		//supported = 1;	//this never gets used ...
 	}
 
-	if (merged_mode6_info[0] == 0x00) {
+	if (!pidmap_test(&merged_mode6_info, 0)) {
 		/* Either not supported, or tests havent been done */
 		fprintf(stderr, "ECU doesn't support non-continuously monitored system tests\n");
 		return;
@@ -1086,7 +1540,7 @@ void do_j1979_ncms(int printall) {
 	 * Now do the tests
 	 */
 	for (i=0 ; i < 60; i++) {
-		if ((merged_mode6_info[i]) && ((i & 0x1f) != 0)) {
+		if (pidmap_test(&merged_mode6_info, i) && ((i & 0x1f) != 0)) {
 			/* Do test */
 			fprintf(stderr, "Requesting Mode 6 TestID 0x%02X...\n", i);
 			rv = l3_do_j1979_rqst(d_conn, 6, (uint8_t)i, 0x00,
@@ -1114,7 +1568,7 @@ void do_j1979_getmodeinfo(uint8_t mode, int response_offset) {
 	unsigned int i, j;
 	ecu_data *ep;
 	int not_done;
-	uint8_t *data;
+	pidmap *data;
 
 	d_conn = global_l3_conn;
 
@@ -1151,22 +1605,22 @@ void do_j1979_getmodeinfo(uint8_t mode, int response_offset) {
 			/* Sort out where to store the received data */
 			switch (mode) {
 			case 1:
-				data = ep->mode1_info;
+				data = &ep->mode1_info;
 				break;
 			case 2:
-				data = ep->mode2_info;
+				data = &ep->mode2_info;
 				break;
 			case 5:
-				data = ep->mode5_info;
+				data = &ep->mode5_info;
 				break;
 			case 6:
-				data = ep->mode6_info;
+				data = &ep->mode6_info;
 				break;
 			case 8:
-				data = ep->mode8_info;
+				data = &ep->mode8_info;
 				break;
 			case 9:
-				data = ep->mode9_info;
+				data = &ep->mode9_info;
 				break;
 			default:
 				data = NULL;
@@ -1177,15 +1631,15 @@ void do_j1979_getmodeinfo(uint8_t mode, int response_offset) {
 				break;
 			}
 
-			data[0] = 1;    /* Pid 0, 0x20, 0x40 always supported */
+			pidmap_set(data, 0);    /* Pid 0, 0x20, 0x40 always supported */
 			for (i=0 ; i<=0x20; i++) {
 				if (l2_check_pid_bits(
 					    &ep->rxmsg->data[response_offset],
 					    (int)i)) {
-					data[i + pid] = 1;
+					pidmap_set(data, i + pid);
 				}
 			}
-			if (data[0x20 + pid] == 1) {
+			if (pidmap_test(data, 0x20 + pid)) {
 				not_done = 1;
 			}
 		}
@@ -1207,7 +1661,7 @@ void do_j1979_getmodeinfo(uint8_t mode, int response_offset) {
  */
 void do_j1979_getpids() {
 	ecu_data *ep;
-	unsigned int i, j;
+	unsigned int i;
 
 	do_j1979_getmodeinfo(1, 2);
 	do_j1979_getmodeinfo(2, 3);
@@ -1221,18 +1675,11 @@ void do_j1979_getpids() {
 	 * from the ECUs into one bitmask, do same
 	 * for Mode5
 	 */
-	memset(merged_mode1_info, 0, sizeof(merged_mode1_info));
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		for (j=0; j<sizeof(ep->mode1_info); j++) {
-			merged_mode1_info[j] |= ep->mode1_info[j];
-		}
-	}
-
-	memset(merged_mode5_info, 0, sizeof(merged_mode5_info));
+	memset(&merged_mode1_info, 0, sizeof(merged_mode1_info));
+	memset(&merged_mode5_info, 0, sizeof(merged_mode5_info));
 	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		for (j=0; j<sizeof(ep->mode5_info); j++) {
-			merged_mode5_info[j] |= ep->mode5_info[j];
-		}
+		pidmap_merge(&merged_mode1_info, &ep->mode1_info);
+		pidmap_merge(&merged_mode5_info, &ep->mode5_info);
 	}
 	return;
 }
@@ -1243,7 +1690,7 @@ void do_j1979_getpids() {
 void do_j1979_O2tests() {
 	int i;
 
-	if (merged_mode5_info[0] == 0) {
+	if (!pidmap_test(&merged_mode5_info, 0)) {
 		fprintf(stderr, "Oxygen (O2) sensor tests not supported\n");
 		return;
 	}
@@ -1274,7 +1721,7 @@ void do_j1979_getO2tests(int O2sensor) {
 
 	for (i=1 ; i<=0x1f; i++) {
 		fprintf(stderr, "O2 Sensor %d Tests: -\n", O2sensor);
-		if ((merged_mode5_info[i]) && ((i & 0x1f) != 0)) {
+		if (pidmap_test(&merged_mode5_info, i) && ((i & 0x1f) != 0)) {
 			/* Do test for of i + testID */
 			fprintf(stderr, "Requesting Mode 0x05 TestID 0x%02X...\n", i);
 			rv = l3_do_j1979_rqst(d_conn, 5, (uint8_t) i, o2s,
@@ -1301,7 +1748,7 @@ int do_j1979_getdtcs() {
 
 	d_conn = global_l3_conn;
 
-	if (merged_mode1_info[1] == 0) {
+	if (!pidmap_test(&merged_mode1_info, 1)) {
 		fprintf(stderr, "ECU(s) do not support DTC#/test query - can't do tests\n");
 		return 0;
 	}
@@ -1319,18 +1766,18 @@ int do_j1979_getdtcs() {
 	mil = 0; readiness = 0, num_dtcs = 0;
 
 	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		if ((ep->rxmsg) && (ep->rxmsg->data[0] == 0x41)) {
+		response *r = resp_get(&ep->mode1_data, 1);
+		if ((ep->rxmsg) && (ep->rxmsg->data[0] == 0x41) && (r != NULL)) {
 			/* Go thru received msgs looking for DTC responses */
-			if ((ep->mode1_data[1].data[3] & 0xf0) ||
-			    ep->mode1_data[1].data[5]) {
+			if ((r->data[3] & 0xf0) || r->data[5]) {
 				readiness = 1;
 			}
 
-			if (ep->mode1_data[1].data[2] & 0x80) {
+			if (r->data[2] & 0x80) {
 				mil = 1;
 			}
 
-			num_dtcs += ep->mode1_data[1].data[2] & 0x7f;
+			num_dtcs += r->data[2] & 0x7f;
 		}
 
 	}
@@ -1400,6 +1847,7 @@ int do_j1979_getO2sensors() {
 	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
 		if ((ep->rxmsg) && (ep->rxmsg->data[0] == 0x41)) {
 			/* Maintain bitmap of sensors */
+			ep->O2_sensors = ep->rxmsg->data[2];
 			global_O2_sensors |= ep->rxmsg->data[2];
 			/* And count additional sensors on this ECU */
 			for (j=0; j<=7; j++) {
@@ -1442,37 +1890,116 @@ struct protocol {
 	const char      *desc;
 	start_fn *start;
 	int flags;
+	int l1proto;    /* L1 protocol required; see diag_l1.h */
+	bool slowinit;  /* uses a 5 baud init */
 };
 
 const struct protocol protocols[] = {
-	{"SAEJ1850-VPW", do_l2_j1850_start, DIAG_L1_J1850_VPW},
-	{"SAEJ1850-PWM", do_l2_j1850_start, DIAG_L1_J1850_PWM},
-	{"ISO14230_FAST", do_l2_14230_start, DIAG_L2_TYPE_FASTINIT},
-	{"ISO9141", do_l2_9141_start, 0x33},
-	{"ISO14230_SLOW", do_l2_14230_start, DIAG_L2_TYPE_SLOWINIT},
+	{"SAEJ1850-VPW", do_l2_j1850_start, DIAG_L1_J1850_VPW, DIAG_L1_J1850_VPW, 0},
+	{"SAEJ1850-PWM", do_l2_j1850_start, DIAG_L1_J1850_PWM, DIAG_L1_J1850_PWM, 0},
+	{"ISO14230_FAST", do_l2_14230_start, DIAG_L2_TYPE_FASTINIT, DIAG_L1_ISO14230, 0},
+	{"ISO15765-CAN", do_l2_can_start, 0, DIAG_L1_CAN, 0},
+	{"ISO9141", do_l2_9141_start, 0x33, DIAG_L1_ISO9141, 1},
+	{"ISO14230_SLOW", do_l2_14230_start, DIAG_L2_TYPE_SLOWINIT, DIAG_L1_ISO14230, 1},
 };
 
+/* index in protocols[] of the last protocol that connected; -1 if none.
+ * Only valid for the interface it connected on.
+ */
+static int lkg_proto = -1;
+static const char *lkg_l0name;
+
+/* address sent by the 5 baud init of protocol p */
+static int proto_5baddr(const struct protocol *p) {
+	if (p->start == do_l2_9141_start) {
+		return p->flags;
+	}
+	return global_cfg.tgt;
+}
+
 /*
  * Connect to ECU by trying all protocols
- * - We do the fast initialising protocols before the slow ones
+ * - We first try the protocol that worked last time on this interface
+ * (remembered in the capability cache if enabled), then the fast initialising
+ * protocols before the slow ones.
+ * - Protocols the interface doesn't support are skipped without opening L2.
+ * - If a 5 baud init got no answer at all, another 5 baud init to the same
+ * address (ISO14230 slow init after ISO9141) is pointless and skipped.
  * This will set global_l3_conn. Ret 0 if ok
  */
 int ecu_connect(void) {
 	int rv = DIAG_ERR_GENERAL;
-	const struct protocol *p;
+	const struct protocol *p = NULL;
+	unsigned int order[ARRAY_SIZE(protocols)];
+	unsigned int i, nprot;
+	int l1mask;
+	int dead_5baddr = -1;   /* 5 baud init address that got no answer */
+	unsigned long t0, tp, tl3;
 
 	if ((global_state >= STATE_CONNECTED) || (global_l3_conn != NULL)) {
 		printf("ecu_connect() : already connected !\n");
 		return DIAG_ERR_GENERAL;
 	}
+	if (!global_dl0d) {
+		printf("No global L0. Please select + configure L0 first\n");
+		return DIAG_ERR_GENERAL;
+	}
 
-	for (p = protocols; p < &protocols[ARRAY_SIZE(protocols)]; p++) {
+	if ((lkg_l0name == NULL) || (strcmp(lkg_l0name, global_cfg.l0name) != 0)) {
+		/* new interface ("set interface") : forget the last one's */
+		lkg_proto = -1;
+		lkg_l0name = global_cfg.l0name;
+	}
+	if (lkg_proto < 0) {
+		char lkg_desc[32];
+		if (capcache_getproto(global_cfg.l0name, lkg_desc, sizeof(lkg_desc)) == 0) {
+			for (i = 0; i < ARRAY_SIZE(protocols); i++) {
+				if (strcmp(protocols[i].desc, lkg_desc) == 0) {
+					lkg_proto = (int) i;
+				}
+			}
+		}
+	}
+
+	/* Last-known-good first, then the rest in table order */
+	nprot = 0;
+	if (lkg_proto >= 0) {
+		order[nprot++] = (unsigned int) lkg_proto;
+	}
+	for (i = 0; i < ARRAY_SIZE(protocols); i++) {
+		if ((int) i != lkg_proto) {
+			order[nprot++] = i;
+		}
+	}
+
+	l1mask = diag_l1_gettype(global_dl0d);
+	t0 = diag_os_getms();
+
+	for (i = 0; i < nprot; i++) {
 		struct diag_l3_conn *d_l3_conn;
 
+		p = &protocols[order[i]];
+
+		if ((l1mask & p->l1proto) == 0) {
+			fprintf(stderr, "\nSkipping %s: not supported by interface\n", p->desc);
+			continue;
+		}
+		if (p->slowinit && (proto_5baddr(p) == dead_5baddr)) {
+			fprintf(stderr, "\nSkipping %s: no answer to 5 baud init @ 0x%02X\n",
+			        p->desc, dead_5baddr);
+			continue;
+		}
+
 		fprintf(stderr, "\nTrying %s:\n", p->desc);
+		tp = diag_os_getms();
+		(void) diag_geterr();   //clear latched error
 		rv = p->start(p->flags);
 		if (rv != 0) {
-			fprintf(stderr, "%s Failed!\n", p->desc);
+			/* Timeout before keybytes : nothing answers at that address */
+			if (p->slowinit && (diag_geterr() == DIAG_ERR_TIMEOUT)) {
+				dead_5baddr = proto_5baddr(p);
+			}
+			fprintf(stderr, "%s Failed! (%lu ms)\n", p->desc, diag_os_getms() - tp);
 			continue;
 		}
 
@@ -1481,12 +2008,14 @@ int ecu_connect(void) {
 		// DIAG_L2_FLAG_CONNECTS_ALWAYS) To confirm we really have a connection we
 		// try to start the J1979 L3 layer and try sending a J1979 keep-alive
 		// request (service 1 pid 0). diag_l3_start() does exactly that.
-		fprintf(stderr, "L2 connection OK; trying to add SAE J1979 layer...\n");
+		fprintf(stderr, "L2 connection OK (%lu ms); trying to add SAE J1979 layer...\n",
+		        diag_os_getms() - tp);
 
+		tl3 = diag_os_getms();
 		d_l3_conn = diag_l3_start("SAEJ1979", global_l2_conn);
 		if (d_l3_conn == NULL) {
 			rv = DIAG_ERR_ECUSAIDNO;
-			fprintf(stderr, "Failed to enable SAEJ1979 mode\n");
+			fprintf(stderr, "Failed to enable SAEJ1979 mode (%lu ms)\n", diag_os_getms() - tl3);
 			// So we'll try another protocol. But close that L2 first:
 			diag_l2_StopCommunications(global_l2_conn);
 			diag_l2_close(global_dl0d);
@@ -1498,10 +2027,17 @@ int ecu_connect(void) {
 		global_l3_conn = d_l3_conn;
 		global_state = STATE_L3ADDED;
 
-		fprintf(stderr, "%s Connected.\n", p->desc);
+		fprintf(stderr, "%s Connected. (L2 %lu ms, J1979 %lu ms)\n", p->desc,
+		        tl3 - tp, diag_os_getms() - tl3);
 		break;
 	}
 
+	if (rv == 0) {
+		lkg_proto = (int) (p - protocols);
+		capcache_setproto(global_cfg.l0name, p->desc);
+		fprintf(stderr, "Time to connect: %lu ms\n", diag_os_getms() - t0);
+	}
+
 	if (diag_cli_debug) {
 		fprintf(stderr, "debug: L2 connection ID %p, L3 ID %p\n",
 		        (void *)global_l2_conn, (void *)global_l3_conn);
@@ -1532,12 +2068,15 @@ static int do_init(void) {
 static void do_usage (void) {
 	fprintf( stderr, "FreeDiag ScanTool:\n\n" );
 	fprintf( stderr, "  Usage -\n" );
-	fprintf( stderr, "	freediag [-h][-a|-c][-f <file]\n");
+	fprintf( stderr, "	freediag [-h][-a|-c][-f <file][-r <prio>[:<cpu>]]\n");
 	fprintf( stderr, "  Where:\n" );
 	fprintf( stderr, "\t-h   -- Display this help message\n" );
 	fprintf( stderr, "\t-c   -- Start in command-line interface mode\n" );
 	fprintf( stderr, "\t		(this is the default)\n");
 	fprintf( stderr, "\t-f <file> Runs the commands from <file> at startup\n");
+	fprintf( stderr, "\t-r <prio>[:<cpu>] Run bus I/O at real-time priority <prio>,\n");
+	fprintf( stderr, "\t		optionally pinned to <cpu>. Needs root through sudo;\n");
+	fprintf( stderr, "\t		privileges are dropped afterwards.\n");
 	fprintf( stderr, "\n" );
 }
 
@@ -1545,8 +2084,8 @@ static void do_usage (void) {
 
 static void format_o2(char *buf, int maxlen, UNUSED(int english),
                       const struct pid *p, response *data, int n) {
-	double v = DATA_SCALED(p, DATA_1(p, n, data));
-	int t = DATA_1(p, n + 1, data);
+	double v = DATA_SCALED(p, DATA_1(n, data));
+	int t = DATA_1(n + 1, data);
 
 	if (t == 0xff) {
 		snprintf(buf, maxlen, p->fmt1, v);
@@ -1564,9 +2103,9 @@ static void format_aux(char *buf, int maxlen, UNUSED(int english), const struct
 
 
 
-static void format_fuel(char *buf, int maxlen, UNUSED(int english), const struct pid *p,
+static void format_fuel(char *buf, int maxlen, UNUSED(int english), UNUSED(const struct pid *p),
                         response *data, int n) {
-	int s = DATA_1(p, n, data);
+	int s = DATA_1(n, data);
 
 	switch (s) {
 	case 1 << 0:
@@ -1705,6 +2244,7 @@ const struct pid *get_pid ( unsigned int i ) {
 int main(int argc, char **argv) {
 	int i;
 	char *startfile=NULL;   /* optional commands to run at startup */
+	struct diag_os_rtcfg rtcfg = {0, -1};
 
 	for ( i = 1 ; i < argc ; i++ ) {
 		if ( argv[i][0] == '-' || argv[i][0] == '+' ) {
@@ -1720,6 +2260,23 @@ int main(int argc, char **argv) {
 				}
 				break;
 			case 'h': do_usage(); exit(0 );
+			case 'r': {
+				char *endp;
+				i++;
+				if (i >= argc) {
+					do_usage();
+					exit(1);
+				}
+				rtcfg.prio = (int) strtol(argv[i], &endp, 0);
+				if (*endp == ':') {
+					rtcfg.cpu = (int) strtol(endp + 1, &endp, 0);
+				}
+				if ((*endp != 0) || (rtcfg.prio <= 0)) {
+					do_usage();
+					exit(1);
+				}
+				break;
+			}
 			default: do_usage(); exit(1);
 			}
 		} else {
@@ -1728,6 +2285,13 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (rtcfg.prio > 0) {
+		if (diag_os_rt_setup(&rtcfg)) {
+			fprintf(stderr, "Could not set up real-time I/O, aborting.\n");
+			exit(1);
+		}
+	}
+
 	if (do_init()) {
 		exit(1);
 	}
@@ -26,6 +26,7 @@
  * J1978 Scan tool
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -40,6 +41,7 @@ extern "C" {
 typedef struct {
 	uint8_t type;
 	uint8_t len;
+	uint8_t pid;		/* PID / TID this response belongs to */
 	uint8_t data[7];
 
 } response;
@@ -48,6 +50,53 @@ typedef struct {
 #define TYPE_FAILED     1       /* Got failure response */
 #define TYPE_GOOD       2       /* Valid info */
 
+/** Supported-PID bitmap
+ *
+ * Bit n is set if PID (or TID, infotype, etc) n is supported. This replaces
+ * the old 256-byte "one flag per PID" arrays; iterate over set bits
+ * with PIDMAP_FOREACH instead of scanning all 256 PIDs.
+ */
+#define PIDMAP_WORDS	(0x100 / 32)
+typedef struct {
+	uint32_t w[PIDMAP_WORDS];
+} pidmap;
+
+void pidmap_set(pidmap *pm, unsigned int pid);
+bool pidmap_test(const pidmap *pm, unsigned int pid);
+/** dst |= src */
+void pidmap_merge(pidmap *dst, const pidmap *src);
+/** @return number of set bits below <pid>, i.e. rank of <pid> */
+unsigned int pidmap_rank(const pidmap *pm, unsigned int pid);
+/** @return first set PID >= start, or -1 if none */
+int pidmap_next(const pidmap *pm, int start);
+
+/** Iterate over all set PIDs >= start; pid must be an int */
+#define PIDMAP_FOREACH_FROM(pm, pid, start) \
+	for ((pid) = pidmap_next((pm), (start)); (pid) >= 0; (pid) = pidmap_next((pm), (pid) + 1))
+#define PIDMAP_FOREACH(pm, pid) PIDMAP_FOREACH_FROM(pm, pid, 0)
+
+/** Sparse response store
+ *
+ * Responses are densely packed in ascending PID order; the slot of a
+ * given PID is its rank in the "present" bitmap, so lookups are O(1) and
+ * iterating costs one step per stored response.
+ */
+typedef struct {
+	pidmap present;         /* PIDs that have a stored response */
+	unsigned int count;     /* # of responses in *resp */
+	unsigned int alloc;     /* # of slots allocated */
+	response *resp;
+} resp_store;
+
+/** @return stored response for <pid>, or NULL */
+response *resp_get(const resp_store *rs, unsigned int pid);
+/** @return stored response for <pid>, creating an empty (TYPE_UNTESTED) one if required; NULL if out of mem */
+response *resp_add(resp_store *rs, unsigned int pid);
+/** free all stored responses */
+void resp_clear(resp_store *rs);
+
+#define RESP_GOOD(r)    (((r) != NULL) && ((r)->type == TYPE_GOOD))
+
 /*
  * This structure holds all the data/config info for a given ecu
  * - one request can result in more than one ECU responding, and so
@@ -59,19 +108,19 @@ typedef struct {
 
 	uint8_t supress;        /* Supress output of data from ECU in monitor mode; not implemented*/
 
-	uint8_t mode1_info[0x100];      /* Pids supported by ECU */
-	uint8_t mode2_info[0x100];      /* Freeze frame version */
-	uint8_t mode5_info[0x100];      /* Mode 5 info */
-	uint8_t mode6_info[0x100];      /* Mode 6 info */
-	uint8_t mode8_info[0x100];      /* Mode 8 info */
-	uint8_t mode9_info[0x100];      /* Mode 9 info */
+	pidmap mode1_info;      /* Pids supported by ECU */
+	pidmap mode2_info;      /* Freeze frame version */
+	pidmap mode5_info;      /* Mode 5 info */
+	pidmap mode6_info;      /* Mode 6 info */
+	pidmap mode8_info;      /* Mode 8 info */
+	pidmap mode9_info;      /* Mode 9 info */
 
 	uint8_t data_good;              /* Flags for above data */
 
 	uint8_t O2_sensors;     /* O2 sensors bit mask */
 
-	response mode1_data[256];        /* Response data for all responses */
-	response mode2_data[256];        /* Same, but for freeze frame */
+	resp_store mode1_data;        /* Response data for all responses */
+	resp_store mode2_data;        /* Same, but for freeze frame */
 
 	struct diag_msg *rxmsg;         /* Received message */
 } ecu_data;
@@ -83,10 +132,28 @@ typedef struct {
 #define ECU_DATA_MODE8  0x10
 #define ECU_DATA_MODE9  0x20
 
-#define MAX_ECU 8                       /* Max 8 Ecus responding */
-extern ecu_data ecu_info[MAX_ECU];
+/*
+ * Table of responding ECUs, in order of first response. It grows as new
+ * source addresses answer, so it may move : keep indexes, not pointers,
+ * across calls to l3_do_j1979_rqst().
+ */
+extern ecu_data *ecu_info;
 extern unsigned int ecu_count;
 
+extern pidmap merged_mode1_info;        /* all ECUs' mode 1 PIDs */
+extern pidmap merged_mode5_info;        /* all ECUs' mode 5 TIDs */
+extern uint8_t global_O2_sensors;       /* O2 sensors bit mask, all ECUs */
+
+/** Find ECU entry by source address.
+ * @return NULL if that address never responded
+ */
+ecu_data *ecu_find(uint8_t addr);
+
+/** Find ECU entry by source address, adding a new one if required.
+ * @return NULL if out of memory
+ */
+ecu_data *ecu_add(uint8_t addr);
+
 struct diag_l2_conn;
 struct diag_l3_conn;
 
@@ -99,6 +166,15 @@ struct diag_l3_conn;
 int l3_do_j1979_rqst(struct diag_l3_conn *d_conn, uint8_t mode, uint8_t p1, uint8_t p2,
                      uint8_t p3, uint8_t p4, uint8_t p5, uint8_t p6, void *handle);
 
+/** Send a SAE J1979 mode 1 request for up to J1979_MAXPIDS PIDs at once (CAN only),
+ * and split the responses into each ECU's mode1_data.
+ *
+ * All PIDs must have a known data length.
+ * @return 0 if ok
+ */
+#define J1979_MAXPIDS	6
+int l3_do_j1979_rqst_multi(struct diag_l3_conn *d_conn, const uint8_t *pids, unsigned int npids);
+
 /*
  * Send some data on the connection
  */
@@ -112,6 +188,39 @@ int do_j1979_getO2sensors(void);
 int diag_cleardtc(void);
 int ecu_connect(void);
 
+/** Request vehicle info (mode 9) of type <itype>.
+ * @return data length (excluding 0x00 termination) written to *obuf; 0 if failed
+ */
+unsigned get_vit_info(struct diag_l3_conn *d_conn, uint8_t itype, uint8_t *obuf, unsigned buflen);
+
+/*
+ * Capability cache : supported PID maps, O2 sensor locations and ECU
+ * addresses of previously scanned vehicles, stored in the file
+ * set with "set capcache".
+ */
+
+/** Try to restore ECU capabilities of the current connection from the cache.
+ *
+ * The cached record is validated with a Mode 1 PID 0 request (the same ECUs
+ * must respond, with the same supported PIDs), then with the VIN if the
+ * record has one, or else by reading all the supported PID maps again.
+ * @return 0 if restored, <0 if not cached / mismatch / cache disabled.
+ */
+int capcache_restore(void);
+
+/** Save ECU capabilities of the current connection to the cache.
+ * @return 0 if ok (or cache disabled)
+ */
+int capcache_store(void);
+
+/** Get the protocol (struct protocol desc) that last connected on interface <l0name>.
+ * @return 0 if found (copied to *desc)
+ */
+int capcache_getproto(const char *l0name, char *desc, size_t len);
+
+/** Remember the protocol that connected on interface <l0name>. No-op if cache disabled */
+void capcache_setproto(const char *l0name, const char *desc);
+
 struct diag_msg *find_ecu_msg(int byte, databyte_type val);
 
 /*
@@ -136,7 +245,12 @@ extern const int _RQST_HANDLE_O2S;      //O2 sensor tests
 extern const int _RQST_HANDLE_READINESS;        //Readiness tests
 
 int do_j1979_getdata(int interruptible_flag);
-void do_j1979_basics(void);
+/** Get supported PIDs, DTCs, current data etc.
+ * @param discover : if 0, supported PID maps and O2 sensor locations
+ * are already known (restored from the capability cache) and are not
+ * requested again.
+ */
+void do_j1979_basics(bool discover);
 void do_j1979_cms(void);
 void do_j1979_ncms(int);
 void do_j1979_getpids(void);
@@ -154,7 +268,7 @@ void    l2raw_data_rcv(void *handle, struct diag_msg *msg);
 
 /** J1979 PID structures + utils **/
 struct pid;
-/* format <numbytes> bytes of data into buf, up to <maxlen> chars. */
+/* format data from the PID's response, starting at offset <numbytes>, into buf, up to <maxlen> chars. */
 typedef void (formatter)(char *buf, int maxlen, int units, const struct pid *, response *, int numbytes);
 
 struct pid {
@@ -170,10 +284,10 @@ struct pid {
 	double offset2;
 };
 
-#define DATA_VALID(p, d)        (d[p->pidID].type == TYPE_GOOD)
-#define DATA_1(p, n, d) (d[p->pidID].data[n])   /* extract 8bit value @offset n */
-#define DATA_2(p, n, d) (DATA_1(p, n, d) * 256 + DATA_1(p, n+1, d))     /* extract 16bit value @offset n */
-#define DATA_RAW(p, n, d)       (p->bytes == 1 ? DATA_1(p, n, d) : DATA_2(p, n, d))
+/* <d> is the (response *) for PID <p> */
+#define DATA_1(n, d)    ((d)->data[n])   /* extract 8bit value @offset n */
+#define DATA_2(n, d)    (DATA_1(n, d) * 256 + DATA_1(n+1, d))     /* extract 16bit value @offset n */
+#define DATA_RAW(p, n, d)       (p->bytes == 1 ? DATA_1(n, d) : DATA_2(n, d))
 
 #define DATA_SCALED(p, v)       (v * p->scale1 + p->offset1)
 #define DATA_ENGLISH(p, v)      (v * p->scale2 + p->offset2)
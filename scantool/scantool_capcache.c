@@ -0,0 +1,644 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Per-vehicle capability cache.
+ *
+ * A full "scan" spends most of its time discovering what the ECUs support
+ * (Mode 1/2/5/6/8/9 PID 0x00, 0x20, ... sweeps, O2 sensor locations). This
+ * stores the result of that discovery in a text file so that the next scan
+ * of the same vehicle can skip it.
+ *
+ * Records are keyed by L2 protocol, L1 protocol, init type and keybytes of
+ * the connection, and by VIN. The key alone doesn't identify a vehicle
+ * (nearly all ISO9141 ECUs send keybytes 08 08), so before a record is used :
+ * - a Mode 1 PID 0 request must get responses from the same set of ECUs,
+ *   with the same supported PIDs;
+ * - if the record has a VIN, the VIN is read again and must match;
+ * - otherwise, the ECU addresses and their Mode 1 PID 0x00 and 0x20 maps
+ *   identify the record : Mode 1 PID 0x20 is requested too, if supported,
+ *   and must match.
+ *
+ * The file also remembers, per interface, which protocol connected last
+ * so ecu_connect() can try it first.
+ *
+ * File format, one record per vehicle :
+ *
+ *	V <key> <VIN or '-'>
+ *	E <addr> <O2 sensors> <mode1 map> <mode2 map> <mode5 map> <mode6 map> <mode8 map> <mode9 map>
+ *	...
+ *
+ * with addr and O2 sensors as 2 hex digits, and each map as 64 hex digits
+ * (8 32-bit words, PIDs 0x00-0x1F first); and one line per interface :
+ *
+ *	P <L0 name> <protocol>
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_l2.h"
+#include "diag_l3.h"
+
+#include "scantool.h"
+#include "scantool_cli.h"
+#include "utlist.h"
+
+#define CC_KEYLEN	40
+#define CC_VINLEN	18	/* 17 chars + 0 */
+#define CC_NMAPS	6
+#define CC_LINELEN	(2 + 3 + 3 + CC_NMAPS * (PIDMAP_WORDS * 8 + 1) + 8)
+
+struct cc_ecu {
+	uint8_t addr;
+	uint8_t O2_sensors;
+	pidmap maps[CC_NMAPS];	/* mode 1, 2, 5, 6, 8, 9 */
+};
+
+struct cc_vehicle {
+	char key[CC_KEYLEN];
+	char vin[CC_VINLEN];
+	unsigned int necu;
+	struct cc_ecu *ecus;
+	bool live;	/* passed the Mode 1 PID 0 check, during capcache_restore() */
+	struct cc_vehicle *next;
+};
+
+#define CC_NAMELEN	32
+struct cc_proto {
+	char l0name[CC_NAMELEN];
+	char desc[CC_NAMELEN];
+	struct cc_proto *next;
+};
+
+/* contents of a cache file */
+struct cc_file {
+	struct cc_vehicle *vlist;
+	struct cc_proto *plist;
+};
+
+/* get pointers to the 6 maps of an ECU, in file order */
+static void ecu_maps(ecu_data *ep, pidmap *maps[CC_NMAPS]) {
+	maps[0] = &ep->mode1_info;
+	maps[1] = &ep->mode2_info;
+	maps[2] = &ep->mode5_info;
+	maps[3] = &ep->mode6_info;
+	maps[4] = &ep->mode8_info;
+	maps[5] = &ep->mode9_info;
+}
+
+/* build record key for the current connection. ret 0 if ok */
+static int make_key(char *key, size_t keylen) {
+	struct diag_l2_conn *d_l2_conn = global_l2_conn;
+
+	if ((d_l2_conn == NULL) || (d_l2_conn->l2proto == NULL)) {
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	snprintf(key, keylen, "%s/%d/%d/%02X%02X",
+	         d_l2_conn->l2proto->shortname,
+	         d_l2_conn->diag_link->l1proto,
+	         (int) (d_l2_conn->diag_l2_type & DIAG_L2_TYPE_INITMASK),
+	         d_l2_conn->diag_l2_kb1, d_l2_conn->diag_l2_kb2);
+	return 0;
+}
+
+static void free_file(struct cc_file *cf) {
+	struct cc_vehicle *vp, *vtmp;
+	struct cc_proto *pp, *ptmp;
+
+	LL_FOREACH_SAFE(cf->vlist, vp, vtmp) {
+		LL_DELETE(cf->vlist, vp);
+		free(vp->ecus);
+		free(vp);
+	}
+	LL_FOREACH_SAFE(cf->plist, pp, ptmp) {
+		LL_DELETE(cf->plist, pp);
+		free(pp);
+	}
+}
+
+/* append a new, zeroed ECU to vp. */
+static struct cc_ecu *vehicle_addecu(struct cc_vehicle *vp) {
+	struct cc_ecu *newecus;
+
+	if (diag_calloc(&newecus, vp->necu + 1)) {
+		return diag_pseterr(DIAG_ERR_NOMEM);
+	}
+	if (vp->necu) {
+		memcpy(newecus, vp->ecus, vp->necu * sizeof(*newecus));
+	}
+	free(vp->ecus);
+	vp->ecus = newecus;
+	return &vp->ecus[vp->necu++];
+}
+
+static void map_write(FILE *fp, const pidmap *pm) {
+	unsigned int i;
+
+	fputc(' ', fp);
+	for (i = 0; i < PIDMAP_WORDS; i++) {
+		fprintf(fp, "%08lX", (unsigned long) pm->w[i]);
+	}
+}
+
+/* parse 64 hex digits into *pm; ret 0 if ok */
+static int map_parse(const char *s, pidmap *pm) {
+	unsigned int i;
+	char word[9];
+
+	if (strlen(s) != PIDMAP_WORDS * 8) {
+		return DIAG_ERR_BADVAL;
+	}
+	word[8] = 0;
+	for (i = 0; i < PIDMAP_WORDS; i++) {
+		char *endp;
+		memcpy(word, &s[i * 8], 8);
+		pm->w[i] = (uint32_t) strtoul(word, &endp, 16);
+		if (*endp != 0) {
+			return DIAG_ERR_BADVAL;
+		}
+	}
+	return 0;
+}
+
+/* parse "E ..." line into ep; ret 0 if ok */
+static int ecu_parse(char *line, struct cc_ecu *cp) {
+	char *tok;
+	unsigned int i;
+
+	strtok(line, " \t\r\n");	//skip "E"
+
+	tok = strtok(NULL, " \t\r\n");
+	if (tok == NULL) {
+		return DIAG_ERR_BADVAL;
+	}
+	cp->addr = (uint8_t) strtoul(tok, NULL, 16);
+
+	tok = strtok(NULL, " \t\r\n");
+	if (tok == NULL) {
+		return DIAG_ERR_BADVAL;
+	}
+	cp->O2_sensors = (uint8_t) strtoul(tok, NULL, 16);
+
+	for (i = 0; i < CC_NMAPS; i++) {
+		tok = strtok(NULL, " \t\r\n");
+		if ((tok == NULL) || map_parse(tok, &cp->maps[i])) {
+			return DIAG_ERR_BADVAL;
+		}
+	}
+	return 0;
+}
+
+/* Load the whole cache file. A missing file is not an error (returns 0 with empty *cf). */
+static int cache_load(const char *fname, struct cc_file *cf) {
+	FILE *fp;
+	char line[CC_LINELEN];
+	struct cc_vehicle *vp = NULL;
+	unsigned int lineno = 0;
+	int rv = 0;
+
+	cf->vlist = NULL;
+	cf->plist = NULL;
+	fp = fopen(fname, "r");
+	if (fp == NULL) {
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		switch (line[0]) {
+		case 'V': {
+			char vin[CC_VINLEN + 1];
+			if (diag_calloc(&vp, 1)) {
+				rv = DIAG_ERR_NOMEM;
+				break;
+			}
+			if (sscanf(line, "V %39s %18s", vp->key, vin) != 2) {
+				free(vp);
+				vp = NULL;
+				rv = DIAG_ERR_BADVAL;
+				break;
+			}
+			if (strcmp(vin, "-") != 0) {
+				strncpy(vp->vin, vin, CC_VINLEN - 1);
+			}
+			LL_APPEND(cf->vlist, vp);
+			break;
+		}
+		case 'P': {
+			struct cc_proto *pp;
+			if (diag_calloc(&pp, 1)) {
+				rv = DIAG_ERR_NOMEM;
+				break;
+			}
+			if (sscanf(line, "P %31s %31s", pp->l0name, pp->desc) != 2) {
+				free(pp);
+				rv = DIAG_ERR_BADVAL;
+				break;
+			}
+			LL_APPEND(cf->plist, pp);
+			break;
+		}
+		case 'E': {
+			struct cc_ecu *cp;
+			if (vp == NULL) {
+				rv = DIAG_ERR_BADVAL;
+				break;
+			}
+			cp = vehicle_addecu(vp);
+			if (cp == NULL) {
+				rv = DIAG_ERR_NOMEM;
+				break;
+			}
+			if (ecu_parse(line, cp)) {
+				rv = DIAG_ERR_BADVAL;
+			}
+			break;
+		}
+		default:
+			//comments, blank lines
+			break;
+		}
+		if (rv) {
+			break;
+		}
+	}
+	fclose(fp);
+
+	if (rv) {
+		fprintf(stderr, "capcache: %s line %u: bad record, ignoring file\n", fname, lineno);
+		free_file(cf);
+		return diag_iseterr(rv);
+	}
+	return 0;
+}
+
+static int cache_save(const char *fname, struct cc_file *cf) {
+	FILE *fp;
+	struct cc_vehicle *vp;
+	struct cc_proto *pp;
+	unsigned int i, j;
+
+	fp = fopen(fname, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "capcache: could not write %s\n", fname);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	fprintf(fp, "# freediag capability cache\n");
+	LL_FOREACH(cf->plist, pp) {
+		fprintf(fp, "P %s %s\n", pp->l0name, pp->desc);
+	}
+	LL_FOREACH(cf->vlist, vp) {
+		fprintf(fp, "V %s %s\n", vp->key, vp->vin[0] ? vp->vin : "-");
+		for (i = 0; i < vp->necu; i++) {
+			struct cc_ecu *cp = &vp->ecus[i];
+			fprintf(fp, "E %02X %02X", cp->addr, cp->O2_sensors);
+			for (j = 0; j < CC_NMAPS; j++) {
+				map_write(fp, &cp->maps[j]);
+			}
+			fputc('\n', fp);
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* compare the ECU addresses and their Mode 1 PID 0x00/0x20 maps (PIDs
+ * 0x01-0x40) found by the scan to a record. ret 1 if they match
+ */
+static bool ecus_match(const struct cc_vehicle *vp) {
+	unsigned int i, pid;
+
+	if (ecu_count != vp->necu) {
+		return 0;
+	}
+	for (i = 0; i < vp->necu; i++) {
+		const struct cc_ecu *cp = &vp->ecus[i];
+		ecu_data *ep = ecu_find(cp->addr);
+
+		if (ep == NULL) {
+			return 0;
+		}
+		for (pid = 1; pid <= 0x40; pid++) {
+			if (pidmap_test(&ep->mode1_info, pid) != pidmap_test(&cp->maps[0], pid)) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* records without a VIN are told apart by their ECUs */
+static struct cc_vehicle *find_vehicle(struct cc_vehicle *vlist, const char *key, const char *vin) {
+	struct cc_vehicle *vp;
+
+	LL_FOREACH(vlist, vp) {
+		if ((strcmp(vp->key, key) == 0) && (strcmp(vp->vin, vin) == 0) &&
+		    (vin[0] || ecus_match(vp))) {
+			return vp;
+		}
+	}
+	return NULL;
+}
+
+/* request the VIN (Mode 9 PID 2); vin is left empty if that fails. */
+static void read_vin(char vin[CC_VINLEN]) {
+	uint8_t infostring[0x100];
+	unsigned int i, j;
+
+	vin[0] = 0;
+	if (get_vit_info(global_l3_conn, 2, infostring, sizeof(infostring)) <= 3) {
+		return;
+	}
+	//skip padding, and spaces which would break the file format
+	for (i = 0, j = 3; (infostring[j] != 0) && (i < CC_VINLEN - 1); j++) {
+		if (infostring[j] > ' ') {
+			vin[i++] = (char) infostring[j];
+		}
+	}
+	vin[i] = 0;
+}
+
+/* check Mode 1 PID <pid> (0x00 or 0x20) responses (in ecu_info) against record.
+ * With PID 0x20, only the ECUs that support it are checked. ret 1 if they match
+ */
+static bool vehicle_matches(const struct cc_vehicle *vp, unsigned int pid) {
+	unsigned int i, j;
+	ecu_data *ep;
+
+	if (ecu_count != vp->necu) {
+		return 0;
+	}
+
+	for (i = 0; i < vp->necu; i++) {
+		const struct cc_ecu *cp = &vp->ecus[i];
+
+		if (pid && !pidmap_test(&cp->maps[0], pid)) {
+			continue;
+		}
+		ep = ecu_find(cp->addr);
+		if ((ep == NULL) || (ep->rxmsg == NULL)) {
+			return 0;
+		}
+		if ((ep->rxmsg->data[0] != 0x41) || (ep->rxmsg->len < 6) ||
+		    (ep->rxmsg->data[1] != pid)) {
+			return 0;
+		}
+		for (j = 1; j <= 0x20; j++) {
+			bool live = l2_check_pid_bits(&ep->rxmsg->data[2], (int) j);
+			if (live != pidmap_test(&cp->maps[0], pid + j)) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* does any ECU of the record support Mode 1 PID 0x20 */
+static bool has_pid20(const struct cc_vehicle *vp) {
+	unsigned int i;
+
+	for (i = 0; i < vp->necu; i++) {
+		if (pidmap_test(&vp->ecus[i].maps[0], 0x20)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int capcache_restore(void) {
+	struct cc_file cf;
+	struct cc_vehicle *vp, *cand;
+	char key[CC_KEYLEN];
+	char vin[CC_VINLEN];
+	bool needvin = 0, needpid20 = 0;
+	unsigned int i, j;
+	int rv;
+
+	if (global_cfg.capcache == NULL) {
+		return DIAG_ERR_GENERAL;
+	}
+	if (make_key(key, sizeof(key))) {
+		return DIAG_ERR_GENERAL;
+	}
+	if (cache_load(global_cfg.capcache, &cf)) {
+		return DIAG_ERR_GENERAL;
+	}
+
+	LL_FOREACH(cf.vlist, cand) {
+		if (strcmp(cand->key, key) == 0) {
+			break;
+		}
+	}
+	if (cand == NULL) {
+		printf("Vehicle not in capability cache\n");
+		free_file(&cf);
+		return DIAG_ERR_GENERAL;
+	}
+
+	/* first check : same ECUs, same first block of Mode 1 PIDs */
+	fprintf(stderr, "Requesting Mode 0x01 PID 0x00 (validate cache)...\n");
+	rv = l3_do_j1979_rqst(global_l3_conn, 1, 0, 0x00,
+	                      0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL);
+	LL_FOREACH(cf.vlist, cand) {
+		cand->live = (rv == 0) && (strcmp(cand->key, key) == 0) && vehicle_matches(cand, 0x00);
+		if (cand->live && cand->vin[0]) {
+			needvin = 1;
+		} else if (cand->live && has_pid20(cand)) {
+			needpid20 = 1;
+		}
+	}
+
+	/* then tell vehicles with the same key apart */
+	vin[0] = 0;
+	if (needvin) {
+		fprintf(stderr, "Requesting VIN (validate cache)...\n");
+		read_vin(vin);
+	}
+	if (!vin[0] && needpid20) {
+		fprintf(stderr, "Requesting Mode 0x01 PID 0x20 (validate cache)...\n");
+		(void) l3_do_j1979_rqst(global_l3_conn, 1, 0x20, 0,
+		                        0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL);
+	}
+	vp = NULL;
+	LL_FOREACH(cf.vlist, cand) {
+		if (!cand->live || (strcmp(cand->vin, vin) != 0)) {
+			continue;
+		}
+		/* a failed PID 0x20 request leaves the PID 0 responses : no match */
+		if (vin[0] || vehicle_matches(cand, 0x20)) {
+			vp = cand;
+			break;
+		}
+	}
+	if (vp == NULL) {
+		printf("Capability cache mismatch, doing full scan\n");
+		free_file(&cf);
+		return DIAG_ERR_GENERAL;
+	}
+
+	memset(&merged_mode1_info, 0, sizeof(merged_mode1_info));
+	memset(&merged_mode5_info, 0, sizeof(merged_mode5_info));
+	global_O2_sensors = 0;
+	for (i = 0; i < vp->necu; i++) {
+		const struct cc_ecu *cp = &vp->ecus[i];
+		ecu_data *ep = ecu_find(cp->addr);
+		pidmap *maps[CC_NMAPS];
+
+		ecu_maps(ep, maps);
+		for (j = 0; j < CC_NMAPS; j++) {
+			*maps[j] = cp->maps[j];
+		}
+		ep->O2_sensors = cp->O2_sensors;
+		global_O2_sensors |= cp->O2_sensors;
+		pidmap_merge(&merged_mode1_info, &ep->mode1_info);
+		pidmap_merge(&merged_mode5_info, &ep->mode5_info);
+	}
+
+	printf("Using cached capabilities for %s\n", vp->vin[0] ? vp->vin : key);
+	free_file(&cf);
+	return 0;
+}
+
+int capcache_store(void) {
+	struct cc_file cf;
+	struct cc_vehicle *vp;
+	char key[CC_KEYLEN];
+	char vin[CC_VINLEN];
+	unsigned int i, j;
+	ecu_data *ep;
+	pidmap merged_mode9_info;
+	int rv;
+
+	if (global_cfg.capcache == NULL) {
+		return 0;
+	}
+	if (make_key(key, sizeof(key))) {
+		return DIAG_ERR_GENERAL;
+	}
+	(void) cache_load(global_cfg.capcache, &cf);    //bad file : overwrite it
+
+	memset(&merged_mode9_info, 0, sizeof(merged_mode9_info));
+	for (i = 0, ep = ecu_info; i < ecu_count; i++, ep++) {
+		pidmap_merge(&merged_mode9_info, &ep->mode9_info);
+	}
+	/* The VIN tells apart vehicles with the same key */
+	vin[0] = 0;
+	if (pidmap_test(&merged_mode9_info, 2)) {
+		read_vin(vin);
+	}
+
+	/* replace any previous record for this vehicle */
+	vp = find_vehicle(cf.vlist, key, vin);
+	if (vp != NULL) {
+		LL_DELETE(cf.vlist, vp);
+		free(vp->ecus);
+		free(vp);
+	}
+
+	if (diag_calloc(&vp, 1)) {
+		free_file(&cf);
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	}
+	strcpy(vp->key, key);
+	strcpy(vp->vin, vin);
+	LL_APPEND(cf.vlist, vp);
+
+	for (i = 0, ep = ecu_info; i < ecu_count; i++, ep++) {
+		struct cc_ecu *cp;
+		pidmap *maps[CC_NMAPS];
+
+		cp = vehicle_addecu(vp);
+		if (cp == NULL) {
+			free_file(&cf);
+			return DIAG_ERR_NOMEM;
+		}
+		cp->addr = ep->ecu_addr;
+		cp->O2_sensors = ep->O2_sensors;
+		ecu_maps(ep, maps);
+		for (j = 0; j < CC_NMAPS; j++) {
+			cp->maps[j] = *maps[j];
+		}
+	}
+
+	rv = cache_save(global_cfg.capcache, &cf);
+	if (rv == 0) {
+		printf("Capabilities saved to %s\n", global_cfg.capcache);
+	}
+	free_file(&cf);
+	return rv;
+}
+
+int capcache_getproto(const char *l0name, char *desc, size_t len) {
+	struct cc_file cf;
+	struct cc_proto *pp;
+	int rv = DIAG_ERR_GENERAL;
+
+	if ((global_cfg.capcache == NULL) || (l0name == NULL)) {
+		return DIAG_ERR_GENERAL;
+	}
+	if (cache_load(global_cfg.capcache, &cf)) {
+		return DIAG_ERR_GENERAL;
+	}
+	LL_FOREACH(cf.plist, pp) {
+		if (strcasecmp(pp->l0name, l0name) == 0) {
+			snprintf(desc, len, "%s", pp->desc);
+			rv = 0;
+			break;
+		}
+	}
+	free_file(&cf);
+	return rv;
+}
+
+void capcache_setproto(const char *l0name, const char *desc) {
+	struct cc_file cf;
+	struct cc_proto *pp;
+
+	if ((global_cfg.capcache == NULL) || (l0name == NULL)) {
+		return;
+	}
+	(void) cache_load(global_cfg.capcache, &cf);
+
+	LL_FOREACH(cf.plist, pp) {
+		if (strcasecmp(pp->l0name, l0name) == 0) {
+			break;
+		}
+	}
+	if (pp == NULL) {
+		if (diag_calloc(&pp, 1)) {
+			free_file(&cf);
+			return;
+		}
+		snprintf(pp->l0name, sizeof(pp->l0name), "%s", l0name);
+		LL_APPEND(cf.plist, pp);
+	} else if (strcmp(pp->desc, desc) == 0) {
+		//unchanged : don't rewrite the file
+		free_file(&cf);
+		return;
+	}
+	snprintf(pp->desc, sizeof(pp->desc), "%s", desc);
+	(void) cache_save(global_cfg.capcache, &cf);
+	free_file(&cf);
+}
@@ -38,7 +38,12 @@
 #include <string.h>
 
 #include "diag.h"
+#include "diag_err.h"
+#include "diag_hex.h"
+#include "diag_l2.h"
+#include "diag_l3.h"
 #include "diag_os.h"
+#include "diag_stats.h"
 
 #include "libcli.h"
 #include "scantool_cli.h"
@@ -72,6 +77,7 @@ UNUSED(static enum cli_retval cmd_play(int argc, char **argv));
 
 static enum cli_retval cmd_date(int argc, char **argv);
 static enum cli_retval cmd_rem(int argc, char **argv);
+static enum cli_retval cmd_stats(int argc, char **argv);
 
 
 /* this table is appended to the "extra" cmdtable to construct the whole root cmd table */
@@ -103,6 +109,13 @@ static const struct cmd_tbl_entry basic_cmd_table[] = {
 	  "'96-'98 Volvo 850/S70/V70/etc functions, \"850 help\" for more info", NULL,
 	  0, v850_cmd_table},
 
+	{ "uds", "uds <command [params]>",
+	  "ISO14229 (UDS) functions, \"uds help\" for more info", NULL,
+	  0, uds_cmd_table},
+	{ "kwp", "kwp <command [params]>",
+	  "ISO14230 (KWP2000) functions, \"kwp help\" for more info", NULL,
+	  0, kwp_cmd_table},
+
 	{ "dyno", "dyno <command [params]",
 	  "Dyno functions, \"dyno help\" for more info", NULL,
 	  0, dyno_cmd_table},
@@ -111,6 +124,10 @@ static const struct cmd_tbl_entry basic_cmd_table[] = {
 	  "Sets/displays debug data and flags, \"debug help\" for available commands", NULL,
 	  0, debug_cmd_table},
 
+	{ "stats", "stats [raw [filename] | reset]",
+	  "Show link statistics (traffic counters, latency histograms) of the current connection",
+	  cmd_stats, 0, NULL},
+
 	{ "date", "date", "Prints date & time", cmd_date, CLI_CMD_HIDDEN, NULL},
 	{ "#", "#", "Does nothing", cmd_rem, CLI_CMD_HIDDEN, NULL},
 	{ "source", "source <file>", "Read commands from a file", cmd_source, CLI_CMD_FILEARG, NULL},
@@ -151,6 +168,51 @@ static enum cli_retval cmd_rem(UNUSED(int argc), UNUSED(char **argv)) {
 }
 
 
+static enum cli_retval cmd_stats(int argc, char **argv) {
+	struct diag_stats st;
+	FILE *out = stdout;
+
+	if (global_l2_conn == NULL) {
+		printf("Not connected.\n");
+		return CMD_FAILED;
+	}
+
+	if ((argc > 1) && (strcasecmp(argv[1], "reset") == 0)) {
+		if (diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_RESET_STATS, NULL)) {
+			return CMD_FAILED;
+		}
+		printf("Statistics cleared.\n");
+		return CMD_OK;
+	}
+
+	if (diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_GET_STATS, &st)) {
+		return CMD_FAILED;
+	}
+
+	if (argc == 1) {
+		diag_stats_print(stdout, &st);
+		return CMD_OK;
+	}
+
+	if (strcasecmp(argv[1], "raw") != 0) {
+		return CMD_USAGE;
+	}
+
+	if (argc > 2) {
+		out = fopen(argv[2], "w");
+		if (out == NULL) {
+			printf("Could not open %s.\n", argv[2]);
+			return CMD_FAILED;
+		}
+	}
+	diag_stats_dump(out, &st);
+	if (out != stdout) {
+		fclose(out);
+	}
+	return CMD_OK;
+}
+
+
 void log_timestamp(const char *prefix) {
 	unsigned long tv;
 
@@ -431,17 +493,9 @@ int htoi(char *buf) {
 	}
 
 	while (*buf) {
-		char upp = toupper(*buf);
-		int val;
+		int val = diag_hex_nibble(*buf);
 
-		if ((upp >= '0') && (upp <= '9')) {
-			val = ((*buf) - '0');
-		} else if ((upp >= 'A') && (upp <= 'F')) {
-			val = (upp - 'A' + 10);
-		} else {
-			return 0;
-		}
-		if (val >= base) { /* Value too big for this base */
+		if ((val < 0) || (val >= base)) { /* Value too big for this base */
 			return 0;
 		}
 		rv *= base;
@@ -452,6 +506,31 @@ int htoi(char *buf) {
 	return sign? rv:-rv;
 }
 
+
+struct diag_l3_conn *cli_l3conn(const char *proto) {
+	char l3name[16];
+	size_t i;
+
+	if ((global_state >= STATE_L3ADDED) && (global_l3_conn != NULL) &&
+	    (strcasecmp(global_l3_conn->d_l3_proto->proto_name, proto) == 0)) {
+		return global_l3_conn;
+	}
+	for (i = 0; proto[i] && (i < sizeof(l3name) - 1); i++) {
+		l3name[i] = (char) tolower((unsigned char) proto[i]);
+	}
+	l3name[i] = 0;
+	printf("No %s connection; use \"diag connect\" then \"diag addl3 %s\".\n", proto, l3name);
+	return NULL;
+}
+
+void cli_l3perror(const char *what, int rv, const char *nrcstr) {
+	if (rv == DIAG_ERR_ECUSAIDNO) {
+		printf("%s : negative response, %s\n", what, nrcstr);
+	} else {
+		printf("%s failed : %s\n", what, diag_errlookup(rv));
+	}
+}
+
 /*
  * Wait until ENTER is pressed
  */
@@ -69,6 +69,24 @@ int pressed_enter(void);
 int htoi(char *buf);
 
 
+struct diag_l3_conn;
+
+/** Get the global L3 connection, if it runs <proto>.
+ *
+ * @param proto : L3 proto_name, e.g. "UDS"
+ * @return NULL after telling the user how to start one, if there's none.
+ */
+struct diag_l3_conn *cli_l3conn(const char *proto);
+
+/** Report a failed L3 request.
+ *
+ * @param what : name of the request
+ * @param rv : its error code
+ * @param nrcstr : description of the NRC, if it got a negative response
+ */
+void cli_l3perror(const char *what, int rv, const char *nrcstr);
+
+
 extern int diag_cli_debug;      /* debug level */
 extern FILE             *global_logfp;          /* Monitor log output file pointer */
 void log_timestamp(const char *prefix);
@@ -92,6 +110,7 @@ extern struct globcfg {
 	int L2idx;              /* index of that L2 proto in struct l2proto_list[] */
 
 	const char *l0name;     /* L0 interface name to use */
+	char *capcache;         /* capability cache file, NULL if disabled */
 	//struct diag_l0_device *dl0d;	/* L0 device to use */
 } global_cfg;
 
@@ -122,6 +141,8 @@ extern const struct cmd_tbl_entry test_cmd_table[];
 extern const struct cmd_tbl_entry diag_cmd_table[];
 extern const struct cmd_tbl_entry vag_cmd_table[];
 extern const struct cmd_tbl_entry v850_cmd_table[];
+extern const struct cmd_tbl_entry uds_cmd_table[];
+extern const struct cmd_tbl_entry kwp_cmd_table[];
 extern const struct cmd_tbl_entry dyno_cmd_table[];
 
 #if defined(__cplusplus)
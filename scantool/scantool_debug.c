@@ -29,6 +29,7 @@
 #include <string.h>
 
 #include "diag.h"
+#include "diag_os.h"
 #include "diag_l0.h"
 #include "diag_l1.h"
 #include "diag_l2.h"
@@ -80,6 +81,9 @@ static enum cli_retval cmd_debug_l2(int argc, char **argv);
 static enum cli_retval cmd_debug_l3(int argc, char **argv);
 static enum cli_retval cmd_debug_all(int argc, char **argv);
 static enum cli_retval cmd_debug_l0test(int argc, char **argv);
+static enum cli_retval cmd_debug_trace(int argc, char **argv);
+static enum cli_retval cmd_debug_spinwait(int argc, char **argv);
+static enum cli_retval cmd_debug_calibrate(int argc, char **argv);
 
 const struct cmd_tbl_entry debug_cmd_table[] = {
 	{ "help", "help [command]", "Gives help for a command",
@@ -104,6 +108,15 @@ const struct cmd_tbl_entry debug_cmd_table[] = {
 	  cmd_debug_all, 0, NULL},
 	{ "l0test", "l0test [testnum]", "Dumb interface tests. Disconnect from vehicle first !",
 	  cmd_debug_l0test, 0, NULL},
+	{ "trace", "trace [on [nrec] | off | dump | flush file | clear]",
+	  "Record debug messages in memory instead of printing them (keeps bus timings intact); "
+	  "show, save or discard the recording",
+	  cmd_debug_trace, 0, NULL},
+	{ "spinwait", "spinwait [on | off]",
+	  "Busy-wait the last part of sub-ms timing waits (P4 etc) for accuracy, at the cost of CPU time",
+	  cmd_debug_spinwait, 0, NULL},
+	{ "calibrate", "calibrate", "Measure OS timing performance again, and update the cached results",
+	  cmd_debug_calibrate, 0, NULL},
 	CLI_TBL_BUILTINS,
 	CLI_TBL_END
 };
@@ -123,7 +136,7 @@ static enum cli_retval cmd_debug_help(int argc, char **argv) {
 
 
 
-static enum cli_retval cmd_debug_common( const char *txt, int *val, int argc, char **argv) {
+static enum cli_retval cmd_debug_common( const char *txt, int *val, int cmask, int argc, char **argv) {
 	int r;
 	int i;
 
@@ -140,25 +153,28 @@ static enum cli_retval cmd_debug_common( const char *txt, int *val, int argc, ch
 			printf("%s ", debugflags[i].shortdescr);
 		}
 	}
+	if ((*val & cmask) != *val) {
+		printf("(build only has 0x%X)", cmask);
+	}
 	printf("\n");
 
 	return CMD_OK;
 }
 
 static enum cli_retval cmd_debug_l0(int argc, char **argv) {
-	return cmd_debug_common("L0", &diag_l0_debug, argc, argv);
+	return cmd_debug_common("L0", &diag_l0_debug, DIAG_DBGMASK_diag_l0_debug, argc, argv);
 }
 static enum cli_retval cmd_debug_l1(int argc, char **argv) {
-	return cmd_debug_common("L1", &diag_l1_debug, argc, argv);
+	return cmd_debug_common("L1", &diag_l1_debug, DIAG_DBGMASK_diag_l1_debug, argc, argv);
 }
 static enum cli_retval cmd_debug_l2(int argc, char **argv) {
-	return cmd_debug_common("L2", &diag_l2_debug, argc, argv);
+	return cmd_debug_common("L2", &diag_l2_debug, DIAG_DBGMASK_diag_l2_debug, argc, argv);
 }
 static enum cli_retval cmd_debug_l3(int argc, char **argv) {
-	return cmd_debug_common("L3", &diag_l3_debug, argc, argv);
+	return cmd_debug_common("L3", &diag_l3_debug, DIAG_DBGMASK_diag_l3_debug, argc, argv);
 }
 static enum cli_retval cmd_debug_cli(int argc, char **argv) {
-	return cmd_debug_common("CLI", &diag_cli_debug, argc, argv);
+	return cmd_debug_common("CLI", &diag_cli_debug, DIAG_DBGMASK_diag_cli_debug, argc, argv);
 	//for now, value > 0x80 will enable all debugging info.
 }
 
@@ -249,3 +265,75 @@ static enum cli_retval cmd_debug_l0test(int argc, char **argv) {
 
 
 }
+
+
+// cmd_debug_trace : control the binary trace backend (see diag_trace.h)
+static enum cli_retval cmd_debug_trace(int argc, char **argv) {
+	if (argc < 2) {
+		printf("Trace is %s, %lu records held.\n",
+		       diag_trace_enabled? "on":"off", diag_trace_count());
+		return CMD_OK;
+	}
+
+	if (strcasecmp(argv[1], "on") == 0) {
+		unsigned int nrec = 0;
+		if (argc >= 3) {
+			nrec = (unsigned int) htoi(argv[2]);
+		}
+		diag_trace_enable(nrec);
+		printf("Debug messages now recorded to trace buffer.\n");
+	} else if (strcasecmp(argv[1], "off") == 0) {
+		diag_trace_disable();
+		printf("Debug messages now printed.\n");
+	} else if (strcasecmp(argv[1], "dump") == 0) {
+		printf("%lu records.\n", diag_trace_dump(stdout));
+	} else if (strcasecmp(argv[1], "flush") == 0) {
+		if (argc != 3) {
+			return CMD_USAGE;
+		}
+		if (diag_trace_save(argv[2])) {
+			printf("Could not save trace to %s\n", argv[2]);
+			return CMD_FAILED;
+		}
+		diag_trace_clear();
+		printf("Trace saved to %s.\n", argv[2]);
+	} else if (strcasecmp(argv[1], "clear") == 0) {
+		diag_trace_clear();
+	} else {
+		return CMD_USAGE;
+	}
+	return CMD_OK;
+}
+
+
+// cmd_debug_spinwait : enable / disable diag_os_sleepuntil() busy-wait tail
+static enum cli_retval cmd_debug_spinwait(int argc, char **argv) {
+	static bool spin_on = 0;
+	unsigned long us;
+
+	if (argc >= 2) {
+		if (strcasecmp(argv[1], "on") == 0) {
+			spin_on = 1;
+		} else if (strcasecmp(argv[1], "off") == 0) {
+			spin_on = 0;
+		} else {
+			return CMD_USAGE;
+		}
+	}
+	us = diag_os_setspin(spin_on);
+	printf("Spin wait is %s (last %luus of each wait).\n", spin_on? "on":"off", us);
+	return CMD_OK;
+}
+
+// cmd_debug_calibrate : redo diag_os timing discovery + calibration
+static enum cli_retval cmd_debug_calibrate(int argc, UNUSED(char **argv)) {
+	if (argc > 1) {
+		return CMD_USAGE;
+	}
+	if (global_state >= STATE_CONNECTED) {
+		printf("Disconnect first.\n");
+		return CMD_FAILED;
+	}
+	diag_os_recalibrate();
+	return CMD_OK;
+}
@@ -36,11 +36,14 @@
 #include <string.h>
 
 #include "diag.h"
+#include "diag_cfg.h"
 #include "diag_l0.h"
 #include "diag_l1.h"
 #include "diag_l2.h"
 #include "diag_l3.h"
 #include "diag_err.h"
+#include "diag_os.h"
+#include "utlist.h"
 
 #include "libcli.h"
 
@@ -60,6 +63,8 @@ static enum cli_retval cmd_diag_reml3(UNUSED(int argc), UNUSED(char **argv));
 
 static enum cli_retval cmd_diag_probe(int argc, char **argv);
 static enum cli_retval cmd_diag_fastprobe(int argc, char **argv);
+static enum cli_retval cmd_diag_funcprobe(int argc, char **argv);
+static enum cli_retval cmd_diag_mprobe(int argc, char **argv);
 
 const struct cmd_tbl_entry diag_cmd_table[] = {
 	{ "help", "help [command]", "Gives help for a command",
@@ -89,6 +94,11 @@ const struct cmd_tbl_entry diag_cmd_table[] = {
 
 	{ "probe", "probe start_addr [stop_addr]", "Scan bus using ISO9141 5 baud init [slow!]", cmd_diag_probe, 0, NULL},
 	{ "fastprobe", "fastprobe start_addr [stop_addr [func]]", "Scan bus using ISO14230 fast init with physical or functional addressing", cmd_diag_fastprobe, 0, NULL},
+	{ "funcprobe", "funcprobe [func_addr]", "List every ECU answering one ISO14230 functional fast init (default addr 0x33)", cmd_diag_funcprobe, 0, NULL},
+	{ "mprobe", "mprobe start_addr stop_addr slow|fast dev1 [dev2 [...]]",
+	  "Scan bus with several interfaces of the current type in parallel, splitting the address range. "
+	  "Each devN sets the first L0 item (port, simfile...); other items are copied from the current interface.",
+	  cmd_diag_mprobe, 0, NULL},
 	CLI_TBL_BUILTINS,
 	CLI_TBL_END
 };
@@ -237,8 +247,8 @@ static enum cli_retval cmd_diag_probe_common(int argc, char **argv, int fastflag
 		return CMD_OK;
 	}
 
-	/* Open interface using hardware type ISO9141 */
-	rv = diag_l2_open(dl0d, DIAG_L1_ISO9141);
+	/* Open interface using the L1 type of the init we'll do */
+	rv = diag_l2_open(dl0d, fastflag? DIAG_L1_ISO14230 : DIAG_L1_ISO9141);
 	if (rv) {
 		printf("Failed to open hardware interface, error 0x%X",rv);
 		if (rv == DIAG_ERR_PROTO_NOTSUPP) {
@@ -321,6 +331,310 @@ static enum cli_retval cmd_diag_fastprobe(int argc, char **argv) {
 }
 
 
+/* Print the ECUs that answered a functional StartComms */
+static void print_responders(const struct diag_l2_data *d) {
+	unsigned int i;
+
+	for (i = 0; i < d->nresp; i++) {
+		printf("\t0x%02X: keybytes 0x%02X 0x%02X\n", d->resp[i].physaddr,
+		       d->resp[i].kb1, d->resp[i].kb2);
+	}
+}
+
+/*
+ * funcprobe [func_addr] : one ISO14230 fastinit to a functional address;
+ * every ECU on the bus answers in the same window, so this finds them all
+ * in a single init instead of one init per address.
+ */
+static enum cli_retval cmd_diag_funcprobe(int argc, char **argv) {
+	struct diag_l0_device *dl0d = global_dl0d;
+	struct diag_l2_conn *d_conn;
+	struct diag_l2_data d;
+	unsigned int tgt = 0x33;
+	unsigned long t0;
+	int rv;
+
+	if (argc > 2) {
+		return CMD_USAGE;
+	}
+	if (argc == 2) {
+		if (strcmp(argv[1], "?") == 0) {
+			return CMD_USAGE;
+		}
+		tgt = htoi(argv[1]);
+		if (tgt > 255) {
+			printf("Value must be between 0 and 255\n");
+			return CMD_OK;
+		}
+	}
+
+	if (global_state != STATE_IDLE) {
+		printf("Cannot probe while there is an active global connection.\n");
+		return CMD_FAILED;
+	}
+
+	if (!dl0d) {
+		printf("No global L0. Please select + configure L0 first\n");
+		return CMD_FAILED;
+	}
+
+	rv = diag_l2_open(dl0d, DIAG_L1_ISO14230);
+	if (rv) {
+		printf("Failed to open hardware interface, error 0x%X\n", rv);
+		return CMD_FAILED;
+	}
+
+	t0 = diag_os_getms();
+	d_conn = diag_l2_StartCommunications(dl0d, DIAG_L2_PROT_ISO14230,
+	                                     DIAG_L2_TYPE_FASTINIT | DIAG_L2_TYPE_FUNCADDR,
+	                                     global_cfg.speed, (target_type) tgt, global_cfg.src);
+	if (d_conn == NULL) {
+		printf("No response to functional address 0x%02X.\n", tgt);
+		diag_l2_close(dl0d);
+		return CMD_OK;
+	}
+
+	diag_l2_ioctl(d_conn, DIAG_IOCTL_GET_L2_DATA, &d);
+	if (d.nresp == 0) {
+		/* L0 didn't give us the headers; we only know someone answered */
+		printf("ECU(s) answered but the interface hides their addresses; keybytes 0x%02X 0x%02X\n",
+		       d.kb1, d.kb2);
+	} else {
+		printf("%u ECU(s) answered functional address 0x%02X:\n", d.nresp, tgt);
+		print_responders(&d);
+	}
+	printf("Probe time: %lu ms\n", diag_os_getms() - t0);
+
+	diag_l2_StopCommunications(d_conn);
+	diag_l2_close(dl0d);
+	return CMD_OK;
+}
+
+
+/*
+ * Parallel probe: one worker thread per L0 device, each walking its own
+ * slice of the address range. Each worker only touches its own dl0d;
+ * the L2 links are opened and closed from this thread. The error latch and
+ * allocation counter are per thread, and diag_l2_StopCommunications()
+ * excludes the keepalive timer, so the workers can share the L2 code.
+ */
+struct probe_hit {
+	uint8_t addr;
+	uint8_t kb1;
+	uint8_t kb2;
+};
+
+struct probe_job {
+	struct diag_l0_device *dl0d;
+	const char *devname;
+	bool fast;
+	bool opened;
+	bool started;           //thread is running
+	diag_thread thr;
+	unsigned int start;     //address slice, inclusive
+	unsigned int end;
+	unsigned int nhits;
+	struct probe_hit hits[0x100];
+};
+
+static void *probe_worker(void *p) {
+	struct probe_job *job = p;
+	unsigned int i;
+
+	for (i = job->start; i <= job->end; i++) {
+		struct diag_l2_conn *d_conn;
+		struct diag_l2_data d;
+
+		if (job->fast) {
+			d_conn = diag_l2_StartCommunications(job->dl0d, DIAG_L2_PROT_ISO14230,
+			                                     DIAG_L2_TYPE_FASTINIT, global_cfg.speed,
+			                                     (target_type) i, global_cfg.src);
+		} else {
+			d_conn = diag_l2_StartCommunications(job->dl0d, DIAG_L2_PROT_ISO9141,
+			                                     DIAG_L2_TYPE_SLOWINIT, global_cfg.speed,
+			                                     (target_type) i, global_cfg.src);
+		}
+		if (d_conn == NULL) {
+			continue;
+		}
+
+		diag_l2_ioctl(d_conn, DIAG_IOCTL_GET_L2_DATA, &d);
+		job->hits[job->nhits].addr = (uint8_t) i;
+		job->hits[job->nhits].kb1 = d.kb1;
+		job->hits[job->nhits].kb2 = d.kb2;
+		job->nhits++;
+		diag_l2_StopCommunications(d_conn);
+	}
+	diag_trace_release();
+	return NULL;
+}
+
+/* Copy every config item of src into dst (same L0 type), then set the
+ * first item (the port / file identifying the device) to devname.
+ */
+static int probe_cfgdev(struct diag_l0_device *dst, struct diag_l0_device *src,
+                        const char *devname) {
+	struct cfgi *dcfg, *scfg;
+
+	dcfg = diag_l0_getcfg(dst);
+	if (!dcfg) {
+		printf("This interface has no device setting !\n");
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	for (scfg = diag_l0_getcfg(src); scfg && dcfg; scfg = scfg->next, dcfg = dcfg->next) {
+		switch (scfg->type) {
+		case CFGT_STR:
+			diag_cfg_setstr(dcfg, scfg->val.str);
+			break;
+		case CFGT_U8:
+			diag_cfg_setu8(dcfg, scfg->val.u8);
+			break;
+		case CFGT_INT:
+			diag_cfg_setint(dcfg, scfg->val.i);
+			break;
+		case CFGT_BOOL:
+			diag_cfg_setbool(dcfg, scfg->val.b);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return diag_cfg_setstr(diag_l0_getcfg(dst), devname);
+}
+
+static enum cli_retval cmd_diag_mprobe(int argc, char **argv) {
+	struct probe_job *jobs;
+	unsigned int start, end, njobs, nfound, i, j;
+	unsigned int span;
+	unsigned long t0;
+	enum cli_retval ret = CMD_FAILED;
+	bool fast;
+	int rv;
+
+	if ((argc < 5) || (strcmp(argv[1], "?") == 0)) {
+		return CMD_USAGE;
+	}
+
+	if (global_state != STATE_IDLE) {
+		printf("Cannot probe while there is an active global connection.\n");
+		return CMD_FAILED;
+	}
+
+	if (!global_dl0d) {
+		printf("No global L0. Please select + configure L0 first\n");
+		return CMD_FAILED;
+	}
+
+	start = htoi(argv[1]);
+	end = htoi(argv[2]);
+	if ((start > 255) || (end > 255)) {
+		printf("Values must be between 0 and 255\n");
+		return CMD_OK;
+	}
+	if (end < start) {
+		printf("Start must not be greater than End address\n");
+		return CMD_OK;
+	}
+
+	if (strcasecmp(argv[3], "fast") == 0) {
+		fast = 1;
+	} else if (strcasecmp(argv[3], "slow") == 0) {
+		fast = 0;
+	} else {
+		return CMD_USAGE;
+	}
+
+	njobs = argc - 4;
+	span = end - start + 1;
+	if (njobs > span) {
+		njobs = span;   //no use for idle interfaces
+	}
+
+	rv = diag_calloc(&jobs, njobs);
+	if (rv) {
+		return CMD_FAILED;
+	}
+
+	/* Create + open every device from here, before starting any thread */
+	for (i = 0; i < njobs; i++) {
+		struct probe_job *job = &jobs[i];
+
+		job->devname = argv[4 + i];
+		job->fast = fast;
+		job->start = start + (span * i) / njobs;
+		job->end = start + (span * (i + 1)) / njobs - 1;
+
+		job->dl0d = diag_l0_new(global_cfg.l0name);
+		if (!job->dl0d) {
+			printf("Could not create interface for %s\n", job->devname);
+			goto cleanup;
+		}
+		if (probe_cfgdev(job->dl0d, global_dl0d, job->devname)) {
+			goto cleanup;
+		}
+		rv = diag_l2_open(job->dl0d, fast? DIAG_L1_ISO14230 : DIAG_L1_ISO9141);
+		if (rv) {
+			printf("Failed to open %s, error 0x%X\n", job->devname, rv);
+			goto cleanup;
+		}
+		job->opened = 1;
+	}
+
+	printf("Scanning 0x%02X-0x%02X on %u interfaces:\n", start, end, njobs);
+	for (i = 0; i < njobs; i++) {
+		printf("\t%s: 0x%02X-0x%02X\n", jobs[i].devname, jobs[i].start, jobs[i].end);
+	}
+	fflush(stdout);
+
+	t0 = diag_os_getms();
+	for (i = 0; i < njobs; i++) {
+		if (diag_os_thread_start(&jobs[i].thr, probe_worker, &jobs[i])) {
+			printf("Could not start probe thread for %s\n", jobs[i].devname);
+			break;
+		}
+		jobs[i].started = 1;
+	}
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].started) {
+			diag_os_thread_join(&jobs[i].thr);
+		}
+	}
+
+	/* slices are disjoint and in increasing order, so this is sorted */
+	nfound = 0;
+	for (i = 0; i < njobs; i++) {
+		for (j = 0; j < jobs[i].nhits; j++) {
+			const struct probe_hit *h = &jobs[i].hits[j];
+			if (nfound == 0) {
+				printf("Responding ECUs:\n");
+			}
+			printf("\t0x%02X: keybytes 0x%02X 0x%02X (%s)\n", h->addr,
+			       h->kb1, h->kb2, jobs[i].devname);
+			nfound++;
+		}
+	}
+	if (nfound == 0) {
+		printf("No ECU responded.\n");
+	}
+	printf("Probe time: %lu ms\n", diag_os_getms() - t0);
+	ret = CMD_OK;
+
+cleanup:
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].opened) {
+			diag_l2_close(jobs[i].dl0d);
+		}
+		if (jobs[i].dl0d) {
+			diag_l0_del(jobs[i].dl0d);
+		}
+	}
+	free(jobs);
+	return ret;
+}
+
+
 /*
  * Generic init, using parameters set by user.
  * Currently only called from cmd_diag_connect;
@@ -119,18 +119,17 @@ static enum cli_retval cmd_dyno_mass(int argc, char **argv) {
 * Functions to measure data                                                  *
 ******************************************************************************/
 
-#define DYNDATA_1(p, n, d)      (d[p].data[n])
-#define DYNDATA_2(p, n, d)      (DYNDATA_1(p, n, d) * 256 + DYNDATA_1(p, n+1, d))
 #define RPM_PID           (0x0c)
-#define RPM_DATA(d)       (DYNDATA_2(RPM_PID, 2, d)*0.25)
+#define RPM_DATA(d)       (DATA_2(2, d)*0.25)
 #define SPEED_PID         (0x0d)
-#define SPEED_DATA(d)     (DYNDATA_1(SPEED_PID, 2, d) * 10000./36.) /* m/s * 1000 */
+#define SPEED_DATA(d)     (DATA_1(2, d) * 10000./36.) /* m/s * 1000 */
 
 #define SPEED_ISO_TO_KMH(_speed_) ((_speed_)*36/10000)
 
 /* measure speed */
 // return <0 if error
-static int measure_data(uint8_t data_pid, ecu_data *ep) {
+static int measure_data(uint8_t data_pid, unsigned int ecu) {
+	response *r;
 	int rv;
 
 	if (global_l3_conn == NULL) {
@@ -144,14 +143,21 @@ static int measure_data(uint8_t data_pid, ecu_data *ep) {
 		return rv;
 	}
 
-	/* data extraction */
+	/* data extraction; ecu_info may have moved during the request */
+	if (ecu >= ecu_count) {
+		return DIAG_ERR_GENERAL;
+	}
+	r = resp_get(&ecu_info[ecu].mode1_data, data_pid);
+	if (!RESP_GOOD(r)) {
+		return DIAG_ERR_GENERAL;
+	}
 	if (data_pid == RPM_PID) {
-		return (int)(RPM_DATA(ep->mode1_data) + .50);
+		return (int)(RPM_DATA(r) + .50);
 	}
 	if (data_pid == SPEED_PID) {
-		return (int)(SPEED_DATA(ep->mode1_data) + .50);
+		return (int)(SPEED_DATA(r) + .50);
 	}
-	return DYNDATA_1(data_pid, 2, ep->mode1_data);
+	return DATA_1(2, r);
 }
 
 
@@ -209,11 +215,11 @@ int fake_run_measure_data(int data_pid) {
 	return 0;
 }
 
-#define LOSS_MEASURE_DATA(_pid_, _ep_) fake_loss_measure_data()
-#define RUN_MEASURE_DATA(_pid_, _ep_)  fake_run_measure_data(_pid_)
+#define LOSS_MEASURE_DATA(_pid_, _ecu_) fake_loss_measure_data()
+#define RUN_MEASURE_DATA(_pid_, _ecu_)  fake_run_measure_data(_pid_)
 #else /* DYNO_DEBUG */
-#define LOSS_MEASURE_DATA(_pid_, _ep_) measure_data(_pid_, _ep_)
-#define RUN_MEASURE_DATA(_pid_, _ep_)  measure_data(_pid_, _ep_)
+#define LOSS_MEASURE_DATA(_pid_, _ecu_) measure_data(_pid_, _ecu_)
+#define RUN_MEASURE_DATA(_pid_, _ecu_)  measure_data(_pid_, _ecu_)
 
 #endif
 
@@ -230,7 +236,7 @@ int dyno_loss_done;
  */
 
 static enum cli_retval cmd_dyno_loss(UNUSED(int argc), UNUSED(char **argv)) {
-	ecu_data *ep;
+	unsigned int ecu;
 
 	int speed;              /* measured speed */
 	int speed_previous = 0; /* previous speed */
@@ -265,10 +271,10 @@ static enum cli_retval cmd_dyno_loss(UNUSED(int argc), UNUSED(char **argv)) {
 	dyno_loss_reset(); /* dyno data */
 	reset_results();
 	tv0=diag_os_getms(); /* initial time */
-	ep = ecu_info; /* ECU data */
+	ecu = 0; /* ECU data */
 
 	/* exclude 1st measure */
-	speed_previous = LOSS_MEASURE_DATA(SPEED_PID, ep); /* m/s * 1000 */
+	speed_previous = LOSS_MEASURE_DATA(SPEED_PID, ecu); /* m/s * 1000 */
 	if (speed_previous < 0) {
 		printf("invalid speed !\n");
 		return CMD_FAILED;
@@ -281,7 +287,7 @@ static enum cli_retval cmd_dyno_loss(UNUSED(int argc), UNUSED(char **argv)) {
 	/* loss measures */
 	while (1) {
 		/* measure speed */
-		speed = LOSS_MEASURE_DATA(SPEED_PID, ep); /* m/s * 1000 */
+		speed = LOSS_MEASURE_DATA(SPEED_PID, ecu); /* m/s * 1000 */
 		if (speed < 0) {
 			printf("invalid speed !\n");
 			break;
@@ -376,7 +382,7 @@ static enum cli_retval cmd_dyno_setloss(int argc, char **argv) {
  */
 
 static enum cli_retval cmd_dyno_run(UNUSED(int argc), UNUSED(char **argv)) {
-	ecu_data *ep;
+	unsigned int ecu;
 
 	int speed;                                              /* measured speed */
 	int rpm;                                                        /* measured rpm */
@@ -419,12 +425,12 @@ static enum cli_retval cmd_dyno_run(UNUSED(int argc), UNUSED(char **argv)) {
 	reset_results();
 
 	tv0=diag_os_getms();    /* initial time */
-	ep = ecu_info; /* ECU data */
+	ecu = 0; /* ECU data */
 
 	/* Measures */
 	while (1) {
 		/* measure RPM */
-		rpm = RUN_MEASURE_DATA(RPM_PID, ep);
+		rpm = RUN_MEASURE_DATA(RPM_PID, ecu);
 
 		if (rpm < 0) {
 			printf("invalid RPM !\n");
@@ -465,8 +471,8 @@ static enum cli_retval cmd_dyno_run(UNUSED(int argc), UNUSED(char **argv)) {
 
 	/* measure gear ratio */
 	rpm_previous = rpm;
-	speed = RUN_MEASURE_DATA(SPEED_PID, ep); /* m/s * 1000 */
-	rpm      = RUN_MEASURE_DATA(RPM_PID, ep);
+	speed = RUN_MEASURE_DATA(SPEED_PID, ecu); /* m/s * 1000 */
+	rpm      = RUN_MEASURE_DATA(RPM_PID, ecu);
 
 	if ((speed < 0) || (rpm < 0)) {
 		printf("invalid RUN_MEASURE_DATA result !\n");
@@ -0,0 +1,314 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ *
+ * Mostly ODBII Compliant Scan Tool (as defined in SAE J1978)
+ *
+ * CLI routines - kwp subcommand
+ *
+ * ISO14230-3 (KWP2000) services on the global L3 connection, which must
+ * have been started with "diag connect" + "diag addl3 iso14230". "define"
+ * packs signals into a dynamically defined local id; "log" reads it into a
+ * column buffer, polled or streamed by the ECU.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_iso14230.h"
+#include "diag_l3.h"
+#include "diag_l3_iso14230.h"
+
+#include "libcli.h"
+
+#include "scantool.h"
+#include "scantool_cli.h"
+
+#define KWP_LOG_TIMEOUT 2000    /* ms to wait for each streamed record */
+
+static enum cli_retval cmd_kwp_help(int argc, char **argv);
+static enum cli_retval cmd_kwp_define(int argc, char **argv);
+static enum cli_retval cmd_kwp_clear(int argc, char **argv);
+static enum cli_retval cmd_kwp_read(int argc, char **argv);
+static enum cli_retval cmd_kwp_log(int argc, char **argv);
+
+const struct cmd_tbl_entry kwp_cmd_table[] = {
+	{ "help", "help [command]", "Gives help for a command",
+	  cmd_kwp_help, 0, NULL},
+	{ "?", "? [command]", "Gives help for a command",
+	  cmd_kwp_help, CLI_CMD_HIDDEN, NULL},
+
+	{ "define", "define <lid> <srclid>:<pos>:<size>|*<addr>:<size> [...]",
+	  "Define <lid> as <size> bytes from byte <pos> (1-based) of local id <srclid>, "
+	  "or from memory address <addr>, for each element in order",
+	  cmd_kwp_define, 0, NULL},
+	{ "clear", "clear <lid>", "Clear a dynamically defined local id",
+	  cmd_kwp_clear, 0, NULL},
+	{ "read", "read <lid1> [lid2 ...]", "Read data by local id",
+	  cmd_kwp_read, 0, NULL},
+	{ "log", "log <lid> <single|slow|medium|fast> <count>",
+	  "Log <count> records of a defined local id, polled one by one (single) or sent repeatedly by the ECU",
+	  cmd_kwp_log, 0, NULL},
+
+	CLI_TBL_BUILTINS,
+	CLI_TBL_END
+};
+
+static enum cli_retval cmd_kwp_help(int argc, char **argv) {
+	return cli_help_basic(argc, argv, kwp_cmd_table);
+}
+
+
+static struct diag_l3_conn *kwp_conn(void) {
+	return cli_l3conn("ISO14230");
+}
+
+static void kwp_perror(struct diag_l3_conn *dl3c, const char *what, int rv) {
+	cli_l3perror(what, rv, diag_l3_iso14230_nrcstr(diag_l3_iso14230_lastnrc(dl3c)));
+}
+
+
+static enum cli_retval cmd_kwp_define(int argc, char **argv) {
+	struct diag_kwp_ddli_elem elems[DIAG_KWP_DDLI_MAXELEMS];
+	struct diag_l3_conn *dl3c;
+	unsigned int n;
+	uint8_t lid;
+	int rv;
+
+	if ((argc < 3) || (argc - 2 > DIAG_KWP_DDLI_MAXELEMS)) {
+		return CMD_USAGE;
+	}
+
+	lid = (uint8_t) htoi(argv[1]);
+	for (n = 0; n < (unsigned int) argc - 2; n++) {
+		char *p = argv[n + 2];
+		char *endp;
+
+		if (*p == '*') {
+			elems[n].mode = DIAG_KW2K_DM_DBMA;
+			elems[n].src = (uint32_t) strtoul(p + 1, &endp, 0);
+			elems[n].pos = 0;
+		} else {
+			elems[n].mode = DIAG_KW2K_DM_DBLI;
+			elems[n].src = (uint32_t) strtoul(p, &endp, 0);
+			if (*endp != ':') {
+				return CMD_USAGE;
+			}
+			elems[n].pos = (uint8_t) strtoul(endp + 1, &endp, 0);
+			if (elems[n].pos == 0) {
+				return CMD_USAGE;
+			}
+		}
+		if (*endp != ':') {
+			return CMD_USAGE;
+		}
+		elems[n].size = (uint8_t) strtoul(endp + 1, &endp, 0);
+		if ((*endp != 0) || (elems[n].size == 0)) {
+			return CMD_USAGE;
+		}
+	}
+
+	dl3c = kwp_conn();
+	if (dl3c == NULL) {
+		return CMD_OK;
+	}
+
+	rv = diag_l3_iso14230_ddli_define(dl3c, lid, elems, n);
+	if (rv < 0) {
+		kwp_perror(dl3c, "define", rv);
+	} else {
+		printf("Local id 0x%02X defined, %u signals\n", lid, n);
+	}
+	return CMD_OK;
+}
+
+static enum cli_retval cmd_kwp_clear(int argc, char **argv) {
+	struct diag_l3_conn *dl3c;
+	int rv;
+
+	if (argc != 2) {
+		return CMD_USAGE;
+	}
+
+	dl3c = kwp_conn();
+	if (dl3c == NULL) {
+		return CMD_OK;
+	}
+
+	rv = diag_l3_iso14230_ddli_clear(dl3c, (uint8_t) htoi(argv[1]));
+	if (rv < 0) {
+		kwp_perror(dl3c, "clear", rv);
+	}
+	return CMD_OK;
+}
+
+static enum cli_retval cmd_kwp_read(int argc, char **argv) {
+	struct diag_l3_conn *dl3c;
+	uint8_t buf[MAXRBUF];
+	int i, j, rv;
+
+	if (argc < 2) {
+		return CMD_USAGE;
+	}
+
+	dl3c = kwp_conn();
+	if (dl3c == NULL) {
+		return CMD_OK;
+	}
+
+	for (i = 1; i < argc; i++) {
+		uint8_t lid = (uint8_t) htoi(argv[i]);
+
+		rv = diag_l3_iso14230_readlid(dl3c, lid, DIAG_KW2K_TM_SINGLE, buf, sizeof(buf));
+		if (rv < 0) {
+			kwp_perror(dl3c, "read", rv);
+			continue;
+		}
+		printf("Local id 0x%02X :", lid);
+		for (j = 0; j < MIN(rv, (int) sizeof(buf)); j++) {
+			printf(" %02X", buf[j]);
+		}
+		printf("\n");
+	}
+	return CMD_OK;
+}
+
+
+/* Print the column buffer as a table, one row per record */
+static void kwp_printcols(const struct diag_kwp_colbuf *cb,
+                          const struct diag_kwp_ddli_elem *elems) {
+	int width[DIAG_KWP_DDLI_MAXELEMS];
+	unsigned int c, r;
+
+	printf("%8s", "t(ms)");
+	for (c = 0; c < cb->ncols; c++) {
+		char label[16];
+		int vw = 2 * MIN(cb->width[c], 4);
+
+		if (elems[c].mode == DIAG_KW2K_DM_DBMA) {
+			snprintf(label, sizeof(label), "*%04X", (unsigned int) elems[c].src);
+		} else {
+			snprintf(label, sizeof(label), "%02X.%u", (unsigned int) elems[c].src, elems[c].pos);
+		}
+		width[c] = ((int) strlen(label) > vw)? (int) strlen(label) : vw;
+		printf(" %*s", width[c], label);
+	}
+	printf("\n");
+
+	for (r = 0; r < cb->nrows; r++) {
+		printf("%8lu", cb->t[r] - cb->t[0]);
+		for (c = 0; c < cb->ncols; c++) {
+			int vw = 2 * MIN(cb->width[c], 4);
+
+			printf(" %*s%0*lX", width[c] - vw, "", vw,
+			       (unsigned long) cb->vals[c * cb->maxrows + r]);
+		}
+		printf("\n");
+	}
+}
+
+static enum cli_retval cmd_kwp_log(int argc, char **argv) {
+	static const char *modes[] = { "single", "slow", "medium", "fast" };
+	const struct diag_kwp_ddli_elem *elems;
+	struct diag_kwp_colbuf *cb;
+	struct diag_l3_conn *dl3c;
+	uint8_t buf[MAXRBUF];
+	unsigned int i, count;
+	unsigned long t0;
+	uint8_t lid, rlid, tm = 0;
+	int rv;
+
+	if (argc != 4) {
+		return CMD_USAGE;
+	}
+
+	lid = (uint8_t) htoi(argv[1]);
+	for (i = 0; i < ARRAY_SIZE(modes); i++) {
+		if (strcasecmp(argv[2], modes[i]) == 0) {
+			tm = (uint8_t) (DIAG_KW2K_TM_SINGLE + i);
+		}
+	}
+	count = (unsigned int) htoi(argv[3]);
+	if ((tm == 0) || (count == 0)) {
+		return CMD_USAGE;
+	}
+
+	dl3c = kwp_conn();
+	if (dl3c == NULL) {
+		return CMD_OK;
+	}
+
+	if (diag_l3_iso14230_ddli_get(dl3c, lid, &elems) == 0) {
+		printf("Local id 0x%02X wasn't defined with \"kwp define\".\n", lid);
+		return CMD_OK;
+	}
+	rv = diag_l3_iso14230_colbuf_new(dl3c, lid, count, &cb);
+	if (rv < 0) {
+		return CMD_FAILED;
+	}
+
+	t0 = diag_os_getms();
+	rlid = lid;
+	rv = diag_l3_iso14230_readlid(dl3c, lid, tm, buf, sizeof(buf));
+	while (rv >= 0) {
+		if (rlid == lid) {
+			rv = diag_l3_iso14230_colbuf_add(cb, buf, MIN((unsigned int) rv, sizeof(buf)),
+			                                 diag_os_getms());
+			if (rv == DIAG_ERR_BADLEN) {
+				printf("Record too short for the definition of 0x%02X\n", lid);
+				rv = 0; //already reported
+				break;
+			}
+		}
+		if (cb->nrows >= count) {
+			break;
+		}
+		if (tm == DIAG_KW2K_TM_SINGLE) {
+			rv = diag_l3_iso14230_readlid(dl3c, lid, tm, buf, sizeof(buf));
+		} else {
+			rv = diag_l3_iso14230_recvrecord(dl3c, KWP_LOG_TIMEOUT, &rlid, buf, sizeof(buf));
+		}
+	}
+	if (rv < 0) {
+		kwp_perror(dl3c, "log", rv);
+	}
+
+	if (tm != DIAG_KW2K_TM_SINGLE) {
+		rv = diag_l3_iso14230_readlid(dl3c, lid, DIAG_KW2K_TM_STOP, buf, sizeof(buf));
+		if (rv < 0) {
+			kwp_perror(dl3c, "stop", rv);
+		}
+	}
+
+	kwp_printcols(cb, elems);
+	if (cb->nrows && (cb->t[cb->nrows - 1] > t0)) {
+		unsigned long dt = cb->t[cb->nrows - 1] - t0;
+		printf("%u records in %lu ms (%lu/s)\n", cb->nrows, dt, (cb->nrows * 1000UL) / dt);
+	} else {
+		printf("%u records\n", cb->nrows);
+	}
+
+	diag_l3_iso14230_colbuf_del(cb);
+	return CMD_OK;
+}
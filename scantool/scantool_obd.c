@@ -175,22 +175,24 @@ static void print_current_data(bool english) {
 		const struct pid *p = get_pid(j);
 
 		for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-			if (DATA_VALID(p, ep->mode1_data) ||
-			    DATA_VALID(p, ep->mode2_data)) {
+			response *r1 = resp_get(&ep->mode1_data, p->pidID);
+			response *r2 = resp_get(&ep->mode2_data, p->pidID);
+
+			if (RESP_GOOD(r1) || RESP_GOOD(r2)) {
 				printf("%-30.30s ", p->desc);
 
-				if (DATA_VALID(p, ep->mode1_data)) {
+				if (RESP_GOOD(r1)) {
 					p->cust_snprintf(buf, sizeof(buf), english, p,
-					                 ep->mode1_data, 2);
+					                 r1, 2);
 				} else {
 					snprintf(buf, sizeof(buf), "-----");
 				}
 
 				printf("%-15.15s ", buf);
 
-				if (DATA_VALID(p, ep->mode2_data)) {
+				if (RESP_GOOD(r2)) {
 					p->cust_snprintf(buf, sizeof(buf), english, p,
-					                 ep->mode2_data, 3);
+					                 r2, 3);
 				} else {
 					snprintf(buf, sizeof(buf), "-----");
 				}
@@ -215,9 +217,8 @@ static void log_response(int ecu, response *r) {
 }
 
 static void log_current_data(void) {
-	response *r;
 	ecu_data *ep;
-	unsigned int i;
+	unsigned int i, j;
 
 	if (!global_logfp) {
 		return;
@@ -226,18 +227,16 @@ static void log_current_data(void) {
 	log_timestamp("D");
 	fprintf(global_logfp, "MODE 1 DATA\n");
 	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		for (r = ep->mode1_data;
-		     r < &ep->mode1_data[ARRAY_SIZE(ep->mode1_data)]; r++) {
-			log_response((int)i, r);
+		for (j=0; j<ep->mode1_data.count; j++) {
+			log_response((int)i, &ep->mode1_data.resp[j]);
 		}
 	}
 
 	log_timestamp("D");
 	fprintf(global_logfp, "MODE 2 DATA\n");
 	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		for (r = ep->mode2_data;
-		     r < &ep->mode2_data[ARRAY_SIZE(ep->mode2_data)]; r++) {
-			log_response((int)i, r);
+		for (j=0; j<ep->mode2_data.count; j++) {
+			log_response((int)i, &ep->mode2_data.resp[j]);
 		}
 	}
 }
@@ -327,10 +326,18 @@ static enum cli_retval cmd_scan(UNUSED(int argc), UNUSED(char **argv)) {
 	}
 
 	if (rv == 0) {
+		bool cached;
+
 		printf("Connection to ECU established\n");
 
+		/* Skip PID discovery if we've seen this vehicle before */
+		cached = (capcache_restore() == 0);
+
 		/* Now ask basic info from ECU */
-		do_j1979_basics();
+		do_j1979_basics(!cached);
+		if (!cached) {
+			capcache_store();
+		}
 		/* Now get test results for continuously monitored systems */
 		do_j1979_cms();
 		/* And the non continuously monitored tests */
@@ -402,42 +409,44 @@ static enum cli_retval cmd_ecus(UNUSED(int argc), UNUSED(char **argv)) {
 	return CMD_OK;
 }
 
-static void print_resp_info(UNUSED(int mode), response *data) {
+static void print_resp_info(UNUSED(int mode), const resp_store *rs) {
+	const response *data;
+	unsigned int i;
 
-	int i;
-	for (i=0; i<256; i++) {
+	/* store is kept sorted by pid */
+	for (i=0; i<rs->count; i++) {
+		data = &rs->resp[i];
 		if (data->type != TYPE_UNTESTED) {
 			if (data->type == TYPE_GOOD) {
-				printf("0x%02X: ", i );
+				printf("0x%02X: ", data->pid);
 				diag_data_dump(stdout, data->data, data->len);
 				printf("\n");
 			} else {
 				printf("0x%02X: Failed 0x%X\n",
-				       i, data->data[1]);
+				       data->pid, data->data[1]);
 			}
 		}
-		data++;
 	}
 }
 
 
 static enum cli_retval cmd_dumpdata(UNUSED(int argc), UNUSED(char **argv)) {
 	ecu_data *ep;
-	int i;
+	unsigned int i;
 
 	printf("Current Data\n");
-	for (i=0, ep=ecu_info; i<MAX_ECU; i++,ep++) {
+	for (i=0, ep=ecu_info; i<ecu_count; i++,ep++) {
 		if (ep->valid) {
 			printf("ECU 0x%02X:\n", ep->ecu_addr & 0xff);
-			print_resp_info(1, ep->mode1_data);
+			print_resp_info(1, &ep->mode1_data);
 		}
 	}
 
 	printf("Freezeframe Data\n");
-	for (i=0,ep=ecu_info; i<MAX_ECU; i++,ep++) {
+	for (i=0,ep=ecu_info; i<ecu_count; i++,ep++) {
 		if (ep->valid) {
 			printf("ECU 0x%02X:\n", ep->ecu_addr & 0xff);
-			print_resp_info(2, ep->mode2_data);
+			print_resp_info(2, &ep->mode2_data);
 		}
 	}
 
@@ -448,7 +457,7 @@ static enum cli_retval cmd_dumpdata(UNUSED(int argc), UNUSED(char **argv)) {
 
 
 /*print_pidinfo() : print supported PIDs (0 to 0x60) */
-static void print_pidinfo(int mode, uint8_t *pid_data) {
+static void print_pidinfo(int mode, const pidmap *pid_data) {
 	int i,j;        /* j : # pid per line */
 
 	printf(" Mode %d:", mode);
@@ -457,7 +466,7 @@ static void print_pidinfo(int mode, uint8_t *pid_data) {
 			j = 0;
 		}
 
-		if (pid_data[i]) {
+		if (pidmap_test(pid_data, i)) {
 			if (j == 0) {
 				printf("\n \t"); // once per line
 			}
@@ -471,23 +480,23 @@ static void print_pidinfo(int mode, uint8_t *pid_data) {
 
 static enum cli_retval cmd_pids(UNUSED(int argc), UNUSED(char **argv)) {
 	ecu_data *ep;
-	int i;
+	unsigned int i;
 
 	if (global_state < STATE_SCANDONE) {
 		printf("SCAN has not been done, please do a scan\n");
 		return CMD_OK;
 	}
 
-	for (i=0,ep=ecu_info; i<MAX_ECU; i++,ep++) {
+	for (i=0,ep=ecu_info; i<ecu_count; i++,ep++) {
 		if (ep->valid) {
-			printf("ECU %d address 0x%02X: Supported PIDs:\n",
+			printf("ECU %u address 0x%02X: Supported PIDs:\n",
 			       i, ep->ecu_addr & 0xff);
-			print_pidinfo(1, ep->mode1_info);
-			print_pidinfo(2, ep->mode2_info);
-			print_pidinfo(5, ep->mode5_info);
-			print_pidinfo(6, ep->mode6_info);
-			print_pidinfo(8, ep->mode8_info);
-			print_pidinfo(9, ep->mode9_info);
+			print_pidinfo(1, &ep->mode1_info);
+			print_pidinfo(2, &ep->mode2_info);
+			print_pidinfo(5, &ep->mode5_info);
+			print_pidinfo(6, &ep->mode6_info);
+			print_pidinfo(8, &ep->mode8_info);
+			print_pidinfo(9, &ep->mode9_info);
 		}
 	}
 	printf("\n");
@@ -38,6 +38,8 @@
 #include "diag_l0.h"
 #include "diag_l1.h"
 #include "diag_l2.h"
+#include "diag_l2_can.h"
+#include "diag_iso15765.h"
 
 #include "libcli.h"
 #include "scantool_cli.h"
@@ -60,6 +62,9 @@ static enum cli_retval cmd_set_l2protocol(int argc, char **argv);
 static enum cli_retval cmd_set_initmode(int argc, char **argv);
 static enum cli_retval cmd_set_display(int argc, char **argv);
 static enum cli_retval cmd_set_interface(int argc, char **argv);
+static enum cli_retval cmd_set_capcache(int argc, char **argv);
+static enum cli_retval cmd_set_isotp(int argc, char **argv);
+static enum cli_retval cmd_set_canid(int argc, char **argv);
 
 const struct cmd_tbl_entry set_cmd_table[] = {
 	{ "help", "help [command]", "Gives help for a command",
@@ -92,6 +97,14 @@ const struct cmd_tbl_entry set_cmd_table[] = {
 	{ "initmode", "initmode [modename]", "Bus initialisation mode to use. Use 'set initmode ?' to show valid choices.",
 	  cmd_set_initmode, 0, NULL},
 
+	{ "capcache", "capcache [filename/none]", "Vehicle capability cache file, used by scan to skip PID discovery",
+	  cmd_set_capcache, 0, NULL},
+
+	{ "isotp", "isotp [blocksize] [stmin]", "CAN (ISO15765) flow control sent to ECUs : block size (0=unlimited), STmin (ms, or 0xF1-0xF9 for 100-900us)",
+	  cmd_set_isotp, 0, NULL},
+	{ "canid", "canid [11/29] or [txid rxid]", "CAN identifiers : OBD 11 or 29-bit, or fixed request / response IDs",
+	  cmd_set_canid, 0, NULL},
+
 	{ "show", "show", "Shows all settable values, including L0-specific items",
 	  cmd_set_show, 0, NULL},
 
@@ -137,6 +150,8 @@ int set_init(void) {
 
 	global_cfg.units = 0;           /* English (1), or Metric (0) */
 
+	global_cfg.capcache = NULL;     /* no capability cache */
+
 	char *garbage_args[] = {default_cmd, default_iface};
 	cmd_set_interface(2, garbage_args); /* Default H/w interface to use */
 
@@ -144,6 +159,8 @@ int set_init(void) {
 }
 
 void set_close(void) {
+	free(global_cfg.capcache);
+	global_cfg.capcache = NULL;
 	return;
 }
 
@@ -251,6 +268,9 @@ static enum cli_retval cmd_set_show(UNUSED(int argc), UNUSED(char **argv)) {
 	cmd_set_l1protocol(0,NULL);
 	cmd_set_l2protocol(0,NULL);
 	cmd_set_initmode(0,NULL);
+	cmd_set_capcache(0,NULL);
+	cmd_set_isotp(0,NULL);
+	cmd_set_canid(0,NULL);
 
 	/* Parse L0-specific config items */
 	if (global_dl0d) {
@@ -352,6 +372,91 @@ static enum cli_retval cmd_set_display(int argc, char **argv) {
 	return CMD_OK;
 }
 
+static enum cli_retval cmd_set_capcache(int argc, char **argv) {
+	if (argc > 1) {
+		if (strcmp(argv[1], "?") == 0) {
+			return CMD_USAGE;
+		}
+
+		free(global_cfg.capcache);
+		global_cfg.capcache = NULL;
+		if (strcasecmp(argv[1], "none") != 0) {
+			if (diag_malloc(&global_cfg.capcache, strlen(argv[1]) + 1)) {
+				return CMD_FAILED;
+			}
+			strcpy(global_cfg.capcache, argv[1]);
+		}
+	}
+	printf("capcache: %s\n", global_cfg.capcache ? global_cfg.capcache : "none");
+
+	return CMD_OK;
+}
+
+static enum cli_retval cmd_set_isotp(int argc, char **argv) {
+	if (argc > 1) {
+		int bs, stmin = diag_l2_can_cfg.stmin;
+
+		if (strcmp(argv[1], "?") == 0) {
+			return CMD_USAGE;
+		}
+		bs = htoi(argv[1]);
+		if (argc > 2) {
+			stmin = htoi(argv[2]);
+		}
+		if ((bs < 0) || (bs > 0xFF) || (stmin < 0) || (stmin > 0xFF)) {
+			return CMD_USAGE;
+		}
+		diag_l2_can_cfg.bs = (uint8_t) bs;
+		diag_l2_can_cfg.stmin = (uint8_t) stmin;
+	}
+	printf("isotp: block size %u, STmin 0x%02X\n",
+	       diag_l2_can_cfg.bs, diag_l2_can_cfg.stmin);
+
+	return CMD_OK;
+}
+
+static enum cli_retval cmd_set_canid(int argc, char **argv) {
+	if (argc > 1) {
+		if (strcmp(argv[1], "?") == 0) {
+			return CMD_USAGE;
+		}
+		if (argc > 2) {
+			/* anything over 11 bits is taken as a 29-bit ID */
+			uint32_t txid = (uint32_t) htoi(argv[1]);
+			uint32_t rxid = (uint32_t) htoi(argv[2]);
+
+			if ((txid == 0) || (txid > DIAG_CAN_EFFMASK) || (rxid > DIAG_CAN_EFFMASK)) {
+				return CMD_USAGE;
+			}
+			if (txid > DIAG_CAN_SFFMASK) {
+				txid |= DIAG_CAN_EFF;
+			}
+			if (rxid > DIAG_CAN_SFFMASK) {
+				rxid |= DIAG_CAN_EFF;
+			}
+			diag_l2_can_cfg.txid = txid;
+			diag_l2_can_cfg.rxid = rxid;
+		} else if (strcmp(argv[1], "11") == 0) {
+			diag_l2_can_cfg.txid = 0;
+			diag_l2_can_cfg.id29 = 0;
+		} else if (strcmp(argv[1], "29") == 0) {
+			diag_l2_can_cfg.txid = 0;
+			diag_l2_can_cfg.id29 = 1;
+		} else {
+			return CMD_USAGE;
+		}
+	}
+	if (diag_l2_can_cfg.txid) {
+		printf("canid: request ID 0x%lX, response ID 0x%lX\n",
+		       (unsigned long) (diag_l2_can_cfg.txid & DIAG_CAN_EFFMASK),
+		       (unsigned long) (diag_l2_can_cfg.rxid & DIAG_CAN_EFFMASK));
+	} else {
+		printf("canid: OBD %s-bit identifiers\n", diag_l2_can_cfg.id29 ? "29":"11");
+	}
+
+	return CMD_OK;
+}
+
 static enum cli_retval cmd_set_speed(int argc, char **argv) {
 	if (argc > 1) {
 		if (strcmp(argv[1], "?") == 0) {
@@ -28,9 +28,13 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "diag.h" /* operating specific includes */
+#include "diag_os.h"
+#include "diag_l2.h"
 #include "diag_l3.h" /* operating specific includes */
 
 #include "libcli.h"
@@ -45,6 +49,7 @@ static enum cli_retval cmd_test_rvi(int argc, char **argv);
 static enum cli_retval cmd_test_cms(int argc, char **argv);
 static enum cli_retval cmd_test_ncms(int argc, char **argv);
 static enum cli_retval cmd_test_readiness(int argc, char **argv);
+static enum cli_retval cmd_test_bench(int argc, char **argv);
 
 const struct cmd_tbl_entry test_cmd_table[] = {
 	{ "help", "help [command]", "Gives help for a command",
@@ -62,6 +67,9 @@ const struct cmd_tbl_entry test_cmd_table[] = {
 	{ "readiness", "readiness",
 	  "Do readiness tests",
 	  cmd_test_readiness, 0, NULL},
+	{ "bench", "bench [seconds]",
+	  "Measure request throughput / latency with a fixed mode 1 PID sweep",
+	  cmd_test_bench, 0, NULL},
 
 	CLI_TBL_BUILTINS,
 	CLI_TBL_END
@@ -76,7 +84,7 @@ static enum cli_retval cmd_test_help(int argc, char **argv) {
  * Guts of routine to ask for VIN/CID/CVN
  * return data length (excluding 0x00 termination) if ok (data written to *obuf)
  */
-static unsigned get_vit_info(struct diag_l3_conn *d_conn, uint8_t itype, uint8_t *obuf, unsigned buflen) {
+unsigned get_vit_info(struct diag_l3_conn *d_conn, uint8_t itype, uint8_t *obuf, unsigned buflen) {
 	struct diag_msg *msg, *msgcur;
 	int rv;
 	unsigned offset;
@@ -123,21 +131,18 @@ static enum cli_retval cmd_test_rvi(UNUSED(int argc), UNUSED(char **argv)) {
 
 	ecu_data *ep;
 	unsigned i;
-	bool merged_mode9_info[0x100];
+	pidmap merged_mode9_info;
 	#define MODE9_INFO_MAXLEN 0x100
 	uint8_t infostring[MODE9_INFO_MAXLEN];
 
 
 	/* merge all infotypes supported by all ECUs */
-	memset(merged_mode9_info, 0, sizeof(merged_mode9_info));
+	memset(&merged_mode9_info, 0, sizeof(merged_mode9_info));
 	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		unsigned j;
-		for (j=0; j<sizeof(ep->mode9_info); j++) {
-			merged_mode9_info[j] |= ep->mode9_info[j];
-		}
+		pidmap_merge(&merged_mode9_info, &ep->mode9_info);
 	}
 
-	if (merged_mode9_info[2]) {
+	if (pidmap_test(&merged_mode9_info, 2)) {
 		if (get_vit_info(d_conn, 2, infostring, MODE9_INFO_MAXLEN) > 3) {
 			printf("VIN: %s\n", (char *) &infostring[3]);   //skip padding !
 		}
@@ -145,7 +150,7 @@ static enum cli_retval cmd_test_rvi(UNUSED(int argc), UNUSED(char **argv)) {
 		printf("ECU doesn't support VIN request\n");
 	}
 
-	if (merged_mode9_info[4]) {
+	if (pidmap_test(&merged_mode9_info, 4)) {
 		if (get_vit_info(d_conn, 4, infostring, MODE9_INFO_MAXLEN)) {
 			printf("Calibration ID: %s\n", (char *) infostring);
 		}
@@ -153,7 +158,7 @@ static enum cli_retval cmd_test_rvi(UNUSED(int argc), UNUSED(char **argv)) {
 		printf("ECU doesn't support Calibration ID request\n");
 	}
 
-	if (merged_mode9_info[6]) {
+	if (pidmap_test(&merged_mode9_info, 6)) {
 		unsigned cvn_len = get_vit_info(d_conn, 6, infostring, MODE9_INFO_MAXLEN);
 		if (cvn_len) {
 			printf("CVN: ");
@@ -234,7 +239,8 @@ static enum cli_retval cmd_test_readiness(UNUSED(int argc), UNUSED(char **argv))
 	/* And process results */
 	incomplete_monitors = 0;
 	for (j=0, ep=ecu_info; j<ecu_count; j++, ep++) {
-		if (ep->mode1_data[1].type == TYPE_GOOD) {
+		response *r = resp_get(&ep->mode1_data, 1);
+		if (RESP_GOOD(r)) {
 			int supported, value;
 
 			for (i=0; i<12; i++) {
@@ -243,11 +249,11 @@ static enum cli_retval cmd_test_readiness(UNUSED(int argc), UNUSED(char **argv))
 					continue;
 				}
 				if (i<4) {
-					supported = (ep->mode1_data[1].data[3]>>i)&1;
-					value = (ep->mode1_data[1].data[3]>>(i+4))&1;
+					supported = (r->data[3]>>i)&1;
+					value = (r->data[3]>>(i+4))&1;
 				} else {
-					supported = (ep->mode1_data[1].data[4]>>(i-4))&1;
-					value = (ep->mode1_data[1].data[5]>>(i-4))&1;
+					supported = (r->data[4]>>(i-4))&1;
+					value = (r->data[5]>>(i-4))&1;
 				}
 				if (supported && value) {
 					incomplete_monitors |= 1<<i;
@@ -285,3 +291,115 @@ static enum cli_retval cmd_test_readiness(UNUSED(int argc), UNUSED(char **argv))
 
 	return CMD_OK;
 }
+
+
+/*
+ * Throughput benchmark : send mode 1 requests for a fixed list of PIDs,
+ * round-robin, for the specified time. Goes through L3 if one is attached,
+ * otherwise straight to L2 (for "raw" etc).
+ * Only meaningful with a simulated ECU (carsim) or on a bench.
+ */
+#define BENCH_MAXSAMPLES 65536
+static const uint8_t bench_pids[] = {0x04, 0x05, 0x0C, 0x0D, 0x0F, 0x11};
+
+static int bench_cmpul(const void *a, const void *b) {
+	unsigned long ua = *(const unsigned long *)a;
+	unsigned long ub = *(const unsigned long *)b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+static enum cli_retval cmd_test_bench(int argc, char **argv) {
+	unsigned long seconds = 5;
+	unsigned long *lat;     //latency samples, us
+	unsigned long nreq = 0, nerr = 0, nsamples = 0;
+	unsigned long long t0, tcur;
+	clock_t cpu0, cpu1;
+	double elapsed_s, cpu_us;
+	unsigned int pidx = 0;
+
+	if (argc > 2) {
+		return CMD_USAGE;
+	}
+	if (argc == 2) {
+		seconds = strtoul(argv[1], NULL, 0);
+		if (seconds == 0) {
+			return CMD_USAGE;
+		}
+	}
+
+	if ((global_l2_conn == NULL) || (global_state < STATE_CONNECTED)) {
+		printf("Not connected to ECU\n");
+		return CMD_FAILED;
+	}
+
+	if (diag_malloc(&lat, BENCH_MAXSAMPLES)) {
+		return CMD_FAILED;
+	}
+
+	printf("Running mode 1 request sweep for %lu s...\n", seconds);
+
+	cpu0 = clock();
+	t0 = diag_os_gethrt();
+
+	while (1) {
+		struct diag_msg msg = {0};
+		struct diag_msg *rxmsg;
+		uint8_t data[2];
+		unsigned long long treq;
+		int errval = 0;
+
+		tcur = diag_os_gethrt();
+		if (diag_os_hrtus(tcur - t0) >= (unsigned long long) seconds * 1000000) {
+			break;
+		}
+
+		data[0] = 1;
+		data[1] = bench_pids[pidx];
+		pidx = (pidx + 1) % ARRAY_SIZE(bench_pids);
+		msg.data = data;
+		msg.len = 2;
+		msg.src = global_cfg.src;
+		msg.dest = global_cfg.tgt;
+
+		treq = diag_os_gethrt();
+		if (global_l3_conn) {
+			rxmsg = diag_l3_request(global_l3_conn, &msg, &errval);
+		} else {
+			rxmsg = diag_l2_request(global_l2_conn, &msg, &errval);
+		}
+		nreq++;
+		if (rxmsg == NULL) {
+			nerr++;
+			continue;
+		}
+		diag_freemsg(rxmsg);
+		if (nsamples < BENCH_MAXSAMPLES) {
+			lat[nsamples++] = (unsigned long) diag_os_hrtus(diag_os_gethrt() - treq);
+		}
+	}
+	cpu1 = clock();
+	elapsed_s = (double) diag_os_hrtus(diag_os_gethrt() - t0) / 1e6;
+	cpu_us = (double) (cpu1 - cpu0) * 1e6 / CLOCKS_PER_SEC;
+
+	printf("%lu requests, %lu errors in %.3f s\n", nreq, nerr, elapsed_s);
+	if (nsamples == 0) {
+		printf("No successful requests !\n");
+		free(lat);
+		return CMD_FAILED;
+	}
+
+	qsort(lat, nsamples, sizeof(*lat), bench_cmpul);
+	printf("Requests/s: %.1f\n", nreq / elapsed_s);
+	printf("Latency p50: %.3f ms, p99: %.3f ms\n",
+	       lat[nsamples / 2] / 1000.0, lat[(nsamples * 99) / 100] / 1000.0);
+	printf("CPU time per request: %.1f us\n", cpu_us / nreq);
+	/* same, in one line for scripts */
+	printf("BENCH l2=%s rps=%.1f p50_ms=%.3f p99_ms=%.3f cpu_us=%.1f errors=%lu\n",
+	       global_l2_conn->l2proto->shortname, nreq / elapsed_s,
+	       lat[nsamples / 2] / 1000.0, lat[(nsamples * 99) / 100] / 1000.0,
+	       cpu_us / nreq, nerr);
+
+	free(lat);
+	return CMD_OK;
+}
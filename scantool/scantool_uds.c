@@ -0,0 +1,336 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ *
+ * Mostly ODBII Compliant Scan Tool (as defined in SAE J1978)
+ *
+ * CLI routines - uds subcommand
+ *
+ * ISO 14229 (UDS) services on the global L3 connection, which must have
+ * been started with "diag connect" + "diag addl3 uds". "define" packs
+ * signals from several DIDs into one dynamically defined DID, which "read"
+ * fetches in one request, or "periodic" + "monitor" stream.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_l3.h"
+#include "diag_l3_uds.h"
+
+#include "libcli.h"
+
+#include "scantool.h"
+#include "scantool_cli.h"
+
+#define UDS_MONITOR_TIMEOUT     1000    /* ms without records before "monitor <count>" gives up */
+
+static enum cli_retval cmd_uds_help(int argc, char **argv);
+static enum cli_retval cmd_uds_session(int argc, char **argv);
+static enum cli_retval cmd_uds_read(int argc, char **argv);
+static enum cli_retval cmd_uds_define(int argc, char **argv);
+static enum cli_retval cmd_uds_clear(int argc, char **argv);
+static enum cli_retval cmd_uds_periodic(int argc, char **argv);
+static enum cli_retval cmd_uds_monitor(int argc, char **argv);
+
+const struct cmd_tbl_entry uds_cmd_table[] = {
+	{ "help", "help [command]", "Gives help for a command",
+	  cmd_uds_help, 0, NULL},
+	{ "?", "? [command]", "Gives help for a command",
+	  cmd_uds_help, CLI_CMD_HIDDEN, NULL},
+
+	{ "session", "session <default|prog|extended|n>", "Change diagnostic session",
+	  cmd_uds_session, 0, NULL},
+	{ "read", "read <did1> [did2 ...]", "Read data by identifier",
+	  cmd_uds_read, 0, NULL},
+	{ "define", "define <did> <srcdid>:<pos>:<size> [...]",
+	  "Define <did> as <size> bytes from byte <pos> (1-based) of each <srcdid>, in order",
+	  cmd_uds_define, 0, NULL},
+	{ "clear", "clear <did>", "Clear a dynamically defined DID",
+	  cmd_uds_clear, 0, NULL},
+	{ "periodic", "periodic <slow|medium|fast|stop> [did1 ...]",
+	  "Start or stop periodic transmission of 0xF2xx DIDs",
+	  cmd_uds_periodic, 0, NULL},
+	{ "monitor", "monitor [count]",
+	  "Display periodic records, until <count> are received or Enter is pressed",
+	  cmd_uds_monitor, 0, NULL},
+
+	CLI_TBL_BUILTINS,
+	CLI_TBL_END
+};
+
+static enum cli_retval cmd_uds_help(int argc, char **argv) {
+	return cli_help_basic(argc, argv, uds_cmd_table);
+}
+
+
+static struct diag_l3_conn *uds_conn(void) {
+	return cli_l3conn("UDS");
+}
+
+static void uds_perror(struct diag_l3_conn *dl3c, const char *what, int rv) {
+	cli_l3perror(what, rv, diag_l3_uds_nrcstr(diag_l3_uds_lastnrc(dl3c)));
+}
+
+/* Print one record; split it in signals if it's a DID we defined. */
+static void uds_printrec(struct diag_l3_conn *dl3c, uint16_t did,
+                         const uint8_t *data, unsigned int len) {
+	const struct diag_uds_dddi_elem *elems;
+	unsigned int n, i, j, off;
+
+	printf("DID 0x%04X :", did);
+	n = diag_l3_uds_dddi_get(dl3c, did, &elems);
+	for (i = 0, off = 0; (i < n) && (off + elems[i].size <= len); i++) {
+		printf(" %04X.%u=", elems[i].srcdid, elems[i].pos);
+		for (j = 0; j < elems[i].size; j++) {
+			printf("%02X", data[off++]);
+		}
+	}
+	for (; off < len; off++) {
+		printf(" %02X", data[off]);
+	}
+	printf("\n");
+}
+
+
+static enum cli_retval cmd_uds_session(int argc, char **argv) {
+	struct diag_l3_conn *dl3c;
+	uint8_t session;
+	int rv;
+
+	if (argc != 2) {
+		return CMD_USAGE;
+	}
+
+	if (strcasecmp(argv[1], "default") == 0) {
+		session = UDS_SESSION_DEFAULT;
+	} else if (strcasecmp(argv[1], "prog") == 0) {
+		session = UDS_SESSION_PROG;
+	} else if (strcasecmp(argv[1], "extended") == 0) {
+		session = UDS_SESSION_EXTENDED;
+	} else {
+		session = (uint8_t) htoi(argv[1]);
+	}
+
+	dl3c = uds_conn();
+	if (dl3c == NULL) {
+		return CMD_OK;
+	}
+
+	rv = diag_l3_uds_session(dl3c, session);
+	if (rv < 0) {
+		uds_perror(dl3c, "session", rv);
+	} else {
+		printf("Session 0x%02X active\n", session);
+	}
+	return CMD_OK;
+}
+
+static enum cli_retval cmd_uds_read(int argc, char **argv) {
+	struct diag_l3_conn *dl3c;
+	uint8_t buf[MAXRBUF];
+	int i, rv;
+
+	if (argc < 2) {
+		return CMD_USAGE;
+	}
+
+	dl3c = uds_conn();
+	if (dl3c == NULL) {
+		return CMD_OK;
+	}
+
+	for (i = 1; i < argc; i++) {
+		uint16_t did = (uint16_t) htoi(argv[i]);
+
+		rv = diag_l3_uds_readdid(dl3c, did, buf, sizeof(buf));
+		if (rv < 0) {
+			uds_perror(dl3c, "read", rv);
+			continue;
+		}
+		uds_printrec(dl3c, did, buf, MIN((unsigned int) rv, sizeof(buf)));
+	}
+	return CMD_OK;
+}
+
+static enum cli_retval cmd_uds_define(int argc, char **argv) {
+	struct diag_uds_dddi_elem elems[UDS_DDDI_MAXELEMS];
+	struct diag_l3_conn *dl3c;
+	unsigned int n;
+	uint16_t did;
+	int rv;
+
+	if ((argc < 3) || (argc - 2 > UDS_DDDI_MAXELEMS)) {
+		return CMD_USAGE;
+	}
+
+	did = (uint16_t) htoi(argv[1]);
+	for (n = 0; n < (unsigned int) argc - 2; n++) {
+		char *p = argv[n + 2];
+		char *endp;
+
+		elems[n].srcdid = (uint16_t) strtoul(p, &endp, 0);
+		if (*endp != ':') {
+			return CMD_USAGE;
+		}
+		elems[n].pos = (uint8_t) strtoul(endp + 1, &endp, 0);
+		if (*endp != ':') {
+			return CMD_USAGE;
+		}
+		elems[n].size = (uint8_t) strtoul(endp + 1, &endp, 0);
+		if ((*endp != 0) || (elems[n].pos == 0) || (elems[n].size == 0)) {
+			return CMD_USAGE;
+		}
+	}
+
+	dl3c = uds_conn();
+	if (dl3c == NULL) {
+		return CMD_OK;
+	}
+
+	rv = diag_l3_uds_dddi_define(dl3c, did, elems, n);
+	if (rv < 0) {
+		uds_perror(dl3c, "define", rv);
+	} else {
+		printf("DID 0x%04X defined, %u signals\n", did, n);
+	}
+	return CMD_OK;
+}
+
+static enum cli_retval cmd_uds_clear(int argc, char **argv) {
+	struct diag_l3_conn *dl3c;
+	int rv;
+
+	if (argc != 2) {
+		return CMD_USAGE;
+	}
+
+	dl3c = uds_conn();
+	if (dl3c == NULL) {
+		return CMD_OK;
+	}
+
+	rv = diag_l3_uds_dddi_clear(dl3c, (uint16_t) htoi(argv[1]));
+	if (rv < 0) {
+		uds_perror(dl3c, "clear", rv);
+	}
+	return CMD_OK;
+}
+
+static enum cli_retval cmd_uds_periodic(int argc, char **argv) {
+	static const char *modes[] = { "slow", "medium", "fast", "stop" };
+	uint16_t dids[UDS_DDDI_MAXELEMS];
+	struct diag_l3_conn *dl3c;
+	unsigned int i, n;
+	uint8_t mode = 0;
+	int rv;
+
+	if ((argc < 2) || (argc - 2 > (int) ARRAY_SIZE(dids))) {
+		return CMD_USAGE;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(modes); i++) {
+		if (strcasecmp(argv[1], modes[i]) == 0) {
+			mode = (uint8_t) (UDS_PERIODIC_SLOW + i);
+		}
+	}
+	if (mode == 0) {
+		return CMD_USAGE;
+	}
+
+	for (n = 0; n < (unsigned int) argc - 2; n++) {
+		dids[n] = (uint16_t) htoi(argv[n + 2]);
+	}
+	if ((n == 0) && (mode != UDS_PERIODIC_STOP)) {
+		return CMD_USAGE;
+	}
+
+	dl3c = uds_conn();
+	if (dl3c == NULL) {
+		return CMD_OK;
+	}
+
+	rv = diag_l3_uds_periodic(dl3c, mode, dids, n);
+	if (rv < 0) {
+		uds_perror(dl3c, "periodic", rv);
+	}
+	return CMD_OK;
+}
+
+static enum cli_retval cmd_uds_monitor(int argc, char **argv) {
+	struct diag_l3_conn *dl3c;
+	uint8_t buf[MAXRBUF];
+	unsigned long t0, tlast;
+	unsigned int count = 0, nrec = 0;
+	uint16_t did;
+	int rv;
+
+	if (argc > 2) {
+		return CMD_USAGE;
+	}
+	if (argc == 2) {
+		count = (unsigned int) htoi(argv[1]);
+	}
+
+	dl3c = uds_conn();
+	if (dl3c == NULL) {
+		return CMD_OK;
+	}
+
+	if (count == 0) {
+		printf("Press Enter to stop.\n");
+		diag_os_ipending();
+	}
+
+	t0 = tlast = diag_os_getms();
+	while ((count == 0) || (nrec < count)) {
+		if ((count == 0) && diag_os_ipending()) {
+			break;
+		}
+		rv = diag_l3_uds_periodic_recv(dl3c, 100, &did, buf, sizeof(buf));
+		if (rv == DIAG_ERR_TIMEOUT) {
+			if (count && (diag_os_getms() - tlast > UDS_MONITOR_TIMEOUT)) {
+				printf("No more records.\n");
+				break;
+			}
+			continue;
+		}
+		if (rv < 0) {
+			uds_perror(dl3c, "monitor", rv);
+			break;
+		}
+		tlast = diag_os_getms();
+		nrec++;
+		printf("%6lu ", tlast - t0);
+		uds_printrec(dl3c, did, buf, MIN((unsigned int) rv, sizeof(buf)));
+	}
+
+	if (tlast > t0) {
+		printf("%u records in %lu ms (%lu/s)\n", nrec, tlast - t0,
+		       (nrec * 1000UL) / (tlast - t0));
+	} else {
+		printf("%u records\n", nrec);
+	}
+	return CMD_OK;
+}
@@ -7,6 +7,12 @@
 #This runs "{TEST_PROG} -f {TESTF}.ini" and compares stdout/err output to
 # TESTFDIR/{TESTF}.stdout and TESTFDIR{TESTF}.stderr respectively
 
+#Tests that write a file name it {TESTF}.cache ("set capcache") or
+#{TESTF}.trace ("debug trace flush"); it is removed before and after the run
+#so every run starts from the same state.
+set(TESTOUTF "${TESTFDIR}/${TESTF}.cache" "${TESTFDIR}/${TESTF}.trace")
+file(REMOVE ${TESTOUTF})
+
 #execute_process(COMMAND ${TEST_PROG} -f ${TESTFDIR}/${TESTF}.ini
 execute_process(COMMAND ${TEST_PROG} -f "${TESTF}.ini"
 	TIMEOUT 25
@@ -15,6 +21,8 @@ execute_process(COMMAND ${TEST_PROG} -f "${TESTF}.ini"
 	ERROR_VARIABLE ERRV
 	)
 
+file(REMOVE ${TESTOUTF})
+
 #message(FATAL_ERROR ${HAD_ERROR} ${OUTV} ${ERRV})
 
 ##parse .std{o,e}_{p,f} files to retrieve regexps (stdout/stderr, pass/fail)